@@ -0,0 +1,614 @@
+// A loopback HTTP/1.1 server for benchmarks. It serves a corpus of files (from a directory, or added directly)
+// on 127.0.0.1 and can be made to behave like a slow or awkward network: answers can be delayed, their bodies
+// sent in pieces of a set size, paced to a bandwidth cap, stalled partway through, gzipped, or sent chunked
+// rather than with a Content-Length. With `tls` set it serves https with a throwaway self-signed certificate.
+// It runs on its own threads (one per connection), so it can be started in the same process as the requests.
+// Only builds on unix.
+
+#ifndef _BENCH_FIXTURE
+    #define _BENCH_FIXTURE 1
+
+    #include <arpa/inet.h>
+    #include <ctype.h>
+    #include <dirent.h>
+    #include <errno.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <strings.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+
+    #include <openssl/err.h>
+    #include <openssl/ssl.h>
+    #include <openssl/x509.h>
+    #include <zlib.h>
+
+    #include "../socket/common.h"
+    #include "../utils/string.h"
+
+// Largest request head that's read
+    #define maxFixtureRequestSize 16384
+    #define defaultFixtureChunkSize 16384
+
+struct fixture_options {
+    // Directory whose files are served (not recursively), or NULL to only serve files added with FIXTURE_addFile
+    char *root;
+    // 0 picks a free port
+    int port;
+
+    // Bytes written at a time, which is also the size of each chunk when `chunked` is set
+    int chunk_size;
+    // Transfer-Encoding: chunked instead of Content-Length
+    int chunked;
+    // Bodies are gzipped for requests that accept it
+    int gzip;
+    int tls;
+
+    // Milliseconds before each response is started
+    int latency;
+    // Bytes per second on each connection (0 for no limit)
+    int bandwidth;
+    // Once this many bytes of a body have been sent (0 for never), the response stops for `stall_time` milliseconds
+    int stall_after;
+    int stall_time;
+};
+
+struct fixture_file {
+    // Path after the first slash, e.g. "index.html"
+    char *name;
+    char *data;
+    int64_t length;
+
+    // NULL unless the server gzips bodies
+    char *gzipped;
+    int64_t gzipped_length;
+};
+
+struct fixture_server {
+    struct fixture_options options;
+    int port;
+
+    struct fixture_file *files;
+    int file_count;
+
+    int listener;
+    SSL_CTX *tls;
+    pthread_t thread;
+
+    // Written to once the server stops; everything that waits also waits on the read end, which then stays readable
+    int stop[2];
+
+    pthread_mutex_t lock;
+    // Signalled when the last connection finishes
+    pthread_cond_t idle;
+    int connections;
+
+    // Counted under `lock`
+    int64_t requests;
+};
+
+struct fixture_connection {
+    struct fixture_server *server;
+    int descriptor;
+    SSL *ssl;
+};
+
+struct fixture_options FIXTURE_defaultOptions() {
+    struct fixture_options options;
+    memset(&options, 0, sizeof(options));
+    options.chunk_size = defaultFixtureChunkSize;
+
+    return options;
+}
+
+// Returns 1 if the server is stopping
+int fixture_isStopping(struct fixture_server *server) {
+    struct pollfd stop = { server->stop[0], POLLIN, 0 };
+    return poll(&stop, 1, 0) > 0;
+}
+
+// Sleeps for `milliseconds`, unless the server stops first (then returns 1)
+int fixture_sleep(struct fixture_server *server, int milliseconds) {
+    if (milliseconds <= 0) {
+        return fixture_isStopping(server);
+    }
+    struct pollfd stop = { server->stop[0], POLLIN, 0 };
+    return poll(&stop, 1, milliseconds) != 0;
+}
+
+int fixture_gzip(const char *data, int64_t length, char **result, int64_t *resultLength) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 added to the window bits makes a gzip header and trailer
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    uLong capacity = deflateBound(&stream, length);
+    *result = (char *) calloc(capacity, sizeof(char));
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *) *result;
+    stream.avail_out = capacity;
+    int status = deflate(&stream, Z_FINISH);
+    *resultLength = stream.total_out;
+    deflateEnd(&stream);
+
+    if (status != Z_STREAM_END) {
+        free(*result);
+        *result = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Serves `data` (copied) at "/`name`". Files can only be added before FIXTURE_start.
+void FIXTURE_addFile(struct fixture_server *server, const char *name, const char *data, int64_t length) {
+    server->files = (struct fixture_file *) realloc(server->files, (server->file_count + 1) * sizeof(struct fixture_file));
+    struct fixture_file *file = &server->files[server->file_count];
+    server->file_count ++;
+
+    file->name = makeStrCpy(name);
+    file->data = (char *) malloc(length + 1);
+    memcpy(file->data, data, length);
+    file->length = length;
+    file->gzipped = NULL;
+    file->gzipped_length = 0;
+
+    if (server->options.gzip && fixture_gzip(file->data, file->length, &file->gzipped, &file->gzipped_length)) {
+        file->gzipped = NULL;
+    }
+}
+
+// Reads every regular file in the server's root into memory, so serving them doesn't touch the disk
+int fixture_loadRoot(struct fixture_server *server) {
+    DIR *directory = opendir(server->options.root);
+    if (directory == NULL) {
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        char *path = (char *) calloc(strlen(server->options.root) + strlen(entry->d_name) + 2, sizeof(char));
+        sprintf(path, "%s/%s", server->options.root, entry->d_name);
+
+        struct stat info;
+        FILE *file = NULL;
+        if (!stat(path, &info) && S_ISREG(info.st_mode)) {
+            file = fopen(path, "rb");
+        }
+        if (file != NULL) {
+            char *data = (char *) malloc(info.st_size + 1);
+            if (fread(data, 1, info.st_size, file) == (size_t) info.st_size) {
+                FIXTURE_addFile(server, entry->d_name, data, info.st_size);
+            }
+            free(data);
+            fclose(file);
+        }
+        free(path);
+    }
+    closedir(directory);
+
+    return 0;
+}
+
+struct fixture_file *fixture_findFile(struct fixture_server *server, const char *name) {
+    for (int i = 0; i < server->file_count; i ++) {
+        if (!strcmp(server->files[i].name, name)) {
+            return &server->files[i];
+        }
+    }
+    return NULL;
+}
+
+// A self-signed certificate for 127.0.0.1, made up on the spot (clients aren't expected to check it)
+SSL_CTX *fixture_makeTLSContext() {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    if (ctx == NULL || key == NULL || certificate == NULL) {
+        SSL_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        X509_free(certificate);
+        return NULL;
+    }
+
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 60 * 60);
+    X509_set_pubkey(certificate, key);
+    X509_NAME *name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "127.0.0.1", -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+
+    int failed = SSL_CTX_use_certificate(ctx, certificate) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1;
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    if (failed) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Waits until the connection can be read (or written, with `events` POLLOUT). Returns 1 if the server stops first.
+int fixture_waitFor(struct fixture_connection *connection, short events) {
+    struct pollfd waits[2] = {
+        { connection->descriptor, events, 0 },
+        { connection->server->stop[0], POLLIN, 0 },
+    };
+    if (poll(waits, 2, -1) < 0 && errno != EINTR) {
+        return 1;
+    }
+    return waits[1].revents != 0;
+}
+
+// Returns the number of bytes read, or 0 when the connection is closed (or the server stops)
+int fixture_read(struct fixture_connection *connection, char *data, int length) {
+    if (connection->ssl != NULL && SSL_pending(connection->ssl) > 0) {
+        return SSL_read(connection->ssl, data, length);
+    }
+    if (fixture_waitFor(connection, POLLIN)) {
+        return 0;
+    }
+
+    int bytesRead = connection->ssl != NULL ? SSL_read(connection->ssl, data, length) : read(connection->descriptor, data, length);
+    return bytesRead > 0 ? bytesRead : 0;
+}
+
+// Returns 0 once all of `data` has been written
+int fixture_write(struct fixture_connection *connection, const char *data, int length) {
+    while (length > 0) {
+        int written = connection->ssl != NULL ? SSL_write(connection->ssl, data, length) : send(connection->descriptor, data, length, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Sends a body `chunk_size` bytes at a time, keeping to the bandwidth cap and stalling where asked to.
+// Returns 0 if the whole body was sent.
+int fixture_writeBody(struct fixture_connection *connection, const char *body, int64_t length) {
+    struct fixture_options *options = &connection->server->options;
+    int chunkSize = options->chunk_size > 0 ? options->chunk_size : defaultFixtureChunkSize;
+    long long start = socket_nowMicroseconds();
+    int stalled = 0;
+
+    int64_t sent = 0;
+    while (sent < length) {
+        int64_t pieceLength = length - sent < chunkSize ? length - sent : chunkSize;
+        if (options->stall_after > 0 && !stalled && sent + pieceLength > options->stall_after) {
+            // Stop exactly at the stall point
+            if (sent < options->stall_after) {
+                pieceLength = options->stall_after - sent;
+            } else {
+                stalled = 1;
+                if (fixture_sleep(connection->server, options->stall_time)) {
+                    return -1;
+                }
+                start += options->stall_time * 1000LL;
+            }
+        }
+
+        if (options->chunked) {
+            char chunkHead[24];
+            sprintf(chunkHead, "%llx\r\n", (long long) pieceLength);
+            if (fixture_write(connection, chunkHead, strlen(chunkHead))) {
+                return -1;
+            }
+        }
+        if (fixture_write(connection, body + sent, pieceLength) || (options->chunked && fixture_write(connection, "\r\n", 2))) {
+            return -1;
+        }
+        sent += pieceLength;
+
+        // Sleep until the body sent so far would have taken that long at the capped rate
+        if (options->bandwidth > 0) {
+            long long due = start + sent * 1000000LL / options->bandwidth;
+            long long wait = due - socket_nowMicroseconds();
+            if (wait > 0 && fixture_sleep(connection->server, (wait + 999) / 1000)) {
+                return -1;
+            }
+        }
+    }
+
+    if (options->chunked) {
+        return fixture_write(connection, "0\r\n\r\n", 5);
+    }
+    return 0;
+}
+
+// Returns 1 if the request head has a `name` header whose value contains `part` (ignoring case)
+int fixture_headerContains(const char *request, const char *name, const char *part) {
+    int nameLength = strlen(name);
+    for (const char *line = strchr(request, '\n'); line != NULL; line = strchr(line, '\n')) {
+        line ++;
+        if (strncasecmp(line, name, nameLength) || line[nameLength] != ':') {
+            continue;
+        }
+
+        const char *lineEnd = strchr(line, '\r');
+        int valueLength = lineEnd != NULL ? lineEnd - line : (int) strlen(line);
+        char *value = (char *) calloc(valueLength + 1, sizeof(char));
+        for (int i = 0; i < valueLength; i ++) {
+            value[i] = tolower(line[i]);
+        }
+        // `part` is lowercase
+        int contains = strstr(value + nameLength + 1, part) != NULL;
+        free(value);
+        if (contains) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Answers one request. Returns 1 if the connection should be kept open for another.
+int fixture_respond(struct fixture_connection *connection, char *request) {
+    struct fixture_server *server = connection->server;
+
+    char method[16], target[2048], version[16];
+    if (sscanf(request, "%15s %2047s %15s", method, target, version) != 3) {
+        fixture_write(connection, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", 66);
+        return 0;
+    }
+    char *query = strchr(target, '?');
+    if (query != NULL) {
+        *query = '\0';
+    }
+
+    int keepAlive = !strcmp(version, "HTTP/1.1") && !fixture_headerContains(request, "connection", "close");
+    int acceptsGzip = fixture_headerContains(request, "accept-encoding", "gzip");
+
+    pthread_mutex_lock(&server->lock);
+    server->requests ++;
+    pthread_mutex_unlock(&server->lock);
+
+    if (fixture_sleep(server, server->options.latency)) {
+        return 0;
+    }
+
+    struct fixture_file *file = target[0] == '/' ? fixture_findFile(server, target + 1) : NULL;
+    if (file == NULL) {
+        const char *notFound = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\n\r\nNot found\n";
+        return !fixture_write(connection, notFound, strlen(notFound)) && keepAlive;
+    }
+
+    int gzipped = file->gzipped != NULL && acceptsGzip;
+    const char *body = gzipped ? file->gzipped : file->data;
+    int64_t length = gzipped ? file->gzipped_length : file->length;
+    const char *contentType = strstr(file->name, ".css") != NULL ? "text/css" : strstr(file->name, ".htm") != NULL ? "text/html" : "text/plain";
+
+    char head[512];
+    int headLength = sprintf(head, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nCache-Control: no-store\r\n", contentType);
+    if (server->options.chunked) {
+        headLength += sprintf(head + headLength, "Transfer-Encoding: chunked\r\n");
+    } else {
+        headLength += sprintf(head + headLength, "Content-Length: %lld\r\n", (long long) length);
+    }
+    if (gzipped) {
+        headLength += sprintf(head + headLength, "Content-Encoding: gzip\r\n");
+    }
+    if (!keepAlive) {
+        headLength += sprintf(head + headLength, "Connection: close\r\n");
+    }
+    headLength += sprintf(head + headLength, "\r\n");
+
+    if (fixture_write(connection, head, headLength)) {
+        return 0;
+    }
+    if (strcmp(method, "HEAD") && fixture_writeBody(connection, body, length)) {
+        return 0;
+    }
+    return keepAlive;
+}
+
+void *fixture_connectionThread(void *arg) {
+    struct fixture_connection *connection = (struct fixture_connection *) arg;
+    struct fixture_server *server = connection->server;
+
+    int handshaken = 1;
+    if (server->tls != NULL) {
+        connection->ssl = SSL_new(server->tls);
+        SSL_set_fd(connection->ssl, connection->descriptor);
+        handshaken = SSL_accept(connection->ssl) == 1;
+    }
+
+    // Requests can arrive pipelined, so whatever follows one head is kept for the next
+    char *buffer = (char *) calloc(maxFixtureRequestSize + 1, sizeof(char));
+    int used = 0;
+    int keepAlive = handshaken;
+    while (keepAlive) {
+        char *end;
+        while ((end = strstr(buffer, "\r\n\r\n")) == NULL) {
+            int bytesRead = used < maxFixtureRequestSize ? fixture_read(connection, buffer + used, maxFixtureRequestSize - used) : 0;
+            if (bytesRead <= 0) {
+                break;
+            }
+            used += bytesRead;
+            buffer[used] = '\0';
+        }
+        if (end == NULL) {
+            break;
+        }
+
+        // Request bodies aren't expected (only GET and HEAD are answered)
+        *end = '\0';
+        keepAlive = fixture_respond(connection, buffer);
+        int headLength = end + 4 - buffer;
+        memmove(buffer, buffer + headLength, used - headLength + 1);
+        used -= headLength;
+    }
+    free(buffer);
+
+    if (connection->ssl != NULL) {
+        if (handshaken) {
+            SSL_shutdown(connection->ssl);
+        }
+        SSL_free(connection->ssl);
+    }
+    close(connection->descriptor);
+    free(connection);
+
+    pthread_mutex_lock(&server->lock);
+    server->connections --;
+    if (!server->connections) {
+        pthread_cond_broadcast(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+void *fixture_acceptThread(void *arg) {
+    struct fixture_server *server = (struct fixture_server *) arg;
+
+    while (1) {
+        struct pollfd waits[2] = {
+            { server->listener, POLLIN, 0 },
+            { server->stop[0], POLLIN, 0 },
+        };
+        if (poll(waits, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (waits[1].revents) {
+            break;
+        }
+
+        int descriptor = accept(server->listener, NULL, NULL);
+        if (descriptor < 0) {
+            continue;
+        }
+
+        // Heads and bodies are written separately, which Nagle's algorithm would hold back on a kept-alive connection
+        int noDelay = 1;
+        setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        struct fixture_connection *connection = (struct fixture_connection *) calloc(1, sizeof(struct fixture_connection));
+        connection->server = server;
+        connection->descriptor = descriptor;
+
+        pthread_mutex_lock(&server->lock);
+        server->connections ++;
+        pthread_mutex_unlock(&server->lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, fixture_connectionThread, connection)) {
+            close(descriptor);
+            free(connection);
+            pthread_mutex_lock(&server->lock);
+            server->connections --;
+            pthread_mutex_unlock(&server->lock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+void fixture_freeServer(struct fixture_server *server) {
+    for (int i = 0; i < server->file_count; i ++) {
+        free(server->files[i].name);
+        free(server->files[i].data);
+        free(server->files[i].gzipped);
+    }
+    free(server->files);
+    if (server->listener >= 0) {
+        close(server->listener);
+    }
+    close(server->stop[0]);
+    close(server->stop[1]);
+    SSL_CTX_free(server->tls);
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->idle);
+    free(server);
+}
+
+// Makes a server, loading the files in `options.root` if set. More files can be added with FIXTURE_addFile before
+// it's started with FIXTURE_start. Returns NULL if the root can't be read.
+struct fixture_server *FIXTURE_makeServer(struct fixture_options options) {
+    struct fixture_server *server = (struct fixture_server *) calloc(1, sizeof(struct fixture_server));
+    server->options = options;
+    server->listener = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->idle, NULL);
+    if (pipe(server->stop)) {
+        free(server);
+        return NULL;
+    }
+
+    if (options.root != NULL && fixture_loadRoot(server)) {
+        fixture_freeServer(server);
+        return NULL;
+    }
+    return server;
+}
+
+// Starts listening on 127.0.0.1 (the port is in `server->port` afterwards). Returns 0 on success.
+int FIXTURE_start(struct fixture_server *server) {
+    if (server->options.tls && (server->tls = fixture_makeTLSContext()) == NULL) {
+        return -1;
+    }
+
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener < 0) {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(server->listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(server->options.port);
+    socklen_t addressLength = sizeof(address);
+    if (bind(server->listener, (struct sockaddr *) &address, sizeof(address)) || listen(server->listener, 128)
+        || getsockname(server->listener, (struct sockaddr *) &address, &addressLength)) {
+        return -1;
+    }
+    if (pthread_create(&server->thread, NULL, fixture_acceptThread, server)) {
+        return -1;
+    }
+    // Only set once there's a thread for FIXTURE_stop to join
+    server->port = ntohs(address.sin_port);
+    return 0;
+}
+
+// Stops accepting, closes every connection (cutting off any response being sent) and frees the server
+void FIXTURE_stop(struct fixture_server *server) {
+    write(server->stop[1], "", 1);
+    if (server->port) {
+        pthread_join(server->thread, NULL);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    while (server->connections) {
+        pthread_cond_wait(&server->idle, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    fixture_freeServer(server);
+}
+
+int64_t FIXTURE_requestCount(struct fixture_server *server) {
+    pthread_mutex_lock(&server->lock);
+    int64_t requests = server->requests;
+    pthread_mutex_unlock(&server->lock);
+    return requests;
+}
+
+#endif
@@ -0,0 +1,325 @@
+// bench/main.c
+// Benchmarks the fetch path (http_makeHTTPRequest) against the loopback fixture server, without touching the real network.
+// Compile with gcc bench/main.c -o bench -lssl -lcrypto -lz -lbrotlidec -pthread (add -DHTTP_NO_BROTLI to build without brotli)
+// Run with --help for the options. With --serve it only runs the fixture server, for pointing the browser at.
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../http/http.h"
+#include "../http/pool.h"
+#include "fixture.h"
+
+struct bench_run {
+    char **urls;
+    // Length of each URL's file, which the (decoded) body has to match
+    int64_t *lengths;
+    int url_count;
+    int requests;
+
+    // Taken under `lock`
+    int next;
+    int64_t bytes;
+    int failures;
+    pthread_mutex_t lock;
+
+    // Microseconds for each request
+    long long *latencies;
+};
+
+// A corpus of HTML pages of a few sizes, for when no directory is given. The text is made up from a fixed seed,
+// so every run serves exactly the same bytes.
+void bench_addSyntheticCorpus(struct fixture_server *server) {
+    const char *words[] = { "lorem", "ipsum", "dolor", "sit", "amet", "network", "request", "browser", "stylesheet", "page" };
+    const char *names[] = { "small.html", "medium.html", "large.html" };
+    const int sizes[] = { 4 * 1024, 64 * 1024, 1024 * 1024 };
+
+    unsigned int seed = 1;
+    for (int i = 0; i < 3; i ++) {
+        char *page = (char *) calloc(sizes[i] + 64, sizeof(char));
+        int length = sprintf(page, "<!DOCTYPE html>\n<html><head><title>%s</title></head><body>\n", names[i]);
+        while (length < sizes[i] - 32) {
+            length += sprintf(page + length, "<p>");
+            for (int word = 0; word < 12; word ++) {
+                seed = seed * 1103515245 + 12345;
+                length += sprintf(page + length, "%s ", words[(seed >> 16) % 10]);
+            }
+            length += sprintf(page + length, "</p>\n");
+        }
+        length += sprintf(page + length, "</body></html>\n");
+
+        FIXTURE_addFile(server, names[i], page, length);
+        free(page);
+    }
+}
+
+void *bench_worker(void *arg) {
+    struct bench_run *run = (struct bench_run *) arg;
+
+    while (1) {
+        pthread_mutex_lock(&run->lock);
+        int index = run->next;
+        run->next ++;
+        pthread_mutex_unlock(&run->lock);
+        if (index >= run->requests) {
+            break;
+        }
+
+        long long start = socket_nowMicroseconds();
+        int url = index % run->url_count;
+        struct http_response response = http_makeHTTPRequest(run->urls[url], "c-http-bench", NULL, NULL, NULL);
+        run->latencies[index] = socket_nowMicroseconds() - start;
+
+        int failed = 1;
+        int64_t length = 0;
+        if (!response.error) {
+            length = response.response_body.length;
+            failed = response.response_code != 200 || length != run->lengths[url];
+            HTTP_freeResponse(&response);
+        }
+
+        pthread_mutex_lock(&run->lock);
+        if (failed) {
+            run->failures ++;
+        } else {
+            run->bytes += length;
+        }
+        pthread_mutex_unlock(&run->lock);
+    }
+
+    return NULL;
+}
+
+int bench_compareLatencies(const void *a, const void *b) {
+    long long first = *(const long long *) a;
+    long long second = *(const long long *) b;
+    return (first > second) - (first < second);
+}
+
+// Nearest-rank percentile of sorted latencies, in milliseconds
+double bench_percentile(long long *sorted, int count, double percentile) {
+    int rank = (int) (percentile * count / 100.0);
+    if (rank * 100.0 < percentile * count) rank ++;
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1] / 1000.0;
+}
+
+// Makes `requests` requests from `concurrency` threads. Returns the time taken in microseconds.
+long long bench_run(struct bench_run *run, int concurrency) {
+    run->next = 0;
+    run->bytes = 0;
+    run->failures = 0;
+
+    pthread_t *threads = (pthread_t *) calloc(concurrency, sizeof(pthread_t));
+    long long start = socket_nowMicroseconds();
+    int started = 0;
+    for (; started < concurrency; started ++) {
+        if (pthread_create(&threads[started], NULL, bench_worker, run)) {
+            break;
+        }
+    }
+    if (!started) {
+        bench_worker(run);
+    }
+    for (int i = 0; i < started; i ++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    return socket_nowMicroseconds() - start;
+}
+
+void bench_printUsage() {
+    printf(
+        "Usage: bench [options] [path...]\n"
+        "Requests the given paths (or every file served) in turn from a loopback server.\n\n"
+        "  --root DIR           serve the files in DIR (default: a made-up corpus of 4 KB, 64 KB and 1 MB pages)\n"
+        "  --requests N         requests to time (default 200)\n"
+        "  --warmup N           untimed requests made first (default 0)\n"
+        "  --concurrency N      requests made at once, each from its own thread (default 1)\n"
+        "  --no-keep-alive      open a new connection for every request\n"
+        "  --tls                serve https\n"
+        "  --chunked            send bodies chunked instead of with Content-Length\n"
+        "  --gzip               gzip bodies\n"
+        "  --chunk-size BYTES   bytes written at a time (default %d)\n"
+        "  --latency MS         delay before each response\n"
+        "  --bandwidth KB       cap each connection at KB kilobytes per second\n"
+        "  --stall BYTES MS     stop each body for MS milliseconds after BYTES bytes\n"
+        "  --port N             port to listen on (default: any free port)\n"
+        "  --serve              only run the server, until interrupted\n",
+        defaultFixtureChunkSize
+    );
+}
+
+int main(int argc, char **argv) {
+    struct fixture_options options = FIXTURE_defaultOptions();
+    int requests = 200;
+    int warmup = 0;
+    int concurrency = 1;
+    int keepAlive = 1;
+    int serveOnly = 0;
+    char **paths = (char **) calloc(argc, sizeof(char *));
+    int pathCount = 0;
+
+    for (int i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "--root") && i + 1 < argc) {
+            options.root = argv[++ i];
+        } else if (!strcmp(argv[i], "--requests") && i + 1 < argc) {
+            requests = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--warmup") && i + 1 < argc) {
+            warmup = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--concurrency") && i + 1 < argc) {
+            concurrency = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--no-keep-alive")) {
+            keepAlive = 0;
+        } else if (!strcmp(argv[i], "--tls")) {
+            options.tls = 1;
+        } else if (!strcmp(argv[i], "--chunked")) {
+            options.chunked = 1;
+        } else if (!strcmp(argv[i], "--gzip")) {
+            options.gzip = 1;
+        } else if (!strcmp(argv[i], "--chunk-size") && i + 1 < argc) {
+            options.chunk_size = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--latency") && i + 1 < argc) {
+            options.latency = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--bandwidth") && i + 1 < argc) {
+            options.bandwidth = atoi(argv[++ i]) * 1024;
+        } else if (!strcmp(argv[i], "--stall") && i + 2 < argc) {
+            options.stall_after = atoi(argv[++ i]);
+            options.stall_time = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            options.port = atoi(argv[++ i]);
+        } else if (!strcmp(argv[i], "--serve")) {
+            serveOnly = 1;
+        } else if (!strcmp(argv[i], "--help")) {
+            bench_printUsage();
+            return 0;
+        } else if (argv[i][0] != '-') {
+            paths[pathCount ++] = argv[i];
+        } else {
+            bench_printUsage();
+            return 1;
+        }
+    }
+    if (requests < 1) requests = 1;
+    if (concurrency < 1) concurrency = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    struct fixture_server *server = FIXTURE_makeServer(options);
+    if (server == NULL) {
+        fprintf(stderr, "Couldn't read the files in \"%s\"\n", options.root);
+        return 1;
+    }
+    if (options.root == NULL) {
+        bench_addSyntheticCorpus(server);
+    }
+    if (FIXTURE_start(server)) {
+        fprintf(stderr, "Couldn't start the server\n");
+        FIXTURE_stop(server);
+        return 1;
+    }
+
+    const char *protocol = options.tls ? "https" : "http";
+    if (serveOnly) {
+        printf("Serving %d files at %s://127.0.0.1:%d/\n", server->file_count, protocol, server->port);
+        for (int i = 0; i < server->file_count; i ++) {
+            printf("  /%s (%lld bytes)\n", server->files[i].name, (long long) server->files[i].length);
+        }
+        fflush(stdout);
+        while (1) {
+            pause();
+        }
+    }
+
+    // Every file is requested in turn unless some were named
+    if (!pathCount) {
+        paths = (char **) realloc(paths, (server->file_count + 1) * sizeof(char *));
+        for (int i = 0; i < server->file_count; i ++) {
+            paths[pathCount ++] = server->files[i].name;
+        }
+    }
+    if (!pathCount) {
+        fprintf(stderr, "There are no files to request\n");
+        FIXTURE_stop(server);
+        return 1;
+    }
+
+    struct bench_run run;
+    memset(&run, 0, sizeof(run));
+    run.url_count = pathCount;
+    run.urls = (char **) calloc(pathCount, sizeof(char *));
+    run.lengths = (int64_t *) calloc(pathCount, sizeof(int64_t));
+    for (int i = 0; i < pathCount; i ++) {
+        char *path = paths[i][0] == '/' ? paths[i] + 1 : paths[i];
+        struct fixture_file *file = fixture_findFile(server, path);
+        run.lengths[i] = file != NULL ? file->length : -1;
+        run.urls[i] = (char *) calloc(strlen(path) + 32, sizeof(char));
+        sprintf(run.urls[i], "%s://127.0.0.1:%d/%s", protocol, server->port, path);
+    }
+    pthread_mutex_init(&run.lock, NULL);
+
+    if (keepAlive) {
+        HTTP_setGlobalConnectionPool(HTTP_makeConnectionPool());
+    }
+
+    if (warmup > 0) {
+        run.requests = warmup;
+        run.latencies = (long long *) calloc(warmup, sizeof(long long));
+        bench_run(&run, concurrency);
+        free(run.latencies);
+    }
+
+    run.requests = requests;
+    run.latencies = (long long *) calloc(requests, sizeof(long long));
+    long long elapsed = bench_run(&run, concurrency);
+    double seconds = elapsed / 1000000.0;
+
+    printf(
+        "Server: %s://127.0.0.1:%d/, %d files, %s, %s, %d-byte writes",
+        protocol,
+        server->port,
+        server->file_count,
+        options.chunked ? "chunked" : "Content-Length",
+        options.gzip ? "gzip" : "identity",
+        options.chunk_size
+    );
+    if (options.latency) printf(", %d ms latency", options.latency);
+    if (options.bandwidth) printf(", %d KB/s", options.bandwidth / 1024);
+    if (options.stall_after) printf(", %d ms stall after %d bytes", options.stall_time, options.stall_after);
+    printf("\n");
+
+    printf("Requests: %d (%d failed), %d at once, %s\n", requests, run.failures, concurrency, keepAlive ? "keep-alive" : "a connection each");
+    printf("Time: %.3f s\n", seconds);
+    printf("Throughput: %.1f requests/s, %.2f MB/s\n", requests / seconds, run.bytes / seconds / (1024.0 * 1024.0));
+
+    qsort(run.latencies, requests, sizeof(long long), bench_compareLatencies);
+    printf(
+        "Latency (ms): min %.2f, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n",
+        run.latencies[0] / 1000.0,
+        bench_percentile(run.latencies, requests, 50),
+        bench_percentile(run.latencies, requests, 90),
+        bench_percentile(run.latencies, requests, 99),
+        run.latencies[requests - 1] / 1000.0
+    );
+
+    if (keepAlive) {
+        HTTP_closeConnectionPool(HTTP_getGlobalConnectionPool());
+        HTTP_setGlobalConnectionPool(NULL);
+    }
+    FIXTURE_stop(server);
+
+    for (int i = 0; i < pathCount; i ++) {
+        free(run.urls[i]);
+    }
+    free(run.urls);
+    free(run.lengths);
+    free(run.latencies);
+    free(paths);
+    pthread_mutex_destroy(&run.lock);
+
+    return run.failures ? 2 : 0;
+}
@@ -0,0 +1,119 @@
+// bench/url.c
+// Benchmarks URL parsing (http_url_from_string) and resolving links against a page (http_resolveRelativeURL, and
+// http_appendResolvedURL into a reused builder, which is what render_nc does on every frame).
+// Compile with gcc -O2 bench/url.c -o bench-url
+// Run with --help for the options.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../http/url.h"
+
+// Pages, as typed into the address bar or reached through redirects
+const char *bench_pages[] = {
+    "http://localhost:8123/index.html",
+    "https://example.com/",
+    "https://en.wikipedia.org/wiki/Uniform_Resource_Locator#Syntax",
+    "https://www.example.org/docs/guide/getting-started/installation.html?lang=en&version=2",
+    "example.com",
+    "localhost:8080/admin/",
+    "127.0.0.1:8443/status",
+    "file:///usr/share/doc/index.html",
+    "/tmp/page%20one.html",
+    "https://cdn.example.net/assets/v3/images/icons/sprite-2x.png?cache=1698765432",
+    "about:blank",
+    "http://a.b.c.d.example.co.uk:8000/a/b/c/d/e/f/g/h/i/j/k/l/m/n/o/p/q/r/s/t/u/v/w/x/y/z.html",
+};
+
+// Links, as they're found in pages
+const char *bench_links[] = {
+    "style.css",
+    "../images/logo.png",
+    "/about",
+    "#top",
+    "?page=2",
+    "//cdn.example.net/lib.js",
+    "https://other.example.com/path/to/resource",
+    "mailto:someone@example.com",
+    "chapter/2/section/5.html#figure-3",
+    "",
+};
+
+long long bench_nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void bench_report(const char *name, long long operations, long long elapsed, long long checksum) {
+    printf("%-28s %10.0f URLs/s  %7.1f ns/URL  (checksum %lld)\n", name, operations / (elapsed / 1e9), (double) elapsed / operations, checksum);
+}
+
+int main(int argc, char **argv) {
+    int iterations = 200000;
+    for (int i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc) {
+            iterations = atoi(argv[++ i]);
+        } else {
+            printf("Usage: %s [--iterations N]\n", argv[0]);
+            printf("Parses and resolves a fixed set of URLs N times (default 200000) and reports URLs/s for each.\n");
+            return !strcmp(argv[i], "--help") ? 0 : 1;
+        }
+    }
+
+    int pageCount = sizeof(bench_pages) / sizeof(bench_pages[0]);
+    int linkCount = sizeof(bench_links) / sizeof(bench_links[0]);
+
+    // The checksums make sure the work isn't optimized away, and should match between runs
+    long long checksum = 0;
+    long long start = bench_nanoseconds();
+    for (int i = 0; i < iterations; i ++) {
+        for (int j = 0; j < pageCount; j ++) {
+            struct http_url *url = http_url_from_string((char *) bench_pages[j]);
+            if (url != NULL) {
+                checksum += url->port + strlen(url->path);
+            }
+            HTTP_freeURL(url);
+        }
+    }
+    bench_report("parse", (long long) iterations * pageCount, bench_nanoseconds() - start, checksum);
+
+    struct http_url *bases[sizeof(bench_pages) / sizeof(bench_pages[0])];
+    for (int j = 0; j < pageCount; j ++) {
+        bases[j] = http_url_from_string((char *) bench_pages[j]);
+    }
+
+    checksum = 0;
+    start = bench_nanoseconds();
+    for (int i = 0; i < iterations / 10; i ++) {
+        for (int j = 0; j < pageCount; j ++) {
+            for (int k = 0; k < linkCount; k ++) {
+                char *resolved = http_resolveRelativeURL(bases[j], (char *) bench_pages[j], (char *) bench_links[k]);
+                checksum += strlen(resolved);
+                free(resolved);
+            }
+        }
+    }
+    bench_report("resolve", (long long) (iterations / 10) * pageCount * linkCount, bench_nanoseconds() - start, checksum);
+
+    checksum = 0;
+    struct string_builder builder = makeStringBuilder(256);
+    start = bench_nanoseconds();
+    for (int i = 0; i < iterations / 10; i ++) {
+        for (int j = 0; j < pageCount; j ++) {
+            for (int k = 0; k < linkCount; k ++) {
+                clearStringBuilder(&builder);
+                http_appendResolvedURL(&builder, bases[j], bench_pages[j], bench_links[k]);
+                checksum += builder.length;
+            }
+        }
+    }
+    bench_report("resolve (reused builder)", (long long) (iterations / 10) * pageCount * linkCount, bench_nanoseconds() - start, checksum);
+    freeStringBuilder(&builder);
+
+    for (int j = 0; j < pageCount; j ++) {
+        HTTP_freeURL(bases[j]);
+    }
+    return 0;
+}
@@ -0,0 +1,671 @@
+// Persistent HTTP cache. Each response is kept in its own file under the user's cache directory, named
+// after a hash of its URL. Fresh entries (Cache-Control/Expires) are used without touching the network;
+// stale ones are revalidated with If-None-Match/If-Modified-Since. Least recently used entries are
+// removed once the cache grows past its byte budget.
+
+#ifndef _HTTP_CACHE
+    #define _HTTP_CACHE 1
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+
+    #ifdef unix
+        #include <dirent.h>
+        #include <fcntl.h>
+        #include <pthread.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <sys/uio.h>
+        #include <unistd.h>
+    #endif
+
+    #include "../utils/log.h"
+    #include "../utils/string.h"
+
+    #include "response.h"
+    #include "url.h"
+
+    #define defaultDiskCacheBudget (64 * 1024 * 1024)
+    // Responses that only have a Last-Modified date are considered fresh for a tenth of their age, up to this long
+    #define maxHeuristicFreshness (24 * 60 * 60)
+    // Bumped whenever the file layout changes; files with another version are ignored and replaced
+    #define diskCacheMagic "chttpc1"
+
+/*
+File layout: the header below, followed by the URL, the stored status line and headers (as they'd be
+sent by a server, ending with an empty line) and the body, each followed by a NUL byte. Everything is at
+a fixed or recorded offset, so a file can be mapped and read without parsing it.
+*/
+struct http_disk_cache_file_header {
+    char magic[8];
+
+    // Wall-clock times, since entries outlive the process
+    int64_t stored;
+    int64_t expires;
+    // Rewritten in place whenever the entry is used
+    int64_t last_used;
+
+    int32_t response_code;
+    int32_t url_length;
+    int32_t headers_length;
+    int32_t body_length;
+};
+
+struct http_disk_cache_entry {
+    uint64_t key;
+    int64_t size;
+    int64_t last_used;
+};
+
+struct http_disk_cache {
+    char *directory;
+    int64_t budget;
+    int64_t total_size;
+
+    // Every file in the directory, so that eviction doesn't have to scan it
+    struct http_disk_cache_entry *entries;
+    int count;
+
+    #ifdef unix
+        pthread_mutex_t lock;
+    #endif
+};
+
+struct http_disk_cache_lookup {
+    int found;
+    // Usable as-is, without revalidating
+    int fresh;
+    struct http_response response;
+    // Request headers (each ending with CRLF) that ask the server whether the entry is still valid, or NULL
+    char *validators;
+};
+
+// Returns the absolute URL that identifies a response in the cache (the URL without its fragment)
+char *HTTP_cacheKeyForURL(struct http_url *url) {
+    char *key = (char *) calloc(strlen(url->protocol) + strlen(url->hostname) + strlen(url->path) + 16, sizeof(char));
+    sprintf(key, "%s://%s:%d%s", url->protocol, url->hostname, url->port, url->path);
+    return key;
+}
+
+// FNV-1a, used to name entry files
+uint64_t http_hashCacheKey(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key; key ++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date (month 1-12)
+int64_t http_daysFromCivil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+// Parses an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 if it isn't one.
+int64_t HTTP_parseDate(const char *value) {
+    static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+    int day, year, hour, minute, second;
+    char month[4];
+    if (value == NULL || sscanf(value, "%*[^,], %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute, &second) != 6) {
+        return -1;
+    }
+
+    for (int i = 0; i < 12; i ++) {
+        if (!strcmp(month, months[i])) {
+            return http_daysFromCivil(year, i + 1, day) * 86400 + hour * 3600 + minute * 60 + second;
+        }
+    }
+    return -1;
+}
+
+// Finds `directive` in a Cache-Control value. Returns 1 if present, and writes its number (or -1) to `value`.
+int http_getCacheDirective(const char *cacheControl, const char *directive, int64_t *value) {
+    int length = strlen(directive);
+    const char *current = cacheControl;
+    while (current != NULL && *current) {
+        while (*current == ' ' || *current == ',') current ++;
+        if (HTTP_startsWithIgnoreCase(current, directive) && (current[length] == '\0' || current[length] == '=' || current[length] == ',' || current[length] == ' ')) {
+            if (value != NULL) {
+                *value = current[length] == '=' ? atoll(current + length + 1 + (current[length + 1] == '"')) : -1;
+            }
+            return 1;
+        }
+        current = strchr(current, ',');
+    }
+    return 0;
+}
+
+// Returns when a response received at `now` stops being fresh (`now` or earlier if it has to be revalidated
+// straight away), or -1 if it mustn't be stored at all.
+int64_t HTTP_getResponseExpiry(struct http_response *response, int64_t now) {
+    char *cacheControl = HTTP_getHeader(response, "cache-control");
+    if (cacheControl != NULL) {
+        if (http_getCacheDirective(cacheControl, "no-store", NULL)) {
+            return -1;
+        }
+        if (http_getCacheDirective(cacheControl, "no-cache", NULL)) {
+            return now;
+        }
+    }
+
+    // Time the response already spent in other caches
+    char *ageHeader = HTTP_getHeader(response, "age");
+    int64_t age = ageHeader != NULL ? atoll(ageHeader) : 0;
+
+    int64_t maxAge;
+    if (cacheControl != NULL && http_getCacheDirective(cacheControl, "max-age", &maxAge) && maxAge >= 0) {
+        return now + maxAge - age;
+    }
+
+    char *expiresHeader = HTTP_getHeader(response, "expires");
+    if (expiresHeader != NULL) {
+        // An invalid date means "already expired"
+        int64_t expires = HTTP_parseDate(expiresHeader);
+        int64_t date = HTTP_parseDate(HTTP_getHeader(response, "date"));
+        if (expires == -1) {
+            return now;
+        }
+        // Relative to the server's clock, which may not agree with ours
+        return now + expires - (date != -1 ? date : now) - age;
+    }
+
+    int64_t lastModified = HTTP_parseDate(HTTP_getHeader(response, "last-modified"));
+    if (lastModified != -1 && lastModified < now) {
+        int64_t lifetime = (now - lastModified) / 10;
+        return now + (lifetime < maxHeuristicFreshness ? lifetime : maxHeuristicFreshness);
+    }
+    return now;
+}
+
+// Headers that describe the connection or the encoding on the wire, neither of which apply to a stored response
+int http_isStoredHeader(const char *name) {
+    return !(
+        HTTP_equalsIgnoreCase(name, "connection") ||
+        HTTP_equalsIgnoreCase(name, "keep-alive") ||
+        HTTP_equalsIgnoreCase(name, "transfer-encoding") ||
+        HTTP_equalsIgnoreCase(name, "content-encoding") ||
+        HTTP_equalsIgnoreCase(name, "content-length") ||
+        HTTP_equalsIgnoreCase(name, "set-cookie")
+    );
+}
+
+// Params: response. Returns the status line and headers that are kept with a stored response
+char *http_serializeStoredHeaders(struct http_response *response) {
+    int length = 32 + strlen(response->response_description);
+    for (int i = 0; i < response->num_headers; i ++) {
+        length += strlen(response->headers[i].name) + (response->headers[i].value ? strlen(response->headers[i].value) : 0) + 4;
+    }
+
+    char *headers = (char *) calloc(length, sizeof(char));
+    int offset = sprintf(headers, "HTTP/1.1 %03d %s\r\n", response->response_code, response->response_description);
+    for (int i = 0; i < response->num_headers; i ++) {
+        struct http_header header = response->headers[i];
+        if (!http_isStoredHeader(header.name)) {
+            continue;
+        }
+        offset += sprintf(headers + offset, "%s: %s\r\n", header.name, header.value ? header.value : "");
+    }
+    strcpy(headers + offset, "\r\n");
+
+    return headers;
+}
+
+int64_t http_cacheNow() {
+    return (int64_t) time(NULL);
+}
+
+    #ifdef unix
+
+// Returns $XDG_CACHE_HOME/c-http (or ~/.cache/c-http), or NULL if neither is known
+char *HTTP_defaultDiskCacheDirectory() {
+    char *base = getenv("XDG_CACHE_HOME");
+    const char *suffix = "/c-http";
+    if (base == NULL || !*base) {
+        base = getenv("HOME");
+        suffix = "/.cache/c-http";
+    }
+    if (base == NULL || !*base) {
+        return NULL;
+    }
+
+    char *directory = (char *) calloc(strlen(base) + strlen(suffix) + 1, sizeof(char));
+    strcpy(directory, base);
+    strcat(directory, suffix);
+    return directory;
+}
+
+// Returns $XDG_DATA_HOME/c-http (or ~/.local/share/c-http), for what's kept on purpose rather than cached
+// (cookies, HSTS hosts), or NULL if neither is known
+char *HTTP_defaultDataDirectory() {
+    char *base = getenv("XDG_DATA_HOME");
+    const char *suffix = "/c-http";
+    if (base == NULL || !*base) {
+        base = getenv("HOME");
+        suffix = "/.local/share/c-http";
+    }
+    if (base == NULL || !*base) {
+        return NULL;
+    }
+
+    char *directory = (char *) calloc(strlen(base) + strlen(suffix) + 1, sizeof(char));
+    strcpy(directory, base);
+    strcat(directory, suffix);
+    return directory;
+}
+
+char *http_diskCachePath(struct http_disk_cache *cache, uint64_t key, const char *extension) {
+    char *path = (char *) calloc(strlen(cache->directory) + 32, sizeof(char));
+    sprintf(path, "%s/%016llx%s", cache->directory, (unsigned long long) key, extension);
+    return path;
+}
+
+// Must be called with the cache's lock held. Returns the entry's index, or -1.
+int http_findDiskCacheEntry(struct http_disk_cache *cache, uint64_t key) {
+    for (int i = 0; i < cache->count; i ++) {
+        if (cache->entries[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Must be called with the cache's lock held
+void http_removeDiskCacheEntry(struct http_disk_cache *cache, int index) {
+    char *path = http_diskCachePath(cache, cache->entries[index].key, "");
+    unlink(path);
+    free(path);
+
+    cache->total_size -= cache->entries[index].size;
+    memmove(cache->entries + index, cache->entries + index + 1, (cache->count - index - 1) * sizeof(struct http_disk_cache_entry));
+    cache->count --;
+}
+
+// Must be called with the cache's lock held
+void http_addDiskCacheEntry(struct http_disk_cache *cache, uint64_t key, int64_t size, int64_t lastUsed) {
+    cache->count ++;
+    cache->entries = (struct http_disk_cache_entry *) realloc(cache->entries, cache->count * sizeof(struct http_disk_cache_entry));
+    cache->entries[cache->count - 1].key = key;
+    cache->entries[cache->count - 1].size = size;
+    cache->entries[cache->count - 1].last_used = lastUsed;
+    cache->total_size += size;
+}
+
+// Creates `directory`, and any of its parents that don't exist
+int http_makeCacheDirectory(const char *directory) {
+    char *path = makeStrCpy(directory);
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    free(path);
+
+    return mkdir(directory, 0700) == 0 || errno == EEXIST ? 0 : 1;
+}
+
+// Opens (creating if needed) the cache in `directory`, or the default one if it's NULL. Only the file
+// headers are read. Returns NULL if there's nowhere to keep the cache.
+struct http_disk_cache *HTTP_openDiskCache(const char *directory, int64_t budget) {
+    char *path = directory != NULL ? makeStrCpy(directory) : HTTP_defaultDiskCacheDirectory();
+    if (path == NULL) {
+        return NULL;
+    }
+    if (http_makeCacheDirectory(path)) {
+        free(path);
+        return NULL;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        free(path);
+        return NULL;
+    }
+
+    struct http_disk_cache *cache = (struct http_disk_cache *) calloc(1, sizeof(struct http_disk_cache));
+    cache->directory = path;
+    cache->budget = budget;
+    cache->total_size = 0;
+    cache->entries = NULL;
+    cache->count = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    struct dirent *file;
+    while ((file = readdir(dir)) != NULL) {
+        char *name = file->d_name;
+        if (name[0] == '.') {
+            continue;
+        }
+
+        char *filePath = (char *) calloc(strlen(path) + strlen(name) + 2, sizeof(char));
+        sprintf(filePath, "%s/%s", path, name);
+
+        // Anything else (such as a write that was interrupted) is removed
+        char *end = NULL;
+        uint64_t key = strtoull(name, &end, 16);
+        struct http_disk_cache_file_header header;
+        struct stat info;
+        int fd = strlen(name) == 16 && *end == '\0' ? open(filePath, O_RDONLY) : -1;
+        int valid = fd != -1 && fstat(fd, &info) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) && !memcmp(header.magic, diskCacheMagic, 8);
+        if (fd != -1) {
+            close(fd);
+        }
+
+        if (valid) {
+            http_addDiskCacheEntry(cache, key, info.st_size, header.last_used);
+        } else {
+            unlink(filePath);
+        }
+        free(filePath);
+    }
+    closedir(dir);
+
+    return cache;
+}
+
+void HTTP_freeDiskCache(struct http_disk_cache *cache) {
+    if (cache == NULL) return;
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    free(cache->directory);
+    free(cache);
+}
+
+// Returns 1 if there's an entry (fresh or not) for `key`
+int HTTP_hasDiskCacheEntry(struct http_disk_cache *cache, const char *key) {
+    if (cache == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int present = http_findDiskCacheEntry(cache, http_hashCacheKey(key)) != -1;
+    pthread_mutex_unlock(&cache->lock);
+    return present;
+}
+
+// Rebuilds a response from its stored headers and body
+struct http_response http_responseFromStoredEntry(const char *headers, int headersLength, const char *body, int bodyLength) {
+    struct http_response_parser parser = HTTP_makeResponseParser();
+    HTTP_continueResponseParser(&parser, headers, headersLength, "1.1");
+    if (!parser.finished) {
+        HTTP_freeResponseParser(&parser);
+        struct http_response failure;
+        failure.error = 1;
+        return failure;
+    }
+
+    struct http_response response = HTTP_finishResponseParser(&parser, headers, parser.body_start);
+    free(response.response_body.data);
+    response.response_body.data = (char *) calloc(bodyLength + 1, sizeof(char));
+    memcpy(response.response_body.data, body, bodyLength);
+    response.response_body.length = bodyLength;
+    response.content_length = bodyLength;
+
+    return response;
+}
+
+// Looks `key` (see HTTP_cacheKeyForURL) up. If `found` is set, the response and validators belong to the caller.
+struct http_disk_cache_lookup HTTP_lookupDiskCache(struct http_disk_cache *cache, const char *key) {
+    struct http_disk_cache_lookup result;
+    result.found = 0;
+    result.fresh = 0;
+    result.validators = NULL;
+
+    if (cache == NULL) {
+        return result;
+    }
+
+    if (!HTTP_hasDiskCacheEntry(cache, key)) {
+        return result;
+    }
+
+    uint64_t hash = http_hashCacheKey(key);
+    char *path = http_diskCachePath(cache, hash, "");
+    int fd = open(path, O_RDWR);
+    free(path);
+    if (fd == -1) {
+        return result;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) || info.st_size < (off_t) sizeof(struct http_disk_cache_file_header)) {
+        close(fd);
+        return result;
+    }
+    char *mapped = (char *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close(fd);
+        return result;
+    }
+
+    struct http_disk_cache_file_header header;
+    memcpy(&header, mapped, sizeof(header));
+    const char *url = mapped + sizeof(header);
+    const char *headers = url + header.url_length + 1;
+    const char *body = headers + header.headers_length + 1;
+
+    // The URL is compared in full in case two URLs hash to the same name
+    int valid = !memcmp(header.magic, diskCacheMagic, 8)
+        && header.url_length >= 0 && header.headers_length >= 0 && header.body_length >= 0
+        && (int64_t) sizeof(header) + header.url_length + header.headers_length + header.body_length + 3 == info.st_size
+        && header.url_length == (int32_t) strlen(key) && !memcmp(url, key, header.url_length);
+
+    if (valid) {
+        result.response = http_responseFromStoredEntry(headers, header.headers_length, body, header.body_length);
+        valid = !result.response.error;
+    }
+
+    if (valid) {
+        int64_t now = http_cacheNow();
+        result.found = 1;
+        result.fresh = now < header.expires;
+
+        char *etag = HTTP_getHeader(&result.response, "etag");
+        char *lastModified = HTTP_getHeader(&result.response, "last-modified");
+        if (!result.fresh && (etag != NULL || lastModified != NULL)) {
+            result.validators = (char *) calloc((etag ? strlen(etag) : 0) + (lastModified ? strlen(lastModified) : 0) + 48, sizeof(char));
+            if (etag != NULL) {
+                strcat(result.validators, "If-None-Match: ");
+                strcat(result.validators, etag);
+                strcat(result.validators, "\r\n");
+            }
+            if (lastModified != NULL) {
+                strcat(result.validators, "If-Modified-Since: ");
+                strcat(result.validators, lastModified);
+                strcat(result.validators, "\r\n");
+            }
+        }
+
+        header.last_used = now;
+        pwrite(fd, &header.last_used, sizeof(header.last_used), offsetof(struct http_disk_cache_file_header, last_used));
+
+        pthread_mutex_lock(&cache->lock);
+        int index = http_findDiskCacheEntry(cache, hash);
+        if (index != -1) {
+            cache->entries[index].last_used = now;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    munmap(mapped, info.st_size);
+    close(fd);
+
+    // Without validators, a stale entry is no use
+    if (result.found && !result.fresh && result.validators == NULL) {
+        HTTP_freeResponse(&result.response);
+        result.found = 0;
+    }
+    return result;
+}
+
+// Returns 1 if the response can be stored at all
+int http_isResponseStorable(struct http_response *response) {
+    if (response->error || response->response_code != 200) {
+        return 0;
+    }
+
+    // A response that depends on request headers can't be reused, except for Accept-Encoding (which is always the same)
+    char *vary = HTTP_getHeader(response, "vary");
+    if (vary != NULL && *vary && !HTTP_equalsIgnoreCase(vary, "accept-encoding")) {
+        return 0;
+    }
+    return 1;
+}
+
+// Stores a (complete, decoded) response under `key`, replacing any previous entry
+void HTTP_storeInDiskCache(struct http_disk_cache *cache, const char *key, struct http_response *response) {
+    if (cache == NULL || !http_isResponseStorable(response)) {
+        return;
+    }
+
+    int64_t now = http_cacheNow();
+    int64_t expires = HTTP_getResponseExpiry(response, now);
+    int hasValidators = HTTP_getHeader(response, "etag") != NULL || HTTP_getHeader(response, "last-modified") != NULL;
+    if (expires == -1 || (expires <= now && !hasValidators)) {
+        return;
+    }
+    // The entry header only has room for 32-bit lengths
+    if (response->response_body.length > INT32_MAX) {
+        return;
+    }
+
+    char *headers = http_serializeStoredHeaders(response);
+
+    struct http_disk_cache_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, diskCacheMagic, 8);
+    header.stored = now;
+    header.expires = expires;
+    header.last_used = now;
+    header.response_code = response->response_code;
+    header.url_length = strlen(key);
+    header.headers_length = strlen(headers);
+    header.body_length = response->response_body.length;
+
+    int64_t size = sizeof(header) + header.url_length + header.headers_length + header.body_length + 3;
+    if (size > cache->budget) {
+        free(headers);
+        return;
+    }
+
+    // Written under another name first, so that an entry is never seen half-written
+    uint64_t hash = http_hashCacheKey(key);
+    char *temporaryPath = http_diskCachePath(cache, hash, ".tmp");
+    char *path = http_diskCachePath(cache, hash, "");
+
+    char nul = '\0';
+    struct iovec regions[7] = {
+        { &header, sizeof(header) },
+        { (void *) key, header.url_length }, { &nul, 1 },
+        { headers, header.headers_length }, { &nul, 1 },
+        { response->response_body.data, header.body_length }, { &nul, 1 },
+    };
+
+    int fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int written = fd != -1 ? writev(fd, regions, 7) : -1;
+    if (fd != -1) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int existing = http_findDiskCacheEntry(cache, hash);
+    if (existing != -1) {
+        cache->total_size -= cache->entries[existing].size;
+        memmove(cache->entries + existing, cache->entries + existing + 1, (cache->count - existing - 1) * sizeof(struct http_disk_cache_entry));
+        cache->count --;
+    }
+
+    if (written == size && !rename(temporaryPath, path)) {
+        // Least recently used first
+        while (cache->count && cache->total_size + size > cache->budget) {
+            int oldest = 0;
+            for (int i = 1; i < cache->count; i ++) {
+                if (cache->entries[i].last_used < cache->entries[oldest].last_used) {
+                    oldest = i;
+                }
+            }
+            http_removeDiskCacheEntry(cache, oldest);
+        }
+        http_addDiskCacheEntry(cache, hash, size, now);
+    } else {
+        unlink(temporaryPath);
+        unlink(path);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    free(temporaryPath);
+    free(path);
+    free(headers);
+}
+
+// Called when a stale entry was revalidated (304 Not Modified): the entry is fresh again for as long as
+// the new response says (falling back to the stored headers).
+void HTTP_refreshDiskCacheEntry(struct http_disk_cache *cache, const char *key, struct http_response *notModified, struct http_response *stored) {
+    if (cache == NULL) {
+        return;
+    }
+
+    int64_t now = http_cacheNow();
+    int hasPolicy = HTTP_getHeader(notModified, "cache-control") != NULL || HTTP_getHeader(notModified, "expires") != NULL;
+    int64_t expires = HTTP_getResponseExpiry(hasPolicy ? notModified : stored, now);
+
+    char *path = http_diskCachePath(cache, http_hashCacheKey(key), "");
+    int fd = open(path, O_WRONLY);
+    free(path);
+    if (fd == -1) {
+        return;
+    }
+    if (expires < now) {
+        expires = now;
+    }
+    pwrite(fd, &expires, sizeof(expires), offsetof(struct http_disk_cache_file_header, expires));
+    close(fd);
+}
+
+    #else
+
+char *HTTP_defaultDiskCacheDirectory() {
+    return NULL;
+}
+
+char *HTTP_defaultDataDirectory() {
+    return NULL;
+}
+
+struct http_disk_cache *HTTP_openDiskCache(const char *_directory, int64_t _budget) {
+    log_err("HTTP_openDiskCache called, not supported on non-Unix compilation target\n");
+    return NULL;
+}
+
+void HTTP_freeDiskCache(struct http_disk_cache *_cache) { }
+
+int HTTP_hasDiskCacheEntry(struct http_disk_cache *_cache, const char *_key) {
+    return 0;
+}
+
+struct http_disk_cache_lookup HTTP_lookupDiskCache(struct http_disk_cache *_cache, const char *_key) {
+    struct http_disk_cache_lookup result;
+    result.found = 0;
+    result.fresh = 0;
+    result.validators = NULL;
+    return result;
+}
+
+void HTTP_storeInDiskCache(struct http_disk_cache *_cache, const char *_key, struct http_response *_response) { }
+
+void HTTP_refreshDiskCacheEntry(struct http_disk_cache *_cache, const char *_key, struct http_response *_notModified, struct http_response *_stored) { }
+
+    #endif
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include "response.h"
 
@@ -5,151 +6,199 @@
     #define _HTTP_CHUNKED 1
 
 struct chunked_response_state {
-    struct http_data current_chunked_data;
+    // Everything decoded so far (NUL-terminated)
     struct http_data current_parsed_data;
+    int64_t capacity;
+
     int finished;
-    int was_incomplete;
     int error;
-};
-
-
-// was_incomplete gets set if the chunk data was not enough. In that case, you need to manually append another data chunk. For example:
-/*
-```
-b\r\n
-hello, wor
-```
-
---> {
-    curchunk: length=16 (the data)
-    curdata: length=0 (parsing failure due to incomplete data)
-    finished: 0
-    was_incomplete: 1 
-}
 
+    // Bytes of the chunked body used so far; once finished, the length of the whole body with its framing
+    int64_t consumed;
 
-```
-b\r\n
-hello, world\r\n
-7\r\n
-goodby
-```
-
---> {
-    curchunk: length=26 (the data)
-    curdata: length=12 ("hello, world")
-    finished: 0
-    was_incomplete: 1 
-}
-*/
+    // Where the decoder is, kept between calls so that each call only looks at new bytes
+    int state;
+    int chunk_remaining;
+    int length_digits;
+};
 
 /*
     error codes:
     1: bad chunk length
+    2: missing CR+LF after chunk data
 */
 
 enum _http_internal_chunk_parser_state {
     CHUNK_LENGTH,
+    CHUNK_EXTENSION,
+    CHUNK_LENGTH_LF,
     CHUNK_BODY,
+    CHUNK_BODY_CR,
+    CHUNK_BODY_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_FINISHED,
 };
 
-struct chunked_response_state parseChunkedResponse(struct http_data body) {
-    struct chunked_response_state errorStruct;
-    errorStruct.error = 1;
-
-    struct http_data currentParsedData;
-
-    struct chunked_response_state responseStruct;
-    responseStruct.finished = 0;
+struct chunked_response_state HTTP_makeChunkedDecoder() {
+    struct chunked_response_state state;
+    state.capacity = 4096;
+    state.current_parsed_data.data = (char *) calloc(state.capacity + 1, sizeof(char));
+    state.current_parsed_data.length = 0;
+    state.finished = 0;
+    state.error = 0;
+    state.consumed = 0;
+    state.state = CHUNK_LENGTH;
+    state.chunk_remaining = 0;
+    state.length_digits = 0;
+
+    return state;
+}
 
-    responseStruct.current_chunked_data = body;
-    responseStruct.was_incomplete = 0;
-    responseStruct.error = 0;
+void http_reserveChunkedData(struct chunked_response_state *state, int64_t amount) {
+    if (state->capacity - state->current_parsed_data.length >= amount) {
+        return;
+    }
 
-    char *overallBody = (char *) calloc(body.length, sizeof(char));
-    int overallBodyLength = 0;
+    int64_t newCapacity = state->capacity ? state->capacity : 1;
+    while (newCapacity - state->current_parsed_data.length < amount) {
+        newCapacity *= 2;
+    }
 
-    char *currentLength = (char *) calloc(body.length, sizeof(char)); // this should probably be optimized and made smaller, but eh
-    int currentLen = 0;
-    int finished = 0;
+    state->current_parsed_data.data = (char *) realloc(state->current_parsed_data.data, newCapacity + 1);
+    state->capacity = newCapacity;
+}
 
-    int currentState = CHUNK_LENGTH;
-    for (int i = 0; i < body.length; i ++) {
-        char curChar = body.data[i];
-        char nextChar;
-        if (i + 1 < body.length) {
-            nextChar = body.data[i + 1];
-        } else {
-            nextChar = '\0';
-        }
-        switch(currentState) {
-            case CHUNK_LENGTH:
-                if (curChar == '\r' && nextChar == '\n') {
-                    currentLen = strtol(currentLength, NULL, 16);
-                    if (currentLen == 0) { // the terminating 0-length chunk
-                        finished = 1;
+// Decodes the next bytes of a chunked body; `chunk` only has to contain data that hasn't been passed in before,
+// and may end anywhere (even in the middle of a chunk length).
+// Returns the number of bytes used: if the body ends before `chunk` does, the rest belongs to whatever comes next.
+int appendChunkToBody(struct chunked_response_state *state, struct http_data chunk) {
+    int i = 0;
+    while (i < chunk.length && !state->finished && !state->error) {
+        char curChar = chunk.data[i];
+
+        switch (state->state) {
+            case CHUNK_LENGTH: {
+                int value = -1;
+                if (curChar >= '0' && curChar <= '9') value = curChar - '0';
+                else if (curChar >= 'a' && curChar <= 'f') value = curChar - 'a' + 10;
+                else if (curChar >= 'A' && curChar <= 'F') value = curChar - 'A' + 10;
+
+                if (value != -1) {
+                    if (state->chunk_remaining > 0x7ffffff) {
+                        state->error = 1;
                         break;
                     }
-
-                    int length = strlen(currentLength);
-                    for (int j = 0; j < length; j ++) {
-                        currentLength[j] = '\0';
-                    }
-                    currentState = CHUNK_BODY;
-                    i ++; // CR+LF, skip over the \n
+                    state->chunk_remaining = state->chunk_remaining * 16 + value;
+                    state->length_digits ++;
+                } else if (!state->length_digits) {
+                    state->error = 1;
+                } else if (curChar == ';' || curChar == ' ' || curChar == '\t') {
+                    state->state = CHUNK_EXTENSION;
+                } else if (curChar == '\r') {
+                    state->state = CHUNK_LENGTH_LF;
+                } else {
+                    state->error = 1;
+                }
+                i ++;
+                break;
+            }
+            case CHUNK_EXTENSION:
+                // Extensions are ignored
+                if (curChar == '\r') {
+                    state->state = CHUNK_LENGTH_LF;
+                }
+                i ++;
+                break;
+            case CHUNK_LENGTH_LF:
+                if (curChar != '\n') {
+                    state->error = 1;
                     break;
                 }
-                if ((curChar >= '0' && curChar <= '9') || (curChar >= 'a' && curChar <= 'z') || (curChar >= 'A' && curChar <= 'Z')) {
-                    currentLength[strlen(currentLength)] = curChar;
-                } else {
-                    return errorStruct;
+                state->length_digits = 0;
+                // The terminating 0-length chunk is followed by (optional) trailers
+                state->state = state->chunk_remaining ? CHUNK_BODY : CHUNK_TRAILER;
+                i ++;
+                break;
+            case CHUNK_BODY: {
+                // Copy as much of the chunk as is available at once
+                int amount = chunk.length - i;
+                if (amount > state->chunk_remaining) {
+                    amount = state->chunk_remaining;
+                }
+                http_reserveChunkedData(state, amount);
+                memcpy(state->current_parsed_data.data + state->current_parsed_data.length, chunk.data + i, amount);
+                state->current_parsed_data.length += amount;
+                state->chunk_remaining -= amount;
+                i += amount;
+
+                if (!state->chunk_remaining) {
+                    state->state = CHUNK_BODY_CR;
                 }
                 break;
-            case CHUNK_BODY:
-                if (currentLen > 0) {
-                    overallBody[overallBodyLength] = curChar;
-                    overallBodyLength ++;
-                    currentLen --;
+            }
+            case CHUNK_BODY_CR:
+                if (curChar != '\r') {
+                    state->error = 2;
                     break;
                 }
-                if (curChar == '\r' && nextChar == '\n') {
-                    currentState = CHUNK_LENGTH;
-                    i ++; // CR+LF, skip over the \n
+                state->state = CHUNK_BODY_LF;
+                i ++;
+                break;
+            case CHUNK_BODY_LF:
+                if (curChar != '\n') {
+                    state->error = 2;
                     break;
                 }
-        }
-        if (finished) {
-            break;
+                state->state = CHUNK_LENGTH;
+                i ++;
+                break;
+            case CHUNK_TRAILER:
+                // An empty line ends the trailers (and the body)
+                if (curChar == '\r') {
+                    state->state = CHUNK_TRAILER_LF;
+                } else {
+                    state->state = CHUNK_TRAILER_LINE;
+                }
+                i ++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (curChar == '\n') {
+                    state->state = CHUNK_TRAILER;
+                }
+                i ++;
+                break;
+            case CHUNK_TRAILER_LF:
+                if (curChar != '\n') {
+                    state->error = 1;
+                    break;
+                }
+                state->state = CHUNK_FINISHED;
+                state->finished = 1;
+                i ++;
+                break;
         }
     }
 
-    free(currentLength);
-
-    currentParsedData.data = overallBody;
-    currentParsedData.length = overallBodyLength;
-
-    responseStruct.finished = finished;
-    responseStruct.current_parsed_data = currentParsedData;
-    if (currentLen > 0) {
-        responseStruct.was_incomplete = 1;
-    }
-
-    return responseStruct;
+    state->current_parsed_data.data[state->current_parsed_data.length] = '\0';
+    state->consumed += i;
+    return i;
 }
 
-void appendChunkToBody(struct chunked_response_state *state, struct http_data chunk) {
-    struct chunked_response_state curState = *state;
-    int newLength = curState.current_chunked_data.length + chunk.length;
-    char *newData = (char *) calloc(newLength + 2, sizeof(char));
-    memcpy(newData, curState.current_chunked_data.data, curState.current_chunked_data.length);
-    memcpy(newData + curState.current_chunked_data.length, chunk.data, chunk.length);
+// Decodes a complete chunked body in one go
+struct chunked_response_state parseChunkedResponse(struct http_data body) {
+    struct chunked_response_state state = HTTP_makeChunkedDecoder();
+    appendChunkToBody(&state, body);
 
-    struct http_data data;
-    data.length = newLength;
-    data.data = newData;
+    return state;
+}
 
-    free(state->current_chunked_data.data);
-    *state = parseChunkedResponse(data);
+void HTTP_freeChunkedDecoder(struct chunked_response_state *state) {
+    free(state->current_parsed_data.data);
+    state->current_parsed_data.data = NULL;
+    state->current_parsed_data.length = 0;
+    state->capacity = 0;
 }
 
 #endif
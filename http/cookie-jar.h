@@ -0,0 +1,547 @@
+// Cookies that outlive the browser (those with Expires or Max-Age), kept in the user's data directory in two files:
+// "cookies", a snapshot with the records of each site together and an index of them at the front, and
+// "cookies.log", the records added since the snapshot was written. Neither is parsed when the browser starts:
+// the snapshot is mapped and only its index is searched, the log only has its record headers read, and a site's
+// cookies are only read into the store when it's first requested. Once the log grows large it's folded into a new
+// snapshot, leaving out cookies that have expired.
+
+#ifndef _HTTP_COOKIE_JAR
+    #define _HTTP_COOKIE_JAR 1
+
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+
+    #ifdef unix
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <unistd.h>
+    #endif
+
+    #include "../socket/common.h"
+    #include "../utils/string.h"
+
+    #include "cache.h"
+    #include "cookie.h"
+
+// Bumped whenever the file layout changes; files with another version are ignored and replaced
+    #define cookieJarMagic "chttpj1"
+// The log is compacted once it's larger than this, and than half of the snapshot
+    #define cookieJarCompactionThreshold (64 * 1024)
+
+// Each record is this header followed by the name, value, domain and path, each followed by a NUL byte
+struct http_cookie_record {
+    // http_hashCookieKey of the cookie's bucket key
+    uint64_t key_hash;
+    int64_t expires;
+    int32_t host_only;
+    int32_t name_length;
+    int32_t value_length;
+    int32_t domain_length;
+    int32_t path_length;
+    int32_t reserved;
+};
+
+// The snapshot starts with this header, then `index_count` index entries sorted by hash, then the records
+struct http_cookie_jar_header {
+    char magic[8];
+    int64_t index_count;
+};
+
+struct http_cookie_jar_index_entry {
+    uint64_t key_hash;
+    // Where the records with this hash are, from the start of the file
+    int64_t offset;
+    int64_t length;
+};
+
+// A record in the log (which starts with the magic, and has no index)
+struct http_cookie_log_entry {
+    uint64_t key_hash;
+    int64_t offset;
+};
+
+struct http_cookie_jar {
+    char *directory;
+
+    // The snapshot as it was when the jar was opened, or NULL (once everything has been read from it)
+    char *snapshot;
+    // Of the snapshot on disk, which is mapped when `snapshot` is set
+    int64_t snapshot_length;
+
+    int log_descriptor;
+    // The log as it was when the jar was opened (or NULL), and its records. Records written since don't need to
+    // be read back, since they were made from cookies that are already in the store.
+    char *log;
+    int64_t log_mapped_length;
+    struct http_cookie_log_entry *log_entries;
+    int log_entry_count;
+    // Including what's been written since
+    int64_t log_length;
+
+    // Hashes of the buckets that have been read into the store, sorted
+    uint64_t *loaded;
+    int loaded_count;
+    // Set once everything in the files is in the store
+    int all_loaded;
+};
+
+// Reads the record at `offset` of `data` (`length` bytes long), filling in `cookie` (with copies of its strings)
+// if it isn't NULL. Returns the record's length, or -1 if it doesn't fit or is malformed.
+int64_t http_readCookieRecord(const char *data, int64_t length, int64_t offset, uint64_t *keyHash, struct http_cookie *cookie) {
+    struct http_cookie_record record;
+    if (offset < 0 || length - offset < (int64_t) sizeof(record)) {
+        return -1;
+    }
+    memcpy(&record, data + offset, sizeof(record));
+
+    int32_t lengths[4] = { record.name_length, record.value_length, record.domain_length, record.path_length };
+    int64_t recordLength = sizeof(record);
+    for (int i = 0; i < 4; i ++) {
+        if (lengths[i] < 0 || length - offset - recordLength < (int64_t) lengths[i] + 1 || data[offset + recordLength + lengths[i]] != '\0') {
+            return -1;
+        }
+        recordLength += lengths[i] + 1;
+    }
+
+    *keyHash = record.key_hash;
+    if (cookie != NULL) {
+        const char *strings = data + offset + sizeof(record);
+        cookie->name = makeStrCpy(strings);
+        cookie->value = makeStrCpy(strings + record.name_length + 1);
+        cookie->domain = makeStrCpy(strings + record.name_length + record.value_length + 2);
+        cookie->path = makeStrCpy(strings + record.name_length + record.value_length + record.domain_length + 3);
+        cookie->host_only = record.host_only;
+        cookie->expires = record.expires;
+    }
+    return recordLength;
+}
+
+// Adds the cookie's record (with `expires` in place of its own) onto the end of `buffer`
+void http_writeCookieRecord(struct socket_buffer *buffer, struct http_cookie *cookie, int64_t expires) {
+    char *key = HTTP_cookieBucketKey(cookie->domain);
+    struct http_cookie_record record;
+    memset(&record, 0, sizeof(record));
+    record.key_hash = http_hashCookieKey(key);
+    record.expires = expires;
+    record.host_only = cookie->host_only;
+    record.name_length = strlen(cookie->name);
+    record.value_length = strlen(cookie->value);
+    record.domain_length = strlen(cookie->domain);
+    record.path_length = strlen(cookie->path);
+    free(key);
+
+    socket_reserveBuffer(buffer, sizeof(record) + record.name_length + record.value_length + record.domain_length + record.path_length + 4);
+    memcpy(buffer->data + buffer->length, &record, sizeof(record));
+    buffer->length += sizeof(record);
+    const char *strings[4] = { cookie->name, cookie->value, cookie->domain, cookie->path };
+    for (int i = 0; i < 4; i ++) {
+        // Copies the NUL too
+        int stringLength = strlen(strings[i]) + 1;
+        memcpy(buffer->data + buffer->length, strings[i], stringLength);
+        buffer->length += stringLength;
+    }
+}
+
+// Returns the index of `keyHash` in the sorted list of loaded hashes, or where it would go (as -index - 1)
+int http_findLoadedCookieHash(struct http_cookie_jar *jar, uint64_t keyHash) {
+    int low = 0;
+    int high = jar->loaded_count - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (jar->loaded[middle] == keyHash) {
+            return middle;
+        }
+        if (jar->loaded[middle] < keyHash) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -low - 1;
+}
+
+// Reads the records with `keyHash` (from the snapshot, then the log, so later records replace earlier ones) into the store
+void http_loadCookieHash(struct http_cookie_jar *jar, struct http_cookie_store *store, uint64_t keyHash) {
+    int position = http_findLoadedCookieHash(jar, keyHash);
+    if (position >= 0) {
+        return;
+    }
+    position = -position - 1;
+    jar->loaded = (uint64_t *) realloc(jar->loaded, (jar->loaded_count + 1) * sizeof(uint64_t));
+    memmove(jar->loaded + position + 1, jar->loaded + position, (jar->loaded_count - position) * sizeof(uint64_t));
+    jar->loaded[position] = keyHash;
+    jar->loaded_count ++;
+
+    if (jar->snapshot != NULL) {
+        struct http_cookie_jar_header header;
+        memcpy(&header, jar->snapshot, sizeof(header));
+        const char *index = jar->snapshot + sizeof(header);
+
+        int64_t low = 0;
+        int64_t high = header.index_count - 1;
+        while (low <= high) {
+            int64_t middle = (low + high) / 2;
+            struct http_cookie_jar_index_entry entry;
+            memcpy(&entry, index + middle * sizeof(entry), sizeof(entry));
+            if (entry.key_hash < keyHash) {
+                low = middle + 1;
+            } else if (entry.key_hash > keyHash) {
+                high = middle - 1;
+            } else {
+                int64_t end = entry.length >= 0 && entry.offset <= jar->snapshot_length - entry.length ? entry.offset + entry.length : 0;
+                for (int64_t offset = entry.offset; offset < end; ) {
+                    uint64_t recordHash;
+                    struct http_cookie cookie;
+                    int64_t recordLength = http_readCookieRecord(jar->snapshot, end, offset, &recordHash, &cookie);
+                    if (recordLength < 0) {
+                        break;
+                    }
+                    HTTP_addCookieToStore(store, cookie);
+                    offset += recordLength;
+                }
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < jar->log_entry_count; i ++) {
+        if (jar->log_entries[i].key_hash != keyHash) {
+            continue;
+        }
+        uint64_t recordHash;
+        struct http_cookie cookie;
+        if (http_readCookieRecord(jar->log, jar->log_mapped_length, jar->log_entries[i].offset, &recordHash, &cookie) >= 0) {
+            HTTP_addCookieToStore(store, cookie);
+        }
+    }
+}
+
+    #ifdef unix
+
+char *http_cookieJarPath(struct http_cookie_jar *jar, const char *name) {
+    char *path = (char *) calloc(strlen(jar->directory) + strlen(name) + 2, sizeof(char));
+    sprintf(path, "%s/%s", jar->directory, name);
+    return path;
+}
+
+// Maps the whole file read-only. Returns NULL if it's empty or can't be mapped.
+char *http_mapCookieFile(int descriptor, int64_t *length) {
+    struct stat info;
+    if (fstat(descriptor, &info) || info.st_size <= 0) {
+        return NULL;
+    }
+    char *data = (char *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *length = info.st_size;
+    return data;
+}
+
+// Maps the snapshot, if there's a valid one
+void http_openCookieSnapshot(struct http_cookie_jar *jar) {
+    char *path = http_cookieJarPath(jar, "cookies");
+    int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (descriptor < 0) {
+        return;
+    }
+
+    jar->snapshot = http_mapCookieFile(descriptor, &jar->snapshot_length);
+    close(descriptor);
+    if (jar->snapshot == NULL) {
+        return;
+    }
+
+    struct http_cookie_jar_header header;
+    int valid = jar->snapshot_length >= (int64_t) sizeof(header);
+    if (valid) {
+        memcpy(&header, jar->snapshot, sizeof(header));
+        valid = !memcmp(header.magic, cookieJarMagic, 8) && header.index_count >= 0
+            && header.index_count <= (jar->snapshot_length - (int64_t) sizeof(header)) / (int64_t) sizeof(struct http_cookie_jar_index_entry);
+    }
+    if (!valid) {
+        munmap(jar->snapshot, jar->snapshot_length);
+        jar->snapshot = NULL;
+        jar->snapshot_length = 0;
+    }
+}
+
+// Opens the log (creating it if needed) and reads where its records are. A record cut off by a crash, and
+// anything after it, is dropped.
+int http_openCookieLog(struct http_cookie_jar *jar) {
+    char *path = http_cookieJarPath(jar, "cookies.log");
+    jar->log_descriptor = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    free(path);
+    if (jar->log_descriptor < 0) {
+        return 1;
+    }
+
+    jar->log = http_mapCookieFile(jar->log_descriptor, &jar->log_mapped_length);
+    if (jar->log == NULL || jar->log_mapped_length < 8 || memcmp(jar->log, cookieJarMagic, 8)) {
+        if (jar->log != NULL) {
+            munmap(jar->log, jar->log_mapped_length);
+            jar->log = NULL;
+        }
+        jar->log_mapped_length = 0;
+        if (ftruncate(jar->log_descriptor, 0) || write(jar->log_descriptor, cookieJarMagic, 8) != 8) {
+            return 1;
+        }
+        jar->log_length = 8;
+        return 0;
+    }
+
+    int64_t offset = 8;
+    while (offset < jar->log_mapped_length) {
+        uint64_t keyHash;
+        int64_t recordLength = http_readCookieRecord(jar->log, jar->log_mapped_length, offset, &keyHash, NULL);
+        if (recordLength < 0) {
+            if (ftruncate(jar->log_descriptor, offset)) {
+                return 1;
+            }
+            break;
+        }
+
+        jar->log_entries = (struct http_cookie_log_entry *) realloc(jar->log_entries, (jar->log_entry_count + 1) * sizeof(struct http_cookie_log_entry));
+        jar->log_entries[jar->log_entry_count].key_hash = keyHash;
+        jar->log_entries[jar->log_entry_count].offset = offset;
+        jar->log_entry_count ++;
+        offset += recordLength;
+    }
+    jar->log_length = offset;
+    return 0;
+}
+
+void HTTP_freeCookieJar(struct http_cookie_jar *jar) {
+    if (jar == NULL) return;
+
+    if (jar->snapshot != NULL) {
+        munmap(jar->snapshot, jar->snapshot_length);
+    }
+    if (jar->log != NULL) {
+        munmap(jar->log, jar->log_mapped_length);
+    }
+    if (jar->log_descriptor >= 0) {
+        close(jar->log_descriptor);
+    }
+    free(jar->log_entries);
+    free(jar->loaded);
+    free(jar->directory);
+    free(jar);
+}
+
+// Opens the cookie jar in `directory`, or the default one if it's NULL. Only the snapshot's header and the
+// log's record headers are read. Returns NULL if there's nowhere to keep cookies.
+struct http_cookie_jar *HTTP_openCookieJar(const char *directory) {
+    char *path = directory != NULL ? makeStrCpy(directory) : HTTP_defaultDataDirectory();
+    if (path == NULL) {
+        return NULL;
+    }
+    if (http_makeCacheDirectory(path)) {
+        free(path);
+        return NULL;
+    }
+
+    struct http_cookie_jar *jar = (struct http_cookie_jar *) calloc(1, sizeof(struct http_cookie_jar));
+    jar->directory = path;
+    jar->log_descriptor = -1;
+
+    http_openCookieSnapshot(jar);
+    if (http_openCookieLog(jar)) {
+        HTTP_freeCookieJar(jar);
+        return NULL;
+    }
+    return jar;
+}
+
+// Reads the cookies that could be sent to `hostname` into the store, unless they're there already.
+// Must be called with the store's lock held, before the store is used for the host.
+void HTTP_loadJarCookies(struct http_cookie_jar *jar, struct http_cookie_store *store, const char *hostname) {
+    if (jar == NULL || store == NULL || jar->all_loaded) return;
+
+    char *lowerHostname = toLowerCase(hostname);
+    char *key = HTTP_cookieBucketKey(lowerHostname);
+    http_loadCookieHash(jar, store, http_hashCookieKey(key));
+    free(key);
+    free(lowerHostname);
+}
+
+struct http_cookie_jar_bucket {
+    uint64_t key_hash;
+    struct http_cookie_bucket *bucket;
+};
+
+int http_compareCookieJarBuckets(const void *a, const void *b) {
+    uint64_t first = ((const struct http_cookie_jar_bucket *) a)->key_hash;
+    uint64_t second = ((const struct http_cookie_jar_bucket *) b)->key_hash;
+    return (first > second) - (first < second);
+}
+
+// Writes every unexpired cookie that has an expiry date into a new snapshot, and empties the log. Everything
+// is read into the store first, since the store then has the latest version of each cookie.
+int http_compactCookieJar(struct http_cookie_jar *jar, struct http_cookie_store *store) {
+    if (jar->snapshot != NULL) {
+        struct http_cookie_jar_header header;
+        memcpy(&header, jar->snapshot, sizeof(header));
+        for (int64_t i = 0; i < header.index_count; i ++) {
+            struct http_cookie_jar_index_entry entry;
+            memcpy(&entry, jar->snapshot + sizeof(header) + i * sizeof(entry), sizeof(entry));
+            http_loadCookieHash(jar, store, entry.key_hash);
+        }
+    }
+    for (int i = 0; i < jar->log_entry_count; i ++) {
+        http_loadCookieHash(jar, store, jar->log_entries[i].key_hash);
+    }
+    jar->all_loaded = 1;
+
+    struct http_cookie_jar_bucket *buckets = (struct http_cookie_jar_bucket *) calloc(store->bucket_count + 1, sizeof(struct http_cookie_jar_bucket));
+    int bucketCount = 0;
+    for (int i = 0; i < store->capacity; i ++) {
+        for (struct http_cookie_bucket *bucket = store->buckets[i]; bucket != NULL; bucket = bucket->next) {
+            buckets[bucketCount].key_hash = http_hashCookieKey(bucket->key);
+            buckets[bucketCount].bucket = bucket;
+            bucketCount ++;
+        }
+    }
+    qsort(buckets, bucketCount, sizeof(struct http_cookie_jar_bucket), http_compareCookieJarBuckets);
+
+    // Buckets whose keys have the same hash share an index entry
+    struct socket_buffer index = socket_makeBuffer(bucketCount * sizeof(struct http_cookie_jar_index_entry));
+    struct socket_buffer records = socket_makeBuffer(4096);
+    int64_t now = http_cookieNow();
+    for (int i = 0; i < bucketCount; i ++) {
+        int64_t start = records.length;
+        for (int j = 0; j < buckets[i].bucket->count; j ++) {
+            struct http_cookie *cookie = &buckets[i].bucket->cookies[j];
+            if (cookie->expires && !HTTP_isCookieExpired(cookie, now)) {
+                http_writeCookieRecord(&records, cookie, cookie->expires);
+            }
+        }
+        if (records.length == start) {
+            continue;
+        }
+
+        struct http_cookie_jar_index_entry *previous = index.length ? (struct http_cookie_jar_index_entry *) (index.data + index.length) - 1 : NULL;
+        if (previous != NULL && previous->key_hash == buckets[i].key_hash) {
+            previous->length += records.length - start;
+            continue;
+        }
+        struct http_cookie_jar_index_entry entry;
+        entry.key_hash = buckets[i].key_hash;
+        entry.offset = start;
+        entry.length = records.length - start;
+        memcpy(index.data + index.length, &entry, sizeof(entry));
+        index.length += sizeof(entry);
+    }
+    free(buckets);
+
+    // Record offsets were counted from the start of the records
+    struct http_cookie_jar_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cookieJarMagic, 8);
+    header.index_count = index.length / sizeof(struct http_cookie_jar_index_entry);
+    int64_t recordsStart = sizeof(header) + index.length;
+    for (int64_t i = 0; i < header.index_count; i ++) {
+        ((struct http_cookie_jar_index_entry *) index.data)[i].offset += recordsStart;
+    }
+
+    // Written beside the old snapshot and renamed over it, so there's always a whole snapshot on disk
+    char *temporaryPath = http_cookieJarPath(jar, "cookies.tmp");
+    char *path = http_cookieJarPath(jar, "cookies");
+    int descriptor = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int failed = descriptor < 0;
+    if (!failed) {
+        failed = write(descriptor, &header, sizeof(header)) != sizeof(header)
+            || write(descriptor, index.data, index.length) != index.length
+            || write(descriptor, records.data, records.length) != records.length
+            || fsync(descriptor);
+        close(descriptor);
+        failed = failed || rename(temporaryPath, path);
+        if (failed) {
+            unlink(temporaryPath);
+        }
+    }
+    free(temporaryPath);
+    free(path);
+    int64_t snapshotLength = recordsStart + records.length;
+    socket_freeBuffer(&index);
+    socket_freeBuffer(&records);
+    if (failed) {
+        return 1;
+    }
+
+    // Everything is in the store now, so neither file has to be read again
+    if (jar->snapshot != NULL) {
+        munmap(jar->snapshot, jar->snapshot_length);
+        jar->snapshot = NULL;
+    }
+    jar->snapshot_length = snapshotLength;
+    if (jar->log != NULL) {
+        munmap(jar->log, jar->log_mapped_length);
+        jar->log = NULL;
+        jar->log_mapped_length = 0;
+    }
+    free(jar->log_entries);
+    jar->log_entries = NULL;
+    jar->log_entry_count = 0;
+
+    if (ftruncate(jar->log_descriptor, 8)) {
+        return 1;
+    }
+    jar->log_length = 8;
+    return 0;
+}
+
+// Adds a cookie to the store, and saves it to the jar (or removes it from there) if it has to be kept on disk.
+// Must be called with the store's lock held.
+void HTTP_addCookieToStoreAndJar(struct http_cookie_jar *jar, struct http_cookie_store *store, struct http_cookie cookie) {
+    if (jar == NULL || store == NULL) {
+        HTTP_addCookieToStore(store, cookie);
+        return;
+    }
+
+    int64_t expires = cookie.expires;
+    if (!expires) {
+        // A session cookie that replaces a saved one deletes it from disk
+        struct http_cookie *stored = HTTP_findCookie(store, &cookie);
+        expires = stored != NULL && stored->expires ? 1 : 0;
+    }
+
+    // The record is made first, since the store takes the cookie over (and may free it), but only written once the
+    // store is up to date: a compaction rebuilds the snapshot from the store, and throws the log away
+    struct socket_buffer record = socket_makeBuffer(256);
+    if (expires) {
+        http_writeCookieRecord(&record, &cookie, expires);
+    }
+    HTTP_addCookieToStore(store, cookie);
+
+    // One write, so that a record is never interleaved with another
+    if (record.length && write(jar->log_descriptor, record.data, record.length) == record.length) {
+        jar->log_length += record.length;
+    }
+    socket_freeBuffer(&record);
+
+    if (jar->log_length > cookieJarCompactionThreshold && jar->log_length > jar->snapshot_length / 2) {
+        http_compactCookieJar(jar, store);
+    }
+}
+
+    #else
+
+struct http_cookie_jar *HTTP_openCookieJar(const char *_directory) {
+    return NULL;
+}
+
+void HTTP_freeCookieJar(struct http_cookie_jar *_jar) { }
+
+void HTTP_loadJarCookies(struct http_cookie_jar *_jar, struct http_cookie_store *_store, const char *_hostname) { }
+
+void HTTP_addCookieToStoreAndJar(struct http_cookie_jar *_jar, struct http_cookie_store *store, struct http_cookie cookie) {
+    HTTP_addCookieToStore(store, cookie);
+}
+
+    #endif
+#endif
@@ -1,143 +1,491 @@
-#include "../utils/string.h"
+// Cookies (RFC 6265). The store is a hash table of buckets, one for each registrable domain (see
+// HTTP_cookieBucketKey), so a request only looks at the cookies of its own site. Domain and Path attributes are
+// followed: a cookie set for a whole domain is stored once and sent to each of its hosts. Cookies with an expiry
+// date are also kept on disk, in the cookie jar (see cookie-jar.h).
+
+#ifndef _HTTP_COOKIE
+    #define _HTTP_COOKIE 1
+
+    #include <ctype.h>
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+
+    #include "../utils/string.h"
+
+    #include "cache.h"
+    #include "response.h"
+
+// Always a power of two
+    #define initialCookieBuckets 64
 
 struct http_cookie {
     char *name;
     char *value;
 
-    char *hostname;
+    // Lowercase, without a leading dot: the host that set the cookie, or its Domain attribute
+    char *domain;
+    char *path;
+    // Set when there was no Domain attribute, so only `domain` itself gets the cookie (not its subdomains)
+    int host_only;
+    // Wall-clock time it expires at, or 0 for a session cookie (which is never saved to disk)
+    int64_t expires;
 };
 
-struct http_cookie_store {
+struct http_cookie_bucket {
+    // The registrable domain of every cookie in the bucket
+    char *key;
     struct http_cookie *cookies;
     int count;
+    // Length of "name=value; " for all of the cookies, which no Cookie header made from them can be longer than
+    int64_t text_length;
+
+    struct http_cookie_bucket *next;
 };
 
-int HTTP_getCookieIndex(struct http_cookie_store *store, char *name, char *hostname) {
-    if (store == NULL) return -1;
+struct http_cookie_store {
+    struct http_cookie_bucket **buckets;
+    int capacity;
+    int bucket_count;
+    // Cookies in all of the buckets
+    int count;
+};
 
-    int len = store->count;
-    for (int i = 0; i < len; i ++) {
-        if (!strcmp(store->cookies[i].hostname, hostname) && !strcmp(store->cookies[i].name, name)) {
-            return i;
+uint64_t http_hashCookieKey(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key; key ++) {
+        hash ^= (unsigned char) *key;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int http_isIPAddress(const char *hostname) {
+    if (strchr(hostname, ':') != NULL) {
+        return 1;
+    }
+    for (; *hostname; hostname ++) {
+        if ((*hostname < '0' || *hostname > '9') && *hostname != '.') {
+            return 0;
         }
     }
+    return 1;
+}
 
-    return -1;
+// Second-level labels that are usually part of a country's public suffix, as in "co.uk" or "ne.jp"
+int http_isPublicSecondLevel(const char *label, int length) {
+    const char *labels[] = { "ac", "co", "com", "edu", "go", "gov", "ne", "net", "or", "org" };
+    for (int i = 0; i < (int) (sizeof(labels) / sizeof(labels[0])); i ++) {
+        if ((int) strlen(labels[i]) == length && !strncmp(label, labels[i], length)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+The bucket a (lowercase) host's cookies are kept in: its registrable domain, e.g. "example.com" for
+"www.example.com" or "example.co.uk" for "a.example.co.uk". There's no public suffix list, so a two-letter
+top-level domain after a label like "co" is taken to be a suffix of its own. A cookie can only be set for a domain
+with the same key as the host setting it, so every cookie a host could be sent is in its bucket.
+*/
+char *HTTP_cookieBucketKey(const char *hostname) {
+    int length = strlen(hostname);
+    if (http_isIPAddress(hostname)) {
+        return makeStrCpy(hostname);
+    }
+
+    // How many labels from the end make up the key
+    int labels = 2;
+    const char *topLevel = strrchr(hostname, '.');
+    if (topLevel != NULL && strlen(topLevel + 1) == 2) {
+        const char *secondLevel = topLevel;
+        while (secondLevel > hostname && secondLevel[-1] != '.') {
+            secondLevel --;
+        }
+        if (secondLevel > hostname && http_isPublicSecondLevel(secondLevel, topLevel - secondLevel)) {
+            labels = 3;
+        }
+    }
+
+    int start = length;
+    for (int found = 0; start > 0; start --) {
+        if (hostname[start - 1] == '.' && ++ found == labels) {
+            break;
+        }
+    }
+    return makeStrCpy(hostname + start);
+}
+
+// Returns 1 if a cookie for `domain` (without a leading dot) can be sent to `hostname` (both lowercase)
+int HTTP_domainMatches(const char *hostname, const char *domain) {
+    int hostnameLength = strlen(hostname);
+    int domainLength = strlen(domain);
+    if (hostnameLength == domainLength) {
+        return !strcmp(hostname, domain);
+    }
+    return hostnameLength > domainLength && hostname[hostnameLength - domainLength - 1] == '.'
+        && !strcmp(hostname + hostnameLength - domainLength, domain) && !http_isIPAddress(hostname);
+}
+
+// Returns 1 if a cookie for `cookiePath` can be sent with a request for `requestPath` (which may have a query)
+int HTTP_pathMatches(const char *requestPath, const char *cookiePath) {
+    int requestLength = strcspn(requestPath, "?#");
+    int cookieLength = strlen(cookiePath);
+    if (cookieLength > requestLength || strncmp(requestPath, cookiePath, cookieLength)) {
+        return 0;
+    }
+    return cookieLength == requestLength || cookiePath[cookieLength - 1] == '/' || requestPath[cookieLength] == '/';
+}
+
+// The path of a cookie that didn't give one: the "directory" of the request's path
+char *HTTP_defaultCookiePath(const char *requestPath) {
+    int length = strcspn(requestPath, "?#");
+    int lastSlash = -1;
+    for (int i = 0; i < length; i ++) {
+        if (requestPath[i] == '/') {
+            lastSlash = i;
+        }
+    }
+    if (requestPath[0] != '/' || lastSlash <= 0) {
+        return makeStrCpy("/");
+    }
+
+    char *path = (char *) calloc(lastSlash + 1, sizeof(char));
+    memcpy(path, requestPath, lastSlash);
+    return path;
+}
+
+void HTTP_freeCookie(struct http_cookie *cookie) {
+    free(cookie->name);
+    free(cookie->value);
+    free(cookie->domain);
+    free(cookie->path);
 }
 
 struct http_cookie_store *HTTP_makeCookieStore() {
     struct http_cookie_store *cookie_store = (struct http_cookie_store *) calloc(1, sizeof(struct http_cookie_store));
+    cookie_store->capacity = initialCookieBuckets;
+    cookie_store->buckets = (struct http_cookie_bucket **) calloc(cookie_store->capacity, sizeof(struct http_cookie_bucket *));
+    cookie_store->bucket_count = 0;
     cookie_store->count = 0;
-    cookie_store->cookies = NULL;
 
     return cookie_store;
 }
 
-void HTTP_addCookieToStore(struct http_cookie_store *store, struct http_cookie cookie) {
+void HTTP_freeCookieStore(struct http_cookie_store *store) {
     if (store == NULL) return;
 
-    int idx = HTTP_getCookieIndex(store, cookie.name, cookie.hostname);
-    if (idx != -1) {
-        store->cookies[idx] = cookie;
+    for (int i = 0; i < store->capacity; i ++) {
+        struct http_cookie_bucket *bucket = store->buckets[i];
+        while (bucket != NULL) {
+            struct http_cookie_bucket *next = bucket->next;
+            for (int j = 0; j < bucket->count; j ++) {
+                HTTP_freeCookie(&bucket->cookies[j]);
+            }
+            free(bucket->cookies);
+            free(bucket->key);
+            free(bucket);
+            bucket = next;
+        }
+    }
+    free(store->buckets);
+    free(store);
+}
+
+// Doubles the number of slots, once there are more buckets than three quarters of them
+void http_growCookieStore(struct http_cookie_store *store) {
+    int capacity = store->capacity * 2;
+    struct http_cookie_bucket **buckets = (struct http_cookie_bucket **) calloc(capacity, sizeof(struct http_cookie_bucket *));
+    for (int i = 0; i < store->capacity; i ++) {
+        struct http_cookie_bucket *bucket = store->buckets[i];
+        while (bucket != NULL) {
+            struct http_cookie_bucket *next = bucket->next;
+            int slot = http_hashCookieKey(bucket->key) & (capacity - 1);
+            bucket->next = buckets[slot];
+            buckets[slot] = bucket;
+            bucket = next;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->capacity = capacity;
+}
+
+// Returns the bucket for `key`, or NULL if there isn't one and `create` isn't set
+struct http_cookie_bucket *http_findCookieBucket(struct http_cookie_store *store, const char *key, int create) {
+    int slot = http_hashCookieKey(key) & (store->capacity - 1);
+    for (struct http_cookie_bucket *bucket = store->buckets[slot]; bucket != NULL; bucket = bucket->next) {
+        if (!strcmp(bucket->key, key)) {
+            return bucket;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    if ((store->bucket_count + 1) * 4 > store->capacity * 3) {
+        http_growCookieStore(store);
+        slot = http_hashCookieKey(key) & (store->capacity - 1);
+    }
+    struct http_cookie_bucket *bucket = (struct http_cookie_bucket *) calloc(1, sizeof(struct http_cookie_bucket));
+    bucket->key = makeStrCpy(key);
+    bucket->next = store->buckets[slot];
+    store->buckets[slot] = bucket;
+    store->bucket_count ++;
+
+    return bucket;
+}
+
+int64_t http_cookieNow() {
+    return (int64_t) time(NULL);
+}
+
+int HTTP_isCookieExpired(struct http_cookie *cookie, int64_t now) {
+    return cookie->expires && cookie->expires <= now;
+}
+
+int64_t http_cookieTextLength(struct http_cookie *cookie) {
+    return strlen(cookie->name) + strlen(cookie->value) + 3;
+}
+
+// Must be called with the cookie's bucket
+void http_removeCookie(struct http_cookie_store *store, struct http_cookie_bucket *bucket, int index) {
+    bucket->text_length -= http_cookieTextLength(&bucket->cookies[index]);
+    HTTP_freeCookie(&bucket->cookies[index]);
+    memmove(bucket->cookies + index, bucket->cookies + index + 1, (bucket->count - index - 1) * sizeof(struct http_cookie));
+    bucket->count --;
+    store->count --;
+}
+
+// Returns the index of the cookie in the bucket with the same name, domain and path as `cookie`, or -1
+int http_findCookieIndex(struct http_cookie_bucket *bucket, struct http_cookie *cookie) {
+    for (int i = 0; i < bucket->count; i ++) {
+        struct http_cookie *stored = &bucket->cookies[i];
+        if (!strcmp(stored->name, cookie->name) && !strcmp(stored->domain, cookie->domain) && !strcmp(stored->path, cookie->path)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the stored cookie that `cookie` would replace, or NULL
+struct http_cookie *HTTP_findCookie(struct http_cookie_store *store, struct http_cookie *cookie) {
+    char *key = HTTP_cookieBucketKey(cookie->domain);
+    struct http_cookie_bucket *bucket = http_findCookieBucket(store, key, 0);
+    free(key);
+    if (bucket == NULL) {
+        return NULL;
+    }
+
+    int index = http_findCookieIndex(bucket, cookie);
+    return index >= 0 ? &bucket->cookies[index] : NULL;
+}
+
+// Adds the cookie (whose strings the store takes over), replacing any with the same name, domain and path.
+// A cookie that has already expired only removes the one it would replace, which is how servers delete cookies.
+void HTTP_addCookieToStore(struct http_cookie_store *store, struct http_cookie cookie) {
+    if (store == NULL) {
+        HTTP_freeCookie(&cookie);
         return;
     }
 
+    char *key = HTTP_cookieBucketKey(cookie.domain);
+    struct http_cookie_bucket *bucket = http_findCookieBucket(store, key, 1);
+    free(key);
+
+    int expired = HTTP_isCookieExpired(&cookie, http_cookieNow());
+    int index = http_findCookieIndex(bucket, &cookie);
+    if (index >= 0) {
+        if (expired) {
+            http_removeCookie(store, bucket, index);
+            HTTP_freeCookie(&cookie);
+            return;
+        }
+        struct http_cookie *stored = &bucket->cookies[index];
+        bucket->text_length += http_cookieTextLength(&cookie) - http_cookieTextLength(stored);
+        HTTP_freeCookie(stored);
+        *stored = cookie;
+        return;
+    }
+    if (expired) {
+        HTTP_freeCookie(&cookie);
+        return;
+    }
+
+    bucket->count ++;
+    bucket->cookies = (struct http_cookie *) realloc(bucket->cookies, sizeof(struct http_cookie) * bucket->count);
+    bucket->cookies[bucket->count - 1] = cookie;
+    bucket->text_length += http_cookieTextLength(&cookie);
     store->count ++;
-    store->cookies = (struct http_cookie *) realloc(store->cookies, sizeof(struct http_cookie) * store->count);
-    store->cookies[store->count - 1] = cookie;
-}
-
-struct http_cookie HTTP_makeCookie(char *name, char *value, char *hostname) {
-    struct http_cookie cookie;
-    cookie.name = name;
-    cookie.value = value;
-    cookie.hostname = hostname;
-
-    return cookie;
-}
-
-struct http_cookie HTTP_parseCookieString(char *string, char *hostname) {
-    int doneParsingName = 0;
-    int len = strlen(string);
-    char *name = (char *) calloc(len, sizeof(char));
-    char *value = (char *) calloc(len, sizeof(char));
-    int idx = 0;
-    for (int i = 0; i < len; i ++) {
-        char curChar = string[i];
-        if (!doneParsingName) {
-            if (curChar == '=') {
-                idx = 0;
-                doneParsingName = 1;
-                continue;
-            } else if (curChar == ';') {
-                break;
-            } else {
-                name[idx] = curChar;
-                idx ++;
-            }
-        } else {
-            if (curChar == ';') {
-                break;
-            } else {
-                value[idx] = curChar;
-                idx ++;
+}
+
+// Copies `length` characters of `text` without the spaces around them
+char *http_copyTrimmed(const char *text, int length) {
+    while (length > 0 && (*text == ' ' || *text == '\t')) {
+        text ++;
+        length --;
+    }
+    while (length > 0 && (text[length - 1] == ' ' || text[length - 1] == '\t')) {
+        length --;
+    }
+
+    char *copy = (char *) calloc(length + 1, sizeof(char));
+    memcpy(copy, text, length);
+    return copy;
+}
+
+// Parses an Expires attribute, which is an HTTP date but often written with dashes ("Wed, 21-Oct-2015 07:28:00 GMT").
+// Returns -1 if it isn't a date.
+int64_t http_parseCookieDate(const char *value) {
+    char *date = makeStrCpy(value);
+    for (char *character = date; *character; character ++) {
+        if (*character == '-') {
+            *character = ' ';
+        }
+    }
+    int64_t time = HTTP_parseDate(date);
+    free(date);
+    return time;
+}
+
+/*
+Parses a Set-Cookie header sent by `hostname` for a request of `requestPath`. Returns 0 and fills in `cookie`,
+or returns -1 if the cookie has to be ignored (its Domain attribute isn't the host or one of its parents, or is
+a public suffix).
+*/
+int HTTP_parseCookieString(char *string, char *hostname, char *requestPath, struct http_cookie *cookie) {
+    char *lowerHostname = toLowerCase(hostname);
+    char *domain = NULL;
+    char *path = NULL;
+    cookie->expires = 0;
+    int hasMaxAge = 0;
+
+    int pairLength = strcspn(string, ";");
+    char *equals = memchr(string, '=', pairLength);
+    if (equals != NULL) {
+        cookie->name = http_copyTrimmed(string, equals - string);
+        cookie->value = http_copyTrimmed(equals + 1, pairLength - (equals + 1 - string));
+    } else {
+        cookie->name = http_copyTrimmed(string, pairLength);
+        cookie->value = makeStrCpy("");
+    }
+
+    for (char *attribute = string + pairLength; *attribute == ';'; ) {
+        attribute ++;
+        int attributeLength = strcspn(attribute, ";");
+        char *attributeText = http_copyTrimmed(attribute, attributeLength);
+        attribute += attributeLength;
+
+        char *value = strchr(attributeText, '=');
+        if (value != NULL) {
+            *value = '\0';
+            char *trimmedName = http_copyTrimmed(attributeText, strlen(attributeText));
+            char *trimmedValue = http_copyTrimmed(value + 1, strlen(value + 1));
+
+            if (HTTP_equalsIgnoreCase(trimmedName, "domain") && *trimmedValue) {
+                free(domain);
+                // A leading dot is left over from an older standard
+                domain = toLowerCase(trimmedValue[0] == '.' ? trimmedValue + 1 : trimmedValue);
+            } else if (HTTP_equalsIgnoreCase(trimmedName, "path") && trimmedValue[0] == '/') {
+                free(path);
+                path = makeStrCpy(trimmedValue);
+            } else if (HTTP_equalsIgnoreCase(trimmedName, "max-age") && (isdigit((unsigned char) trimmedValue[0]) || trimmedValue[0] == '-')) {
+                // Takes precedence over Expires; 0 or less means the cookie is deleted
+                long long maxAge = strtoll(trimmedValue, NULL, 10);
+                cookie->expires = maxAge > 0 ? http_cookieNow() + maxAge : 1;
+                hasMaxAge = 1;
+            } else if (HTTP_equalsIgnoreCase(trimmedName, "expires") && !hasMaxAge) {
+                int64_t expires = http_parseCookieDate(trimmedValue);
+                if (expires != -1) {
+                    cookie->expires = expires > 0 ? expires : 1;
+                }
             }
+            free(trimmedName);
+            free(trimmedValue);
         }
+        free(attributeText);
     }
 
-    char *nameCpy = makeStrCpy(name);
-    free(name);
+    cookie->path = path != NULL ? path : HTTP_defaultCookiePath(requestPath);
+    cookie->host_only = domain == NULL;
+    if (cookie->host_only) {
+        cookie->domain = lowerHostname;
+        return 0;
+    }
 
-    char *valueCpy = makeStrCpy(value);
-    free(value);
+    cookie->domain = domain;
+    char *hostKey = HTTP_cookieBucketKey(lowerHostname);
+    char *domainKey = HTTP_cookieBucketKey(domain);
+    int allowed = HTTP_domainMatches(lowerHostname, domain) && !strcmp(hostKey, domainKey);
+    free(hostKey);
+    free(domainKey);
+    free(lowerHostname);
 
-    return HTTP_makeCookie(nameCpy, valueCpy, makeStrCpy(hostname));
+    if (!allowed) {
+        HTTP_freeCookie(cookie);
+        return -1;
+    }
+    return 0;
 }
 
-char *HTTP_cookieStoreToString(struct http_cookie_store *store, char *hostname) {
+// The cookies that would be sent to `hostname`, as "name=value" joined by `separator` (two characters).
+// `path` is NULL to list the cookies for every path.
+char *http_joinCookies(struct http_cookie_store *store, char *hostname, char *path, const char *separator) {
     if (store == NULL) return makeStrCpy("");
 
-    char *result = (char *) calloc(1, sizeof(char));
-    int count = store->count;
-    for (int i = 0; i < count; i ++) {
-        struct http_cookie cookie = store->cookies[i];
-
-        // Should this be case-insensitive?
-        if (!strcmp(cookie.hostname, hostname)) {
-            result = (char *) realloc(result, strlen(result) + strlen(cookie.name) + strlen(cookie.value) + 8);
-            strcat(result, cookie.name);
-            strcat(result, "=");
-            strcat(result, cookie.value);
-            if (i != count - 1) {
-                strcat(result, "; ");
-            }
+    char *lowerHostname = toLowerCase(hostname);
+    char *key = HTTP_cookieBucketKey(lowerHostname);
+    struct http_cookie_bucket *bucket = http_findCookieBucket(store, key, 0);
+    free(key);
+    if (bucket == NULL) {
+        free(lowerHostname);
+        return makeStrCpy("");
+    }
+
+    char *result = (char *) calloc(bucket->text_length + 1, sizeof(char));
+    int64_t length = 0;
+    int64_t now = http_cookieNow();
+    for (int i = 0; i < bucket->count; i ++) {
+        struct http_cookie *cookie = &bucket->cookies[i];
+        if (HTTP_isCookieExpired(cookie, now)) {
+            continue;
+        }
+        int domainMatches = cookie->host_only ? !strcmp(cookie->domain, lowerHostname) : HTTP_domainMatches(lowerHostname, cookie->domain);
+        if (!domainMatches || (path != NULL && !HTTP_pathMatches(path, cookie->path))) {
+            continue;
+        }
+
+        if (length) {
+            memcpy(result + length, separator, 2);
+            length += 2;
         }
+        int nameLength = strlen(cookie->name);
+        int valueLength = strlen(cookie->value);
+        memcpy(result + length, cookie->name, nameLength);
+        length += nameLength;
+        result[length ++] = '=';
+        memcpy(result + length, cookie->value, valueLength);
+        length += valueLength;
     }
-    char *res = makeStrCpy(result);
-    free(result);
-    return res;
+    free(lowerHostname);
+
+    return result;
+}
+
+// The value of the Cookie header for a request, or "" if there are no cookies to send
+char *HTTP_cookieStoreToString(struct http_cookie_store *store, char *hostname, char *path) {
+    return http_joinCookies(store, hostname, path, "; ");
 }
 
 char *HTTP_cookieStoreToStringPretty(struct http_cookie_store *store, char *hostname) {
-    if (store == NULL || store->count == 0) return makeStrCpy("None");
-
-    char *result = (char *) calloc(1, sizeof(char));
-    int count = store->count;
-    for (int i = 0; i < count; i ++) {
-        struct http_cookie cookie = store->cookies[i];
-
-        // Should this be case-insensitive?
-        if (!strcmp(cookie.hostname, hostname)) {
-            result = (char *) realloc(result, strlen(result) + strlen(cookie.name) + strlen(cookie.value) + 8);
-            strcat(result, cookie.name);
-            strcat(result, "=");
-            strcat(result, cookie.value);
-            if (i != count - 1) {
-                strcat(result, "\n\n");
-            }
-        }
+    char *result = http_joinCookies(store, hostname, NULL, "\n\n");
+    if (!*result) {
+        free(result);
+        return makeStrCpy("None");
     }
-    char *res = makeStrCpy(result);
-    free(result);
-    return res;
+    return result;
 }
+
+#endif
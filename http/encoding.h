@@ -0,0 +1,304 @@
+// Content-Encoding support: bodies are decompressed as they arrive, after the chunked/Content-Length framing.
+// Build with -lz -lbrotlidec, or define HTTP_NO_BROTLI to leave brotli out (and drop -lbrotlidec).
+
+#ifndef _HTTP_ENCODING
+    #define _HTTP_ENCODING 1
+
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <zlib.h>
+
+    #ifndef HTTP_NO_BROTLI
+        #include <brotli/decode.h>
+    #endif
+
+    #include "response.h"
+
+    #ifdef HTTP_NO_BROTLI
+        #define HTTP_acceptEncoding "gzip, deflate"
+    #else
+        #define HTTP_acceptEncoding "gzip, deflate, br"
+    #endif
+
+    #define maxDecodePieceLength (1 << 30)
+
+enum http_content_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+    HTTP_ENCODING_BROTLI,
+    HTTP_ENCODING_UNSUPPORTED,
+};
+
+// Params: value of the Content-Encoding header (or NULL)
+int HTTP_contentEncodingFromHeader(const char *value) {
+    if (value == NULL || !*value || HTTP_equalsIgnoreCase(value, "identity")) {
+        return HTTP_ENCODING_IDENTITY;
+    }
+    if (HTTP_equalsIgnoreCase(value, "gzip") || HTTP_equalsIgnoreCase(value, "x-gzip")) {
+        return HTTP_ENCODING_GZIP;
+    }
+    if (HTTP_equalsIgnoreCase(value, "deflate")) {
+        return HTTP_ENCODING_DEFLATE;
+    }
+    #ifndef HTTP_NO_BROTLI
+        if (HTTP_equalsIgnoreCase(value, "br")) {
+            return HTTP_ENCODING_BROTLI;
+        }
+    #endif
+    // Includes stacked encodings ("gzip, br"), which we never ask for
+    return HTTP_ENCODING_UNSUPPORTED;
+}
+
+struct http_content_decoder {
+    int encoding;
+
+    // zlib keeps a pointer to its z_stream, so it's only set up once the decoder is at its final address
+    z_stream zlib;
+    int zlib_initialized;
+    // Set until "deflate" data has been seen to have a zlib header, since some servers send raw deflate.
+    // Everything given to the decoder until then is kept, to be decoded again from the start if it's raw.
+    int deflate_may_be_raw;
+    struct http_data deflate_input;
+    #ifndef HTTP_NO_BROTLI
+        BrotliDecoderState *brotli;
+    #endif
+
+    // Everything decoded so far (NUL-terminated)
+    struct http_data output;
+    int64_t capacity;
+
+    // Set once any encoded data has been given to the decoder, and once it has reached the end of the encoded data
+    int started;
+    int finished;
+    int error;
+};
+
+struct http_content_decoder HTTP_makeContentDecoder(int encoding) {
+    struct http_content_decoder decoder;
+    memset(&decoder, 0, sizeof(decoder));
+    decoder.encoding = encoding;
+    // Unencoded data doesn't go through the decoder's buffer unless the caller chooses to
+    decoder.capacity = encoding == HTTP_ENCODING_IDENTITY ? 0 : 16384;
+    decoder.output.data = (char *) calloc(decoder.capacity + 1, sizeof(char));
+    decoder.output.length = 0;
+
+    decoder.deflate_may_be_raw = encoding == HTTP_ENCODING_DEFLATE;
+    #ifndef HTTP_NO_BROTLI
+        if (encoding == HTTP_ENCODING_BROTLI) {
+            decoder.brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+            if (decoder.brotli == NULL) {
+                decoder.error = 1;
+            }
+        }
+    #endif
+
+    return decoder;
+}
+
+void http_reserveDecodedData(struct http_content_decoder *decoder, int64_t amount) {
+    if (decoder->capacity - decoder->output.length >= amount) {
+        return;
+    }
+
+    int64_t newCapacity = decoder->capacity ? decoder->capacity : 1;
+    while (newCapacity - decoder->output.length < amount) {
+        newCapacity *= 2;
+    }
+
+    decoder->output.data = (char *) realloc(decoder->output.data, newCapacity + 1);
+    decoder->capacity = newCapacity;
+}
+
+// Stops keeping the input of a "deflate" body, once it's known whether it's raw
+void http_forgetDeflateInput(struct http_content_decoder *decoder) {
+    decoder->deflate_may_be_raw = 0;
+    free(decoder->deflate_input.data);
+    decoder->deflate_input.data = NULL;
+    decoder->deflate_input.length = 0;
+}
+
+int http_inflate(struct http_content_decoder *decoder, const char *data, int length) {
+    if (decoder->deflate_may_be_raw) {
+        // The zlib header (2 bytes) can arrive split across calls, so nothing is known until it has been checked
+        char *kept = (char *) realloc(decoder->deflate_input.data, decoder->deflate_input.length + length);
+        if (kept == NULL) {
+            return 1;
+        }
+        memcpy(kept + decoder->deflate_input.length, data, length);
+        decoder->deflate_input.data = kept;
+        decoder->deflate_input.length += length;
+    }
+
+    if (!decoder->zlib_initialized) {
+        // 32: detect a gzip or zlib header automatically
+        if (inflateInit2(&decoder->zlib, decoder->encoding == HTTP_ENCODING_GZIP ? 15 + 32 : 15) != Z_OK) {
+            return 1;
+        }
+        decoder->zlib_initialized = 1;
+    }
+
+    decoder->zlib.next_in = (Bytef *) data;
+    decoder->zlib.avail_in = length;
+
+    while (decoder->zlib.avail_in > 0 && !decoder->finished) {
+        // Compressed data usually grows several times over
+        http_reserveDecodedData(decoder, 4 * (int64_t) decoder->zlib.avail_in + 4096);
+        // zlib's output space is counted in 32-bit units too
+        int64_t space = decoder->capacity - decoder->output.length;
+        uInt availableOut = space > maxDecodePieceLength ? maxDecodePieceLength : (uInt) space;
+        decoder->zlib.next_out = (Bytef *) decoder->output.data + decoder->output.length;
+        decoder->zlib.avail_out = availableOut;
+
+        int res = inflate(&decoder->zlib, Z_NO_FLUSH);
+        decoder->output.length += availableOut - decoder->zlib.avail_out;
+
+        if (res == Z_DATA_ERROR && decoder->deflate_may_be_raw && decoder->zlib.total_out == 0) {
+            // No zlib header, so everything given so far is decoded again as raw deflate
+            inflateEnd(&decoder->zlib);
+            memset(&decoder->zlib, 0, sizeof(decoder->zlib));
+            if (inflateInit2(&decoder->zlib, -15) != Z_OK) {
+                decoder->zlib_initialized = 0;
+                return 1;
+            }
+            decoder->deflate_may_be_raw = 0;
+            decoder->zlib.next_in = (Bytef *) decoder->deflate_input.data;
+            decoder->zlib.avail_in = decoder->deflate_input.length;
+            continue;
+        }
+        if (res == Z_STREAM_END) {
+            decoder->finished = 1;
+        } else if (res != Z_OK && res != Z_BUF_ERROR) {
+            return 1;
+        }
+        // zlib checks the header before anything else, so once it has been read the data isn't raw
+        if (decoder->zlib.total_in >= 2 || decoder->zlib.total_out > 0) {
+            decoder->deflate_may_be_raw = 0;
+        }
+    }
+
+    // The input kept for a retry is only needed until the retry is no longer possible (or has been made)
+    if (!decoder->deflate_may_be_raw && decoder->deflate_input.data != NULL) {
+        http_forgetDeflateInput(decoder);
+    }
+    return 0;
+}
+
+    #ifndef HTTP_NO_BROTLI
+
+int http_decodeBrotli(struct http_content_decoder *decoder, const char *data, int length) {
+    size_t availableIn = length;
+    const uint8_t *nextIn = (const uint8_t *) data;
+
+    while (1) {
+        http_reserveDecodedData(decoder, 4 * availableIn + 4096);
+        size_t availableOut = decoder->capacity - decoder->output.length;
+        uint8_t *nextOut = (uint8_t *) decoder->output.data + decoder->output.length;
+
+        BrotliDecoderResult res = BrotliDecoderDecompressStream(decoder->brotli, &availableIn, &nextIn, &availableOut, &nextOut, NULL);
+        decoder->output.length = decoder->capacity - availableOut;
+
+        if (res == BROTLI_DECODER_RESULT_SUCCESS) {
+            decoder->finished = 1;
+            return 0;
+        }
+        if (res == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) {
+            return 0;
+        }
+        if (res == BROTLI_DECODER_RESULT_ERROR) {
+            return 1;
+        }
+        // BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT: grow and carry on
+    }
+}
+
+    #endif
+
+// Decodes the next part of the body, appending the result to `decoder->output`. Sets `decoder->error` on failure.
+void HTTP_decodeContent(struct http_content_decoder *decoder, const char *data, int64_t length) {
+    if (decoder->error || length <= 0) {
+        return;
+    }
+    decoder->started = 1;
+
+    // The decoders count their input in 32-bit units, so a very large body is passed in a piece at a time
+    while (length > 0 && !decoder->error) {
+        int piece = length > maxDecodePieceLength ? maxDecodePieceLength : (int) length;
+
+        switch (decoder->encoding) {
+            case HTTP_ENCODING_GZIP:
+            case HTTP_ENCODING_DEFLATE:
+                decoder->error = http_inflate(decoder, data, piece);
+                break;
+            #ifndef HTTP_NO_BROTLI
+                case HTTP_ENCODING_BROTLI:
+                    decoder->error = http_decodeBrotli(decoder, data, piece);
+                    break;
+            #endif
+            default:
+                http_reserveDecodedData(decoder, piece);
+                memcpy(decoder->output.data + decoder->output.length, data, piece);
+                decoder->output.length += piece;
+        }
+
+        data += piece;
+        length -= piece;
+    }
+
+    decoder->output.data[decoder->output.length] = '\0';
+}
+
+// Called once the whole body has been given to the decoder. Sets `decoder->error` if the encoded data ended before
+// its end was reached (a truncated body). An empty body is left as it is.
+void HTTP_endContent(struct http_content_decoder *decoder) {
+    if (decoder->encoding != HTTP_ENCODING_IDENTITY && decoder->started && !decoder->finished) {
+        decoder->error = 1;
+    }
+}
+
+// Frees the decoder's state, but not its output (which is usually handed on as the response body)
+void HTTP_finishContentDecoder(struct http_content_decoder *decoder) {
+    http_forgetDeflateInput(decoder);
+    if (decoder->zlib_initialized) {
+        inflateEnd(&decoder->zlib);
+        decoder->zlib_initialized = 0;
+    }
+    #ifndef HTTP_NO_BROTLI
+        if (decoder->brotli != NULL) {
+            BrotliDecoderDestroyInstance(decoder->brotli);
+            decoder->brotli = NULL;
+        }
+    #endif
+}
+
+void HTTP_freeContentDecoder(struct http_content_decoder *decoder) {
+    HTTP_finishContentDecoder(decoder);
+    free(decoder->output.data);
+    decoder->output.data = NULL;
+    decoder->output.length = 0;
+}
+
+// Decodes a complete body in place, for responses that were read in full before being decoded.
+// Returns 0, or 1 if the body couldn't be decoded.
+int HTTP_decodeResponseBody(struct http_response *response) {
+    int encoding = HTTP_contentEncodingFromHeader(HTTP_getHeader(response, "content-encoding"));
+    if (encoding == HTTP_ENCODING_IDENTITY || encoding == HTTP_ENCODING_UNSUPPORTED) {
+        return 0;
+    }
+
+    struct http_content_decoder decoder = HTTP_makeContentDecoder(encoding);
+    HTTP_decodeContent(&decoder, response->response_body.data, response->response_body.length);
+    HTTP_endContent(&decoder);
+    if (decoder.error) {
+        HTTP_freeContentDecoder(&decoder);
+        return 1;
+    }
+
+    HTTP_finishContentDecoder(&decoder);
+    free(response->response_body.data);
+    response->response_body = decoder.output;
+    return 0;
+}
+
+#endif
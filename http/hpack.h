@@ -0,0 +1,621 @@
+// HPACK (RFC 7541), the header compression used by HTTP/2. Both directions keep a dynamic table of recently sent
+// headers, so headers repeated across the requests of a connection (user agent, cookies...) only cost a byte or two.
+
+#ifndef _HTTP_HPACK
+    #define _HTTP_HPACK 1
+
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+
+    #include "../socket/common.h"
+    #include "../utils/string.h"
+
+    // The dynamic table size both sides start with (and the most we allow the server to use)
+    #define hpackDefaultTableSize 4096
+    // Added to the length of every dynamic table entry (RFC 7541, section 4.1)
+    #define hpackEntryOverhead 32
+    #define hpackStaticTableLength 61
+
+struct hpack_entry {
+    char *name;
+    char *value;
+};
+
+const struct hpack_entry hpack_staticTable[hpackStaticTableLength] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+struct hpack_huffman_code {
+    uint32_t code;
+    int length;
+};
+
+// Indexed by byte; the end-of-string symbol (256) is only ever used as padding
+const struct hpack_huffman_code hpack_huffmanCodes[256] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+};
+
+// Most recently added entry first
+struct hpack_table {
+    struct hpack_entry *entries;
+    int count;
+
+    // Sum of the entries' sizes, and the most it may be
+    int size;
+    int max_size;
+};
+
+struct hpack_decoder {
+    struct hpack_table table;
+
+    // Huffman decoding tree: children of each internal node. Positive values are nodes, negative ones are
+    // -(symbol + 1), and 0 is a missing branch.
+    short tree[512][2];
+    int tree_nodes;
+};
+
+struct hpack_encoder {
+    struct hpack_table table;
+
+    // Set when the server lowered the table size; the next header block has to announce it first
+    int pending_size_update;
+};
+
+// A decoded header block
+struct hpack_header_list {
+    struct hpack_entry *headers;
+    int count;
+};
+
+struct hpack_table hpack_makeTable(int maxSize) {
+    struct hpack_table table;
+    table.entries = NULL;
+    table.count = 0;
+    table.size = 0;
+    table.max_size = maxSize;
+
+    return table;
+}
+
+void hpack_evictTableEntries(struct hpack_table *table, int neededSpace) {
+    while (table->count > 0 && table->size + neededSpace > table->max_size) {
+        struct hpack_entry oldest = table->entries[table->count - 1];
+        table->size -= strlen(oldest.name) + strlen(oldest.value) + hpackEntryOverhead;
+        free(oldest.name);
+        free(oldest.value);
+        table->count --;
+    }
+}
+
+void hpack_setTableSize(struct hpack_table *table, int maxSize) {
+    table->max_size = maxSize;
+    hpack_evictTableEntries(table, 0);
+}
+
+// Copies the header into the table, making room by dropping the oldest entries.
+// An entry larger than the whole table just empties it.
+void hpack_addTableEntry(struct hpack_table *table, const char *name, const char *value) {
+    int entrySize = strlen(name) + strlen(value) + hpackEntryOverhead;
+    hpack_evictTableEntries(table, entrySize);
+    if (entrySize > table->max_size) {
+        return;
+    }
+
+    table->entries = (struct hpack_entry *) realloc(table->entries, (table->count + 1) * sizeof(struct hpack_entry));
+    memmove(table->entries + 1, table->entries, table->count * sizeof(struct hpack_entry));
+    table->entries[0].name = makeStrCpy(name);
+    table->entries[0].value = makeStrCpy(value);
+    table->count ++;
+    table->size += entrySize;
+}
+
+void hpack_freeTable(struct hpack_table *table) {
+    for (int i = 0; i < table->count; i ++) {
+        free(table->entries[i].name);
+        free(table->entries[i].value);
+    }
+    free(table->entries);
+    table->entries = NULL;
+    table->count = 0;
+    table->size = 0;
+}
+
+// Index 1 is the first static entry; the dynamic table follows the static one. Returns NULL for invalid indices.
+const struct hpack_entry *hpack_getEntry(struct hpack_table *table, int index) {
+    if (index >= 1 && index <= hpackStaticTableLength) {
+        return &hpack_staticTable[index - 1];
+    }
+    if (index > hpackStaticTableLength && index - hpackStaticTableLength <= table->count) {
+        return &table->entries[index - hpackStaticTableLength - 1];
+    }
+    return NULL;
+}
+
+// Returns the index of a matching name and value, or 0. `nameIndex` is set to the index of an entry with
+// just the same name (or 0).
+int hpack_findEntry(struct hpack_table *table, const char *name, const char *value, int *nameIndex) {
+    *nameIndex = 0;
+    for (int i = 0; i < hpackStaticTableLength; i ++) {
+        if (!strcmp(hpack_staticTable[i].name, name)) {
+            if (!strcmp(hpack_staticTable[i].value, value)) {
+                return i + 1;
+            }
+            if (*nameIndex == 0) {
+                *nameIndex = i + 1;
+            }
+        }
+    }
+    for (int i = 0; i < table->count; i ++) {
+        if (!strcmp(table->entries[i].name, name)) {
+            if (!strcmp(table->entries[i].value, value)) {
+                return hpackStaticTableLength + i + 1;
+            }
+            if (*nameIndex == 0) {
+                *nameIndex = hpackStaticTableLength + i + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Decoding */
+
+struct hpack_decoder *HPACK_makeDecoder() {
+    struct hpack_decoder *decoder = (struct hpack_decoder *) calloc(1, sizeof(struct hpack_decoder));
+    decoder->table = hpack_makeTable(hpackDefaultTableSize);
+
+    // Every code is inserted into a binary tree, one bit per level
+    decoder->tree_nodes = 1;
+    decoder->tree[0][0] = 0;
+    decoder->tree[0][1] = 0;
+    for (int symbol = 0; symbol < 256; symbol ++) {
+        struct hpack_huffman_code code = hpack_huffmanCodes[symbol];
+        int node = 0;
+        for (int bit = code.length - 1; bit > 0; bit --) {
+            int direction = (code.code >> bit) & 1;
+            if (decoder->tree[node][direction] == 0) {
+                int newNode = decoder->tree_nodes;
+                decoder->tree_nodes ++;
+                decoder->tree[newNode][0] = 0;
+                decoder->tree[newNode][1] = 0;
+                decoder->tree[node][direction] = newNode;
+            }
+            node = decoder->tree[node][direction];
+        }
+        decoder->tree[node][code.code & 1] = -(symbol + 1);
+    }
+
+    return decoder;
+}
+
+void HPACK_freeDecoder(struct hpack_decoder *decoder) {
+    if (decoder == NULL) return;
+
+    hpack_freeTable(&decoder->table);
+    free(decoder);
+}
+
+// Reads an integer with an N-bit prefix (RFC 7541, section 5.1). Returns 0, or 1 if it's truncated or too large.
+int hpack_readInteger(const unsigned char *data, int length, int *offset, int prefixBits, int *result) {
+    if (*offset >= length) {
+        return 1;
+    }
+
+    int limit = (1 << prefixBits) - 1;
+    int value = data[*offset] & limit;
+    (*offset) ++;
+    if (value < limit) {
+        *result = value;
+        return 0;
+    }
+
+    int shift = 0;
+    while (1) {
+        if (*offset >= length || shift > 21) {
+            return 1;
+        }
+        unsigned char byte = data[*offset];
+        (*offset) ++;
+        value += (byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    *result = value;
+    return 0;
+}
+
+// Returns the decoded string, or NULL if the Huffman data is invalid
+char *hpack_decodeHuffman(struct hpack_decoder *decoder, const unsigned char *data, int length) {
+    // Codes are at least 5 bits long, so the result is never more than 8/5 of the input
+    char *result = (char *) calloc(length * 8 / 5 + 2, sizeof(char));
+    int resultLength = 0;
+
+    int node = 0;
+    // Bits read since the last complete symbol, and whether they were all 1s (valid padding)
+    int pendingBits = 0;
+    int pendingOnes = 1;
+    for (int i = 0; i < length; i ++) {
+        for (int bit = 7; bit >= 0; bit --) {
+            int direction = (data[i] >> bit) & 1;
+            int next = decoder->tree[node][direction];
+            pendingBits ++;
+            pendingOnes = pendingOnes && direction;
+
+            if (next < 0) {
+                result[resultLength] = (char) (-next - 1);
+                resultLength ++;
+                node = 0;
+                pendingBits = 0;
+                pendingOnes = 1;
+            } else if (next == 0) {
+                // Only the end-of-string symbol (30 1s) leads nowhere, and it mustn't appear
+                free(result);
+                return NULL;
+            } else {
+                node = next;
+            }
+        }
+    }
+
+    if (pendingBits > 7 || !pendingOnes) {
+        free(result);
+        return NULL;
+    }
+    result[resultLength] = '\0';
+    return result;
+}
+
+// Reads a string literal (RFC 7541, section 5.2). Returns the string, or NULL if it's malformed.
+char *hpack_readString(struct hpack_decoder *decoder, const unsigned char *data, int length, int *offset) {
+    if (*offset >= length) {
+        return NULL;
+    }
+    int isHuffman = data[*offset] & 0x80;
+
+    int stringLength;
+    if (hpack_readInteger(data, length, offset, 7, &stringLength) || stringLength > length - *offset) {
+        return NULL;
+    }
+
+    char *result;
+    if (isHuffman) {
+        result = hpack_decodeHuffman(decoder, data + *offset, stringLength);
+    } else {
+        result = (char *) calloc(stringLength + 1, sizeof(char));
+        memcpy(result, data + *offset, stringLength);
+    }
+    *offset += stringLength;
+    return result;
+}
+
+void hpack_addHeader(struct hpack_header_list *list, char *name, char *value) {
+    list->headers = (struct hpack_entry *) realloc(list->headers, (list->count + 1) * sizeof(struct hpack_entry));
+    list->headers[list->count].name = name;
+    list->headers[list->count].value = value;
+    list->count ++;
+}
+
+void HPACK_freeHeaderList(struct hpack_header_list *list) {
+    for (int i = 0; i < list->count; i ++) {
+        free(list->headers[i].name);
+        free(list->headers[i].value);
+    }
+    free(list->headers);
+    list->headers = NULL;
+    list->count = 0;
+}
+
+// Returns the value of the first header called `name`, or NULL
+char *HPACK_getHeader(struct hpack_header_list *list, const char *name) {
+    for (int i = 0; i < list->count; i ++) {
+        if (!strcmp(list->headers[i].name, name)) {
+            return list->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// Decodes a complete header block into `list`. Returns 0, or 1 if the block is malformed (which leaves the
+// decoder's table unusable, so the connection has to be dropped).
+int HPACK_decodeBlock(struct hpack_decoder *decoder, const unsigned char *data, int length, struct hpack_header_list *list) {
+    list->headers = NULL;
+    list->count = 0;
+
+    int offset = 0;
+    while (offset < length) {
+        unsigned char first = data[offset];
+
+        if (first & 0x80) {
+            // Indexed header field
+            int index;
+            if (hpack_readInteger(data, length, &offset, 7, &index)) break;
+            const struct hpack_entry *entry = hpack_getEntry(&decoder->table, index);
+            if (entry == NULL) break;
+            hpack_addHeader(list, makeStrCpy(entry->name), makeStrCpy(entry->value));
+            continue;
+        }
+
+        if ((first & 0xe0) == 0x20) {
+            // Dynamic table size update, which can't exceed the size we allowed
+            int size;
+            if (hpack_readInteger(data, length, &offset, 5, &size) || size > hpackDefaultTableSize) break;
+            hpack_setTableSize(&decoder->table, size);
+            continue;
+        }
+
+        // Literal header field: with incremental indexing (01), or without indexing / never indexed (000)
+        int shouldIndex = (first & 0xc0) == 0x40;
+        int nameIndex;
+        if (hpack_readInteger(data, length, &offset, shouldIndex ? 6 : 4, &nameIndex)) break;
+
+        char *name;
+        if (nameIndex) {
+            const struct hpack_entry *entry = hpack_getEntry(&decoder->table, nameIndex);
+            if (entry == NULL) break;
+            name = makeStrCpy(entry->name);
+        } else {
+            name = hpack_readString(decoder, data, length, &offset);
+            if (name == NULL) break;
+        }
+
+        char *value = hpack_readString(decoder, data, length, &offset);
+        if (value == NULL) {
+            free(name);
+            break;
+        }
+
+        if (shouldIndex) {
+            hpack_addTableEntry(&decoder->table, name, value);
+        }
+        hpack_addHeader(list, name, value);
+    }
+
+    if (offset < length) {
+        HPACK_freeHeaderList(list);
+        return 1;
+    }
+    return 0;
+}
+
+/* Encoding */
+
+struct hpack_encoder *HPACK_makeEncoder() {
+    struct hpack_encoder *encoder = (struct hpack_encoder *) calloc(1, sizeof(struct hpack_encoder));
+    encoder->table = hpack_makeTable(hpackDefaultTableSize);
+    encoder->pending_size_update = 0;
+
+    return encoder;
+}
+
+void HPACK_freeEncoder(struct hpack_encoder *encoder) {
+    if (encoder == NULL) return;
+
+    hpack_freeTable(&encoder->table);
+    free(encoder);
+}
+
+// Called with the server's SETTINGS_HEADER_TABLE_SIZE. Our table never grows past the default size.
+void HPACK_setEncoderTableSize(struct hpack_encoder *encoder, int maxSize) {
+    if (maxSize > hpackDefaultTableSize) {
+        maxSize = hpackDefaultTableSize;
+    }
+    if (maxSize != encoder->table.max_size) {
+        hpack_setTableSize(&encoder->table, maxSize);
+        encoder->pending_size_update = 1;
+    }
+}
+
+void hpack_writeInteger(struct socket_buffer *out, int firstByte, int prefixBits, int value) {
+    socket_reserveBuffer(out, 8);
+
+    int limit = (1 << prefixBits) - 1;
+    if (value < limit) {
+        out->data[out->length ++] = (char) (firstByte | value);
+        return;
+    }
+
+    out->data[out->length ++] = (char) (firstByte | limit);
+    value -= limit;
+    while (value >= 0x80) {
+        out->data[out->length ++] = (char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out->data[out->length ++] = (char) value;
+}
+
+// Writes a string literal, Huffman-encoded when that makes it shorter
+void hpack_writeString(struct socket_buffer *out, const char *string) {
+    int length = strlen(string);
+
+    int huffmanBits = 0;
+    for (int i = 0; i < length; i ++) {
+        huffmanBits += hpack_huffmanCodes[(unsigned char) string[i]].length;
+    }
+    int huffmanLength = (huffmanBits + 7) / 8;
+
+    if (huffmanLength >= length) {
+        hpack_writeInteger(out, 0x00, 7, length);
+        socket_reserveBuffer(out, length);
+        memcpy(out->data + out->length, string, length);
+        out->length += length;
+        return;
+    }
+
+    hpack_writeInteger(out, 0x80, 7, huffmanLength);
+    socket_reserveBuffer(out, huffmanLength);
+
+    uint64_t pending = 0;
+    int pendingBits = 0;
+    for (int i = 0; i < length; i ++) {
+        struct hpack_huffman_code code = hpack_huffmanCodes[(unsigned char) string[i]];
+        pending = (pending << code.length) | code.code;
+        pendingBits += code.length;
+        while (pendingBits >= 8) {
+            pendingBits -= 8;
+            out->data[out->length ++] = (char) (pending >> pendingBits);
+        }
+    }
+    if (pendingBits > 0) {
+        // Padded with the most significant bits of the end-of-string code, which are all 1s
+        out->data[out->length ++] = (char) ((pending << (8 - pendingBits)) | (0xff >> pendingBits));
+    }
+}
+
+// Appends one header to a header block. `shouldIndex` adds it to the dynamic table, which pays off for
+// headers that are sent again on later requests.
+void HPACK_encodeHeader(struct hpack_encoder *encoder, struct socket_buffer *out, const char *name, const char *value, int shouldIndex) {
+    if (encoder->pending_size_update) {
+        hpack_writeInteger(out, 0x20, 5, encoder->table.max_size);
+        encoder->pending_size_update = 0;
+    }
+
+    int nameIndex;
+    int index = hpack_findEntry(&encoder->table, name, value, &nameIndex);
+    if (index) {
+        hpack_writeInteger(out, 0x80, 7, index);
+        return;
+    }
+
+    if (shouldIndex) {
+        hpack_writeInteger(out, 0x40, 6, nameIndex);
+    } else {
+        hpack_writeInteger(out, 0x00, 4, nameIndex);
+    }
+    if (!nameIndex) {
+        hpack_writeString(out, name);
+    }
+    hpack_writeString(out, value);
+
+    if (shouldIndex) {
+        hpack_addTableEntry(&encoder->table, name, value);
+    }
+}
+
+#endif
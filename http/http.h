@@ -11,23 +11,39 @@
 
 
     #include <errno.h>
+    #include <pthread.h>
 
     #include "../socket/domain.h"
     #include "../socket/secure-socket.h"
     #include "../socket/socket.h"
     #include "../utils/string.h"
 
+    #include "cache.h"
     #include "chunked.h"
+    #include "cookie-jar.h"
     #include "cookie.h"
+    #include "encoding.h"
+    #include "http2.h"
+    #include "memory-cache.h"
+    #include "pool.h"
+    #include "range.h"
+    #include "redirects.h"
     #include "response.h"
+    #include "timeouts.h"
+    #include "timing.h"
     #include "url.h"
 
 // see https://aticleworld.com/ssl-server-client-using-openssl-in-c/ for TLS 1.2 example
 
     #define maxInitialResponseSize 8192
     #define maxSegmentLength 4096
+    // Bodies with a Content-Length are allocated up front to this size at most; past it, the buffer grows as the
+    // body actually arrives, so a server can't make the browser allocate memory just by claiming a huge length
+    #define maxPreallocatedBodyLength (8 * 1024 * 1024)
 
 struct http_cookie_store *HTTP_globalCookieStore = NULL;
+// Requests can be made from several threads; the cookie store itself isn't thread-safe
+pthread_mutex_t HTTP_cookieStoreLock = PTHREAD_MUTEX_INITIALIZER;
 
 void HTTP_setGlobalCookieStore(struct http_cookie_store *store) {
     HTTP_globalCookieStore = store;
@@ -37,314 +53,1216 @@ struct http_cookie_store *HTTP_getGlobalCookieStore() {
     return HTTP_globalCookieStore;
 }
 
-typedef void (*dataReceiveHandler)(void *);
+// Where cookies with an expiry date are saved, or NULL to keep them in memory only. Guarded by HTTP_cookieStoreLock.
+struct http_cookie_jar *HTTP_globalCookieJar = NULL;
 
-typedef struct socket_info (*socketConnecter)(const char *, const char *, int, char *, char *, int);
+void HTTP_setGlobalCookieJar(struct http_cookie_jar *jar) {
+    HTTP_globalCookieJar = jar;
+}
 
-typedef struct socket_info (*socketReader)(struct socket_info, char *, int);
+struct http_cookie_jar *HTTP_getGlobalCookieJar() {
+    return HTTP_globalCookieJar;
+}
 
-typedef void (*socketCloser)(struct socket_info);
+// Set by threads loading pages the user hasn't asked for yet (such as speculative loads). Their requests carry no
+// cookies, and neither the cookies nor the disk cache take anything from their responses, so loading a page on
+// such a thread has no effect on the user's sessions.
+__thread int http_credentialsOmitted = 0;
 
+void HTTP_omitCredentialsOnThread() {
+    http_credentialsOmitted = 1;
+}
 
-struct http_response http_readFileToHTTP(char *path) {
-    char *contents = (char *) calloc(1048576, sizeof(char));
-    errno = 0;
-    FILE *fp = fopen(path, "r");
-    if (errno == ENOENT) {
-        struct http_response err;
-        err.error = 198;
-        return err;
-    }
-    if (errno == EACCES) {
-        struct http_response err;
-        err.error = 196;
-        return err;
-    }
+struct http_connection_pool *HTTP_globalConnectionPool = NULL;
 
-    errno = 0;
-    unsigned int c = fgetc(fp);
-    if (errno == EISDIR) {
-        struct http_response err;
-        err.error = 197;
-        return err;
-    }
+void HTTP_setGlobalConnectionPool(struct http_connection_pool *pool) {
+    HTTP_globalConnectionPool = pool;
+}
 
-    int i = 0;
-    while(c != EOF) {
-        contents[i] = c;
-        c = fgetc(fp);
-        i ++;
-        if (i > 1048574) {
-            break;
-        }
+struct http_connection_pool *HTTP_getGlobalConnectionPool() {
+    return HTTP_globalConnectionPool;
+}
+
+struct http_disk_cache *HTTP_globalDiskCache = NULL;
+
+void HTTP_setGlobalDiskCache(struct http_disk_cache *cache) {
+    HTTP_globalDiskCache = cache;
+}
+
+struct http_disk_cache *HTTP_getGlobalDiskCache() {
+    return HTTP_globalDiskCache;
+}
+
+struct http_redirect_cache *HTTP_globalRedirectCache = NULL;
+
+void HTTP_setGlobalRedirectCache(struct http_redirect_cache *cache) {
+    HTTP_globalRedirectCache = cache;
+}
+
+struct http_redirect_cache *HTTP_getGlobalRedirectCache() {
+    return HTTP_globalRedirectCache;
+}
+
+struct http_memory_cache *HTTP_globalMemoryCache = NULL;
+
+void HTTP_setGlobalMemoryCache(struct http_memory_cache *cache) {
+    HTTP_globalMemoryCache = cache;
+}
+
+struct http_memory_cache *HTTP_getGlobalMemoryCache() {
+    return HTTP_globalMemoryCache;
+}
+
+typedef void (*dataReceiveHandler)(void *);
+
+
+// The error code for a file that can't be opened or read, from errno (187 if none of the others fit)
+int http_fileError(int error) {
+    switch (error) {
+        case ENOENT:
+        case ENOTDIR:
+            return 198;
+        case EACCES:
+        case EPERM:
+            return 196;
+        case EISDIR:
+            return 197;
     }
+    return 187;
+}
 
+struct http_response http_fileResponse(char *data, int64_t length) {
     struct http_response result;
     result.response_code = 200;
-    result.response_description = makeStrCpy("OK");
+    result.raw_headers = makeStrCpy("OK");
+    result.response_description = result.raw_headers;
     result.num_headers = 0;
     result.headers = NULL;
     result.is_chunked = 0;
     result.is_html = 0;
-    result.content_length = i;
+    result.content_length = length;
     result.error = 0;
     result.redirect = NULL;
     result.do_redirect = 0;
+    result.has_body = 1;
 
     struct http_data res;
-    res.length = i;
-    res.data = contents;
+    res.length = length;
+    res.data = data;
     result.response_body = res;
 
     return result;
 }
 
-struct http_response http_makeNetworkHTTPRequest(
-    struct http_url *url,
-    socketConnecter rwsocket,
-    socketReader rsocket,
-    socketCloser csocket,
-    char *userAgent,
-    dataReceiveHandler chunkHandler,
-    dataReceiveHandler finishHandler,
-    void *chunkArg
-) {
-    struct http_response errorResponse;
-    errorResponse.error = 1;
+    #ifdef unix
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <unistd.h>
+
+        // Maps `length` bytes of the file, followed by at least one zero byte (past the end of the file, so
+        // the body ends in a NUL like the ones that are read into memory). Returns NULL if it can't be mapped.
+        // Writes to the mapping stay private to it. A file truncated while it's mapped can't be read past its
+        // new end, as with any mapping.
+        char *http_mapFile(int descriptor, int64_t length) {
+            size_t pageSize = sysconf(_SC_PAGESIZE);
+            if ((uint64_t) length >= SIZE_MAX - pageSize) {
+                return NULL;
+            }
+            size_t mappedLength = (length + pageSize) / pageSize * pageSize;
 
-    int curBufLen = maxInitialResponseSize;
-    char *buffer = (char *) calloc(maxInitialResponseSize, sizeof(char)); // this should be dynamically returned by rwsocket, but 8kb is probably good for now
-    char *ipBuffer = (char *) calloc(2048, sizeof(char)); // this should be dynamic, but 2kb is probably good
+            // Zeroed memory to map the file over; the pages past the file stay zero
+            char *region = (char *) mmap(NULL, mappedLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (region == MAP_FAILED) {
+                return NULL;
+            }
+            if (mmap(region, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, descriptor, 0) == MAP_FAILED) {
+                munmap(region, mappedLength);
+                return NULL;
+            }
+            madvise(region, length, MADV_SEQUENTIAL);
+
+            HTTP_addMappedBody(region, mappedLength);
+            return region;
+        }
+
+        // Reads a file that can't be mapped (a pipe, a device, or a file in /proc that claims to be empty) to its end.
+        // `sizeHint` is the size the file is expected to have, or 0.
+        struct http_response http_readFileDescriptor(int descriptor, int64_t sizeHint) {
+            int64_t capacity = sizeHint > 0 ? sizeHint + 1 : 65536;
+            int64_t length = 0;
+            char *data = (char *) malloc(capacity);
+
+            while (1) {
+                if (length + 1 >= capacity) {
+                    capacity *= 2;
+                    data = (char *) realloc(data, capacity);
+                }
+                ssize_t bytesRead = read(descriptor, data + length, capacity - length - 1);
+                if (bytesRead < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytesRead < 0) {
+                    int error = errno;
+                    free(data);
+                    struct http_response err;
+                    err.error = http_fileError(error);
+                    return err;
+                }
+                if (bytesRead == 0) {
+                    break;
+                }
+                length += bytesRead;
+            }
+            data[length] = '\0';
+
+            return http_fileResponse(data, length);
+        }
+
+        struct http_response http_readFileToHTTP(char *path) {
+            int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (descriptor < 0 || fstat(descriptor, &info)) {
+                struct http_response err;
+                err.error = http_fileError(errno);
+                if (descriptor >= 0) {
+                    close(descriptor);
+                }
+                return err;
+            }
+            if (S_ISDIR(info.st_mode)) {
+                close(descriptor);
+                struct http_response err;
+                err.error = 197;
+                return err;
+            }
+
+            struct http_response result;
+            // Empty files are read too, since some (in /proc, say) only look empty
+            if (S_ISREG(info.st_mode) && info.st_size > 0) {
+                char *data = http_mapFile(descriptor, info.st_size);
+                result = data != NULL ? http_fileResponse(data, info.st_size) : http_readFileDescriptor(descriptor, info.st_size);
+            } else {
+                result = http_readFileDescriptor(descriptor, 0);
+            }
+            close(descriptor);
+
+            return result;
+        }
+
+    #else
+
+        struct http_response http_readFileToHTTP(char *path) {
+            errno = 0;
+            FILE *fp = fopen(path, "rb");
+            if (fp == NULL) {
+                struct http_response err;
+                err.error = http_fileError(errno);
+                return err;
+            }
+
+            int64_t capacity = 65536;
+            int64_t length = 0;
+            char *data = (char *) malloc(capacity);
+            size_t bytesRead;
+            while ((bytesRead = fread(data + length, 1, capacity - length - 1, fp)) > 0) {
+                length += bytesRead;
+                if (length + 1 >= capacity) {
+                    capacity *= 2;
+                    data = (char *) realloc(data, capacity);
+                }
+            }
+            int failed = ferror(fp);
+            fclose(fp);
+            if (failed) {
+                free(data);
+                struct http_response err;
+                err.error = 187;
+                return err;
+            }
+            data[length] = '\0';
+
+            return http_fileResponse(data, length);
+        }
+
+    #endif
+
+// Reads the next segment of the response onto the end of `buffer`, recording the amount read (or the error) in `socket`.
+// Once something has been received, the next read only gets the stall timeout to wait.
+void http_readSegment(struct socket_transport *transport, struct socket_info *socket, struct socket_buffer *buffer, int amount) {
+    int bytesRead = socket_readIntoBuffer(transport, socket, buffer, amount);
+    if (bytesRead < 0) {
+        socket->bytesRead = -1;
+        socket->error = bytesRead;
+    } else {
+        socket->bytesRead = bytesRead;
+        socket->error = 0;
+        socket->deadline = socket_deadlineAfter(HTTP_timeouts.stall);
+        HTTP_countTimingBytes(bytesRead);
+    }
+}
+
+// Sends the request and reads the first segment of the response
+void http_sendRequest(struct socket_transport *transport, struct socket_info *socket, char *requestString, struct socket_buffer *buffer, int amount) {
+    socket->deadline = socket_deadlineAfter(HTTP_timeouts.first_byte);
+    int status = socket_writeAll(transport, socket, requestString, strlen(requestString));
+    if (status < 0) {
+        socket->bytesRead = -1;
+        socket->error = status;
+        return;
+    }
+
+    http_readSegment(transport, socket, buffer, amount);
+    if (socket->bytesRead > 0) {
+        HTTP_markTiming(HTTP_TIMING_FIRST_BYTE);
+    }
+}
 
-    char *cookieString = HTTP_cookieStoreToString(HTTP_globalCookieStore, url->hostname);
-    char *baseString = (char *) calloc(64 + strlen(url->path) + strlen(url->hostname) + strlen(userAgent) + strlen(cookieString), sizeof(char));
+// The value of the Cookie header for a request to `url` ("" if there are no cookies for it)
+char *http_cookieStringFor(struct http_url *url) {
+    pthread_mutex_lock(&HTTP_cookieStoreLock);
+    HTTP_loadJarCookies(HTTP_globalCookieJar, HTTP_globalCookieStore, url->hostname);
+    char *cookieString = HTTP_cookieStoreToString(HTTP_globalCookieStore, url->hostname, url->path);
+    pthread_mutex_unlock(&HTTP_cookieStoreLock);
+    return cookieString;
+}
+
+// Returns 1 if a request for `charURL` would carry cookies (even on a thread that omits them)
+int HTTP_hasCookiesFor(char *charURL) {
+    struct http_url *url = http_url_from_string(charURL);
+    if (url == NULL) return 0;
+
+    char *cookieString = http_cookieStringFor(url);
+    int hasCookies = cookieString[0] != '\0';
+    free(cookieString);
+    HTTP_freeURL(url);
+    return hasCookies;
+}
+
+// `extraHeaders` (or NULL) are added as they are, so each must end with CRLF
+char *http_buildRequestString(struct http_url *url, char *userAgent, char *extraHeaders) {
+    char *cookieString = http_credentialsOmitted ? makeStrCpy("") : http_cookieStringFor(url);
+    int hasCookies = cookieString[0] != '\0';
+    int extraLength = extraHeaders != NULL ? strlen(extraHeaders) : 0;
+    char *baseString = (char *) calloc(128 + strlen(HTTP_acceptEncoding) + strlen(url->path) + strlen(url->hostname) + strlen(userAgent) + strlen(cookieString) + extraLength, sizeof(char));
     strcpy(baseString, "GET ");
     strcat(baseString, url->path);
     strcat(baseString, " HTTP/1.1\r\nHost: ");
     strcat(baseString, url->hostname);
     strcat(baseString, "\r\n");
-    if (HTTP_globalCookieStore && HTTP_globalCookieStore->count) {
+    if (hasCookies) {
         strcat(baseString, "Cookie: ");
         strcat(baseString, cookieString);
         strcat(baseString, "\r\n");
     }
     strcat(baseString, "User-Agent: ");
     strcat(baseString, userAgent);
-    strcat(baseString, "\r\n\r\n");
-    char *requestString = makeStrCpy(baseString);
+    strcat(baseString, "\r\nAccept-Encoding: " HTTP_acceptEncoding);
+    if (HTTP_globalConnectionPool) {
+        strcat(baseString, "\r\nConnection: keep-alive");
+    } else {
+        strcat(baseString, "\r\nConnection: close");
+    }
+    strcat(baseString, "\r\n");
+    if (extraHeaders != NULL) {
+        strcat(baseString, extraHeaders);
+    }
+    strcat(baseString, "\r\n");
+    free(cookieString);
 
-    int res = lookupIP(url->hostname, ipBuffer);
+    return baseString;
+}
+
+// Maps a (negative) socket error to an HTTP error code. errno should still be set from the failing call.
+// `timeoutError` is reported if the step's own deadline passed.
+int http_errorFromSocket(int socketError, int timeoutError) {
+    switch (socketError) {
+        case SOCKET_CANCELLED:
+        case SOCKET_TIMED_OUT:
+        case SOCKET_EXPIRED:
+        case SOCKET_NO_MEMORY:
+            return HTTP_readError(socketError, timeoutError);
+    }
+    switch(errno) {
+        case 101: // Network unreachable
+        case 111: // Connection refused
+        case 113: // No route to host
+            return errno;
+    }
+    switch (socketError) {
+        case -6:
+            return 192;
+        case -7:
+            return 193;
+    }
+    return 200;
+}
+
+// Returns 1 if a connect that failed with `error` might work if tried again
+int http_isRetryableConnectError(int error) {
+    return error == 101 || error == 111 || error == 113 || error == 181 || error == 200;
+}
+
+// Resolves the host and connects to it, trying again (after a growing delay) if connecting fails.
+// Everything has to be done by `requestDeadline` (0 for no limit). Returns 0, or an HTTP error code.
+int http_openConnection(struct http_url *url, struct socket_transport *transport, struct socket_info *socket, long long requestDeadline) {
+    char *ipBuffer = (char *) calloc(2048, sizeof(char)); // this should be dynamic, but 2kb is probably good
+
+    struct socket_info lookupInfo = socket_makeInfo();
+    lookupInfo.deadline = socket_deadlineAfter(HTTP_timeouts.dns);
+    lookupInfo.final_deadline = requestDeadline;
+    int res = lookupIPUntil(url->hostname, ipBuffer, &lookupInfo);
     if (res) {
-        free(buffer);
         free(ipBuffer);
+        if (res < 0) {
+            return HTTP_readError(res, 180);
+        }
         if (res == HOST_NOT_FOUND) {
-            errorResponse.error = 5;
-            return errorResponse;
+            return 5;
         }
         if (res == TRY_AGAIN) {
-            errorResponse.error = 7;
-            return errorResponse;
+            return 7;
         }
-        errorResponse.error = 6;
-        return errorResponse;
+        return 6;
     }
+    HTTP_markTiming(HTTP_TIMING_DNS);
+
+    int error = 0;
+    int delay = HTTP_timeouts.retry_delay;
+    for (int attempt = 0; attempt < HTTP_timeouts.connect_attempts || attempt == 0; attempt ++) {
+        if (attempt > 0) {
+            if (requestDeadline && socket_now() + delay >= requestDeadline) {
+                break;
+            }
+            if (socket_sleep(delay)) {
+                error = 190;
+                break;
+            }
+            delay *= 2;
+        }
+
+        errno = 0;
+        *socket = socket_makeInfo();
+        socket->deadline = socket_deadlineAfter(HTTP_timeouts.connect);
+        socket->final_deadline = requestDeadline;
+        long long connectedAt = 0;
+        int status = socket_connect(transport, socket, ipBuffer, url->hostname, url->port, HTTP_timeouts.handshake, &connectedAt);
+        if (status >= 0) {
+            HTTP_markTimingAt(HTTP_TIMING_CONNECT, connectedAt);
+            if (transport == &secure_transport) {
+                HTTP_markTiming(HTTP_TIMING_HANDSHAKE);
+            }
+            free(ipBuffer);
+            return 0;
+        }
 
-    errno = 0;
-    struct socket_info tcpResult = rwsocket(ipBuffer, url->hostname, url->port, requestString, buffer, maxInitialResponseSize);
+        // The transport has already closed the socket
+        error = http_errorFromSocket(status, socket->stage == SOCKET_STAGE_TLS_HANDSHAKE ? 182 : 181);
+        if (!http_isRetryableConnectError(error)) {
+            break;
+        }
+    }
     free(ipBuffer);
-    free(url->protocol);
-    // Don't free url->hostname or url as the hostname is required for header parsing
-    free(url->path);
-    free(url->fragment);
-    free(requestString);
 
-    if (chunkHandler != NULL) chunkHandler(chunkArg);
+    return error;
+}
 
-    if (tcpResult.error) {
-        switch(errno) {
-            case 101:
-              //  printf("Network unreachable\n");
-                errorResponse.error = errno;
-                free(buffer);
-                return errorResponse;
-            case 111:
-              //  printf("Connection refused\n");
-                errorResponse.error = errno;
-                free(buffer);
-                return errorResponse;
-            case 113:
-               // printf("No route to host\n");
-                errorResponse.error = errno;
-                free(buffer);
-                return errorResponse;
+// Stores cookies set by the response to a request for `path` on `hostname`. Returns 0 if the server asked for the
+// connection to be closed; `idleTimeout` is lowered to the server's Keep-Alive timeout, if it sent one.
+int http_processResponseHeaders(struct http_response *response, char *hostname, char *path, int *idleTimeout) {
+    int keepAlive = 1;
+    for (int i = 0; i < response->num_headers; i ++) {
+        struct http_header header = response->headers[i];
+
+        struct http_cookie cookie;
+        if (!http_credentialsOmitted && HTTP_equalsIgnoreCase(header.name, "set-cookie") && header.value && !HTTP_parseCookieString(header.value, hostname, path, &cookie)) {
+            pthread_mutex_lock(&HTTP_cookieStoreLock);
+            HTTP_loadJarCookies(HTTP_globalCookieJar, HTTP_globalCookieStore, hostname);
+            HTTP_addCookieToStoreAndJar(HTTP_globalCookieJar, HTTP_globalCookieStore, cookie);
+            pthread_mutex_unlock(&HTTP_cookieStoreLock);
         }
-        switch (tcpResult.error) {
-            case -6:
-                errorResponse.error = 192;
-                free(buffer);
-                return errorResponse;
-            case -7:
-                errorResponse.error = 193;
-                free(buffer);
-                return errorResponse;
+    }
+
+    char *connection = HTTP_getHeader(response, "connection");
+    if (connection && HTTP_containsIgnoreCase(connection, "close")) {
+        keepAlive = 0;
+    }
+
+    char *keepAliveHeader = HTTP_getHeader(response, "keep-alive");
+    if (keepAliveHeader) {
+        char *value = toLowerCase(keepAliveHeader);
+        char *timeout = strstr(value, "timeout=");
+        if (timeout) {
+            int serverTimeout = atoi(timeout + 8);
+            if (serverTimeout < *idleTimeout) {
+                *idleTimeout = serverTimeout;
+            }
         }
-        errorResponse.error = 200;
-        free(buffer);
-        return errorResponse;
-        //printf("error: %d\n", errno);
+        free(value);
     }
+    return keepAlive;
+}
 
-    // we can't realloc-shrink the buffer because it gets reused
+// Reads the next part of a body. Unencoded bodies are read straight into `body`; encoded ones are read into
+// `receiveBuffer` and decoded from there, so the compressed body is never kept around.
+void http_readBodySegment(struct socket_transport *transport, struct socket_info *socket, struct http_content_decoder *decoder, struct socket_buffer *body, struct socket_buffer *receiveBuffer, int amount) {
+    if (decoder->encoding == HTTP_ENCODING_IDENTITY) {
+        http_readSegment(transport, socket, body, amount);
+        return;
+    }
 
+    receiveBuffer->length = 0;
+    http_readSegment(transport, socket, receiveBuffer, amount);
+    if (socket->bytesRead > 0) {
+        HTTP_decodeContent(decoder, receiveBuffer->data, receiveBuffer->length);
+    }
+}
 
-    struct http_data initialHttpResponse;
-    initialHttpResponse.length = tcpResult.bytesRead;
-    initialHttpResponse.data = buffer;
+// Turns the result of an HTTP/2 request into a response, as if it had been read from an HTTP/1.1 connection
+struct http_response http_responseFromHTTP2(struct http2_result *result, char *hostname, char *path) {
+    struct http_response errorResponse;
+    if (result->error) {
+        errorResponse.error = result->error;
+        socket_freeBuffer(&result->response);
+        return errorResponse;
+    }
 
-    struct http_response parsedResponse = parsePossiblyIncompleteHTTPResponse(initialHttpResponse, "1.1");
+    struct http_response_parser responseParser = HTTP_makeResponseParser();
+    HTTP_continueResponseParser(&responseParser, result->response.data, result->response.length, "1.1");
+    if (!responseParser.finished || responseParser.error) {
+        errorResponse.error = responseParser.error ? responseParser.error : 1;
+        HTTP_freeResponseParser(&responseParser);
+        socket_freeBuffer(&result->response);
+        return errorResponse;
+    }
 
-    if (parsedResponse.error) {
-        errorResponse.error = parsedResponse.error;
-        csocket(tcpResult);
+    struct http_response response = HTTP_finishResponseParser(&responseParser, result->response.data, result->response.length);
+    socket_freeBuffer(&result->response);
+
+    if (HTTP_decodeResponseBody(&response)) {
+        HTTP_freeResponse(&response);
+        errorResponse.error = 191;
         return errorResponse;
     }
 
+    int idleTimeout = defaultPoolIdleTimeout;
+    http_processResponseHeaders(&response, hostname, path, &idleTimeout);
+    return response;
+}
+
+// Makes one request over HTTP/2 and gives the connection back. `retry` is set if the server didn't process it.
+struct http_response http_makeHTTP2Request(struct http2_connection *connection, char *hostname, char *path, char *requestString, long long requestDeadline, int *retry, dataReceiveHandler chunkHandler, dataReceiveHandler finishHandler, void *chunkArg) {
+    connection->socket.final_deadline = requestDeadline;
+
+    struct http2_result result;
+    HTTP2_exchange(connection, &requestString, 1, &result, chunkHandler, chunkArg);
+    HTTP2_releaseConnection(connection);
+
+    *retry = result.retry;
+    if (!result.error && finishHandler != NULL) finishHandler(chunkArg);
+    return http_responseFromHTTP2(&result, hostname, path);
+}
+
+// Reads the rest of the head of a response (its first segment should already be in `buffer`) and parses it.
+// Returns 0, or an HTTP error code. The connection is left open either way.
+int http_readResponseHead(struct socket_transport *transport, struct socket_info *socket, struct socket_buffer *buffer, struct http_response *response) {
+    // The parser carries on from where it stopped after each read, so the headers are only parsed once
+    struct http_response_parser responseParser = HTTP_makeResponseParser();
+    HTTP_continueResponseParser(&responseParser, buffer->data, buffer->length, "1.1");
+
     // There's no guarantee that all the headers will be sent in the initial read
-    while(!parsedResponse.has_body) {
-        int initialBytesRead = tcpResult.bytesRead;
-        char *currentPosition = buffer + initialBytesRead;
-        tcpResult = rsocket(tcpResult, currentPosition, (maxInitialResponseSize - 8) - tcpResult.bytesRead);
+    while (!responseParser.finished && !responseParser.error) {
+        // The buffer grows as needed, so the headers can be any size
+        http_readSegment(transport, socket, buffer, maxSegmentLength);
 
-        if (tcpResult.error) {
-            errorResponse.error = 200;
-            free(buffer);
-            return errorResponse;
+        if (socket->error || socket->bytesRead == 0) {
+            HTTP_freeResponseParser(&responseParser);
+            return HTTP_readError(socket->error, 184);
         }
 
-        tcpResult.bytesRead = initialBytesRead + tcpResult.bytesRead;
+        HTTP_continueResponseParser(&responseParser, buffer->data, buffer->length, "1.1");
+    }
+
+    if (responseParser.error) {
+        int error = responseParser.error;
+        HTTP_freeResponseParser(&responseParser);
+        return error;
+    }
 
-        initialHttpResponse.length = tcpResult.bytesRead;
-        parsedResponse = parsePossiblyIncompleteHTTPResponse(initialHttpResponse, "1.1");
+    *response = HTTP_finishResponseParser(&responseParser, buffer->data, buffer->length);
+    return 0;
+}
 
-        if (parsedResponse.error) {
-            errorResponse.error = parsedResponse.error;
-            csocket(tcpResult);
-            return errorResponse;
+// Asks for bytes `start` to `end` (inclusive) of a body of `total` bytes on a new connection, with `requestString`
+// being the request the body was first asked for with. On success the connection is left in `socket`, with
+// whatever part of the range came with the head in `buffer`. Returns 0, or an HTTP error code (rangeRefusedError
+// if the server answered with anything but that range).
+int http_requestRange(
+    struct http_url *url,
+    struct socket_transport *transport,
+    char *requestString,
+    char *validator,
+    int64_t start,
+    int64_t end,
+    int64_t total,
+    struct socket_info *socket,
+    struct socket_buffer *buffer,
+    long long requestDeadline
+) {
+    int error = http_openConnection(url, transport, socket, requestDeadline);
+    if (error) {
+        return error;
+    }
+
+    // Ranges are only asked for where the body was coming over HTTP/1.1
+    if (HTTP2_isNegotiated(transport, socket)) {
+        transport->close(socket);
+        return 200;
+    }
+
+    char *rangeRequest = HTTP_makeRangeRequest(requestString, validator, start, end);
+    buffer->length = 0;
+    http_sendRequest(transport, socket, rangeRequest, buffer, maxInitialResponseSize);
+    free(rangeRequest);
+    if (socket->error) {
+        error = http_errorFromSocket(socket->error, 183);
+        transport->close(socket);
+        return error;
+    }
+
+    struct http_response response;
+    error = http_readResponseHead(transport, socket, buffer, &response);
+    if (error) {
+        transport->close(socket);
+        return error;
+    }
+
+    // Anything else (most likely the whole body again, because it has changed) can't be used
+    int matches = HTTP_isMatchingRange(&response, start, end, total);
+    int64_t bodyStart = buffer->length - response.response_body.length;
+    HTTP_freeResponse(&response);
+    if (!matches) {
+        transport->close(socket);
+        return rangeRefusedError;
+    }
+
+    memmove(buffer->data, buffer->data + bodyStart, buffer->length - bodyStart);
+    buffer->length -= bodyStart;
+    return 0;
+}
+
+// One of the byte ranges of a body that's fetched over several connections at once
+struct http_range_part {
+    struct http_url *url;
+    struct socket_transport *transport;
+    char *requestString;
+    char *validator;
+    int64_t total;
+    long long requestDeadline;
+
+    // Where the range goes in the body, and the bytes it covers (inclusive)
+    char *destination;
+    int64_t start;
+    int64_t end;
+    int64_t received;
+
+    int error;
+    int started;
+    pthread_t thread;
+    // The thread's cancellation flag (see socket_setThreadCancellation), and where it says it's finished
+    volatile int *cancellation;
+    int notify;
+};
+
+// Reads the part from a connection that's sending it, straight into its place in the body.
+// Returns 0 once it's all there, or an HTTP error code.
+int http_readRangePart(struct http_range_part *part, struct socket_info *socket) {
+    int64_t length = part->end - part->start + 1;
+    while (part->received < length) {
+        int64_t remaining = length - part->received;
+        // Reading into the body itself (not a socket_buffer) means nothing is written past the end of the part
+        int bytesRead = socket_read(part->transport, socket, part->destination + part->received, remaining > INT32_MAX ? INT32_MAX : (int) remaining);
+        if (bytesRead <= 0) {
+            return HTTP_readError(bytesRead, 184);
         }
+        part->received += bytesRead;
+        socket->deadline = socket_deadlineAfter(HTTP_timeouts.stall);
+        HTTP_countTimingBytes(bytesRead);
     }
+    return 0;
+}
 
-    if (parsedResponse.error) {
-        errorResponse.error = parsedResponse.error;
-        csocket(tcpResult);
-        return errorResponse;
+// Fetches the rest of the part over a new connection, asking again if that one drops too.
+// Returns 0, or an HTTP error code.
+int http_fetchRangePart(struct http_range_part *part) {
+    struct socket_buffer receiveBuffer = socket_makeBuffer(maxInitialResponseSize);
+    int64_t length = part->end - part->start + 1;
+
+    int error = 0;
+    for (int attempt = 0; part->received < length; attempt ++) {
+        if (attempt > maxRangeResumes || error == 190 || error == 185 || error == rangeRefusedError) {
+            break;
+        }
+
+        struct socket_info socket;
+        error = http_requestRange(part->url, part->transport, part->requestString, part->validator, part->start + part->received, part->end, part->total, &socket, &receiveBuffer, part->requestDeadline);
+        if (error) {
+            continue;
+        }
+
+        int64_t leftover = receiveBuffer.length < length - part->received ? receiveBuffer.length : length - part->received;
+        memcpy(part->destination + part->received, receiveBuffer.data, leftover);
+        part->received += leftover;
+
+        error = http_readRangePart(part, &socket);
+        part->transport->close(&socket);
+    }
+    socket_freeBuffer(&receiveBuffer);
+
+    return part->received < length ? error : 0;
+}
+
+    #ifdef unix
+
+void *http_rangePartThread(void *arg) {
+    struct http_range_part *part = (struct http_range_part *) arg;
+    socket_setThreadCancellation(part->cancellation);
+
+    part->error = http_fetchRangePart(part);
+    write(part->notify, "", 1);
+
+    return NULL;
+}
+
+// Starts fetching each part on its own thread, writing to `notify` as each finishes. Parts whose thread couldn't
+// be started are left for http_finishRangeParts.
+void http_startRangeParts(struct http_range_part *parts, int count, int notify) {
+    for (int i = 0; i < count; i ++) {
+        // Cancelling the request cancels the parts too
+        parts[i].cancellation = socket_threadCancellation;
+        parts[i].notify = notify;
+        parts[i].started = !pthread_create(&parts[i].thread, NULL, http_rangePartThread, &parts[i]);
+    }
+}
+
+// Waits for the parts started by http_startRangeParts (handling the event source meanwhile, so the request can
+// still be cancelled) and fetches any that weren't started. Returns 0, or the HTTP error code of a failed part.
+int http_finishRangeParts(struct http_range_part *parts, int count, int notify, long long requestDeadline) {
+    int running = 0;
+    for (int i = 0; i < count; i ++) {
+        running += parts[i].started;
+    }
+
+    struct socket_info waitInfo = socket_makeInfo();
+    waitInfo.descriptor = notify;
+    waitInfo.final_deadline = requestDeadline;
+    while (running > 0) {
+        // A failed wait (cancelled or out of time) ends the parts' own waits too, so they're joined either way
+        if (socket_wait(&waitInfo, SOCKET_WANT_READ)) {
+            break;
+        }
+        char finished;
+        if (read(notify, &finished, 1) == 1) {
+            running --;
+        }
+    }
+
+    int error = 0;
+    for (int i = 0; i < count; i ++) {
+        if (parts[i].started) {
+            pthread_join(parts[i].thread, NULL);
+        } else if (!error) {
+            parts[i].error = http_fetchRangePart(&parts[i]);
+        }
+        if (parts[i].error && !error) {
+            error = parts[i].error;
+        }
+    }
+    return error;
+}
+
+    #else
+
+void http_startRangeParts(struct http_range_part *_parts, int _count, int _notify) { }
+
+int http_finishRangeParts(struct http_range_part *parts, int count, int _notify, long long _requestDeadline) {
+    for (int i = 0; i < count; i ++) {
+        parts[i].error = http_fetchRangePart(&parts[i]);
+        if (parts[i].error) {
+            return parts[i].error;
+        }
     }
+    return 0;
+}
 
-    if (parsedResponse.is_chunked) {
-        int totalBytesRead = tcpResult.bytesRead;
+    #endif
 
-        struct chunked_response_state chunkedResponse = parseChunkedResponse(parsedResponse.response_body);
-        if (chunkedResponse.error) {
-            errorResponse.error = 199;
-            free(buffer);
-            csocket(tcpResult);
+struct http_response http_makeNetworkHTTPRequest(
+    struct http_url *url,
+    struct socket_transport *transport,
+    char *userAgent,
+    char *extraHeaders,
+    dataReceiveHandler chunkHandler,
+    dataReceiveHandler finishHandler,
+    void *chunkArg
+) {
+    struct http_response errorResponse;
+    errorResponse.error = 1;
+
+    long long requestDeadline = HTTP_requestDeadline();
+    struct socket_buffer receiveBuffer = socket_makeBuffer(maxInitialResponseSize);
+    char *requestString = http_buildRequestString(url, userAgent, extraHeaders);
+
+    // A connection that already speaks HTTP/2 can take the request alongside any others in flight
+    struct http2_connection *http2Connection = transport == &secure_transport ? HTTP2_takeConnection(url->protocol, url->hostname, url->port) : NULL;
+    if (http2Connection != NULL) {
+        HTTP_setTimingConnection(1, 1);
+        int retry;
+        struct http_response response = http_makeHTTP2Request(http2Connection, url->hostname, url->path, requestString, requestDeadline, &retry, chunkHandler, finishHandler, chunkArg);
+
+        // Otherwise the server had closed the idle connection, and the request is made on a new one
+        if (!retry) {
+            socket_freeBuffer(&receiveBuffer);
+            free(requestString);
+            HTTP_freeURL(url);
+            return response;
+        }
+    }
+
+    struct socket_info tcpResult;
+    int reusedConnection = HTTP_takePooledConnection(HTTP_globalConnectionPool, url->protocol, url->hostname, url->port, &tcpResult);
+    if (reusedConnection) {
+        tcpResult.final_deadline = requestDeadline;
+        http_sendRequest(transport, &tcpResult, requestString, &receiveBuffer, maxInitialResponseSize);
+
+        // The server may have closed the connection while it sat idle. We only ever send GET
+        // requests, so it's always safe to retry once on a fresh connection.
+        if (tcpResult.error || tcpResult.bytesRead <= 0) {
+            transport->close(&tcpResult);
+            receiveBuffer.length = 0;
+            reusedConnection = 0;
+        } else {
+            HTTP_setTimingConnection(1, 0);
+        }
+    }
+
+    if (!reusedConnection) {
+        int openError = http_openConnection(url, transport, &tcpResult, requestDeadline);
+        if (openError) {
+            socket_freeBuffer(&receiveBuffer);
+            free(requestString);
+            errorResponse.error = openError;
             return errorResponse;
         }
-        parsedResponse.response_body = chunkedResponse.current_parsed_data;
 
-        char *currentPosition = buffer + totalBytesRead;
-        while (!chunkedResponse.finished) {
-            if (totalBytesRead + maxSegmentLength > curBufLen) {
-                curBufLen *= 2;
-                buffer = realloc(buffer, curBufLen);
-            }
+        if (HTTP2_isNegotiated(transport, &tcpResult)) {
+            HTTP_setTimingConnection(0, 1);
+            http2Connection = HTTP2_makeConnection(tcpResult, transport, url->protocol, url->hostname, url->port);
+            int retry;
+            struct http_response response = http_makeHTTP2Request(http2Connection, url->hostname, url->path, requestString, requestDeadline, &retry, chunkHandler, finishHandler, chunkArg);
 
-            currentPosition = buffer + totalBytesRead;
-            errno = 0;
-            tcpResult = rsocket(tcpResult, currentPosition, maxSegmentLength);
-            totalBytesRead += tcpResult.bytesRead;
+            socket_freeBuffer(&receiveBuffer);
+            free(requestString);
+            HTTP_freeURL(url);
+            return response;
+        }
 
-            if (chunkHandler != NULL) chunkHandler(chunkArg);
+        http_sendRequest(transport, &tcpResult, requestString, &receiveBuffer, maxInitialResponseSize);
+        if (tcpResult.error) {
+            int sendErrno = errno;
+            transport->close(&tcpResult);
+            errno = sendErrno;
+        }
+    }
+    // Don't free url as it's required for header parsing (cookies) and connection pooling. The request string is
+    // kept until the head has arrived, in case the body has to be asked for again in ranges.
+
+    if (chunkHandler != NULL) chunkHandler(chunkArg);
+
+    if (tcpResult.error) {
+        errorResponse.error = http_errorFromSocket(tcpResult.error, 183);
+        socket_freeBuffer(&receiveBuffer);
+        free(requestString);
+        return errorResponse;
+    }
+
+    struct http_data initialHttpResponse;
+
+    struct http_response parsedResponse;
+    int headError = http_readResponseHead(transport, &tcpResult, &receiveBuffer, &parsedResponse);
+    if (headError) {
+        errorResponse.error = headError;
+        socket_freeBuffer(&receiveBuffer);
+        free(requestString);
+        transport->close(&tcpResult);
+        return errorResponse;
+    }
+    // These never have a body, whatever their Content-Length or Transfer-Encoding says, so the response ends with its headers
+    int code = parsedResponse.response_code;
+    int hasBody = !(code == 204 || code == 304 || code < 200);
+    if (hasBody && HTTP_isOverBodyLimit(parsedResponse.content_length)) {
+        // Not worth receiving at all
+        errorResponse.error = 188;
+        HTTP_freeResponse(&parsedResponse);
+        socket_freeBuffer(&receiveBuffer);
+        free(requestString);
+        transport->close(&tcpResult);
+        return errorResponse;
+    }
+
+    // Only a body with a known length and a validator can be asked for in ranges
+    char *validator = HTTP_resumeValidator(&parsedResponse);
+    if (validator == NULL) {
+        free(requestString);
+        requestString = NULL;
+    }
+
+    // Whether the end of the response body is known, so the connection can be reused
+    int isFramed = 0;
 
-            initialHttpResponse.data = currentPosition;
-            initialHttpResponse.length = tcpResult.bytesRead;
-            appendChunkToBody(&chunkedResponse, initialHttpResponse);
+    // Decoding happens as each part of the body is de-framed. Encodings we didn't ask for are passed on as they are.
+    int encoding = HTTP_contentEncodingFromHeader(HTTP_getHeader(&parsedResponse, "content-encoding"));
+    if (encoding == HTTP_ENCODING_UNSUPPORTED) {
+        encoding = HTTP_ENCODING_IDENTITY;
+    }
+    struct http_content_decoder contentDecoder = HTTP_makeContentDecoder(encoding);
+    int isEncoded = encoding != HTTP_ENCODING_IDENTITY;
+    // Set once the body (as decoded) passes the thread's limit, which ends the request
+    int tooLarge = 0;
+
+    if (!hasBody) {
+        // Anything already read after the headers wasn't asked for, so the connection can't be reused
+        isFramed = parsedResponse.response_body.length == 0;
+        free(parsedResponse.response_body.data);
+        parsedResponse.response_body.data = (char *) calloc(1, sizeof(char));
+        parsedResponse.response_body.length = 0;
+        if (finishHandler != NULL) finishHandler(chunkArg);
+    } else if (parsedResponse.is_chunked) {
+        // Only the bytes read since the last call are decoded each time, so the body is handled in one pass
+        struct chunked_response_state chunkedResponse = HTTP_makeChunkedDecoder();
+        int consumed = appendChunkToBody(&chunkedResponse, parsedResponse.response_body);
+        int lastLength = parsedResponse.response_body.length;
+        free(parsedResponse.response_body.data);
+
+        if (isEncoded) {
+            // The de-chunked data is decoded straight away, so the chunked decoder's buffer can be reused
+            HTTP_decodeContent(&contentDecoder, chunkedResponse.current_parsed_data.data, chunkedResponse.current_parsed_data.length);
+            chunkedResponse.current_parsed_data.length = 0;
+        }
+        tooLarge = HTTP_isOverBodyLimit(isEncoded ? contentDecoder.output.length : chunkedResponse.current_parsed_data.length);
 
-            if (chunkedResponse.error) {
-                errorResponse.error = 199;
-                csocket(tcpResult);
+        while (!chunkedResponse.finished && !chunkedResponse.error && !contentDecoder.error && !tooLarge) {
+            // Only the newest segment is needed, so the buffer's space is reused for every read
+            receiveBuffer.length = 0;
+            errno = 0;
+            http_readSegment(transport, &tcpResult, &receiveBuffer, maxSegmentLength);
+            if (tcpResult.error || tcpResult.bytesRead == 0) {
+                // The connection ended (or the load was cancelled) before the last chunk
+                errorResponse.error = HTTP_readError(tcpResult.error, 184);
+                HTTP_freeChunkedDecoder(&chunkedResponse);
+                HTTP_freeContentDecoder(&contentDecoder);
+                socket_freeBuffer(&receiveBuffer);
+                transport->close(&tcpResult);
                 return errorResponse;
             }
+            if (chunkHandler != NULL) chunkHandler(chunkArg);
+
+            initialHttpResponse.data = receiveBuffer.data;
+            initialHttpResponse.length = receiveBuffer.length;
+            consumed = appendChunkToBody(&chunkedResponse, initialHttpResponse);
+            lastLength = initialHttpResponse.length;
+
+            if (isEncoded) {
+                HTTP_decodeContent(&contentDecoder, chunkedResponse.current_parsed_data.data, chunkedResponse.current_parsed_data.length);
+                chunkedResponse.current_parsed_data.length = 0;
+            }
+            tooLarge = HTTP_isOverBodyLimit(isEncoded ? contentDecoder.output.length : chunkedResponse.current_parsed_data.length);
+        }
 
-            free(parsedResponse.response_body.data);
+        // A compressed body that stops short of its end is as broken as one that can't be decoded
+        HTTP_endContent(&contentDecoder);
+        if (tooLarge || chunkedResponse.error || contentDecoder.error) {
+            errorResponse.error = tooLarge ? 188 : chunkedResponse.error ? 199 : 191;
+            HTTP_freeChunkedDecoder(&chunkedResponse);
+            HTTP_freeContentDecoder(&contentDecoder);
+            socket_freeBuffer(&receiveBuffer);
+            transport->close(&tcpResult);
+            return errorResponse;
+        }
+
+        if (isEncoded) {
+            HTTP_freeChunkedDecoder(&chunkedResponse);
+            parsedResponse.response_body = contentDecoder.output;
+        } else {
             parsedResponse.response_body = chunkedResponse.current_parsed_data;
         }
-        free(chunkedResponse.current_chunked_data.data);
+
+        // Anything after the end of the body wasn't asked for, so the connection can't be reused
+        isFramed = consumed == lastLength;
         if (finishHandler != NULL) finishHandler(chunkArg);
     } else if (parsedResponse.content_length == -2) {
-        // This is pretty normal, no reason to warn
-    } else {
-        if (parsedResponse.content_length != parsedResponse.response_body.length) {
-            int totalBytesRead = 0; // note; this implementation of a repeated read doesn't actually match up with the chunked response response length handling
-            char *currentPosition;
-            char *extra = NULL;
-
-            while (parsedResponse.content_length > parsedResponse.response_body.length) {
-                if (totalBytesRead + maxSegmentLength > curBufLen) {
-                    curBufLen *= 2;
-                    buffer = realloc(buffer, curBufLen);
-                }
+        // Without a length, the body ends when the server closes the connection. The size isn't
+        // known, so the buffer grows geometrically.
+        struct socket_buffer body = socket_makeBuffer(isEncoded ? 0 : parsedResponse.response_body.length + maxSegmentLength);
+        if (isEncoded) {
+            HTTP_decodeContent(&contentDecoder, parsedResponse.response_body.data, parsedResponse.response_body.length);
+        } else {
+            memcpy(body.data, parsedResponse.response_body.data, parsedResponse.response_body.length);
+            body.length = parsedResponse.response_body.length;
+        }
+        free(parsedResponse.response_body.data);
+
+        while (!contentDecoder.error && !tooLarge) {
+            http_readBodySegment(transport, &tcpResult, &contentDecoder, &body, &receiveBuffer, maxSegmentLength);
+            if (tcpResult.error) {
+                errorResponse.error = HTTP_readError(tcpResult.error, 184);
+                socket_freeBuffer(&body);
+                HTTP_freeContentDecoder(&contentDecoder);
+                socket_freeBuffer(&receiveBuffer);
+                transport->close(&tcpResult);
+                return errorResponse;
+            }
+            if (tcpResult.bytesRead == 0) {
+                break;
+            }
+            tooLarge = HTTP_isOverBodyLimit(isEncoded ? contentDecoder.output.length : body.length);
+            if (chunkHandler != NULL) chunkHandler(chunkArg);
+        }
 
-                if (extra) free(extra);
+        HTTP_endContent(&contentDecoder);
+        if (tooLarge || contentDecoder.error) {
+            errorResponse.error = tooLarge ? 188 : 191;
+            socket_freeBuffer(&body);
+            HTTP_freeContentDecoder(&contentDecoder);
+            socket_freeBuffer(&receiveBuffer);
+            transport->close(&tcpResult);
+            return errorResponse;
+        }
 
-                currentPosition = buffer + totalBytesRead;
-                errno = 0;
-                tcpResult = rsocket(tcpResult, currentPosition, maxSegmentLength);
-                totalBytesRead += tcpResult.bytesRead;
+        if (isEncoded) {
+            socket_freeBuffer(&body);
+            parsedResponse.response_body = contentDecoder.output;
+        } else {
+            parsedResponse.response_body.data = body.data;
+            parsedResponse.response_body.length = body.length;
+        }
+        if (finishHandler != NULL) finishHandler(chunkArg);
+    } else {
+        // The size is known, so an unencoded body is allocated once (up to maxPreallocatedBodyLength) and read into directly
+        int64_t contentLength = parsedResponse.content_length;
+        int64_t received = parsedResponse.response_body.length;
+        if (received > contentLength) {
+            received = contentLength;
+        }
 
-                if (chunkHandler != NULL) chunkHandler(chunkArg);
+        struct socket_buffer body = socket_makeBuffer(isEncoded ? 0 : (contentLength < maxPreallocatedBodyLength ? contentLength : maxPreallocatedBodyLength));
+        if (body.data == NULL || socket_reserveBuffer(&body, isEncoded ? 0 : received)) {
+            errorResponse.error = 189;
+            socket_freeBuffer(&body);
+            HTTP_freeResponse(&parsedResponse);
+            HTTP_freeContentDecoder(&contentDecoder);
+            socket_freeBuffer(&receiveBuffer);
+            free(requestString);
+            transport->close(&tcpResult);
+            return errorResponse;
+        }
+        if (isEncoded) {
+            HTTP_decodeContent(&contentDecoder, parsedResponse.response_body.data, received);
+            tooLarge = HTTP_isOverBodyLimit(contentDecoder.output.length);
+        } else {
+            memcpy(body.data, parsedResponse.response_body.data, received);
+            body.length = received;
+        }
+        free(parsedResponse.response_body.data);
+
+        // Set once the body has come over more than one connection
+        int resumed = 0;
+
+        int rangeCount = HTTP_parallelRanges;
+        // The ranges are written straight to where they go in the body, so all of it has to be allocated
+        if (validator != NULL && !isEncoded && rangeCount > 1 && contentLength >= parallelRangeThreshold && HTTP_acceptsByteRanges(&parsedResponse) && !socket_reserveBuffer(&body, contentLength - body.length)) {
+            // This connection reads the first range, while the others are each fetched over their own
+            struct http_range_part *parts = (struct http_range_part *) calloc(rangeCount, sizeof(struct http_range_part));
+            int64_t rangeLength = contentLength / rangeCount;
+            for (int i = 0; i < rangeCount; i ++) {
+                parts[i].url = url;
+                parts[i].transport = transport;
+                parts[i].requestString = requestString;
+                parts[i].validator = validator;
+                parts[i].total = contentLength;
+                parts[i].requestDeadline = requestDeadline;
+                parts[i].start = i * rangeLength;
+                parts[i].end = i == rangeCount - 1 ? contentLength - 1 : (i + 1) * rangeLength - 1;
+                parts[i].destination = body.data + parts[i].start;
+            }
+            parts[0].received = received;
 
-                initialHttpResponse.data = currentPosition;
-                initialHttpResponse.length = tcpResult.bytesRead;
+            int notify[2] = { -1, -1 };
+            #ifdef unix
+                if (!pipe(notify)) {
+                    http_startRangeParts(parts + 1, rangeCount - 1, notify[1]);
+                }
+            #endif
 
-                char *extra = (char *) calloc(totalBytesRead + parsedResponse.response_body.length + 2, sizeof(char));
+            int error = http_readRangePart(&parts[0], &tcpResult);
+            // The server would otherwise carry on sending the rest of the body
+            transport->close(&tcpResult);
+            if (error && error != 190 && error != 185) {
+                error = http_fetchRangePart(&parts[0]);
+            }
 
-                memcpy(extra, parsedResponse.response_body.data, parsedResponse.response_body.length);
-                memcpy(extra + parsedResponse.response_body.length, initialHttpResponse.data, initialHttpResponse.length);
-                free(parsedResponse.response_body.data);
+            int partsError = http_finishRangeParts(parts + 1, rangeCount - 1, notify[0], requestDeadline);
+            #ifdef unix
+                if (notify[0] != -1) {
+                    close(notify[0]);
+                    close(notify[1]);
+                }
+            #endif
+            free(parts);
+
+            if (error || partsError) {
+                errorResponse.error = error ? error : partsError;
+                socket_freeBuffer(&body);
+                HTTP_freeContentDecoder(&contentDecoder);
+                socket_freeBuffer(&receiveBuffer);
+                free(requestString);
+                return errorResponse;
+            }
 
-                int newLength = parsedResponse.response_body.length + initialHttpResponse.length;
+            body.length = contentLength;
+            body.data[body.length] = '\0';
+            received = contentLength;
+            resumed = 1;
+            if (chunkHandler != NULL) chunkHandler(chunkArg);
+        }
 
-                struct http_data newData;
-                newData.data = extra;
-                newData.length = newLength;
+        int resumes = 0;
+        while (received < contentLength && !contentDecoder.error && !tooLarge) {
+            int64_t remaining = contentLength - received;
+            int amount = remaining > INT32_MAX ? INT32_MAX : (int) remaining;
+            if (isEncoded && amount > maxSegmentLength) {
+                amount = maxSegmentLength;
+            } else if (!isEncoded && amount > body.capacity - body.length) {
+                // Past what was allocated up front, the body buffer grows geometrically
+                amount = body.capacity - body.length > maxSegmentLength ? body.capacity - body.length : maxSegmentLength;
+            }
+            http_readBodySegment(transport, &tcpResult, &contentDecoder, &body, &receiveBuffer, amount);
+            if (tcpResult.error || tcpResult.bytesRead == 0) {
+                // The connection ended (or the load was cancelled) before Content-Length bytes were received
+                int error = HTTP_readError(tcpResult.error, 184);
+                transport->close(&tcpResult);
+
+                // Unless the load was cancelled or ran out of time, the rest is asked for on a new connection.
+                // The decoder just carries on, as the range is of the encoded body.
+                while (error && validator != NULL && error != 190 && error != 185 && error != 189 && error != rangeRefusedError && resumes < maxRangeResumes) {
+                    resumes ++;
+                    error = http_requestRange(url, transport, requestString, validator, received, contentLength - 1, contentLength, &tcpResult, &receiveBuffer, requestDeadline);
+                }
+                if (error) {
+                    errorResponse.error = error;
+                    socket_freeBuffer(&body);
+                    HTTP_freeContentDecoder(&contentDecoder);
+                    socket_freeBuffer(&receiveBuffer);
+                    free(requestString);
+                    return errorResponse;
+                }
 
-                parsedResponse.response_body = newData;
+                // The part of the range that came with its head
+                int64_t leftover = receiveBuffer.length < remaining ? receiveBuffer.length : remaining;
+                if (!isEncoded && socket_reserveBuffer(&body, leftover)) {
+                    errorResponse.error = 189;
+                    socket_freeBuffer(&body);
+                    HTTP_freeContentDecoder(&contentDecoder);
+                    socket_freeBuffer(&receiveBuffer);
+                    free(requestString);
+                    transport->close(&tcpResult);
+                    return errorResponse;
+                }
+                if (isEncoded) {
+                    HTTP_decodeContent(&contentDecoder, receiveBuffer.data, leftover);
+                } else {
+                    memcpy(body.data + body.length, receiveBuffer.data, leftover);
+                    body.length += leftover;
+                    body.data[body.length] = '\0';
+                }
+                received += leftover;
+                resumed = 1;
+                continue;
             }
+            received += tcpResult.bytesRead;
+            // Content-Length was already checked, but a compressed body can decode to far more
+            tooLarge = isEncoded && HTTP_isOverBodyLimit(contentDecoder.output.length);
+
+            if (chunkHandler != NULL) chunkHandler(chunkArg);
         }
-        if (finishHandler != NULL) finishHandler(chunkArg);
-    }
 
-    free(buffer);
+        HTTP_endContent(&contentDecoder);
+        if (tooLarge || contentDecoder.error) {
+            errorResponse.error = tooLarge ? 188 : 191;
+            socket_freeBuffer(&body);
+            HTTP_freeContentDecoder(&contentDecoder);
+            socket_freeBuffer(&receiveBuffer);
+            free(requestString);
+            transport->close(&tcpResult);
+            return errorResponse;
+        }
 
-    csocket(tcpResult);
+        if (isEncoded) {
+            socket_freeBuffer(&body);
+            parsedResponse.response_body = contentDecoder.output;
+        } else {
+            parsedResponse.response_body.data = body.data;
+            parsedResponse.response_body.length = body.length;
+        }
 
-    for (int i = 0; i < parsedResponse.num_headers; i ++) {
-        struct http_header header = parsedResponse.headers[i];
-        char *name = toLowerCase(header.name);
+        // The connection that's left was only asked for part of the body, under headers that weren't processed
+        isFramed = !resumed;
+        if (finishHandler != NULL) finishHandler(chunkArg);
+    }
 
-        if (!strcmp(name, "set-cookie")) {
-            HTTP_addCookieToStore(HTTP_globalCookieStore, HTTP_parseCookieString(header.value, url->hostname));
-        }
+    if (parsedResponse.response_body.data == contentDecoder.output.data) {
+        HTTP_finishContentDecoder(&contentDecoder);
+    } else {
+        HTTP_freeContentDecoder(&contentDecoder);
+    }
+    socket_freeBuffer(&receiveBuffer);
+    free(requestString);
+
+    int idleTimeout = defaultPoolIdleTimeout;
+    int keepAlive = http_processResponseHeaders(&parsedResponse, url->hostname, url->path, &idleTimeout) && isFramed;
 
-        free(name);
+    if (keepAlive) {
+        HTTP_releaseConnection(HTTP_globalConnectionPool, url->protocol, url->hostname, url->port, tcpResult, transport, idleTimeout);
+    } else {
+        transport->close(&tcpResult);
     }
-    free(url->hostname);
-    free(url);
+
+    HTTP_freeURL(url);
 
     return parsedResponse;
 }
 
-struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataReceiveHandler chunkHandler, dataReceiveHandler finishHandler, void *chunkArg) {
+// Keeps what later requests can use from a response to `charURL` that came from the network: the response itself,
+// in the disk cache under `cacheKey`, and any permanent redirect or HSTS host it tells of. Responses that were
+// batched (see http_makePipelinedHTTPRequests) go through this as well.
+void http_keepNetworkResponse(char *charURL, char *cacheKey, struct http_response *response) {
+    // A response to a request without cookies may not be what the user would otherwise get
+    if (!response->error && !http_credentialsOmitted) {
+        HTTP_storeInDiskCache(HTTP_globalDiskCache, cacheKey, response);
+    }
+    HTTP_rememberPermanentRedirect(HTTP_globalRedirectCache, charURL, response);
+    HTTP_rememberStrictTransportSecurity(HTTP_globalRedirectCache, charURL, response);
+}
+
+struct http_response http_loadURL(char *charURL, char *userAgent, dataReceiveHandler chunkHandler, dataReceiveHandler finishHandler, void *chunkArg) {
+    // Nothing is ever sent to an HSTS host in plain text
+    char *upgradedURL = HTTP_upgradeToHTTPS(HTTP_globalRedirectCache, charURL);
+    if (upgradedURL != NULL) {
+        struct http_response response = http_loadURL(upgradedURL, userAgent, chunkHandler, finishHandler, chunkArg);
+        free(upgradedURL);
+        return response;
+    }
+
     struct http_url *url = http_url_from_string(charURL);
 
     if (errno) {
@@ -353,17 +1271,39 @@ struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataRe
         return failure;
     }
 
-    if (!strcmp(url->protocol, "http")) {
-        return http_makeNetworkHTTPRequest(url, rwsocket, rsocket, csocket, userAgent, chunkHandler, finishHandler, chunkArg);
-    } else if (!strcmp(url->protocol, "https")) {
-        return http_makeNetworkHTTPRequest(url, secure_rwsocket, secure_rsocket, secure_csocket, userAgent, chunkHandler, finishHandler, chunkArg);
+    if (!strcmp(url->protocol, "http") || !strcmp(url->protocol, "https")) {
+        struct socket_transport *transport = !strcmp(url->protocol, "https") ? &secure_transport : &tcp_transport;
+
+        char *cacheKey = HTTP_cacheKeyForURL(url);
+        struct http_disk_cache_lookup cached = HTTP_lookupDiskCache(HTTP_globalDiskCache, cacheKey);
+        if (cached.found && cached.fresh) {
+            free(cacheKey);
+            HTTP_freeURL(url);
+
+            HTTP_setTimingCached();
+            if (finishHandler != NULL) finishHandler(chunkArg);
+            return cached.response;
+        }
+
+        // A stale entry is sent with its validators, so the server can answer 304 instead of sending it again
+        struct http_response response = http_makeNetworkHTTPRequest(url, transport, userAgent, cached.validators, chunkHandler, finishHandler, chunkArg);
+        if (cached.found && !response.error && response.response_code == 304) {
+            HTTP_refreshDiskCacheEntry(HTTP_globalDiskCache, cacheKey, &response, &cached.response);
+            HTTP_freeResponse(&response);
+            response = cached.response;
+        } else {
+            if (cached.found) {
+                HTTP_freeResponse(&cached.response);
+            }
+            http_keepNetworkResponse(charURL, cacheKey, &response);
+        }
+
+        free(cached.validators);
+        free(cacheKey);
+        return response;
     } else if (!strcmp(url->protocol, "file")) {
-        free(url->hostname);
-        free(url->protocol);
         struct http_response response = http_readFileToHTTP(url->path);
-        free(url->path);
-        free(url->fragment);
-        free(url);
+        HTTP_freeURL(url);
 
         return response;
     } else if (!strcmp(charURL, "about:blank")) {
@@ -373,7 +1313,8 @@ struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataRe
 
         struct http_response result;
         result.response_code = 200;
-        result.response_description = makeStrCpy("OK");
+        result.raw_headers = makeStrCpy("OK");
+        result.response_description = result.raw_headers;
         result.num_headers = 0;
         result.headers = NULL;
         result.is_chunked = 0;
@@ -385,7 +1326,11 @@ struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataRe
         result.has_body = 1;
         result.response_body = body;
 
+        HTTP_freeURL(url);
         return result;
+    } else if (!strcmp(charURL, "about:timing")) {
+        HTTP_freeURL(url);
+        return HTTP_responseFromString(HTTP_formatTimingLog(), 0);
     } else if (!strcmp(url->protocol, "about")) {
         struct http_data body;
         body.length = strlen("Invalid about: page");
@@ -393,7 +1338,8 @@ struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataRe
 
         struct http_response result;
         result.response_code = 400;
-        result.response_description = makeStrCpy("INVALID");
+        result.raw_headers = makeStrCpy("INVALID");
+        result.response_description = result.raw_headers;
         result.num_headers = 0;
         result.headers = NULL;
         result.is_chunked = 0;
@@ -405,13 +1351,31 @@ struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataRe
         result.has_body = 1;
         result.response_body = body;
 
+        HTTP_freeURL(url);
         return result;
     } else {
         // Unsupported protocol
         struct http_response errorResponse;
         errorResponse.error = 194;
+        HTTP_freeURL(url);
         return errorResponse;
     }
 }
 
+// Loads a URL (http, https, file or about), recording how long it took for about:timing
+struct http_response http_makeHTTPRequest(char *charURL, char *userAgent, dataReceiveHandler chunkHandler, dataReceiveHandler finishHandler, void *chunkArg) {
+    // about: pages are made on the spot, so there's nothing to time
+    if (!strncmp(charURL, "about:", 6)) {
+        return http_loadURL(charURL, userAgent, chunkHandler, finishHandler, chunkArg);
+    }
+
+    struct http_timing timing = HTTP_makeTiming(charURL);
+    struct http_timing *outerTiming = HTTP_setCurrentTiming(&timing);
+    struct http_response response = http_loadURL(charURL, userAgent, chunkHandler, finishHandler, chunkArg);
+    HTTP_setCurrentTiming(outerTiming);
+
+    HTTP_recordTiming(&timing, response.error, response.error ? 0 : response.response_body.length);
+    return response;
+}
+
 #endif
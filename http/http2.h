@@ -0,0 +1,841 @@
+// HTTP/2 (RFC 9113) over TLS, picked with ALPN when the server supports it. All the requests to an origin
+// share one connection and run as concurrent streams, and each response is handed back in HTTP/1.1 form
+// so that the usual response parser can take it from there.
+// Only GET requests are ever sent, and server push is turned off.
+
+#ifndef _HTTP_HTTP2
+    #define _HTTP_HTTP2 1
+
+    #include <pthread.h>
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+
+    #include "../socket/common.h"
+    #include "../socket/secure-socket.h"
+    #include "../utils/string.h"
+
+    #include "hpack.h"
+    #include "pool.h"
+    #include "timeouts.h"
+    #include "timing.h"
+
+    // The windows we give the server. With the defaults (64 KB) a large download stalls every 64 KB waiting
+    // for a WINDOW_UPDATE, so these are sized for bulk transfers instead.
+    #define http2StreamWindowSize (16 * 1024 * 1024)
+    #define http2ConnectionWindowSize (32 * 1024 * 1024)
+    #define http2DefaultWindowSize 65535
+
+    #define http2FrameHeaderLength 9
+    // The largest frame either side may send until told otherwise (we never raise ours)
+    #define http2DefaultMaxFrameSize 16384
+    // Used until the server's SETTINGS say how many streams it allows
+    #define http2DefaultMaxConcurrentStreams 100
+    // Maximum number of idle HTTP/2 connections kept, over all origins (one is enough per origin)
+    #define maxIdleHTTP2Connections 8
+
+enum http2_frame_type {
+    HTTP2_DATA = 0,
+    HTTP2_HEADERS = 1,
+    HTTP2_PRIORITY = 2,
+    HTTP2_RST_STREAM = 3,
+    HTTP2_SETTINGS = 4,
+    HTTP2_PUSH_PROMISE = 5,
+    HTTP2_PING = 6,
+    HTTP2_GOAWAY = 7,
+    HTTP2_WINDOW_UPDATE = 8,
+    HTTP2_CONTINUATION = 9,
+};
+
+enum http2_frame_flag {
+    HTTP2_FLAG_END_STREAM = 0x1,
+    HTTP2_FLAG_ACK = 0x1,
+    HTTP2_FLAG_END_HEADERS = 0x4,
+    HTTP2_FLAG_PADDED = 0x8,
+    HTTP2_FLAG_PRIORITY = 0x20,
+};
+
+enum http2_setting {
+    HTTP2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    HTTP2_SETTINGS_ENABLE_PUSH = 2,
+    HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    HTTP2_SETTINGS_MAX_FRAME_SIZE = 5,
+};
+
+enum http2_error_code {
+    HTTP2_NO_ERROR = 0,
+    HTTP2_PROTOCOL_ERROR = 1,
+    HTTP2_FRAME_SIZE_ERROR = 6,
+    HTTP2_REFUSED_STREAM = 7,
+    HTTP2_CANCEL = 8,
+    HTTP2_COMPRESSION_ERROR = 9,
+};
+
+struct http2_connection {
+    char *protocol;
+    char *hostname;
+    int port;
+
+    struct socket_info socket;
+    struct socket_transport *transport;
+
+    // Header compression state, one for each direction
+    struct hpack_encoder *encoder;
+    struct hpack_decoder *decoder;
+
+    // Frames waiting to be sent
+    struct socket_buffer output;
+    // Received bytes; the frames before `input_offset` have been handled
+    struct socket_buffer input;
+    int input_offset;
+
+    // Client streams are odd and only ever go up
+    int next_stream_id;
+
+    // From the server's SETTINGS
+    int max_frame_size;
+    int max_concurrent_streams;
+
+    // DATA received since the connection's window was last topped up
+    int unacknowledged;
+
+    // Set once the server sent GOAWAY or the connection failed; no more streams can be started on it
+    int closed;
+
+    time_t lastUsed;
+};
+
+// The outcome of one request made with HTTP2_exchange
+struct http2_result {
+    // 0, or an HTTP error code (190 if cancelled)
+    int error;
+    // Set when the server didn't process the request, so it can be made again on another connection
+    int retry;
+    // The status line and headers in HTTP/1.1 form, then the body
+    struct socket_buffer response;
+};
+
+// Progress of one request during HTTP2_exchange
+struct http2_stream {
+    int id;
+    int finished;
+    // Set once the final (non-1xx) headers have been received
+    int has_headers;
+    // DATA received since the stream's window was last topped up
+    int unacknowledged;
+};
+
+int HTTP2_enabled = 0;
+
+// Offering HTTP/2 only changes anything for https; the server decides which protocol is used
+void HTTP2_setEnabled(int enabled) {
+    HTTP2_enabled = enabled;
+    if (enabled) {
+        secure_setALPNProtocols((const unsigned char *) "\x02h2\x08http/1.1", 12);
+    } else {
+        secure_setALPNProtocols(NULL, 0);
+    }
+}
+
+int HTTP2_getEnabled() {
+    return HTTP2_enabled;
+}
+
+// Origins ("scheme://host:port") that have answered with HTTP/2, so their requests are worth batching up
+char **http2_knownOrigins = NULL;
+int http2_knownOriginCount = 0;
+
+// Idle connections, most recently used last
+struct http2_connection **http2_idleConnections = NULL;
+int http2_idleConnectionCount = 0;
+
+// Requests can be made from several threads at once
+pthread_mutex_t http2_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns 1 if `origin` (as "scheme://host:port") has been seen to support HTTP/2
+int HTTP2_isKnownOrigin(const char *origin) {
+    if (!HTTP2_enabled || origin == NULL) return 0;
+
+    int known = 0;
+    pthread_mutex_lock(&http2_lock);
+    for (int i = 0; i < http2_knownOriginCount && !known; i ++) {
+        known = !strcmp(http2_knownOrigins[i], origin);
+    }
+    pthread_mutex_unlock(&http2_lock);
+    return known;
+}
+
+char *http2_makeOrigin(const char *protocol, const char *hostname, int port) {
+    char *origin = (char *) calloc(strlen(protocol) + strlen(hostname) + 16, sizeof(char));
+    sprintf(origin, "%s://%s:%d", protocol, hostname, port);
+    return origin;
+}
+
+void http2_rememberOrigin(const char *protocol, const char *hostname, int port) {
+    char *origin = http2_makeOrigin(protocol, hostname, port);
+
+    pthread_mutex_lock(&http2_lock);
+    for (int i = 0; i < http2_knownOriginCount; i ++) {
+        if (!strcmp(http2_knownOrigins[i], origin)) {
+            pthread_mutex_unlock(&http2_lock);
+            free(origin);
+            return;
+        }
+    }
+    http2_knownOriginCount ++;
+    http2_knownOrigins = (char **) realloc(http2_knownOrigins, http2_knownOriginCount * sizeof(char *));
+    http2_knownOrigins[http2_knownOriginCount - 1] = origin;
+    pthread_mutex_unlock(&http2_lock);
+}
+
+// Returns 1 if the server picked HTTP/2 for a connection that was just opened
+int HTTP2_isNegotiated(struct socket_transport *transport, struct socket_info *socket) {
+    return transport == &secure_transport && secure_isProtocolNegotiated(socket, "h2");
+}
+
+void http2_writeUint32(char *out, uint32_t value) {
+    out[0] = (char) (value >> 24);
+    out[1] = (char) (value >> 16);
+    out[2] = (char) (value >> 8);
+    out[3] = (char) value;
+}
+
+uint32_t http2_readUint32(const unsigned char *data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | (uint32_t) data[3];
+}
+
+// Adds a frame to the connection's output; nothing is sent until http2_flush
+void http2_queueFrame(struct http2_connection *connection, int type, int flags, int streamID, const char *payload, int length) {
+    struct socket_buffer *out = &connection->output;
+    socket_reserveBuffer(out, http2FrameHeaderLength + length);
+
+    char *header = out->data + out->length;
+    header[0] = (char) (length >> 16);
+    header[1] = (char) (length >> 8);
+    header[2] = (char) length;
+    header[3] = (char) type;
+    header[4] = (char) flags;
+    http2_writeUint32(header + 5, streamID & 0x7fffffff);
+    if (length > 0) {
+        memcpy(header + http2FrameHeaderLength, payload, length);
+    }
+    out->length += http2FrameHeaderLength + length;
+    out->data[out->length] = '\0';
+}
+
+void http2_queueWindowUpdate(struct http2_connection *connection, int streamID, int increment) {
+    char payload[4];
+    http2_writeUint32(payload, increment);
+    http2_queueFrame(connection, HTTP2_WINDOW_UPDATE, 0, streamID, payload, 4);
+}
+
+// Stops the connection from being used for anything else, telling the server why
+void http2_queueGoaway(struct http2_connection *connection, int errorCode) {
+    if (connection->closed) return;
+
+    char payload[8];
+    http2_writeUint32(payload, 0);
+    http2_writeUint32(payload + 4, errorCode);
+    http2_queueFrame(connection, HTTP2_GOAWAY, 0, 0, payload, 8);
+    connection->closed = 1;
+}
+
+// Sends everything that has been queued. Returns 0, or a (negative) socket error.
+int http2_flush(struct http2_connection *connection) {
+    if (connection->output.length == 0) {
+        return 0;
+    }
+
+    int status = socket_writeAll(connection->transport, &connection->socket, connection->output.data, connection->output.length);
+    connection->output.length = 0;
+    return status < 0 ? status : 0;
+}
+
+// Takes over a connection on which the server picked HTTP/2, and queues the connection preface
+struct http2_connection *HTTP2_makeConnection(struct socket_info socket, struct socket_transport *transport, const char *protocol, const char *hostname, int port) {
+    struct http2_connection *connection = (struct http2_connection *) calloc(1, sizeof(struct http2_connection));
+    connection->protocol = makeStrCpy(protocol);
+    connection->hostname = makeStrCpy(hostname);
+    connection->port = port;
+    connection->socket = socket;
+    connection->transport = transport;
+    connection->encoder = HPACK_makeEncoder();
+    connection->decoder = HPACK_makeDecoder();
+    connection->output = socket_makeBuffer(http2DefaultMaxFrameSize);
+    connection->input = socket_makeBuffer(http2DefaultMaxFrameSize + http2FrameHeaderLength);
+    connection->input_offset = 0;
+    connection->next_stream_id = 1;
+    connection->max_frame_size = http2DefaultMaxFrameSize;
+    connection->max_concurrent_streams = http2DefaultMaxConcurrentStreams;
+    connection->unacknowledged = 0;
+    connection->closed = 0;
+
+    const char *preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    socket_reserveBuffer(&connection->output, strlen(preface));
+    memcpy(connection->output.data, preface, strlen(preface));
+    connection->output.length = strlen(preface);
+
+    char settings[12];
+    settings[0] = 0;
+    settings[1] = HTTP2_SETTINGS_ENABLE_PUSH;
+    http2_writeUint32(settings + 2, 0);
+    settings[6] = 0;
+    settings[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    http2_writeUint32(settings + 8, http2StreamWindowSize);
+    http2_queueFrame(connection, HTTP2_SETTINGS, 0, 0, settings, 12);
+    http2_queueWindowUpdate(connection, 0, http2ConnectionWindowSize - http2DefaultWindowSize);
+
+    http2_rememberOrigin(protocol, hostname, port);
+
+    return connection;
+}
+
+void HTTP2_closeConnection(struct http2_connection *connection) {
+    if (connection == NULL) return;
+
+    // Best effort: the GOAWAY is only sent if it fits in the socket buffer straight away
+    http2_queueGoaway(connection, HTTP2_NO_ERROR);
+    if (connection->output.length > 0) {
+        int written;
+        connection->transport->write(&connection->socket, connection->output.data, connection->output.length, &written);
+    }
+    connection->transport->close(&connection->socket);
+
+    HPACK_freeEncoder(connection->encoder);
+    HPACK_freeDecoder(connection->decoder);
+    socket_freeBuffer(&connection->output);
+    socket_freeBuffer(&connection->input);
+    free(connection->protocol);
+    free(connection->hostname);
+    free(connection);
+}
+
+// Takes an idle connection to the origin, or returns NULL if there isn't one
+struct http2_connection *HTTP2_takeConnection(const char *protocol, const char *hostname, int port) {
+    if (!HTTP2_enabled) return NULL;
+
+    time_t now = HTTP_poolNow();
+    struct http2_connection *found = NULL;
+    struct http2_connection **expired = NULL;
+    int numExpired = 0;
+
+    pthread_mutex_lock(&http2_lock);
+    for (int i = http2_idleConnectionCount - 1; i >= 0; i --) {
+        struct http2_connection *connection = http2_idleConnections[i];
+        int isExpired = now - connection->lastUsed >= defaultPoolIdleTimeout;
+        int matches = !isExpired && found == NULL && connection->port == port && !strcmp(connection->protocol, protocol) && !strcmp(connection->hostname, hostname);
+        if (!isExpired && !matches) {
+            continue;
+        }
+
+        if (matches) {
+            found = connection;
+        } else {
+            numExpired ++;
+            expired = (struct http2_connection **) realloc(expired, numExpired * sizeof(struct http2_connection *));
+            expired[numExpired - 1] = connection;
+        }
+        memmove(http2_idleConnections + i, http2_idleConnections + i + 1, (http2_idleConnectionCount - i - 1) * sizeof(struct http2_connection *));
+        http2_idleConnectionCount --;
+    }
+    pthread_mutex_unlock(&http2_lock);
+
+    // Closing can block briefly, so it's done without holding the lock
+    for (int i = 0; i < numExpired; i ++) {
+        HTTP2_closeConnection(expired[i]);
+    }
+    free(expired);
+
+    return found;
+}
+
+// Gives a connection back once its requests are done, closing it if it can't be used again
+void HTTP2_releaseConnection(struct http2_connection *connection) {
+    if (connection->closed || !HTTP2_enabled) {
+        HTTP2_closeConnection(connection);
+        return;
+    }
+
+    connection->lastUsed = HTTP_poolNow();
+    struct http2_connection *evicted = NULL;
+
+    pthread_mutex_lock(&http2_lock);
+    if (http2_idleConnectionCount >= maxIdleHTTP2Connections) {
+        evicted = http2_idleConnections[0];
+        memmove(http2_idleConnections, http2_idleConnections + 1, (http2_idleConnectionCount - 1) * sizeof(struct http2_connection *));
+        http2_idleConnectionCount --;
+    }
+    http2_idleConnectionCount ++;
+    http2_idleConnections = (struct http2_connection **) realloc(http2_idleConnections, http2_idleConnectionCount * sizeof(struct http2_connection *));
+    http2_idleConnections[http2_idleConnectionCount - 1] = connection;
+    pthread_mutex_unlock(&http2_lock);
+
+    HTTP2_closeConnection(evicted);
+}
+
+// Headers that only make sense for HTTP/1.1 connections, which HTTP/2 forbids
+int http2_isConnectionHeader(const char *name) {
+    return !strcmp(name, "host") || !strcmp(name, "connection") || !strcmp(name, "keep-alive") || !strcmp(name, "proxy-connection") ||
+        !strcmp(name, "transfer-encoding") || !strcmp(name, "upgrade") || !strcmp(name, "te");
+}
+
+// Queues the HEADERS (and any CONTINUATION) frames for a request given in HTTP/1.1 form, as made by
+// http_buildRequestString
+void http2_queueRequest(struct http2_connection *connection, const char *request, int streamID) {
+    struct socket_buffer block = socket_makeBuffer(256);
+
+    const char *lineEnd = strstr(request, "\r\n");
+    const char *methodEnd = strchr(request, ' ');
+    const char *pathEnd = methodEnd != NULL && lineEnd != NULL ? strchr(methodEnd + 1, ' ') : NULL;
+    if (pathEnd == NULL || pathEnd > lineEnd) {
+        pathEnd = lineEnd;
+    }
+
+    char *method = (char *) calloc(methodEnd - request + 1, sizeof(char));
+    memcpy(method, request, methodEnd - request);
+    char *path = (char *) calloc(pathEnd - methodEnd, sizeof(char));
+    memcpy(path, methodEnd + 1, pathEnd - methodEnd - 1);
+
+    char *authority = (char *) calloc(strlen(connection->hostname) + 16, sizeof(char));
+    if (connection->port == 443) {
+        strcpy(authority, connection->hostname);
+    } else {
+        sprintf(authority, "%s:%d", connection->hostname, connection->port);
+    }
+
+    // Pseudo-headers have to come first. Paths rarely repeat, so they're kept out of the dynamic table.
+    HPACK_encodeHeader(connection->encoder, &block, ":method", method, 1);
+    HPACK_encodeHeader(connection->encoder, &block, ":scheme", connection->protocol, 1);
+    HPACK_encodeHeader(connection->encoder, &block, ":authority", authority, 1);
+    HPACK_encodeHeader(connection->encoder, &block, ":path", path, 0);
+    free(method);
+    free(path);
+    free(authority);
+
+    const char *line = lineEnd + 2;
+    while ((lineEnd = strstr(line, "\r\n")) != NULL && lineEnd != line) {
+        const char *colon = (const char *) memchr(line, ':', lineEnd - line);
+        if (colon != NULL) {
+            char *name = (char *) calloc(colon - line + 1, sizeof(char));
+            memcpy(name, line, colon - line);
+            char *lowerName = toLowerCase(name);
+            free(name);
+
+            const char *valueStart = colon + 1;
+            while (valueStart < lineEnd && (*valueStart == ' ' || *valueStart == '\t')) valueStart ++;
+            char *value = (char *) calloc(lineEnd - valueStart + 1, sizeof(char));
+            memcpy(value, valueStart, lineEnd - valueStart);
+
+            if (!http2_isConnectionHeader(lowerName)) {
+                HPACK_encodeHeader(connection->encoder, &block, lowerName, value, 1);
+            }
+            free(lowerName);
+            free(value);
+        }
+        line = lineEnd + 2;
+    }
+
+    // Only GET requests are made, so the request ends with its headers
+    int offset = 0;
+    int first = 1;
+    do {
+        int length = block.length - offset;
+        if (length > connection->max_frame_size) {
+            length = connection->max_frame_size;
+        }
+        int isLast = offset + length == block.length;
+        int flags = isLast ? HTTP2_FLAG_END_HEADERS : 0;
+        if (first) {
+            flags |= HTTP2_FLAG_END_STREAM;
+        }
+        http2_queueFrame(connection, first ? HTTP2_HEADERS : HTTP2_CONTINUATION, flags, streamID, block.data + offset, length);
+        offset += length;
+        first = 0;
+    } while (offset < block.length);
+
+    socket_freeBuffer(&block);
+}
+
+// Returns the index of the request using stream `streamID`, or -1
+int http2_findStream(struct http2_stream *streams, int count, int streamID) {
+    if (streamID == 0) return -1;
+
+    for (int i = 0; i < count; i ++) {
+        if (streams[i].id == streamID) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Ends every request that's still waiting for its response
+void http2_failStreams(struct http2_stream *streams, struct http2_result *results, int count, int error) {
+    for (int i = 0; i < count; i ++) {
+        if (streams[i].finished) {
+            continue;
+        }
+        streams[i].finished = 1;
+        results[i].error = error;
+        // A request that got nothing back is safe to make again (we only ever send GET requests), unless
+        // the server is just slow or the load was cancelled
+        results[i].retry = error == 200 && !streams[i].has_headers;
+    }
+}
+
+// Handles a complete header block. Returns 0, or 1 if it couldn't be decoded (which breaks the connection).
+int http2_handleHeaderBlock(struct http2_connection *connection, struct socket_buffer *block, int streamID, int endStream, struct http2_stream *streams, struct http2_result *results, int count) {
+    // Every block has to be decoded, even for streams we no longer care about, to keep the table in step
+    struct hpack_header_list list;
+    if (HPACK_decodeBlock(connection->decoder, (const unsigned char *) block->data, block->length, &list)) {
+        return 1;
+    }
+
+    int index = http2_findStream(streams, count, streamID);
+    if (index == -1 || streams[index].finished) {
+        HPACK_freeHeaderList(&list);
+        return 0;
+    }
+    struct http2_stream *stream = &streams[index];
+    struct socket_buffer *response = &results[index].response;
+
+    char *status = HPACK_getHeader(&list, ":status");
+    if (!stream->has_headers) {
+        if (status == NULL || strlen(status) != 3) {
+            stream->finished = 1;
+            results[index].error = 1;
+            HPACK_freeHeaderList(&list);
+            return 0;
+        }
+
+        // Informational responses (100 Continue, 103 Early Hints) are followed by the real one
+        if (status[0] != '1') {
+            stream->has_headers = 1;
+
+            int length = 16;
+            for (int i = 0; i < list.count; i ++) {
+                length += strlen(list.headers[i].name) + strlen(list.headers[i].value) + 4;
+            }
+            socket_reserveBuffer(response, length);
+
+            char *out = response->data + response->length;
+            out += sprintf(out, "HTTP/1.1 %s\r\n", status);
+            for (int i = 0; i < list.count; i ++) {
+                if (list.headers[i].name[0] == ':') {
+                    continue;
+                }
+                char *line = out;
+                out += sprintf(out, "%s: %s", list.headers[i].name, list.headers[i].value);
+
+                // HPACK allows line breaks inside a value, which the HTTP/1.1 form can't have
+                for (char *c = line; c < out; c ++) {
+                    if (*c == '\r' || *c == '\n') *c = ' ';
+                }
+                out += sprintf(out, "\r\n");
+            }
+            out += sprintf(out, "\r\n");
+            response->length = out - response->data;
+        }
+    }
+    // Anything after the response headers is a trailer block, which isn't used
+
+    if (endStream) {
+        stream->finished = 1;
+        if (!stream->has_headers) {
+            results[index].error = 1;
+        }
+    }
+
+    HPACK_freeHeaderList(&list);
+    return 0;
+}
+
+/*
+Makes `count` requests (given in HTTP/1.1 form, as made by http_buildRequestString) as concurrent streams on
+`connection`, filling in `results` (free each response buffer with socket_freeBuffer). `onData` (or NULL) is
+called with `arg` whenever part of a body arrives.
+When the connection fails, requests without a response are marked as failed, and as retryable if the server
+never answered them. The connection should be given back with HTTP2_releaseConnection afterwards.
+The server gets the first-byte timeout to start answering, then the stall timeout between frames of the
+responses; the socket's final deadline (e.g. the request budget) is left as the caller set it.
+*/
+void HTTP2_exchange(struct http2_connection *connection, char **requests, int count, struct http2_result *results, void (*onData)(void *), void *arg) {
+    struct http2_stream *streams = (struct http2_stream *) calloc(count, sizeof(struct http2_stream));
+    for (int i = 0; i < count; i ++) {
+        results[i].error = 0;
+        results[i].retry = 0;
+        results[i].response = socket_makeBuffer(0);
+    }
+
+    // A header block can be split over several frames, which have to arrive back to back
+    struct socket_buffer headerBlock = socket_makeBuffer(0);
+    int headerStreamID = 0;
+    int headerEndStream = 0;
+
+    // Until something is received for one of the requests, the timeout error is "no response" rather than "stalled"
+    int responding = 0;
+    connection->socket.deadline = socket_deadlineAfter(HTTP_timeouts.first_byte);
+
+    int started = 0;
+    int error = 0;
+    while (1) {
+        int open = 0;
+        int unfinished = 0;
+        for (int i = 0; i < started; i ++) {
+            open += !streams[i].finished;
+        }
+        for (int i = 0; i < count; i ++) {
+            unfinished += !streams[i].finished;
+        }
+        if (unfinished == 0) {
+            break;
+        }
+
+        while (!connection->closed && started < count && open < connection->max_concurrent_streams && connection->next_stream_id < 0x7fffffff) {
+            streams[started].id = connection->next_stream_id;
+            connection->next_stream_id += 2;
+            http2_queueRequest(connection, requests[started], streams[started].id);
+            started ++;
+            open ++;
+        }
+
+        int status = http2_flush(connection);
+        if (status < 0) {
+            error = HTTP_readError(status, responding ? 184 : 183);
+            break;
+        }
+        if (open == 0) {
+            // Nothing more can be started on this connection (it's going away, or the server allows no streams)
+            error = 200;
+            break;
+        }
+
+        // Wait for a whole frame
+        int available = connection->input.length - connection->input_offset;
+        const unsigned char *frame = (const unsigned char *) connection->input.data + connection->input_offset;
+        int length = available >= http2FrameHeaderLength ? (frame[0] << 16) | (frame[1] << 8) | frame[2] : 0;
+        if (length > http2DefaultMaxFrameSize) {
+            http2_queueGoaway(connection, HTTP2_FRAME_SIZE_ERROR);
+            error = 1;
+            break;
+        }
+        if (available < http2FrameHeaderLength || available < http2FrameHeaderLength + length) {
+            if (connection->input_offset > 0) {
+                memmove(connection->input.data, connection->input.data + connection->input_offset, available);
+                connection->input.length = available;
+                connection->input_offset = 0;
+            }
+            int bytesRead = socket_readIntoBuffer(connection->transport, &connection->socket, &connection->input, http2DefaultMaxFrameSize + http2FrameHeaderLength);
+            if (bytesRead <= 0) {
+                error = HTTP_readError(bytesRead, responding ? 184 : 183);
+                break;
+            }
+            HTTP_countTimingBytes(bytesRead);
+            continue;
+        }
+
+        int type = frame[3];
+        int flags = frame[4];
+        int streamID = http2_readUint32(frame + 5) & 0x7fffffff;
+        const unsigned char *payload = frame + http2FrameHeaderLength;
+        connection->input_offset += http2FrameHeaderLength + length;
+
+        if (headerStreamID && (type != HTTP2_CONTINUATION || streamID != headerStreamID)) {
+            http2_queueGoaway(connection, HTTP2_PROTOCOL_ERROR);
+            error = 1;
+            break;
+        }
+
+        int index = http2_findStream(streams, count, streamID);
+        int protocolError = 0;
+        if (index != -1 && (type == HTTP2_DATA || type == HTTP2_HEADERS || type == HTTP2_CONTINUATION)) {
+            responding = 1;
+            connection->socket.deadline = socket_deadlineAfter(HTTP_timeouts.stall);
+            HTTP_markTiming(HTTP_TIMING_FIRST_BYTE);
+        }
+
+        switch (type) {
+            case HTTP2_DATA:
+            case HTTP2_HEADERS: {
+                // Strip the padding (and, for HEADERS, the priority)
+                int start = 0;
+                int end = length;
+                if (flags & HTTP2_FLAG_PADDED) {
+                    if (length < 1 || payload[0] >= length) {
+                        protocolError = 1;
+                        break;
+                    }
+                    start = 1;
+                    end = length - payload[0];
+                }
+                if (type == HTTP2_HEADERS && (flags & HTTP2_FLAG_PRIORITY)) {
+                    start += 5;
+                }
+                if (start > end || streamID == 0) {
+                    protocolError = 1;
+                    break;
+                }
+
+                if (type == HTTP2_HEADERS) {
+                    headerBlock.length = 0;
+                    socket_reserveBuffer(&headerBlock, end - start);
+                    memcpy(headerBlock.data, payload + start, end - start);
+                    headerBlock.length = end - start;
+                    headerEndStream = flags & HTTP2_FLAG_END_STREAM;
+                    headerStreamID = streamID;
+                    break;
+                }
+
+                // Flow control counts the whole frame, padding included
+                connection->unacknowledged += length;
+                if (connection->unacknowledged >= http2ConnectionWindowSize / 2) {
+                    http2_queueWindowUpdate(connection, 0, connection->unacknowledged);
+                    connection->unacknowledged = 0;
+                }
+
+                if (index == -1 || streams[index].finished) {
+                    break;
+                }
+                struct http2_stream *stream = &streams[index];
+                if (!stream->has_headers) {
+                    stream->finished = 1;
+                    results[index].error = 1;
+                    break;
+                }
+
+                struct socket_buffer *response = &results[index].response;
+                socket_reserveBuffer(response, end - start);
+                memcpy(response->data + response->length, payload + start, end - start);
+                response->length += end - start;
+                response->data[response->length] = '\0';
+
+                if (HTTP_isOverBodyLimit(response->length) && !(flags & HTTP2_FLAG_END_STREAM)) {
+                    // Only this stream is given up on; the connection can carry on with the rest
+                    char code[4];
+                    http2_writeUint32(code, HTTP2_CANCEL);
+                    http2_queueFrame(connection, HTTP2_RST_STREAM, 0, streamID, code, 4);
+                    stream->finished = 1;
+                    results[index].error = 188;
+                } else if (flags & HTTP2_FLAG_END_STREAM) {
+                    stream->finished = 1;
+                } else {
+                    stream->unacknowledged += length;
+                    if (stream->unacknowledged >= http2StreamWindowSize / 2) {
+                        http2_queueWindowUpdate(connection, streamID, stream->unacknowledged);
+                        stream->unacknowledged = 0;
+                    }
+                }
+                if (onData != NULL) onData(arg);
+                break;
+            }
+            case HTTP2_CONTINUATION:
+                if (!headerStreamID) {
+                    protocolError = 1;
+                    break;
+                }
+                socket_reserveBuffer(&headerBlock, length);
+                memcpy(headerBlock.data + headerBlock.length, payload, length);
+                headerBlock.length += length;
+                break;
+            case HTTP2_RST_STREAM:
+                if (length != 4 || streamID == 0) {
+                    protocolError = 1;
+                    break;
+                }
+                if (index != -1 && !streams[index].finished) {
+                    streams[index].finished = 1;
+                    results[index].error = 200;
+                    results[index].retry = http2_readUint32(payload) == HTTP2_REFUSED_STREAM;
+                }
+                break;
+            case HTTP2_SETTINGS:
+                if (flags & HTTP2_FLAG_ACK) {
+                    break;
+                }
+                if (length % 6 || streamID != 0) {
+                    protocolError = 1;
+                    break;
+                }
+                for (int i = 0; i < length; i += 6) {
+                    int setting = (payload[i] << 8) | payload[i + 1];
+                    uint32_t value = http2_readUint32(payload + i + 2);
+                    if (setting == HTTP2_SETTINGS_HEADER_TABLE_SIZE) {
+                        HPACK_setEncoderTableSize(connection->encoder, value > hpackDefaultTableSize ? hpackDefaultTableSize : (int) value);
+                    } else if (setting == HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS) {
+                        connection->max_concurrent_streams = value > http2DefaultMaxConcurrentStreams ? http2DefaultMaxConcurrentStreams : (int) value;
+                    } else if (setting == HTTP2_SETTINGS_MAX_FRAME_SIZE) {
+                        if (value < http2DefaultMaxFrameSize || value > 0xffffff) {
+                            protocolError = 1;
+                        }
+                        // Our header blocks are small, so there's nothing to gain from larger frames
+                    }
+                }
+                http2_queueFrame(connection, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+                break;
+            case HTTP2_PING:
+                if (length != 8) {
+                    protocolError = 1;
+                    break;
+                }
+                if (!(flags & HTTP2_FLAG_ACK)) {
+                    http2_queueFrame(connection, HTTP2_PING, HTTP2_FLAG_ACK, 0, (const char *) payload, 8);
+                }
+                break;
+            case HTTP2_GOAWAY: {
+                if (length < 8) {
+                    protocolError = 1;
+                    break;
+                }
+                // Streams after the last one the server processed can be made again elsewhere
+                int lastStreamID = http2_readUint32(payload) & 0x7fffffff;
+                connection->closed = 1;
+                for (int i = 0; i < count; i ++) {
+                    if (!streams[i].finished && (streams[i].id == 0 || streams[i].id > lastStreamID)) {
+                        streams[i].finished = 1;
+                        results[i].error = 200;
+                        results[i].retry = 1;
+                    }
+                }
+                break;
+            }
+            case HTTP2_PUSH_PROMISE:
+                // Push was turned off in our SETTINGS
+                protocolError = 1;
+                break;
+            default:
+                // PRIORITY, WINDOW_UPDATE (we never send DATA) and unknown frame types
+                break;
+        }
+
+        if (protocolError) {
+            http2_queueGoaway(connection, HTTP2_PROTOCOL_ERROR);
+            error = 1;
+            break;
+        }
+
+        if (headerStreamID && (type == HTTP2_HEADERS || type == HTTP2_CONTINUATION) && (flags & HTTP2_FLAG_END_HEADERS)) {
+            int decodeError = http2_handleHeaderBlock(connection, &headerBlock, headerStreamID, headerEndStream, streams, results, count);
+            headerStreamID = 0;
+            if (decodeError) {
+                http2_queueGoaway(connection, HTTP2_COMPRESSION_ERROR);
+                error = 1;
+                break;
+            }
+        }
+    }
+
+    if (error) {
+        // The connection is out of step with the server; the GOAWAY (if any) is sent when it's closed
+        connection->closed = 1;
+        http2_failStreams(streams, results, count, error);
+    } else if (headerStreamID != 0 || http2_flush(connection) < 0) {
+        // Stopped halfway through a header block, or couldn't acknowledge what was just received
+        connection->closed = 1;
+    }
+
+    socket_freeBuffer(&headerBlock);
+    free(streams);
+}
+
+#endif
@@ -0,0 +1,296 @@
+// Keeps subresource bodies (stylesheets) in memory for the lifetime of the process, so that pages of the
+// same site don't download their shared resources again. Entries follow Cache-Control no-store/max-age,
+// and the least recently used are dropped once the cache grows past its byte budget.
+// Simultaneous requests for one URL are only fetched once: the first caller fetches, the others wait for it.
+
+#ifndef _HTTP_MEMORY_CACHE
+    #define _HTTP_MEMORY_CACHE 1
+
+    #include <errno.h>
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+
+    #include "../socket/common.h"
+    #include "../utils/log.h"
+    #include "../utils/string.h"
+
+    #include "cache.h"
+    #include "response.h"
+
+    #define defaultMemoryCacheBudget (16 * 1024 * 1024)
+    // How long a response without any freshness information is reused for
+    #define defaultMemoryCacheLifetime 60
+
+    #ifdef unix
+        #include <pthread.h>
+
+        struct http_memory_cache_entry {
+            char *url;
+            struct http_data body;
+
+            // Monotonic times
+            time_t expires;
+            time_t last_used;
+
+            // Set while the first request for the URL is being made; the body isn't there yet
+            int pending;
+        };
+
+        struct http_memory_cache {
+            struct http_memory_cache_entry *entries;
+            int count;
+
+            int64_t budget;
+            int64_t total_size;
+
+            pthread_mutex_t lock;
+            // Signalled whenever a pending entry is filled in or dropped
+            pthread_cond_t fetched;
+        };
+
+        struct http_memory_cache *HTTP_makeMemoryCache(int64_t budget) {
+            struct http_memory_cache *cache = (struct http_memory_cache *) calloc(1, sizeof(struct http_memory_cache));
+            cache->entries = NULL;
+            cache->count = 0;
+            cache->budget = budget;
+            cache->total_size = 0;
+            pthread_mutex_init(&cache->lock, NULL);
+            pthread_cond_init(&cache->fetched, NULL);
+
+            return cache;
+        }
+
+        time_t HTTP_memoryCacheNow() {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return now.tv_sec;
+        }
+
+        // Must be called with the cache's lock held. Returns the entry's index, or -1.
+        int http_findMemoryCacheEntry(struct http_memory_cache *cache, const char *url) {
+            for (int i = 0; i < cache->count; i ++) {
+                if (!strcmp(cache->entries[i].url, url)) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        // Must be called with the cache's lock held
+        void http_removeMemoryCacheEntry(struct http_memory_cache *cache, int index) {
+            free(cache->entries[index].url);
+            free(cache->entries[index].body.data);
+            cache->total_size -= cache->entries[index].body.length;
+
+            memmove(cache->entries + index, cache->entries + index + 1, (cache->count - index - 1) * sizeof(struct http_memory_cache_entry));
+            cache->count --;
+        }
+
+        // Must be called with the cache's lock held. Drops least recently used entries until `amount` more bytes fit.
+        void http_makeRoomInMemoryCache(struct http_memory_cache *cache, int64_t amount) {
+            while (cache->total_size + amount > cache->budget) {
+                int oldest = -1;
+                for (int i = 0; i < cache->count; i ++) {
+                    if (!cache->entries[i].pending && (oldest == -1 || cache->entries[i].last_used < cache->entries[oldest].last_used)) {
+                        oldest = i;
+                    }
+                }
+                if (oldest == -1) {
+                    return;
+                }
+                http_removeMemoryCacheEntry(cache, oldest);
+            }
+        }
+
+        // Lowers the budget (dropping entries if needed) or raises it. A budget of 0 turns the cache off.
+        void HTTP_setMemoryCacheBudget(struct http_memory_cache *cache, int64_t budget) {
+            if (cache == NULL) return;
+
+            pthread_mutex_lock(&cache->lock);
+            cache->budget = budget;
+            http_makeRoomInMemoryCache(cache, 0);
+            pthread_mutex_unlock(&cache->lock);
+        }
+
+        // Waits (with the cache's lock held) for a pending entry to be filled in. Returns 0 once something changed
+        // or a moment has passed, or SOCKET_CANCELLED if the calling thread's wait was cancelled (see socket_isCancelled).
+        int http_waitForMemoryCacheFetch(struct http_memory_cache *cache) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += socketCancellationCheckInterval * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec ++;
+                until.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&cache->fetched, &cache->lock, &until) != ETIMEDOUT) {
+                return 0;
+            }
+
+            // The event source (e.g. CTRL+X) is only handled while waiting on a socket
+            pthread_mutex_unlock(&cache->lock);
+            int status = socket_sleep(1);
+            pthread_mutex_lock(&cache->lock);
+            return status;
+        }
+
+        /*
+        Looks `url` up, waiting if another thread is already fetching it.
+        Returns:
+            1: `body` is a copy of the cached body (free it with free())
+            0: the caller has to fetch the URL, and must then call HTTP_storeInMemoryCache (even if the fetch failed)
+            -1: the wait was cancelled; the URL shouldn't be fetched (and HTTP_storeInMemoryCache mustn't be called)
+        */
+        int HTTP_beginMemoryCacheFetch(struct http_memory_cache *cache, const char *url, struct http_data *body) {
+            if (cache == NULL) return 0;
+
+            pthread_mutex_lock(&cache->lock);
+            while (1) {
+                int index = http_findMemoryCacheEntry(cache, url);
+                if (index == -1) {
+                    break;
+                }
+
+                struct http_memory_cache_entry *entry = &cache->entries[index];
+                if (entry->pending) {
+                    if (http_waitForMemoryCacheFetch(cache) == SOCKET_CANCELLED) {
+                        pthread_mutex_unlock(&cache->lock);
+                        return -1;
+                    }
+                    continue;
+                }
+
+                time_t now = HTTP_memoryCacheNow();
+                if (entry->expires <= now) {
+                    http_removeMemoryCacheEntry(cache, index);
+                    break;
+                }
+
+                entry->last_used = now;
+                body->length = entry->body.length;
+                body->data = (char *) calloc(entry->body.length + 1, sizeof(char));
+                memcpy(body->data, entry->body.data, entry->body.length);
+                pthread_mutex_unlock(&cache->lock);
+                return 1;
+            }
+
+            if (cache->budget > 0) {
+                // Anyone else asking for the URL now waits for this fetch
+                cache->count ++;
+                cache->entries = (struct http_memory_cache_entry *) realloc(cache->entries, cache->count * sizeof(struct http_memory_cache_entry));
+                struct http_memory_cache_entry *entry = &cache->entries[cache->count - 1];
+                entry->url = makeStrCpy(url);
+                entry->body.data = NULL;
+                entry->body.length = 0;
+                entry->expires = 0;
+                entry->last_used = 0;
+                entry->pending = 1;
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return 0;
+        }
+
+        // Returns how long (in seconds) a response can be reused for, or 0 if it can't be
+        int http_getMemoryCacheLifetime(struct http_response *response) {
+            // Errors (and anything else that didn't come from a server) have no headers
+            if (response->error || response->headers == NULL || response->response_code != 200) {
+                return 0;
+            }
+
+            int hasPolicy = HTTP_getHeader(response, "cache-control") != NULL || HTTP_getHeader(response, "expires") != NULL;
+            if (!hasPolicy) {
+                return defaultMemoryCacheLifetime;
+            }
+
+            // no-store and no-cache come back as expiring straight away, or not at all
+            int64_t now = http_cacheNow();
+            int64_t expires = HTTP_getResponseExpiry(response, now);
+            return expires > now ? (int) (expires - now) : 0;
+        }
+
+        // Stores the result of a fetch started with HTTP_beginMemoryCacheFetch (or any other response for `url`),
+        // and wakes up anyone waiting for it. The response isn't taken over; its body is copied if it's kept.
+        void HTTP_storeInMemoryCache(struct http_memory_cache *cache, const char *url, struct http_response *response) {
+            if (cache == NULL) return;
+
+            int lifetime = http_getMemoryCacheLifetime(response);
+
+            pthread_mutex_lock(&cache->lock);
+            int index = http_findMemoryCacheEntry(cache, url);
+            if (index != -1) {
+                http_removeMemoryCacheEntry(cache, index);
+            }
+
+            int64_t length = lifetime > 0 ? response->response_body.length : 0;
+            if (lifetime > 0 && length <= cache->budget) {
+                http_makeRoomInMemoryCache(cache, length);
+
+                time_t now = HTTP_memoryCacheNow();
+                cache->count ++;
+                cache->entries = (struct http_memory_cache_entry *) realloc(cache->entries, cache->count * sizeof(struct http_memory_cache_entry));
+                struct http_memory_cache_entry *entry = &cache->entries[cache->count - 1];
+                entry->url = makeStrCpy(url);
+                entry->body.data = (char *) calloc(length + 1, sizeof(char));
+                memcpy(entry->body.data, response->response_body.data, length);
+                entry->body.length = length;
+                entry->expires = now + lifetime;
+                entry->last_used = now;
+                entry->pending = 0;
+                cache->total_size += length;
+            }
+
+            pthread_cond_broadcast(&cache->fetched);
+            pthread_mutex_unlock(&cache->lock);
+        }
+
+        // Returns 1 if `url` is cached (or being fetched), so there's no need to request it separately
+        int HTTP_isInMemoryCache(struct http_memory_cache *cache, const char *url) {
+            if (cache == NULL) return 0;
+
+            pthread_mutex_lock(&cache->lock);
+            int index = http_findMemoryCacheEntry(cache, url);
+            int present = index != -1 && (cache->entries[index].pending || cache->entries[index].expires > HTTP_memoryCacheNow());
+            pthread_mutex_unlock(&cache->lock);
+            return present;
+        }
+
+        void HTTP_clearMemoryCache(struct http_memory_cache *cache) {
+            if (cache == NULL) return;
+
+            pthread_mutex_lock(&cache->lock);
+            for (int i = cache->count - 1; i >= 0; i --) {
+                if (!cache->entries[i].pending) {
+                    http_removeMemoryCacheEntry(cache, i);
+                }
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+
+    #else
+
+        struct http_memory_cache {
+            int64_t budget;
+        };
+
+        struct http_memory_cache *HTTP_makeMemoryCache(int64_t _budget) {
+            log_err("HTTP_makeMemoryCache called, not supported on non-Unix compilation target\n");
+            return NULL;
+        }
+
+        void HTTP_setMemoryCacheBudget(struct http_memory_cache *_cache, int64_t _budget) { }
+
+        int HTTP_beginMemoryCacheFetch(struct http_memory_cache *_cache, const char *_url, struct http_data *_body) {
+            return 0;
+        }
+
+        void HTTP_storeInMemoryCache(struct http_memory_cache *_cache, const char *_url, struct http_response *_response) { }
+
+        int HTTP_isInMemoryCache(struct http_memory_cache *_cache, const char *_url) {
+            return 0;
+        }
+
+        void HTTP_clearMemoryCache(struct http_memory_cache *_cache) { }
+
+    #endif
+#endif
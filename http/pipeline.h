@@ -0,0 +1,409 @@
+// HTTP/1.1 pipelining: several GET requests to one origin are written back to back on a single
+// connection, and the responses are read back in the same order.
+// Many servers and proxies handle this badly, so it's opt-in (see HTTP_setPipeliningEnabled).
+// Origins that speak HTTP/2 get the same batching without the drawbacks, as streams of one connection.
+
+#ifndef _HTTP_PIPELINE
+    #define _HTTP_PIPELINE 1
+
+    #include "http.h"
+
+int HTTP_pipeliningEnabled = 0;
+
+void HTTP_setPipeliningEnabled(int enabled) {
+    HTTP_pipeliningEnabled = enabled;
+}
+
+int HTTP_getPipeliningEnabled() {
+    return HTTP_pipeliningEnabled;
+}
+
+// Returns 1 if the URL's origin is known to speak HTTP/2
+int http_isHTTP2Origin(char *charURL) {
+    errno = 0;
+    struct http_url *url = http_url_from_string(charURL);
+    if (errno || url == NULL) {
+        return 0;
+    }
+
+    char *origin = http2_makeOrigin(url->protocol, url->hostname, url->port);
+    int known = HTTP2_isKnownOrigin(origin);
+    free(origin);
+
+    HTTP_freeURL(url);
+
+    return known;
+}
+
+// Returns 1 if every URL is http(s) and has the same scheme, host and port as the first one
+int http_canPipeline(char **urls, int count) {
+    errno = 0;
+    struct http_url *first = http_url_from_string(urls[0]);
+    if (errno || first == NULL) {
+        return 0;
+    }
+
+    int result = !strcmp(first->protocol, "http") || !strcmp(first->protocol, "https");
+    for (int i = 1; i < count && result; i ++) {
+        struct http_url *url = http_url_from_string(urls[i]);
+        if (errno || url == NULL) {
+            result = 0;
+            break;
+        }
+        result = url->port == first->port && !strcmp(url->protocol, first->protocol) && !strcmp(url->hostname, first->hostname);
+
+        HTTP_freeURL(url);
+    }
+
+    HTTP_freeURL(first);
+
+    return result;
+}
+
+/*
+Tries to take one complete response off the front of `buffer`. `parser` keeps the header parsing
+progress between calls, and `chunked` the decoding of a chunked body (which also finds where it ends);
+both are reset once a response has been taken.
+Returns:
+    1: `response` was filled in and its bytes were removed from the buffer
+    0: more data is needed
+   -1: the response can't be framed (no Content-Length and not chunked), or is malformed
+*/
+int http_takePipelinedResponse(struct socket_buffer *buffer, struct http_response_parser *parser, struct chunked_response_state *chunked, struct http_response *response) {
+    if (!HTTP_continueResponseParser(parser, buffer->data, buffer->length, "1.1")) {
+        return parser->error ? -1 : 0;
+    }
+    int headerLength = parser->body_start;
+
+    // Only the framing headers are needed to find the end of the body
+    int isChunked = 0;
+    int64_t contentLength = -2;
+    for (int i = 0; i < parser->num_spans; i ++) {
+        struct http_header_span span = parser->spans[i];
+        if (span.value_start == -1) {
+            continue;
+        }
+        const char *name = buffer->data + span.name_start;
+        const char *value = buffer->data + span.value_start;
+        if (span.name_length == 17 && HTTP_startsWithIgnoreCase(name, "transfer-encoding")) {
+            isChunked = span.value_length >= 7 && HTTP_startsWithIgnoreCase(value + span.value_length - 7, "chunked");
+        }
+        if (span.name_length == 14 && HTTP_startsWithIgnoreCase(name, "content-length")) {
+            contentLength = http_parseContentLength(value, span.value_length);
+        }
+    }
+
+    // These never have a body, whatever their Content-Length or Transfer-Encoding says
+    int hasBody = parser->response_code != 204 && parser->response_code != 304;
+
+    int64_t bodyLength;
+    if (!hasBody) {
+        bodyLength = 0;
+    } else if (isChunked) {
+        // Only what arrived since the last call is decoded
+        struct http_data received;
+        received.data = buffer->data + headerLength + chunked->consumed;
+        received.length = buffer->length - headerLength - chunked->consumed;
+        appendChunkToBody(chunked, received);
+        if (chunked->error) {
+            return -1;
+        }
+        bodyLength = chunked->finished ? chunked->consumed : -1;
+    } else if (contentLength >= 0) {
+        bodyLength = buffer->length - headerLength >= contentLength ? contentLength : -1;
+    } else {
+        return -1;
+    }
+
+    if (bodyLength == -1) {
+        // The headers stay parsed (and a chunked body decoded as far as it goes) until the rest of the body has arrived
+        return 0;
+    }
+
+    int64_t used = headerLength + bodyLength;
+    struct http_response parsedResponse = HTTP_finishResponseParser(parser, buffer->data, headerLength);
+    if (hasBody && isChunked) {
+        free(parsedResponse.response_body.data);
+        parsedResponse.response_body = chunked->current_parsed_data;
+        *chunked = HTTP_makeChunkedDecoder();
+    } else {
+        free(parsedResponse.response_body.data);
+
+        struct http_data body;
+        body.data = (char *) calloc(bodyLength + 1, sizeof(char));
+        body.length = bodyLength;
+        memcpy(body.data, buffer->data + headerLength, bodyLength);
+        parsedResponse.response_body = body;
+    }
+
+    if (hasBody && HTTP_decodeResponseBody(&parsedResponse)) {
+        HTTP_freeResponse(&parsedResponse);
+        return -1;
+    }
+
+    // Keep whatever belongs to the next response
+    memmove(buffer->data, buffer->data + used, buffer->length - used);
+    buffer->length -= used;
+    buffer->data[buffer->length] = '\0';
+    *parser = HTTP_makeResponseParser();
+
+    *response = parsedResponse;
+    return 1;
+}
+
+// Sends every request on one connection and reads responses until one can't be used.
+// Returns the number of responses that were filled in, starting from the first.
+int http_pipelineOnConnection(char **urls, int count, char *userAgent, struct http_response *responses) {
+    struct http_url *url = http_url_from_string(urls[0]);
+    struct socket_transport *transport = !strcmp(url->protocol, "https") ? &secure_transport : &tcp_transport;
+
+    // The batch as a whole gets the budget of a single request
+    long long requestDeadline = HTTP_requestDeadline();
+
+    struct socket_info connection;
+    int reusedConnection = HTTP_takePooledConnection(HTTP_globalConnectionPool, url->protocol, url->hostname, url->port, &connection);
+    if (reusedConnection) {
+        connection.final_deadline = requestDeadline;
+        HTTP_setTimingConnection(1, 0);
+    }
+    if (!reusedConnection && http_openConnection(url, transport, &connection, requestDeadline)) {
+        HTTP_freeURL(url);
+        // Sequential requests will report the error
+        return 0;
+    }
+    if (!reusedConnection && HTTP2_isNegotiated(transport, &connection)) {
+        // The requests made one at a time will share this connection instead
+        HTTP2_releaseConnection(HTTP2_makeConnection(connection, transport, url->protocol, url->hostname, url->port));
+        HTTP_freeURL(url);
+        return 0;
+    }
+
+    int requestsLength = 0;
+    char **requestStrings = (char **) calloc(count, sizeof(char *));
+    // Kept for the cookies the responses set
+    char **paths = (char **) calloc(count, sizeof(char *));
+    for (int i = 0; i < count; i ++) {
+        struct http_url *requestURL = http_url_from_string(urls[i]);
+        requestStrings[i] = http_buildRequestString(requestURL, userAgent, NULL);
+        requestsLength += strlen(requestStrings[i]);
+        paths[i] = makeStrCpy(requestURL->path);
+        HTTP_freeURL(requestURL);
+    }
+
+    char *requests = (char *) calloc(requestsLength + 1, sizeof(char));
+    for (int i = 0; i < count; i ++) {
+        strcat(requests, requestStrings[i]);
+        free(requestStrings[i]);
+    }
+    free(requestStrings);
+
+    connection.deadline = socket_deadlineAfter(HTTP_timeouts.first_byte);
+    int status = socket_writeAll(transport, &connection, requests, requestsLength);
+    free(requests);
+
+    int completed = 0;
+    int keepAlive = status == SOCKET_DONE;
+    int idleTimeout = defaultPoolIdleTimeout;
+
+    struct socket_buffer receiveBuffer = socket_makeBuffer(maxInitialResponseSize);
+    struct http_response_parser responseParser = HTTP_makeResponseParser();
+    struct chunked_response_state chunkedResponse = HTTP_makeChunkedDecoder();
+    while (keepAlive && completed < count) {
+        int taken = http_takePipelinedResponse(&receiveBuffer, &responseParser, &chunkedResponse, &responses[completed]);
+        if (taken == -1) {
+            keepAlive = 0;
+            break;
+        }
+        if (taken == 1) {
+            keepAlive = http_processResponseHeaders(&responses[completed], url->hostname, paths[completed], &idleTimeout);
+            completed ++;
+            continue;
+        }
+
+        // Closed early (or cancelled): whatever is left is requested again one at a time
+        int bytesRead = socket_readIntoBuffer(transport, &connection, &receiveBuffer, maxSegmentLength);
+        if (bytesRead <= 0) {
+            keepAlive = 0;
+        } else {
+            HTTP_markTiming(HTTP_TIMING_FIRST_BYTE);
+            HTTP_countTimingBytes(bytesRead);
+        }
+        connection.deadline = socket_deadlineAfter(HTTP_timeouts.stall);
+    }
+
+    // Leftover bytes mean the server sent something that wasn't asked for
+    if (keepAlive && completed == count && receiveBuffer.length == 0) {
+        HTTP_releaseConnection(HTTP_globalConnectionPool, url->protocol, url->hostname, url->port, connection, transport, idleTimeout);
+    } else {
+        transport->close(&connection);
+    }
+    HTTP_freeResponseParser(&responseParser);
+    HTTP_freeChunkedDecoder(&chunkedResponse);
+    socket_freeBuffer(&receiveBuffer);
+    for (int i = 0; i < count; i ++) {
+        free(paths[i]);
+    }
+    free(paths);
+
+    HTTP_freeURL(url);
+
+    return completed;
+}
+
+// Makes every request as a stream of one HTTP/2 connection. Only https URLs of a single origin can be given.
+// Sets `answered` for each response that was filled in; the others should be requested again one at a time.
+void http_multiplexOnConnection(char **urls, int count, char *userAgent, struct http_response *responses, int *answered) {
+    struct http_url *url = http_url_from_string(urls[0]);
+    long long requestDeadline = HTTP_requestDeadline();
+
+    struct http2_connection *connection = HTTP2_takeConnection(url->protocol, url->hostname, url->port);
+    HTTP_setTimingConnection(connection != NULL, 1);
+    if (connection == NULL) {
+        struct socket_info socket;
+        if (!http_openConnection(url, &secure_transport, &socket, requestDeadline)) {
+            if (HTTP2_isNegotiated(&secure_transport, &socket)) {
+                connection = HTTP2_makeConnection(socket, &secure_transport, url->protocol, url->hostname, url->port);
+            } else {
+                HTTP_releaseConnection(HTTP_globalConnectionPool, url->protocol, url->hostname, url->port, socket, &secure_transport, defaultPoolIdleTimeout);
+            }
+        }
+    }
+
+    if (connection != NULL) {
+        char **requestStrings = (char **) calloc(count, sizeof(char *));
+        // Kept for the cookies the responses set
+        char **paths = (char **) calloc(count, sizeof(char *));
+        for (int i = 0; i < count; i ++) {
+            struct http_url *requestURL = http_url_from_string(urls[i]);
+            requestStrings[i] = http_buildRequestString(requestURL, userAgent, NULL);
+            paths[i] = makeStrCpy(requestURL->path);
+            HTTP_freeURL(requestURL);
+        }
+
+        struct http2_result *results = (struct http2_result *) calloc(count, sizeof(struct http2_result));
+        connection->socket.final_deadline = requestDeadline;
+        HTTP2_exchange(connection, requestStrings, count, results, NULL, NULL);
+        HTTP2_releaseConnection(connection);
+
+        for (int i = 0; i < count; i ++) {
+            // Failed requests are made again, which either works or reports the error properly
+            struct http_response response = http_responseFromHTTP2(&results[i], url->hostname, paths[i]);
+            if (!response.error) {
+                responses[i] = response;
+                answered[i] = 1;
+            }
+            free(requestStrings[i]);
+            free(paths[i]);
+        }
+        free(results);
+        free(requestStrings);
+        free(paths);
+    }
+
+    HTTP_freeURL(url);
+}
+
+// Fetches `count` URLs, returning their responses in the same order (free the array with free()).
+// When all of the URLs share an origin, the requests are multiplexed if the origin is known to speak HTTP/2,
+// or else pipelined if pipelining is enabled; any that couldn't be answered that way (and every request
+// otherwise) are made one at a time.
+// URLs that are in the disk cache are always left to http_makeHTTPRequest, which can use or revalidate them.
+struct http_response *http_makePipelinedHTTPRequests(char **urls, int count, char *userAgent) {
+    struct http_response *responses = (struct http_response *) calloc(count, sizeof(struct http_response));
+    int *answered = (int *) calloc(count, sizeof(int));
+
+    // Nothing is ever sent to an HSTS host in plain text, whether batched or not
+    char **requestURLs = (char **) calloc(count, sizeof(char *));
+    for (int i = 0; i < count; i ++) {
+        char *upgradedURL = HTTP_upgradeToHTTPS(HTTP_globalRedirectCache, urls[i]);
+        requestURLs[i] = upgradedURL != NULL ? upgradedURL : urls[i];
+    }
+
+    int canBatch = count > 1 && http_canPipeline(requestURLs, count);
+    int multiplex = canBatch && http_isHTTP2Origin(requestURLs[0]);
+    if (canBatch && (multiplex || HTTP_pipeliningEnabled)) {
+        char **uncached = (char **) calloc(count, sizeof(char *));
+        char **keys = (char **) calloc(count, sizeof(char *));
+        int *indices = (int *) calloc(count, sizeof(int));
+        int numUncached = 0;
+        for (int i = 0; i < count; i ++) {
+            struct http_url *url = http_url_from_string(requestURLs[i]);
+            char *key = HTTP_cacheKeyForURL(url);
+            if (HTTP_hasDiskCacheEntry(HTTP_globalDiskCache, key)) {
+                free(key);
+            } else {
+                uncached[numUncached] = requestURLs[i];
+                keys[numUncached] = key;
+                indices[numUncached] = i;
+                numUncached ++;
+            }
+
+            HTTP_freeURL(url);
+        }
+
+        if (numUncached > 1) {
+            struct http_response *pipelined = (struct http_response *) calloc(numUncached, sizeof(struct http_response));
+            int *pipelinedAnswered = (int *) calloc(numUncached, sizeof(int));
+
+            // The requests of the batch share the connection's timings
+            struct http_timing batchTiming = HTTP_makeTiming(uncached[0]);
+            struct http_timing *outerTiming = HTTP_setCurrentTiming(&batchTiming);
+            if (multiplex) {
+                http_multiplexOnConnection(uncached, numUncached, userAgent, pipelined, pipelinedAnswered);
+            } else {
+                int completed = http_pipelineOnConnection(uncached, numUncached, userAgent, pipelined);
+                for (int i = 0; i < completed; i ++) {
+                    pipelinedAnswered[i] = 1;
+                }
+            }
+            HTTP_setCurrentTiming(outerTiming);
+
+            int recorded = 0;
+            for (int i = 0; i < numUncached; i ++) {
+                if (!pipelinedAnswered[i]) {
+                    continue;
+                }
+                // The bytes read for the whole batch are counted on its first request; the others came over
+                // the connection it made
+                struct http_timing timing = batchTiming;
+                timing.url = uncached[i];
+                if (recorded > 0) {
+                    timing.received = 0;
+                    timing.reused = 1;
+                }
+                HTTP_recordTiming(&timing, 0, pipelined[i].response_body.length);
+                recorded ++;
+
+                http_keepNetworkResponse(uncached[i], keys[i], &pipelined[i]);
+                responses[indices[i]] = pipelined[i];
+                answered[indices[i]] = 1;
+            }
+            free(pipelinedAnswered);
+            free(pipelined);
+        }
+
+        for (int i = 0; i < numUncached; i ++) {
+            free(keys[i]);
+        }
+        free(uncached);
+        free(keys);
+        free(indices);
+    }
+
+    for (int i = 0; i < count; i ++) {
+        if (!answered[i]) {
+            responses[i] = http_makeHTTPRequest(requestURLs[i], userAgent, NULL, NULL, NULL);
+        }
+    }
+    free(answered);
+    for (int i = 0; i < count; i ++) {
+        if (requestURLs[i] != urls[i]) {
+            free(requestURLs[i]);
+        }
+    }
+    free(requestURLs);
+
+    return responses;
+}
+
+#endif
@@ -0,0 +1,186 @@
+// Keeps idle HTTP/1.1 connections around so that requests to the same origin can reuse them.
+
+#ifndef _HTTP_POOL
+    #define _HTTP_POOL 1
+
+    #include <errno.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <sys/socket.h>
+    #include <time.h>
+
+    #include "../socket/common.h"
+    #include "../utils/string.h"
+
+    // How long an idle connection is kept if the server doesn't send a Keep-Alive timeout
+    #define defaultPoolIdleTimeout 30
+    // Maximum number of idle connections kept for a single (scheme, host, port)
+    #define maxPooledConnectionsPerOrigin 6
+
+struct http_pooled_connection {
+    char *protocol;
+    char *hostname;
+    int port;
+
+    struct socket_info socket;
+    struct socket_transport *transport;
+
+    time_t lastUsed;
+    int idleTimeout;
+};
+
+struct http_connection_pool {
+    struct http_pooled_connection *connections;
+    int count;
+
+    // Requests can be made from several threads at once
+    pthread_mutex_t lock;
+};
+
+struct http_connection_pool *HTTP_makeConnectionPool() {
+    struct http_connection_pool *pool = (struct http_connection_pool *) calloc(1, sizeof(struct http_connection_pool));
+    pool->connections = NULL;
+    pool->count = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+time_t HTTP_poolNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void HTTP_removePooledConnection(struct http_connection_pool *pool, int index, int shouldClose) {
+    struct http_pooled_connection conn = pool->connections[index];
+    if (shouldClose) {
+        conn.transport->close(&conn.socket);
+    }
+    free(conn.protocol);
+    free(conn.hostname);
+
+    memmove(pool->connections + index, pool->connections + index + 1, (pool->count - index - 1) * sizeof(struct http_pooled_connection));
+    pool->count --;
+}
+
+// Must be called with the pool's lock held
+void http_pruneConnectionPoolLocked(struct http_connection_pool *pool) {
+    time_t now = HTTP_poolNow();
+    for (int i = pool->count - 1; i >= 0; i --) {
+        if (now - pool->connections[i].lastUsed >= pool->connections[i].idleTimeout) {
+            HTTP_removePooledConnection(pool, i, 1);
+        }
+    }
+}
+
+// Closes every connection that has been idle for longer than its timeout.
+void HTTP_pruneConnectionPool(struct http_connection_pool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    http_pruneConnectionPoolLocked(pool);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// An idle connection should have nothing to read. If the peer has closed it (or sent something unexpected), it can't be reused.
+int HTTP_isPooledConnectionAlive(struct http_pooled_connection *conn) {
+    struct pollfd fd;
+    fd.fd = conn->socket.descriptor;
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int res = poll(&fd, 1, 0);
+    if (res < 0) return 0;
+    if (res == 0) return 1;
+    if (fd.revents & (POLLERR | POLLHUP | POLLNVAL)) return 0;
+
+    char peeked;
+    int peekRes = recv(conn->socket.descriptor, &peeked, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peekRes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Returns 1 and fills `result` if an idle connection to this origin was available.
+int HTTP_takePooledConnection(struct http_connection_pool *pool, const char *protocol, const char *hostname, int port, struct socket_info *result) {
+    if (pool == NULL) return 0;
+
+    pthread_mutex_lock(&pool->lock);
+    http_pruneConnectionPoolLocked(pool);
+
+    // Prefer the most recently used connection; it's the least likely to have been closed by the server
+    for (int i = pool->count - 1; i >= 0; i --) {
+        struct http_pooled_connection *conn = &pool->connections[i];
+        if (conn->port != port || strcmp(conn->protocol, protocol) || strcmp(conn->hostname, hostname)) {
+            continue;
+        }
+
+        if (!HTTP_isPooledConnectionAlive(conn)) {
+            HTTP_removePooledConnection(pool, i, 1);
+            continue;
+        }
+
+        *result = conn->socket;
+        HTTP_removePooledConnection(pool, i, 0);
+        pthread_mutex_unlock(&pool->lock);
+        return 1;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Hands a connection whose response was completely read back to the pool. If the pool is
+// full for this origin, the oldest idle connection is closed.
+void HTTP_releaseConnection(struct http_connection_pool *pool, const char *protocol, const char *hostname, int port, struct socket_info socket, struct socket_transport *transport, int idleTimeout) {
+    if (pool == NULL || idleTimeout <= 0) {
+        transport->close(&socket);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    int sameOrigin = 0;
+    int oldestIndex = -1;
+    for (int i = 0; i < pool->count; i ++) {
+        struct http_pooled_connection *conn = &pool->connections[i];
+        if (conn->port == port && !strcmp(conn->protocol, protocol) && !strcmp(conn->hostname, hostname)) {
+            if (oldestIndex == -1) oldestIndex = i;
+            sameOrigin ++;
+        }
+    }
+    if (sameOrigin >= maxPooledConnectionsPerOrigin) {
+        HTTP_removePooledConnection(pool, oldestIndex, 1);
+    }
+
+    struct http_pooled_connection conn;
+    conn.protocol = makeStrCpy(protocol);
+    conn.hostname = makeStrCpy(hostname);
+    conn.port = port;
+    conn.socket = socket;
+    conn.socket.bytesRead = 0;
+    conn.socket.error = 0;
+    conn.transport = transport;
+    conn.lastUsed = HTTP_poolNow();
+    conn.idleTimeout = idleTimeout;
+
+    pool->count ++;
+    pool->connections = (struct http_pooled_connection *) realloc(pool->connections, sizeof(struct http_pooled_connection) * pool->count);
+    pool->connections[pool->count - 1] = conn;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Closes every idle connection and frees the pool, which mustn't be used by any thread afterwards
+void HTTP_closeConnectionPool(struct http_connection_pool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = pool->count - 1; i >= 0; i --) {
+        HTTP_removePooledConnection(pool, i, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->connections);
+    free(pool);
+}
+
+#endif
@@ -0,0 +1,88 @@
+// Byte ranges (RFC 7233). A body that's cut off partway is asked for again from where it stopped, and a large one
+// can be fetched as several ranges over separate connections at once. The ranges are asked for with If-Range, so
+// a resource that has changed in the meantime is never pieced together from two versions.
+
+#ifndef _HTTP_RANGE
+    #define _HTTP_RANGE 1
+
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+
+    #include "response.h"
+
+// The error reported when the server won't send just the range that's missing (because the resource has changed,
+// or it doesn't do ranges). Asking again wouldn't help.
+    #define rangeRefusedError 186
+
+// How many times the rest of a body is asked for after the connection drops
+    #define maxRangeResumes 3
+// Smaller bodies are always fetched over one connection
+    #define parallelRangeThreshold (4 * 1024 * 1024)
+    #define maxParallelRanges 8
+
+// How many connections a large body is fetched over (1 to fetch everything over one connection)
+int HTTP_parallelRanges = 1;
+
+void HTTP_setParallelRanges(int ranges) {
+    if (ranges < 1) {
+        ranges = 1;
+    }
+    if (ranges > maxParallelRanges) {
+        ranges = maxParallelRanges;
+    }
+    HTTP_parallelRanges = ranges;
+}
+
+int HTTP_getParallelRanges() {
+    return HTTP_parallelRanges;
+}
+
+// The validator to send with If-Range when asking for the rest of the response's body: a strong ETag, or failing
+// that Last-Modified. Returns NULL if the body can't be resumed (it isn't a complete 200 with a known length).
+char *HTTP_resumeValidator(struct http_response *response) {
+    if (response->response_code != 200 || response->is_chunked || response->content_length < 0) {
+        return NULL;
+    }
+
+    char *etag = HTTP_getHeader(response, "etag");
+    if (etag != NULL && strncmp(etag, "W/", 2)) {
+        return etag;
+    }
+    return HTTP_getHeader(response, "last-modified");
+}
+
+// Returns 1 if the server said it answers byte ranges for this resource
+int HTTP_acceptsByteRanges(struct http_response *response) {
+    char *acceptRanges = HTTP_getHeader(response, "accept-ranges");
+    return acceptRanges != NULL && HTTP_containsIgnoreCase(acceptRanges, "bytes");
+}
+
+// Adds Range and If-Range headers to a request from http_buildRequestString, asking for bytes `start` to `end`
+// (inclusive) of the body
+char *HTTP_makeRangeRequest(char *requestString, char *validator, int64_t start, int64_t end) {
+    // The request ends with the empty line, which has to stay last
+    int headLength = strlen(requestString) - 2;
+    char *request = (char *) calloc(headLength + strlen(validator) + 80, sizeof(char));
+    memcpy(request, requestString, headLength);
+    sprintf(request + headLength, "Range: bytes=%lld-%lld\r\nIf-Range: %s\r\n\r\n", (long long) start, (long long) end, validator);
+
+    return request;
+}
+
+// Returns 1 if the response is a 206 holding exactly bytes `start` to `end` (inclusive) of a body of `total` bytes
+int HTTP_isMatchingRange(struct http_response *response, int64_t start, int64_t end, int64_t total) {
+    if (response->response_code != 206 || response->is_chunked || response->content_length != end - start + 1) {
+        return 0;
+    }
+
+    char *contentRange = HTTP_getHeader(response, "content-range");
+    long long first, last, length;
+    if (contentRange == NULL || sscanf(contentRange, "bytes %lld-%lld/%lld", &first, &last, &length) != 3) {
+        return 0;
+    }
+    return first == start && last == end && length == total;
+}
+
+#endif
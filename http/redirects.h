@@ -0,0 +1,536 @@
+// Permanent redirects (301 and 308) and HSTS hosts (Strict-Transport-Security), remembered so that navigation can
+// go straight to where a URL ends up instead of asking the server again each time. Every request for an http URL
+// of an HSTS host is made over https instead, and navigation goes straight to the target of a URL that
+// permanently redirected.
+// Both are kept in memory and saved in the user's data directory, in a small text file that's read whole when
+// the browser starts and rewritten whenever an entry is added or removed.
+
+#ifndef _HTTP_REDIRECTS
+    #define _HTTP_REDIRECTS 1
+
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <time.h>
+
+    #ifdef unix
+        #include <pthread.h>
+        #include <unistd.h>
+    #endif
+
+    #include "../utils/string.h"
+
+    #include "cache.h"
+    #include "response.h"
+    #include "url.h"
+
+    // Bumped whenever the file layout changes; files with another version are ignored and replaced
+    #define redirectCacheMagic "chttpr1"
+    // How long a permanent redirect without Cache-Control or Expires is followed without asking the server again
+    #define defaultPermanentRedirectLifetime (30 * 24 * 60 * 60)
+    // More cached redirects in a row than this are left for the server to repeat (they're probably a loop)
+    #define maxKnownRedirectHops 10
+    // An HSTS host's expiry is only saved again once it has moved by this much, not on every response
+    #define hstsSaveInterval (24 * 60 * 60)
+
+struct http_known_redirect {
+    // http_hashCacheKey of `from`, which the entries are sorted by
+    uint64_t hash;
+    // A cache key (see HTTP_cacheKeyForURL)
+    char *from;
+    // Absolute
+    char *to;
+    int64_t expires;
+};
+
+struct http_hsts_host {
+    // http_hashCacheKey of `host`, which the entries are sorted by
+    uint64_t hash;
+    // Lowercase
+    char *host;
+    int include_subdomains;
+    int64_t expires;
+};
+
+struct http_redirect_cache {
+    // The file the entries are saved to, or NULL to only keep them in memory
+    char *path;
+
+    struct http_known_redirect *redirects;
+    int redirect_count;
+    struct http_hsts_host *hosts;
+    int host_count;
+
+    #ifdef unix
+        pthread_mutex_t lock;
+    #endif
+};
+
+int64_t http_redirectNow() {
+    return (int64_t) time(NULL);
+}
+
+// Returns the first of the entries with `hash` in a sorted array of `count` entries, each `size` bytes long and
+// starting with its hash, or where one would go as -index - 1
+int http_findHashedEntry(const void *entries, int count, size_t size, uint64_t hash) {
+    int low = 0;
+    int high = count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (*(const uint64_t *) ((const char *) entries + middle * size) < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < count && *(const uint64_t *) ((const char *) entries + low * size) == hash) {
+        return low;
+    }
+    return -low - 1;
+}
+
+// Must be called with the cache's lock held. Returns the redirect from `from`, or -1.
+int http_findKnownRedirect(struct http_redirect_cache *cache, const char *from, uint64_t hash) {
+    int index = http_findHashedEntry(cache->redirects, cache->redirect_count, sizeof(struct http_known_redirect), hash);
+    for (int i = index; i >= 0 && i < cache->redirect_count && cache->redirects[i].hash == hash; i ++) {
+        if (!strcmp(cache->redirects[i].from, from)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Must be called with the cache's lock held. Returns the entry for exactly `host`, or -1.
+int http_findHSTSHost(struct http_redirect_cache *cache, const char *host, uint64_t hash) {
+    int index = http_findHashedEntry(cache->hosts, cache->host_count, sizeof(struct http_hsts_host), hash);
+    for (int i = index; i >= 0 && i < cache->host_count && cache->hosts[i].hash == hash; i ++) {
+        if (!strcmp(cache->hosts[i].host, host)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Must be called with the cache's lock held. Takes over `from` and `to`.
+void http_addKnownRedirect(struct http_redirect_cache *cache, char *from, char *to, int64_t expires) {
+    uint64_t hash = http_hashCacheKey(from);
+    int index = http_findKnownRedirect(cache, from, hash);
+    if (index >= 0) {
+        free(from);
+        free(cache->redirects[index].to);
+        cache->redirects[index].to = to;
+        cache->redirects[index].expires = expires;
+        return;
+    }
+
+    int position = http_findHashedEntry(cache->redirects, cache->redirect_count, sizeof(struct http_known_redirect), hash);
+    position = position >= 0 ? position : -position - 1;
+    cache->redirects = (struct http_known_redirect *) realloc(cache->redirects, (cache->redirect_count + 1) * sizeof(struct http_known_redirect));
+    memmove(cache->redirects + position + 1, cache->redirects + position, (cache->redirect_count - position) * sizeof(struct http_known_redirect));
+    cache->redirects[position].hash = hash;
+    cache->redirects[position].from = from;
+    cache->redirects[position].to = to;
+    cache->redirects[position].expires = expires;
+    cache->redirect_count ++;
+}
+
+// Must be called with the cache's lock held
+void http_removeKnownRedirect(struct http_redirect_cache *cache, int index) {
+    free(cache->redirects[index].from);
+    free(cache->redirects[index].to);
+    memmove(cache->redirects + index, cache->redirects + index + 1, (cache->redirect_count - index - 1) * sizeof(struct http_known_redirect));
+    cache->redirect_count --;
+}
+
+// Must be called with the cache's lock held. Takes over `host`.
+void http_addHSTSHost(struct http_redirect_cache *cache, char *host, int includeSubdomains, int64_t expires) {
+    uint64_t hash = http_hashCacheKey(host);
+    int index = http_findHSTSHost(cache, host, hash);
+    if (index >= 0) {
+        free(host);
+        cache->hosts[index].include_subdomains = includeSubdomains;
+        cache->hosts[index].expires = expires;
+        return;
+    }
+
+    int position = http_findHashedEntry(cache->hosts, cache->host_count, sizeof(struct http_hsts_host), hash);
+    position = position >= 0 ? position : -position - 1;
+    cache->hosts = (struct http_hsts_host *) realloc(cache->hosts, (cache->host_count + 1) * sizeof(struct http_hsts_host));
+    memmove(cache->hosts + position + 1, cache->hosts + position, (cache->host_count - position) * sizeof(struct http_hsts_host));
+    cache->hosts[position].hash = hash;
+    cache->hosts[position].host = host;
+    cache->hosts[position].include_subdomains = includeSubdomains;
+    cache->hosts[position].expires = expires;
+    cache->host_count ++;
+}
+
+// Must be called with the cache's lock held
+void http_removeHSTSHost(struct http_redirect_cache *cache, int index) {
+    free(cache->hosts[index].host);
+    memmove(cache->hosts + index, cache->hosts + index + 1, (cache->host_count - index - 1) * sizeof(struct http_hsts_host));
+    cache->host_count --;
+}
+
+// Must be called with the cache's lock held. Returns 1 if https has to be used for `host` (which is lowercase):
+// it's an HSTS host, or a subdomain of one that includes its subdomains.
+int http_isHSTSHost(struct http_redirect_cache *cache, const char *host, int64_t now) {
+    for (const char *candidate = host; candidate != NULL; candidate = strchr(candidate, '.')) {
+        if (*candidate == '.') {
+            candidate ++;
+        }
+        int index = http_findHSTSHost(cache, candidate, http_hashCacheKey(candidate));
+        if (index >= 0 && cache->hosts[index].expires > now && (candidate == host || cache->hosts[index].include_subdomains)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Entries have to fit on one line of the file, between tabs
+int http_isSavableRedirectText(const char *text) {
+    return strpbrk(text, "\t\r\n") == NULL;
+}
+
+void HTTP_freeRedirectCache(struct http_redirect_cache *cache) {
+    if (cache == NULL) return;
+
+    for (int i = 0; i < cache->redirect_count; i ++) {
+        free(cache->redirects[i].from);
+        free(cache->redirects[i].to);
+    }
+    for (int i = 0; i < cache->host_count; i ++) {
+        free(cache->hosts[i].host);
+    }
+    free(cache->redirects);
+    free(cache->hosts);
+    free(cache->path);
+    #ifdef unix
+        pthread_mutex_destroy(&cache->lock);
+    #endif
+    free(cache);
+}
+
+    #ifdef unix
+
+/*
+File layout: a line with the magic, then one line for each entry that hasn't expired, with tab-separated fields:
+"redirect", expiry, from, to
+"hsts", expiry, 1 if subdomains are included (else 0), host
+*/
+
+// Must be called with the cache's lock held. Writes every unexpired entry to a new file, which replaces the old one.
+void http_saveRedirectCache(struct http_redirect_cache *cache) {
+    if (cache->path == NULL) return;
+
+    struct string_builder text = makeStringBuilder(256);
+    appendStringToBuilder(&text, redirectCacheMagic "\n");
+    int64_t now = http_redirectNow();
+    char number[32];
+    for (int i = 0; i < cache->redirect_count; i ++) {
+        struct http_known_redirect redirect = cache->redirects[i];
+        if (redirect.expires <= now) {
+            continue;
+        }
+        appendToStringBuilder(&text, number, sprintf(number, "redirect\t%lld\t", (long long) redirect.expires));
+        appendStringToBuilder(&text, redirect.from);
+        appendStringToBuilder(&text, "\t");
+        appendStringToBuilder(&text, redirect.to);
+        appendStringToBuilder(&text, "\n");
+    }
+    for (int i = 0; i < cache->host_count; i ++) {
+        struct http_hsts_host host = cache->hosts[i];
+        if (host.expires <= now) {
+            continue;
+        }
+        appendToStringBuilder(&text, number, sprintf(number, "hsts\t%lld\t%d\t", (long long) host.expires, host.include_subdomains));
+        appendStringToBuilder(&text, host.host);
+        appendStringToBuilder(&text, "\n");
+    }
+
+    // Written beside the old file and renamed over it, so there's always a whole file on disk
+    char *temporaryPath = (char *) calloc(strlen(cache->path) + 8, sizeof(char));
+    sprintf(temporaryPath, "%s.tmp", cache->path);
+    FILE *file = fopen(temporaryPath, "w");
+    if (file != NULL) {
+        int failed = fwrite(text.data, 1, text.length, file) != (size_t) text.length;
+        failed = fclose(file) || failed;
+        if (failed || rename(temporaryPath, cache->path)) {
+            unlink(temporaryPath);
+        }
+    }
+    free(temporaryPath);
+    freeStringBuilder(&text);
+}
+
+// Reads the entries saved in the file, skipping those that have expired
+void http_loadRedirectCache(struct http_redirect_cache *cache) {
+    FILE *file = fopen(cache->path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, file);
+    if (length < 0 || strcmp(line, redirectCacheMagic "\n")) {
+        free(line);
+        fclose(file);
+        return;
+    }
+
+    int64_t now = http_redirectNow();
+    while ((length = getline(&line, &capacity, file)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+
+        char *fields[4];
+        int fieldCount = 0;
+        for (char *field = line; field != NULL && fieldCount < 4; fieldCount ++) {
+            fields[fieldCount] = field;
+            field = strchr(field, '\t');
+            if (field != NULL) {
+                *field = '\0';
+                field ++;
+            }
+        }
+        if (fieldCount != 4) {
+            continue;
+        }
+
+        int64_t expires = strtoll(fields[1], NULL, 10);
+        if (expires <= now) {
+            continue;
+        }
+        if (!strcmp(fields[0], "redirect")) {
+            http_addKnownRedirect(cache, makeStrCpy(fields[2]), makeStrCpy(fields[3]), expires);
+        } else if (!strcmp(fields[0], "hsts")) {
+            http_addHSTSHost(cache, makeStrCpy(fields[3]), atoi(fields[2]), expires);
+        }
+    }
+
+    free(line);
+    fclose(file);
+}
+
+// Opens the redirect cache saved in `directory`, or the default data directory if it's NULL. If there's nowhere
+// to save it, the cache is still made, and only kept in memory.
+struct http_redirect_cache *HTTP_openRedirectCache(const char *directory) {
+    struct http_redirect_cache *cache = (struct http_redirect_cache *) calloc(1, sizeof(struct http_redirect_cache));
+    pthread_mutex_init(&cache->lock, NULL);
+
+    char *path = directory != NULL ? makeStrCpy(directory) : HTTP_defaultDataDirectory();
+    if (path != NULL && !http_makeCacheDirectory(path)) {
+        cache->path = (char *) calloc(strlen(path) + 16, sizeof(char));
+        sprintf(cache->path, "%s/redirects", path);
+        http_loadRedirectCache(cache);
+    }
+    free(path);
+
+    return cache;
+}
+
+// Returns when a permanent redirect received at `now` stops being followed without asking the server, or -1 if
+// it mustn't be remembered. Permanent redirects can be cached without Cache-Control or Expires.
+int64_t http_getPermanentRedirectExpiry(struct http_response *response, int64_t now) {
+    char *cacheControl = HTTP_getHeader(response, "cache-control");
+    if (HTTP_getHeader(response, "expires") == NULL && (cacheControl == NULL || (!http_getCacheDirective(cacheControl, "max-age", NULL) && !http_getCacheDirective(cacheControl, "no-store", NULL) && !http_getCacheDirective(cacheControl, "no-cache", NULL)))) {
+        return now + defaultPermanentRedirectLifetime;
+    }
+    return HTTP_getResponseExpiry(response, now);
+}
+
+// Remembers where `urlString` permanently redirects to, if `response` is a permanent redirect that may be cached
+void HTTP_rememberPermanentRedirect(struct http_redirect_cache *cache, char *urlString, struct http_response *response) {
+    if (cache == NULL || response->error || !response->do_redirect || (response->response_code != 301 && response->response_code != 308)) {
+        return;
+    }
+
+    int64_t now = http_redirectNow();
+    int64_t expires = http_getPermanentRedirectExpiry(response, now);
+    struct http_url *url = http_url_from_string(urlString);
+    if (expires <= now || url == NULL) {
+        HTTP_freeURL(url);
+        return;
+    }
+
+    char *from = HTTP_cacheKeyForURL(url);
+    char *to = http_resolveRelativeURL(url, urlString, response->redirect);
+    HTTP_freeURL(url);
+    if (!http_isSavableRedirectText(from) || !http_isSavableRedirectText(to) || !strcmp(from, to)) {
+        free(from);
+        free(to);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    http_addKnownRedirect(cache, from, to, expires);
+    http_saveRedirectCache(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Remembers (or forgets) the host of `urlString` as an HSTS host, if `response` came over https with a
+// Strict-Transport-Security header (which means nothing over http, since anyone could have added it)
+void HTTP_rememberStrictTransportSecurity(struct http_redirect_cache *cache, char *urlString, struct http_response *response) {
+    char *header = cache != NULL && !response->error ? HTTP_getHeader(response, "strict-transport-security") : NULL;
+    if (header == NULL) {
+        return;
+    }
+    struct http_url *url = http_url_from_string(urlString);
+    if (url == NULL || strcmp(url->protocol, "https")) {
+        HTTP_freeURL(url);
+        return;
+    }
+
+    // The directives are separated by semicolons rather than commas, but otherwise look like Cache-Control's
+    char *directives = makeStrCpy(header);
+    for (char *semicolon = strchr(directives, ';'); semicolon != NULL; semicolon = strchr(semicolon, ';')) {
+        *semicolon = ',';
+    }
+    int64_t maxAge;
+    int hasMaxAge = http_getCacheDirective(directives, "max-age", &maxAge) && maxAge >= 0;
+    int includeSubdomains = http_getCacheDirective(directives, "includesubdomains", NULL);
+    free(directives);
+
+    // IP addresses can't be HSTS hosts
+    char *host = toLowerCase(url->hostname);
+    HTTP_freeURL(url);
+    if (!hasMaxAge || strspn(host, "0123456789.") == strlen(host) || strchr(host, ':') != NULL || !http_isSavableRedirectText(host)) {
+        free(host);
+        return;
+    }
+
+    int64_t now = http_redirectNow();
+    pthread_mutex_lock(&cache->lock);
+    int index = http_findHSTSHost(cache, host, http_hashCacheKey(host));
+    if (maxAge == 0) {
+        // max-age=0 is how a server stops being an HSTS host
+        if (index >= 0) {
+            http_removeHSTSHost(cache, index);
+            http_saveRedirectCache(cache);
+        }
+        free(host);
+    } else {
+        int64_t expires = now + maxAge;
+        int changed = index < 0 || cache->hosts[index].include_subdomains != includeSubdomains || llabs(cache->hosts[index].expires - expires) >= hstsSaveInterval;
+        http_addHSTSHost(cache, host, includeSubdomains, expires);
+        if (changed) {
+            http_saveRedirectCache(cache);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Must be called with the cache's lock held. Points `url` at https if it's an http URL of an HSTS host (the fields
+// point into the URL's own buffer, so one can be pointed at a literal before it's freed). Returns 1 if it did.
+int http_upgradeHSTSURL(struct http_redirect_cache *cache, struct http_url *url, int64_t now) {
+    if (strcmp(url->protocol, "http")) {
+        return 0;
+    }
+    char *host = toLowerCase(url->hostname);
+    int isHSTS = http_isHSTSHost(cache, host, now);
+    free(host);
+    if (!isHSTS) {
+        return 0;
+    }
+
+    url->protocol = "https";
+    if (url->port == 80) {
+        url->port = 443;
+        url->has_explicit_port = 0;
+    }
+    return 1;
+}
+
+// Returns `string` as an https URL if it's an http URL of an HSTS host, or NULL if it can be asked for as it is.
+// Every request goes through this, so nothing is ever sent to an HSTS host in plain text.
+char *HTTP_upgradeToHTTPS(struct http_redirect_cache *cache, const char *string) {
+    if (cache == NULL) return NULL;
+
+    struct http_url *url = http_url_from_string((char *) string);
+    if (url == NULL) {
+        return NULL;
+    }
+
+    char *upgraded = NULL;
+    pthread_mutex_lock(&cache->lock);
+    if (http_upgradeHSTSURL(cache, url, http_redirectNow())) {
+        upgraded = http_urlToString(url);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    HTTP_freeURL(url);
+    return upgraded;
+}
+
+// Returns the URL that `string` is known to end up at through remembered permanent redirects, or NULL if it has to
+// be asked for as it is. A fragment is kept, unless the target has one of its own. Redirects are looked up as
+// they'll actually be requested, so after any upgrade to https (see HTTP_upgradeToHTTPS).
+char *HTTP_followKnownRedirects(struct http_redirect_cache *cache, const char *string) {
+    if (cache == NULL) return NULL;
+
+    char *current = makeStrCpy(string);
+    int changed = 0;
+    int64_t now = http_redirectNow();
+    pthread_mutex_lock(&cache->lock);
+    for (int hop = 0; hop < maxKnownRedirectHops; hop ++) {
+        struct http_url *url = http_url_from_string(current);
+        if (url == NULL) {
+            break;
+        }
+
+        char *next = NULL;
+        http_upgradeHSTSURL(cache, url, now);
+        if (!strcmp(url->protocol, "http") || !strcmp(url->protocol, "https")) {
+            char *key = HTTP_cacheKeyForURL(url);
+            int index = http_findKnownRedirect(cache, key, http_hashCacheKey(key));
+            if (index >= 0 && cache->redirects[index].expires <= now) {
+                http_removeKnownRedirect(cache, index);
+            } else if (index >= 0) {
+                const char *to = cache->redirects[index].to;
+                int keepFragment = url->had_explicit_fragment && strchr(to, '#') == NULL;
+                next = (char *) calloc(strlen(to) + strlen(url->fragment) + 2, sizeof(char));
+                sprintf(next, keepFragment ? "%s#%s" : "%s", to, url->fragment);
+            }
+            free(key);
+        }
+        HTTP_freeURL(url);
+
+        if (next == NULL) {
+            break;
+        }
+        free(current);
+        current = next;
+        changed = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!changed) {
+        free(current);
+        return NULL;
+    }
+    return current;
+}
+
+    #else
+
+struct http_redirect_cache *HTTP_openRedirectCache(const char *_directory) {
+    return NULL;
+}
+
+void HTTP_rememberPermanentRedirect(struct http_redirect_cache *_cache, char *_urlString, struct http_response *_response) { }
+
+void HTTP_rememberStrictTransportSecurity(struct http_redirect_cache *_cache, char *_urlString, struct http_response *_response) { }
+
+char *HTTP_upgradeToHTTPS(struct http_redirect_cache *_cache, const char *_string) {
+    return NULL;
+}
+
+char *HTTP_followKnownRedirects(struct http_redirect_cache *_cache, const char *_string) {
+    return NULL;
+}
+
+    #endif
+#endif
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdint.h>
 
 #include "../utils/string.h"
 
@@ -23,16 +24,6 @@ enum _http_internal_header_type {
     HEADER_ONLY_NAME,
 };
 
-enum _http_internal_response_parser_state {
-    PARSE_HTTP_VERSION,
-    PARSE_HTTP_STATUS,
-    PARSE_HTTP_STATUS_NAME,
-    PARSE_HTTP_HEADER_NAME,
-    PARSE_HTTP_HEADER_SEPARATOR,
-    PARSE_HTTP_HEADER_VALUE,
-    PARSE_HTTP_BODY,
-};
-
 struct http_header {
     char *name;
     char *value;
@@ -41,7 +32,7 @@ struct http_header {
 
 struct http_data {
     char *data;
-    int length;
+    int64_t length;
 };
 
 struct http_response {
@@ -52,11 +43,15 @@ struct http_response {
     struct http_data response_body;
     int is_chunked;
     int is_html;
-    int content_length;
+    // -2 if there's no Content-Length
+    int64_t content_length;
     char *redirect;
     int do_redirect;
     int has_body;
     int error;
+
+    // The status line and headers; `response_description`, `redirect` and the header names/values point into it
+    char *raw_headers;
 };
 
 struct http_response HTTP_responseFromString(char *string, int is_html) {
@@ -66,7 +61,8 @@ struct http_response HTTP_responseFromString(char *string, int is_html) {
 
     struct http_response res;
     res.response_code = 200;
-    res.response_description = makeStrCpy("OK");
+    res.raw_headers = makeStrCpy("OK");
+    res.response_description = res.raw_headers;
     res.num_headers = 0;
     res.headers = NULL;
     res.response_body = data;
@@ -81,6 +77,142 @@ struct http_response HTTP_responseFromString(char *string, int is_html) {
     return res;
 }
 
+// Compares header names (or other tokens) case-insensitively
+int HTTP_equalsIgnoreCase(const char *a, const char *b) {
+    for (; *a && *b; a ++, b ++) {
+        char lowerA = (*a >= 'A' && *a <= 'Z') ? *a + 32 : *a;
+        char lowerB = (*b >= 'A' && *b <= 'Z') ? *b + 32 : *b;
+        if (lowerA != lowerB) return 0;
+    }
+    return *a == *b;
+}
+
+int HTTP_startsWithIgnoreCase(const char *text, const char *prefix) {
+    for (; *prefix; text ++, prefix ++) {
+        char lowerText = (*text >= 'A' && *text <= 'Z') ? *text + 32 : *text;
+        char lowerPrefix = (*prefix >= 'A' && *prefix <= 'Z') ? *prefix + 32 : *prefix;
+        if (!*text || lowerText != lowerPrefix) return 0;
+    }
+    return 1;
+}
+
+int HTTP_containsIgnoreCase(const char *text, const char *part) {
+    for (; *text; text ++) {
+        if (HTTP_startsWithIgnoreCase(text, part)) return 1;
+    }
+    return 0;
+}
+
+// Returns the value of the first header called `name` (case-insensitive), or NULL
+char *HTTP_getHeader(struct http_response *response, const char *name) {
+    for (int i = 0; i < response->num_headers; i ++) {
+        if (HTTP_equalsIgnoreCase(response->headers[i].name, name)) {
+            return response->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+// Bodies of file:// responses are mapped from the file instead of being allocated. They're kept track of here, so
+// that HTTP_freeResponse knows to unmap them.
+    #ifdef unix
+        #include <pthread.h>
+        #include <string.h>
+        #include <sys/mman.h>
+
+        struct http_mapped_body {
+            char *data;
+            // Of the whole mapping, which goes past the end of the body
+            size_t length;
+        };
+
+        struct http_mapped_body *http_mappedBodies = NULL;
+        int http_mappedBodyCount = 0;
+        pthread_mutex_t http_mappedBodiesLock = PTHREAD_MUTEX_INITIALIZER;
+
+        void HTTP_addMappedBody(char *data, size_t length) {
+            pthread_mutex_lock(&http_mappedBodiesLock);
+            http_mappedBodies = (struct http_mapped_body *) realloc(http_mappedBodies, (http_mappedBodyCount + 1) * sizeof(struct http_mapped_body));
+            http_mappedBodies[http_mappedBodyCount].data = data;
+            http_mappedBodies[http_mappedBodyCount].length = length;
+            http_mappedBodyCount ++;
+            pthread_mutex_unlock(&http_mappedBodiesLock);
+        }
+
+        int http_isMappedBody(char *data) {
+            int mapped = 0;
+            pthread_mutex_lock(&http_mappedBodiesLock);
+            for (int i = 0; i < http_mappedBodyCount && !mapped; i ++) {
+                mapped = http_mappedBodies[i].data == data;
+            }
+            pthread_mutex_unlock(&http_mappedBodiesLock);
+            return mapped;
+        }
+
+        // Unmaps `data` if it's a mapped body. Returns 0 if it isn't (so it has to be freed instead).
+        int http_releaseMappedBody(char *data) {
+            if (data == NULL) return 0;
+
+            size_t length = 0;
+            pthread_mutex_lock(&http_mappedBodiesLock);
+            for (int i = 0; i < http_mappedBodyCount; i ++) {
+                if (http_mappedBodies[i].data == data) {
+                    length = http_mappedBodies[i].length;
+                    http_mappedBodies[i] = http_mappedBodies[http_mappedBodyCount - 1];
+                    http_mappedBodyCount --;
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&http_mappedBodiesLock);
+
+            if (!length) {
+                return 0;
+            }
+            munmap(data, length);
+            return 1;
+        }
+
+    #else
+
+        int http_isMappedBody(char *_data) {
+            return 0;
+        }
+
+        int http_releaseMappedBody(char *_data) {
+            return 0;
+        }
+
+    #endif
+
+// Takes the body out of the response, as an allocated string the caller frees (copied if it was mapped)
+char *HTTP_takeResponseBody(struct http_response *response) {
+    char *body = response->response_body.data;
+    response->response_body.data = NULL;
+    if (!http_isMappedBody(body)) {
+        return body;
+    }
+
+    char *copy = (char *) calloc(response->response_body.length + 1, sizeof(char));
+    memcpy(copy, body, response->response_body.length);
+    http_releaseMappedBody(body);
+    return copy;
+}
+
+void HTTP_freeResponse(struct http_response *response) {
+    free(response->raw_headers);
+    free(response->headers);
+    if (!http_releaseMappedBody(response->response_body.data)) {
+        free(response->response_body.data);
+    }
+    response->raw_headers = NULL;
+    response->response_description = NULL;
+    response->redirect = NULL;
+    response->headers = NULL;
+    response->num_headers = 0;
+    response->response_body.data = NULL;
+    response->response_body.length = 0;
+}
+
 // error codes:
 /*
 0: no error
@@ -90,6 +222,7 @@ struct http_response HTTP_responseFromString(char *string, int is_html) {
 4: URL parse error
 5: Failed to lookup host
 6: Error while obtaining host IP
+195: not an HTTP response
 */
 
 /*
@@ -97,201 +230,241 @@ A content length of -1 indicates an error.
 A content length of -2 indicates a response where the Content-Length header was not present (possibly chunked).
 */
 
-struct http_response parsePossiblyIncompleteHTTPResponse(struct http_data rawResponse, char *expectedVersion) {
+// Offsets into the data being parsed, so they stay valid when the receive buffer is reallocated
+struct http_header_span {
+    int name_start;
+    int name_length;
+    // -1 for a header without a value
+    int value_start;
+    int value_length;
+};
+
+// Parses the status line and headers as they arrive. Each call carries on from where the last one
+// stopped, and nothing is copied until the headers are complete (see HTTP_finishResponseParser).
+struct http_response_parser {
+    // Everything before this offset has been parsed
+    int offset;
+    int finished;
+    int error;
+
+    int response_code;
+    int description_start;
+    int description_length;
+
+    struct http_header_span *spans;
+    int num_spans;
+    int spans_capacity;
+
+    // Where the body starts, once finished
+    int body_start;
+};
+
+struct http_response_parser HTTP_makeResponseParser() {
+    struct http_response_parser parser;
+    parser.offset = 0;
+    parser.finished = 0;
+    parser.error = 0;
+    parser.response_code = 0;
+    parser.description_start = 0;
+    parser.description_length = 0;
+    parser.spans = NULL;
+    parser.num_spans = 0;
+    parser.spans_capacity = 0;
+    parser.body_start = 0;
+
+    return parser;
+}
+
+void HTTP_freeResponseParser(struct http_response_parser *parser) {
+    free(parser->spans);
+    parser->spans = NULL;
+    parser->num_spans = 0;
+    parser->spans_capacity = 0;
+}
+
+int http_parseStatusLine(struct http_response_parser *parser, const char *line, int length, const char *expectedVersion) {
+    int versionLength = strlen(expectedVersion);
+    if (length < 5 || strncmp(line, "HTTP/", 5)) {
+        return 195;
+    }
+    if (length < 5 + versionLength || strncmp(line + 5, expectedVersion, versionLength)) {
+        return 2;
+    }
+
+    int i = 5 + versionLength;
+    if (i >= length || line[i] != ' ') {
+        return 1;
+    }
+    i ++;
+
+    int code = 0;
+    for (int j = 0; j < 3; j ++, i ++) {
+        if (i >= length || line[i] < '0' || line[i] > '9') {
+            return 3;
+        }
+        code = code * 10 + line[i] - '0';
+    }
+    // The reason phrase is optional
+    if (i < length && line[i] != ' ') {
+        return 3;
+    }
+    if (i < length) i ++;
+
+    parser->response_code = code;
+    parser->description_start = i;
+    parser->description_length = length - i;
+    return 0;
+}
+
+void http_addHeaderSpan(struct http_response_parser *parser, const char *data, int lineStart, int lineLength) {
+    if (parser->num_spans == parser->spans_capacity) {
+        parser->spans_capacity = parser->spans_capacity ? parser->spans_capacity * 2 : 16;
+        parser->spans = (struct http_header_span *) realloc(parser->spans, sizeof(struct http_header_span) * parser->spans_capacity);
+    }
+
+    struct http_header_span span;
+    span.name_start = lineStart;
+    span.value_start = -1;
+    span.value_length = 0;
+
+    const char *colon = (const char *) memchr(data + lineStart, ':', lineLength);
+    int nameEnd = colon ? colon - data : lineStart + lineLength;
+    while (nameEnd > lineStart && (data[nameEnd - 1] == ' ' || data[nameEnd - 1] == '\t')) nameEnd --;
+    span.name_length = nameEnd - lineStart;
+
+    if (colon) {
+        int valueStart = colon - data + 1;
+        int valueEnd = lineStart + lineLength;
+        while (valueStart < valueEnd && (data[valueStart] == ' ' || data[valueStart] == '\t')) valueStart ++;
+        while (valueEnd > valueStart && (data[valueEnd - 1] == ' ' || data[valueEnd - 1] == '\t')) valueEnd --;
+        span.value_start = valueStart;
+        span.value_length = valueEnd - valueStart;
+    }
+
+    parser->spans[parser->num_spans] = span;
+    parser->num_spans ++;
+}
+
+// Parses a Content-Length value. Returns -1 unless it's a whole number of bytes that fits in 64 bits.
+int64_t http_parseContentLength(const char *value, int length) {
+    if (length == 0) {
+        return -1;
+    }
+    int64_t contentLength = 0;
+    for (int i = 0; i < length; i ++) {
+        if (value[i] < '0' || value[i] > '9' || contentLength > (INT64_MAX - (value[i] - '0')) / 10) {
+            return -1;
+        }
+        contentLength = contentLength * 10 + value[i] - '0';
+    }
+    return contentLength;
+}
+
+// Parses any complete lines in `data` (all of the response received so far) that haven't been parsed yet.
+// Returns 1 once the headers are complete, 0 if more data is needed; errors are stored in `parser->error`.
+int HTTP_continueResponseParser(struct http_response_parser *parser, const char *data, int64_t length, const char *expectedVersion) {
+    while (!parser->finished && !parser->error) {
+        const char *newline = (const char *) memchr(data + parser->offset, '\n', length - parser->offset);
+        if (newline == NULL) {
+            // Fail early on something that can't be an HTTP response
+            if (parser->offset == 0) {
+                int available = length < 5 ? length : 5;
+                if (strncmp(data, "HTTP/", available)) {
+                    parser->error = 195;
+                }
+            }
+            break;
+        }
+
+        int lineStart = parser->offset;
+        int lineLength = newline - (data + lineStart);
+        if (lineLength > 0 && data[lineStart + lineLength - 1] == '\r') lineLength --;
+        parser->offset = newline - data + 1;
+
+        if (lineStart == 0) {
+            parser->error = http_parseStatusLine(parser, data, lineLength, expectedVersion);
+        } else if (lineLength == 0) {
+            parser->finished = 1;
+            parser->body_start = parser->offset;
+        } else {
+            http_addHeaderSpan(parser, data, lineStart, lineLength);
+
+            // The body's length is trusted from here on, so one that isn't a number makes the response malformed
+            struct http_header_span span = parser->spans[parser->num_spans - 1];
+            if (span.name_length == 14 && HTTP_startsWithIgnoreCase(data + span.name_start, "content-length") && (span.value_start == -1 || http_parseContentLength(data + span.value_start, span.value_length) == -1)) {
+                parser->error = 1;
+            }
+        }
+    }
+
+    return parser->finished;
+}
+
+// Turns a finished parser into a response. The status line and headers are copied in one go;
+// the rest of `data` becomes the start of the body.
+struct http_response HTTP_finishResponseParser(struct http_response_parser *parser, const char *data, int64_t length) {
     struct http_response response;
     response.error = 0;
+    response.response_code = parser->response_code;
     response.is_chunked = 0;
     response.is_html = 0;
-    response.content_length = -1;
+    response.content_length = -2;
     response.redirect = NULL;
     response.do_redirect = 0;
-    response.has_body = 0;
+    response.has_body = 1;
 
-    if (rawResponse.length < 7 || strncmp(rawResponse.data, "HTTP/", 5)) {
-        response.error = 195;
-        return response;
-    }
+    char *block = (char *) calloc(parser->body_start + 1, sizeof(char));
+    memcpy(block, data, parser->body_start);
+    response.raw_headers = block;
 
-    struct http_data response_body;
-    response_body.length = 0;
-    response_body.data = "";
-
-    char *statusCode = (char *) calloc(5, sizeof(char));
-    char *statusName = (char *) calloc(rawResponse.length - 7, sizeof(char));
-    char *body = (char *) calloc(rawResponse.length - 7, sizeof(char));
-    int bodyLength = 0;
-    struct http_header *headers = (struct http_header *) calloc(0, sizeof(struct http_header));
-
-    int currentState = PARSE_HTTP_VERSION;
-    int currentIndex = 0;
-    int numHeaders = 0;
-    int contentLengthNotReturned = 1;
-    for (int i = 0; i < rawResponse.length; i ++) {
-        char curChar = rawResponse.data[i];
-
-        char nextChar;
-        if (i + 1 < rawResponse.length) {
-            nextChar = rawResponse.data[i + 1];
-        } else {
-            nextChar = '\0';
-        }
-        switch(currentState) {
-            case PARSE_HTTP_VERSION:
-                if (currentIndex == 0) {
-                    if (strncmp(rawResponse.data + i, "HTTP/", 5)) {
-                        response.error = 1;
-                        return response;
-                    } else {
-                        i += 5;
-                        currentIndex = 5;
-                    }
-                } else if (currentIndex == 5) {
-                    if (strncmp(rawResponse.data + i, expectedVersion, 3)) {
-                        response.error = 2;
-                        return response;
-                    } else {
-                        i += 3;
-                        currentIndex = 8;
-                    }
-                } else if (currentIndex == 8) {
-                    if (curChar != ' ') {
-                        response.error = 1;
-                        return response;
-                    } else {
-                        currentState = PARSE_HTTP_STATUS;
-                        currentIndex = 0;
-                    }
-                }
-                break;
-            case PARSE_HTTP_STATUS:
-                if (currentIndex == 4) {
-                    if (curChar == ' ') {
-                        currentState = PARSE_HTTP_STATUS_NAME;
-                        currentIndex = 0;
-                        break;
-                    } else {
-                        response.error = 3;
-                        return response;
-                    }
-                }
-                if (curChar < '0' || curChar > '9') {
-                    response.error = 3;
-                    return response;
-                }
-                statusCode[strlen(statusCode)] = curChar;
-                break;
-            case PARSE_HTTP_STATUS_NAME:
-                if (curChar == '\n') {
-                    currentState = PARSE_HTTP_HEADER_NAME;
-                    currentIndex = 0;
-                    break;
-                }
-                statusName[strlen(statusName)] = curChar;
-                break;
-            case PARSE_HTTP_HEADER_NAME:
-                if (curChar == '\r' && nextChar == '\n') {
-                    if (currentIndex == 1) {
-                        currentState = PARSE_HTTP_BODY;
-                        currentIndex = 0;
-                        response.has_body = 1;
-                        i ++; // CR+LF
-                        break;
-                    } else {
-                        headers[numHeaders - 1].type = HEADER_ONLY_NAME;
-                        currentState = PARSE_HTTP_HEADER_NAME;
-                        currentIndex = 0;
-                        i ++;
-                        break;
-                    }
-                }
-                if (curChar == ':') {
-                    headers[numHeaders - 1].type = HEADER_NAME_VALUE;
-                    currentState = PARSE_HTTP_HEADER_SEPARATOR;
-                    currentIndex = 0;
-                    break;
-                }
-                int header_index = numHeaders - 1;
-                if (currentIndex == 1) {
-                    numHeaders ++;
-                    header_index = numHeaders - 1;
-                    headers = (struct http_header *) realloc(headers, sizeof(struct http_header) * numHeaders);
-                    headers[header_index].name = (char *) calloc(rawResponse.length - 7, sizeof(char));
-                    headers[header_index].value = NULL;
-                }
-                char *nameString = headers[header_index].name;
-                nameString[strlen(nameString)] = curChar;
-                break;
-            case PARSE_HTTP_HEADER_SEPARATOR:
-                if (curChar == ' ') {
-                    currentState = PARSE_HTTP_HEADER_SEPARATOR;
-                    // setting currentindex is unnecessary here
-                } else {
-                    i = i - 1;
-                    currentState = PARSE_HTTP_HEADER_VALUE;
-                    currentIndex = 0;
-                }
-                break;
-            case PARSE_HTTP_HEADER_VALUE:
-                if (curChar == '\r' && nextChar == '\n') {
-                    char *lowerName = HTTP_toLowerCase(headers[numHeaders - 1].name);
-
-                    if (!strcmp(lowerName, "transfer-encoding")) {
-                        if (!strcmp(headers[numHeaders - 1].value, "chunked")) {
-                            response.is_chunked = 1;
-                        }
-                    }
-                    if (!strcmp(lowerName, "content-type")) {
-                        if (!strncmp(headers[numHeaders - 1].value, "text/html", 9)) {
-                            response.is_html = 1;
-                        }
-                    }
-                    if (!strcmp(lowerName, "content-length")) {
-                        response.content_length = atoi(headers[numHeaders - 1].value);
-                        contentLengthNotReturned = 0;
-                    }
-                    if (!strcmp(lowerName, "location")) {
-                        int stat = atoi(statusCode);
-                        if (stat == 301 || stat == 302 || stat == 303 || stat == 307 || stat == 308) {
-                            response.redirect = headers[numHeaders - 1].value;
-                            response.do_redirect = 1;
-                        }
-                    }
-                    free(lowerName);
-                    currentState = PARSE_HTTP_HEADER_NAME;
-                    currentIndex = 0;
-                    i ++; // aaagh CR+LF
-                    break;
-                }
-                int value_index = numHeaders - 1;
-                if (currentIndex == 1) {
-                    headers[header_index].value = (char *) calloc(rawResponse.length - 7, sizeof(char));
-                }
-                char *valueString = headers[value_index].value;
-                valueString[strlen(valueString)] = curChar;
-                break;
-            case PARSE_HTTP_BODY:
-                body[bodyLength] = curChar;
-                bodyLength ++;
-                break;
-        }
-        currentIndex ++;
-    }
+    // Each name, value and the description end just before a separator or line ending, which can be overwritten
+    block[parser->description_start + parser->description_length] = '\0';
+    response.response_description = block + parser->description_start;
+
+    response.num_headers = parser->num_spans;
+    response.headers = (struct http_header *) calloc(parser->num_spans + 1, sizeof(struct http_header));
+    for (int i = 0; i < parser->num_spans; i ++) {
+        struct http_header_span span = parser->spans[i];
+        struct http_header *header = &response.headers[i];
 
-    response.response_code = atoi(statusCode);
-    free(statusCode);
+        block[span.name_start + span.name_length] = '\0';
+        header->name = block + span.name_start;
+        if (span.value_start == -1) {
+            header->value = NULL;
+            header->type = HEADER_ONLY_NAME;
+            continue;
+        }
+        block[span.value_start + span.value_length] = '\0';
+        header->value = block + span.value_start;
+        header->type = HEADER_NAME_VALUE;
 
-    response.response_description = statusName;
-    if (contentLengthNotReturned) {
-        response.content_length = -2;
+        // Chunked has to be the last transfer coding applied
+        int valueLength = span.value_length;
+        if (HTTP_equalsIgnoreCase(header->name, "transfer-encoding") && valueLength >= 7 && HTTP_equalsIgnoreCase(header->value + valueLength - 7, "chunked")) {
+            response.is_chunked = 1;
+        }
+        if (HTTP_equalsIgnoreCase(header->name, "content-type") && HTTP_startsWithIgnoreCase(header->value, "text/html")) {
+            response.is_html = 1;
+        }
+        if (HTTP_equalsIgnoreCase(header->name, "content-length")) {
+            response.content_length = http_parseContentLength(header->value, span.value_length);
+        }
+        if (HTTP_equalsIgnoreCase(header->name, "location")) {
+            int code = response.response_code;
+            if (code == 301 || code == 302 || code == 303 || code == 307 || code == 308) {
+                response.redirect = header->value;
+                response.do_redirect = 1;
+            }
+        }
     }
-    response.headers = headers;
-    response.num_headers = numHeaders;
 
+    int64_t bodyLength = length - parser->body_start;
+    response.response_body.data = (char *) calloc(bodyLength + 1, sizeof(char));
+    memcpy(response.response_body.data, data + parser->body_start, bodyLength);
+    response.response_body.length = bodyLength;
 
-    response_body.data = body;
-    response_body.length = bodyLength;
+    HTTP_freeResponseParser(parser);
 
-    response.response_body = response_body;
     return response;
 }
 
@@ -0,0 +1,89 @@
+// Time limits for each phase of a request. A server that accepts the connection and then goes quiet would
+// otherwise hold the request (and whoever is waiting for it) forever. Each phase reports its own error code:
+/*
+180: DNS lookup timed out
+181: Connecting timed out
+182: TLS handshake timed out
+183: No response from the server (time to first byte)
+184: The response stalled (too long between two reads)
+185: The whole request took longer than its budget
+*/
+// A thread can also limit how large a body it's willing to receive (see HTTP_setBodyLimitOnThread):
+/*
+188: The body was larger than the calling thread's limit
+*/
+
+#ifndef _HTTP_TIMEOUTS
+    #define _HTTP_TIMEOUTS 1
+
+    #include "../socket/common.h"
+
+// Milliseconds; 0 means no limit
+struct http_timeouts {
+    int dns;
+    int connect;
+    int handshake;
+    int first_byte;
+    int stall;
+    // From the DNS lookup to the end of the body, including any connect attempts
+    int request;
+
+    // Connecting is tried this many times in all; the wait before each retry starts at `retry_delay` and doubles
+    int connect_attempts;
+    int retry_delay;
+};
+
+struct http_timeouts HTTP_timeouts = {
+    10000,
+    10000,
+    10000,
+    30000,
+    30000,
+    0,
+    2,
+    250,
+};
+
+// Bytes; 0 means no limit. Set by threads working in the background (such as speculative loads), which give up on
+// a response as soon as it's too large to keep rather than receiving all of it first.
+__thread int64_t http_bodyLimit = 0;
+
+void HTTP_setBodyLimitOnThread(int64_t limit) {
+    http_bodyLimit = limit;
+}
+
+// Returns 1 if `length` bytes of body (received or decoded) are more than the calling thread accepts
+int HTTP_isOverBodyLimit(int64_t length) {
+    return http_bodyLimit > 0 && length > http_bodyLimit;
+}
+
+void HTTP_setTimeouts(struct http_timeouts timeouts) {
+    HTTP_timeouts = timeouts;
+}
+
+struct http_timeouts HTTP_getTimeouts() {
+    return HTTP_timeouts;
+}
+
+// The deadline for a whole request that starts now
+long long HTTP_requestDeadline() {
+    return socket_deadlineAfter(HTTP_timeouts.request);
+}
+
+// Maps a socket error from a read (or the write before it) to an HTTP error code. `timeoutError` is reported
+// if the step's own deadline passed (183 before anything was received, 184 after).
+int HTTP_readError(int socketError, int timeoutError) {
+    switch (socketError) {
+        case SOCKET_CANCELLED:
+            return 190;
+        case SOCKET_TIMED_OUT:
+            return timeoutError;
+        case SOCKET_EXPIRED:
+            return 185;
+        case SOCKET_NO_MEMORY:
+            return 189;
+    }
+    return 200;
+}
+
+#endif
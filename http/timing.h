@@ -0,0 +1,390 @@
+// Timing of page loads, shown by about:timing. Each request records when its phases ended (DNS, connecting,
+// the TLS handshake, the first byte of the response), and the stages of turning the page into text are timed
+// too. Only the last navigation is kept.
+
+#ifndef _HTTP_TIMING
+    #define _HTTP_TIMING 1
+
+    #include <pthread.h>
+    #include <stdint.h>
+    #include <stdio.h>
+    #include <stdlib.h>
+    #include <string.h>
+
+    #include "../socket/common.h"
+    #include "../utils/string.h"
+
+// Later requests and stages of a navigation aren't recorded
+    #define maxTimingRequests 256
+    #define maxTimingStages 16
+// Columns of the waterfall in about:timing
+    #define timingWaterfallWidth 64
+
+// The phases of a request, in the order they happen
+enum http_timing_phase {
+    HTTP_TIMING_DNS,
+    HTTP_TIMING_CONNECT,
+    HTTP_TIMING_HANDSHAKE,
+    HTTP_TIMING_FIRST_BYTE,
+    HTTP_TIMING_PHASES,
+};
+
+struct http_timing {
+    char *url;
+
+    // Microseconds (see socket_nowMicroseconds). A phase that didn't happen (e.g. connecting, on a reused
+    // connection) is 0.
+    long long start;
+    long long phases[HTTP_TIMING_PHASES];
+    long long end;
+
+    // Bytes read from the network (headers included), and the size of the body once decoded
+    int64_t received;
+    int64_t size;
+
+    int reused;
+    int http2;
+    // Answered from the disk cache
+    int cached;
+    int error;
+};
+
+struct http_timing_stage {
+    // Not copied, so it has to be a string literal
+    const char *name;
+    long long start;
+    long long end;
+
+    // Stages that happen in bursts (such as applying CSS) add up the time spent in each
+    long long busy;
+    long long burst_start;
+};
+
+struct http_timing_log {
+    // NULL until a navigation starts; nothing is recorded before then
+    char *url;
+    long long start;
+
+    struct http_timing requests[maxTimingRequests];
+    int request_count;
+
+    struct http_timing_stage stages[maxTimingStages];
+    int stage_count;
+};
+
+// Requests are recorded from any thread; stages only from the one loading the page
+struct http_timing_log HTTP_timingLog;
+pthread_mutex_t HTTP_timingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The request that the calling thread is making (NULL if none), whose phases HTTP_markTiming sets
+__thread struct http_timing *http_currentTiming = NULL;
+// Set by threads working in the background (such as speculative loads), which aren't part of the navigation
+__thread int http_timingIgnored = 0;
+
+void HTTP_ignoreTimingOnThread() {
+    http_timingIgnored = 1;
+}
+
+struct http_timing HTTP_makeTiming(char *url) {
+    struct http_timing timing;
+    memset(&timing, 0, sizeof(timing));
+    timing.url = url;
+    timing.start = socket_nowMicroseconds();
+
+    return timing;
+}
+
+// Makes `timing` (or NULL) the calling thread's current request. Returns the one it replaces.
+struct http_timing *HTTP_setCurrentTiming(struct http_timing *timing) {
+    struct http_timing *previous = http_currentTiming;
+    http_currentTiming = timing;
+    return previous;
+}
+
+// Sets when a phase of the current request ended. Only the first time counts, so a request that has to
+// connect again (to resume a body, say) keeps the times of its first connection.
+void HTTP_markTimingAt(enum http_timing_phase phase, long long time) {
+    if (http_currentTiming != NULL && !http_currentTiming->phases[phase]) {
+        http_currentTiming->phases[phase] = time;
+    }
+}
+
+void HTTP_markTiming(enum http_timing_phase phase) {
+    HTTP_markTimingAt(phase, socket_nowMicroseconds());
+}
+
+void HTTP_countTimingBytes(int64_t bytes) {
+    if (http_currentTiming != NULL && bytes > 0) {
+        http_currentTiming->received += bytes;
+    }
+}
+
+void HTTP_setTimingConnection(int reused, int http2) {
+    if (http_currentTiming != NULL) {
+        http_currentTiming->reused = reused;
+        http_currentTiming->http2 = http2;
+    }
+}
+
+void HTTP_setTimingCached() {
+    if (http_currentTiming != NULL) {
+        http_currentTiming->cached = 1;
+    }
+}
+
+// Ends a request and adds it to the log. `size` is the length of the body (ignored if there's an error).
+void HTTP_recordTiming(struct http_timing *timing, int error, int64_t size) {
+    timing->end = socket_nowMicroseconds();
+    timing->error = error;
+    timing->size = error ? 0 : size;
+    if (http_timingIgnored) {
+        return;
+    }
+
+    pthread_mutex_lock(&HTTP_timingLock);
+    if (HTTP_timingLog.url != NULL && HTTP_timingLog.request_count < maxTimingRequests) {
+        struct http_timing *recorded = &HTTP_timingLog.requests[HTTP_timingLog.request_count];
+        *recorded = *timing;
+        recorded->url = makeStrCpy(timing->url);
+        HTTP_timingLog.request_count ++;
+    }
+    pthread_mutex_unlock(&HTTP_timingLock);
+}
+
+// Throws away the last log and starts timing a navigation to `url`. Opening about:timing itself keeps the log
+// of the page before it, which is what it shows.
+void HTTP_beginTimingLog(char *url) {
+    if (!strcmp(url, "about:timing")) {
+        return;
+    }
+
+    pthread_mutex_lock(&HTTP_timingLock);
+    for (int i = 0; i < HTTP_timingLog.request_count; i ++) {
+        free(HTTP_timingLog.requests[i].url);
+    }
+    free(HTTP_timingLog.url);
+    HTTP_timingLog.url = makeStrCpy(url);
+    HTTP_timingLog.start = socket_nowMicroseconds();
+    HTTP_timingLog.request_count = 0;
+    HTTP_timingLog.stage_count = 0;
+    pthread_mutex_unlock(&HTTP_timingLock);
+}
+
+// Returns 1 if stages of a navigation are timed on the calling thread
+int HTTP_isTimingStages() {
+    return !http_timingIgnored;
+}
+
+// Must be called with HTTP_timingLock held. Returns the index of the stage called `name`, adding it (as starting
+// at `now`) if it's new, or -1 if it can't be recorded.
+int http_findTimingStage(const char *name, long long now) {
+    int index = -1;
+    for (int i = 0; i < HTTP_timingLog.stage_count; i ++) {
+        if (!strcmp(HTTP_timingLog.stages[i].name, name)) {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1 && HTTP_timingLog.url != NULL && HTTP_timingLog.stage_count < maxTimingStages) {
+        index = HTTP_timingLog.stage_count;
+        HTTP_timingLog.stage_count ++;
+
+        struct http_timing_stage *stage = &HTTP_timingLog.stages[index];
+        stage->name = name;
+        stage->start = now;
+        stage->end = 0;
+        stage->busy = 0;
+    }
+    return index;
+}
+
+// Starts (or, for a stage that was timed before, resumes) a stage of the navigation. Returns the index to give
+// to HTTP_finishTimingStage.
+int HTTP_startTimingStage(const char *name) {
+    if (http_timingIgnored) {
+        return -1;
+    }
+    long long now = socket_nowMicroseconds();
+
+    pthread_mutex_lock(&HTTP_timingLock);
+    int index = http_findTimingStage(name, now);
+    if (index != -1) {
+        HTTP_timingLog.stages[index].burst_start = now;
+    }
+    pthread_mutex_unlock(&HTTP_timingLock);
+
+    return index;
+}
+
+void HTTP_finishTimingStage(int index) {
+    if (index < 0) {
+        return;
+    }
+    long long now = socket_nowMicroseconds();
+
+    pthread_mutex_lock(&HTTP_timingLock);
+    // The log may have been started again in the meantime
+    if (index < HTTP_timingLog.stage_count) {
+        struct http_timing_stage *stage = &HTTP_timingLog.stages[index];
+        stage->end = now;
+        stage->busy += now - stage->burst_start;
+    }
+    pthread_mutex_unlock(&HTTP_timingLock);
+}
+
+// Records a stage that the caller timed itself, for stages made of many short bursts (such as matching CSS rules
+// for each element), which would otherwise take the lock for every one. `busy` is the time spent in it between
+// `start` and `end`.
+void HTTP_recordTimingStage(const char *name, long long start, long long end, long long busy) {
+    if (http_timingIgnored || end == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&HTTP_timingLock);
+    int index = http_findTimingStage(name, start);
+    if (index != -1) {
+        struct http_timing_stage *stage = &HTTP_timingLog.stages[index];
+        stage->end = end;
+        stage->busy += busy;
+    }
+    pthread_mutex_unlock(&HTTP_timingLock);
+}
+
+// The column of the waterfall that `time` falls in
+int http_timingColumn(long long time, long long start, long long span) {
+    int column = (int) ((time - start) * timingWaterfallWidth / span);
+    return column < 0 ? 0 : column >= timingWaterfallWidth ? timingWaterfallWidth - 1 : column;
+}
+
+// Fills the columns from `from` to `to` with `mark`. Something that happened at all takes at least one column.
+void http_drawTimingBar(char *bar, long long from, long long to, long long start, long long span, char mark) {
+    int first = http_timingColumn(from, start, span);
+    int last = http_timingColumn(to, start, span);
+    for (int i = first; i <= last; i ++) {
+        bar[i] = mark;
+    }
+}
+
+// Writes milliseconds (or "-" for a phase that didn't happen) right-aligned in `width` characters
+int http_printTimingDuration(char *text, int width, long long microseconds, int happened) {
+    if (!happened) {
+        return sprintf(text, "%*s", width, "-");
+    }
+    return sprintf(text, "%*.1f", width, microseconds / 1000.0);
+}
+
+// The text of about:timing: a waterfall of the requests of the last navigation, then its stages
+char *HTTP_formatTimingLog() {
+    pthread_mutex_lock(&HTTP_timingLock);
+    struct http_timing_log *log = &HTTP_timingLog;
+
+    if (log->url == NULL) {
+        pthread_mutex_unlock(&HTTP_timingLock);
+        return makeStrCpy("No page has been loaded yet.\n");
+    }
+
+    long long lastEnd = log->start + 1;
+    int urlLengths = strlen(log->url);
+    for (int i = 0; i < log->request_count; i ++) {
+        if (log->requests[i].end > lastEnd) lastEnd = log->requests[i].end;
+        urlLengths += strlen(log->requests[i].url);
+    }
+    for (int i = 0; i < log->stage_count; i ++) {
+        if (log->stages[i].end > lastEnd) lastEnd = log->stages[i].end;
+    }
+    long long span = lastEnd - log->start;
+
+    char *text = (char *) calloc(1024 + urlLengths + (log->request_count * 2 + log->stage_count * 2) * (160 + timingWaterfallWidth), sizeof(char));
+    int length = sprintf(text, "Last page load: %s\nTotal: %.1f ms, %d request%s\n\n", log->url, span / 1000.0, log->request_count, log->request_count == 1 ? "" : "s");
+
+    length += sprintf(
+        text + length,
+        "Requests (times in milliseconds)\n"
+        "d: DNS, c: connect, t: TLS handshake, w: waiting for a response, r: receiving\n\n"
+        "  start   dns  conn   tls  wait  recv   total  received      size  connection\n"
+    );
+    for (int i = 0; i < log->request_count; i ++) {
+        struct http_timing *request = &log->requests[i];
+
+        // Each phase runs from the end of the last one that happened
+        long long phaseStart = request->start;
+        long long durations[HTTP_TIMING_PHASES + 1];
+        int happened[HTTP_TIMING_PHASES + 1];
+        for (int phase = 0; phase < HTTP_TIMING_PHASES; phase ++) {
+            happened[phase] = request->phases[phase] != 0;
+            durations[phase] = happened[phase] ? request->phases[phase] - phaseStart : 0;
+            if (happened[phase]) {
+                phaseStart = request->phases[phase];
+            }
+        }
+        happened[HTTP_TIMING_PHASES] = happened[HTTP_TIMING_FIRST_BYTE];
+        durations[HTTP_TIMING_PHASES] = request->end - phaseStart;
+
+        // The URL gets a line of its own, so the columns fit in 80 characters
+        length += sprintf(text + length, "\n");
+        if (request->error) {
+            length += sprintf(text + length, "[error %d] ", request->error);
+        }
+        length += sprintf(text + length, "%s\n", request->url);
+
+        length += http_printTimingDuration(text + length, 7, request->start - log->start, 1);
+        for (int phase = 0; phase <= HTTP_TIMING_PHASES; phase ++) {
+            length += http_printTimingDuration(text + length, 6, durations[phase], happened[phase]);
+        }
+        length += http_printTimingDuration(text + length, 8, request->end - request->start, 1);
+
+        const char *connection = request->cached ? "cache" : request->http2 ? (request->reused ? "h2 reused" : "h2 new") : request->reused ? "reused" : "new";
+        length += sprintf(text + length, "%10lld%10lld  %s\n", (long long) request->received, (long long) request->size, connection);
+
+        char bar[timingWaterfallWidth + 1];
+        memset(bar, ' ', timingWaterfallWidth);
+        bar[timingWaterfallWidth] = '\0';
+        const char marks[HTTP_TIMING_PHASES + 1] = { 'd', 'c', 't', 'w', 'r' };
+        phaseStart = request->start;
+        for (int phase = 0; phase <= HTTP_TIMING_PHASES; phase ++) {
+            long long phaseEnd = phase < HTTP_TIMING_PHASES ? request->phases[phase] : request->end;
+            if (phase < HTTP_TIMING_PHASES && !phaseEnd) {
+                continue;
+            }
+            // Without a first byte (errors, cached responses), everything after connecting is waiting
+            char mark = phase == HTTP_TIMING_PHASES && !happened[HTTP_TIMING_FIRST_BYTE] ? 'w' : marks[phase];
+            http_drawTimingBar(bar, phaseStart, phaseEnd, log->start, span, mark);
+            phaseStart = phaseEnd;
+        }
+        length += sprintf(text + length, "  |%s|\n", bar);
+    }
+
+    length += sprintf(text + length, "\nStages (busy is the time actually spent in a stage between its start and end)\n\n  start      end     busy  stage\n");
+    // Stages are kept in the order they were recorded, which for those timed by the caller is once they've ended,
+    // so they're listed by when they started
+    int order[maxTimingStages];
+    for (int i = 0; i < log->stage_count; i ++) {
+        int j = i;
+        while (j > 0 && log->stages[order[j - 1]].start > log->stages[i].start) {
+            order[j] = order[j - 1];
+            j --;
+        }
+        order[j] = i;
+    }
+    for (int i = 0; i < log->stage_count; i ++) {
+        struct http_timing_stage *stage = &log->stages[order[i]];
+        // A stage that's still going (such as drawing this page) ends now
+        long long end = stage->end >= stage->start ? stage->end : lastEnd;
+
+        length += http_printTimingDuration(text + length, 7, stage->start - log->start, 1);
+        length += http_printTimingDuration(text + length, 9, end - log->start, 1);
+        length += http_printTimingDuration(text + length, 9, stage->busy, 1);
+        length += sprintf(text + length, "  %s\n", stage->name);
+
+        char bar[timingWaterfallWidth + 1];
+        memset(bar, ' ', timingWaterfallWidth);
+        bar[timingWaterfallWidth] = '\0';
+        http_drawTimingBar(bar, stage->start, end, log->start, span, '#');
+        length += sprintf(text + length, "  |%s|\n", bar);
+    }
+    pthread_mutex_unlock(&HTTP_timingLock);
+
+    return text;
+}
+
+#endif
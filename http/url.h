@@ -6,9 +6,11 @@
     #define _HTTP_URL 1
 
 struct http_url {
+    // These all point into `buffer`, so the URL is freed all at once with HTTP_freeURL
     char *protocol;
     char *hostname;
-    short port;
+    // 0 to 65535
+    int port;
     char *path;
     char *fragment;
 
@@ -16,16 +18,8 @@ struct http_url {
     int has_explicit_port;
     int had_explicit_path;
     int had_explicit_fragment;
-};
 
-enum _http_internal_url_parser_state {
-    HTTP_PROTOCOL,
-    HTTP_PROTOCOL_1,
-    HTTP_PROTOCOL_2,
-    HTTP_HOSTNAME,
-    HTTP_PORT,
-    HTTP_PATH,
-    HTTP_FRAGMENT,
+    char *buffer;
 };
 
 /*
@@ -36,354 +30,290 @@ errno list
 4: Illegal port
 */
 
+void HTTP_freeURL(struct http_url *url) {
+    if (url == NULL) return;
+
+    free(url->buffer);
+    free(url);
+}
+
+int http_isURLDigit(char character) {
+    return character >= '0' && character <= '9';
+}
+
+// Copies `length` characters of `text` to `out`, NUL-terminated. Returns where the copy starts.
+char *http_copyURLPart(char **out, const char *text, int length) {
+    char *start = *out;
+    memcpy(start, text, length);
+    start[length] = '\0';
+    *out += length + 1;
+    return start;
+}
+
+// Parses the URL in one pass over it, finding where each part starts and ends, then copies the parts into a
+// single buffer. Bare hostnames ("example.com", "localhost:8080") are taken as http, and paths ("/index.html")
+// as file. Returns NULL, with errno set, if the URL is malformed.
 struct http_url *http_url_from_string(char *string) {
     errno = 0;
-    struct http_url *result_mem = (struct http_url*) calloc(1, sizeof(struct http_url));
+    int length = strlen(string);
 
-    int urllen = strlen(string);
+    if (length && strchr(":#!?&=+()", string[0]) != NULL) {
+        errno = 3;
+        return NULL;
+    }
 
-    char *protocol = (char *) calloc(urllen + 2, sizeof(char));
-    char *hostname = (char *) calloc(urllen + 2, sizeof(char));
-    char *port = (char *) calloc(urllen + 6, sizeof(char));
-    char *path = (char *) calloc(urllen + 2, sizeof(char));
-    char *fragment = (char *) calloc(urllen + 1, sizeof(char));
+    const char *protocol = "http";
+    int protocolLength = 4;
+    int hasProtocolSlashes = 1;
+    int isFile = 0;
 
-    int currentState = HTTP_PROTOCOL;
-    int currentIndex = 1;
-    int isIp = 0;
+    // The protocol ends at the first ':'. If a '.' or '/' comes first there's no protocol, and the URL is a
+    // hostname or a file path.
+    int i = 0;
+    while (i < length && string[i] != ':' && string[i] != '/' && string[i] != '.') {
+        i ++;
+    }
+
+    int hostnameStart = 0;
+    int hostnameEnd = 0;
+    int portStart = 0;
+    int portEnd = 0;
+    int pathStart = length;
+    int pathEnd = length;
+    int fragmentStart = length;
     int isPortExplicit = 0;
-    int hasProtocolSlashes = 1;
     int hasPath = 0;
     int hasFragment = 0;
-    int didGetToProtocolEnd = 0;
-    for (int i = 0; i < urllen; i ++) {
-        char curChar = string[i];
-        switch (currentState) {
-            case HTTP_PROTOCOL:
-                if (currentIndex == 1) {
-                    if (
-                        curChar == ':' ||
-                        curChar == '#' ||
-                        curChar == '!' ||
-                        curChar == '?' ||
-                        curChar == '&' ||
-                        curChar == '=' ||
-                        curChar == '+' ||
-                        curChar == '(' ||
-                        curChar == ')'
-                    ) {
-                        errno = 3;
-                        return NULL;
-                    }
-                }
 
-                if (curChar == ':') {
-                    didGetToProtocolEnd = 1;
-                    currentState = HTTP_PROTOCOL_1;
-                    currentIndex = 0;
-                    break;
-                } else if (curChar == '/') {
-                    didGetToProtocolEnd = 1;
-                    strcpy(protocol, "file");
-                    hasPath = 1;
-                    currentState = HTTP_PATH;
-                    currentIndex = 0;
-                    i --;
-                    break;
+    if (i == length) {
+        // Nothing but a hostname
+        hostnameEnd = length;
+    } else if (string[i] == '/') {
+        protocol = "file";
+        isFile = 1;
+        hasPath = 1;
+        pathStart = i;
+        i = length;
+        pathEnd = strchr(string + pathStart, '#') != NULL ? strchr(string + pathStart, '#') - string : length;
+        if (pathEnd < length) {
+            hasFragment = 1;
+            fragmentStart = pathEnd + 1;
+        }
+    } else {
+        if (string[i] == '.' || http_isURLDigit(string[i + 1])) {
+            // A hostname, possibly with a port
+            i = 0;
+        } else {
+            protocol = string;
+            protocolLength = i;
+            i ++;
+            if (string[i] == '/') {
+                if (i + 1 < length && string[i + 1] != '/') {
+                    errno = 2;
+                    return NULL;
                 }
+                i = i + 2 < length ? i + 2 : length;
+            } else if (i < length) {
+                // [protocol]:[hostname], like about:blank
+                hasProtocolSlashes = 0;
+            }
+        }
 
-                // Protocols cannot have periods inside them; if they do, turns out we were parsing a hostname
-                if (curChar == '.') {
-                    didGetToProtocolEnd = 1;
-                    i = -1;
-                    free(protocol);
-                    protocol = makeStrCpy("http");
-                    currentState = HTTP_HOSTNAME;
-                    currentIndex = 0;
-                    break;
-                }
-                protocol[strlen(protocol)] = curChar;
-                break;
-            case HTTP_PROTOCOL_1:
-                if (curChar == '/') {
-                    currentState = HTTP_PROTOCOL_2;
-                    currentIndex = 0;
-                } else if (curChar >= '0' && curChar <= '9') {
-                    // turns out we started with the hostname, and this is the port
-                    i = -1;
-                    free(protocol);
-                    protocol = makeStrCpy("http");
-                    currentState = HTTP_HOSTNAME;
-                    currentIndex = 0;
-                    break;
-                } else {
-                    hasProtocolSlashes = 0;
-                    // welp, turns out we had a [protocol]:[hostname] instead of [protocol]://[hostname]
-                    currentState = HTTP_HOSTNAME;
-                    currentIndex = 0;
-                    i --;
-                }
-                break;
-            case HTTP_PROTOCOL_2:
-                if (curChar == '/') {
-                    currentState = HTTP_HOSTNAME;
-                    currentIndex = 0;
-                    break;
-                } else {
+        hostnameStart = i;
+        int isIP = 0;
+        for (; i < length; i ++) {
+            char character = string[i];
+            int isFirst = i == hostnameStart;
+            if (character == '#') {
+                if (isFirst) {
                     errno = 2;
                     return NULL;
                 }
+                hasPath = 1;
+                hasFragment = 1;
+                fragmentStart = i + 1;
                 break;
-            case HTTP_HOSTNAME:
-                if (curChar == '#') {
-                    if (currentIndex == 1) {
-                        errno = 2;
-                        return NULL;
-                    }
-
-                    hasPath = 1;
-                    hasFragment = 1;
-                    currentState = HTTP_FRAGMENT;
-                    currentIndex = 0;
-                    break;
-                }
-                if (currentIndex == 1 && curChar >= '0' && curChar <= '9') {
-                    isIp = 1;
-                }
-                if (isIp && ((curChar >= 'a' && curChar <= 'z') || (curChar >= 'A' && curChar <= 'Z'))) {
+            }
+            if (isFirst && http_isURLDigit(character)) {
+                isIP = 1;
+            }
+            if (isIP && ((character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z'))) {
+                errno = 3;
+                return NULL;
+            }
+            if (character == ':') {
+                if (isFirst) {
                     errno = 3;
                     return NULL;
                 }
-                if (curChar == ':') {
-                    if (currentIndex == 1) {
-                        errno = 3;
-                        return NULL;
-                    }
-                    isPortExplicit = 1;
-                    currentState = HTTP_PORT;
-                    currentIndex = 0;
-                    break;
-                }
-                if (curChar == '/' || curChar == '?') {
-                    hasPath = 1;
-                    currentState = HTTP_PATH;
-                    currentIndex = 0;
-                    i --;
-                    break;
-                }
-                hostname[strlen(hostname)] = curChar;
+                isPortExplicit = 1;
                 break;
-            case HTTP_PORT:
-                if (curChar == '/') {
-                    currentState = HTTP_PATH;
-                    currentIndex = 0;
-                    break;
-                }
-                if (curChar < '0' || curChar > '9') {
+            }
+            if (character == '/' || character == '?') {
+                hasPath = 1;
+                break;
+            }
+        }
+        hostnameEnd = i;
+
+        if (isPortExplicit) {
+            portStart = ++ i;
+            for (; i < length && string[i] != '/'; i ++) {
+                if (!http_isURLDigit(string[i])) {
                     errno = 4;
                     return NULL;
                 }
-                port[strlen(port)] = curChar;
-                break;
-            case HTTP_PATH:
-                if (curChar == '#') {
-                    hasFragment = 1;
-                    currentState = HTTP_FRAGMENT;
-                    currentIndex = 0;
-                    break;
-                }
-                if (curChar == '%') {
-                    if (urllen - i >= 2) {
-                        char next1 = string[i + 1];
-                        char next2 = string[i + 2];
-                        if (next1 >= '0' && next1 <= '9' && next2 >= '0' && next2 <= '9') {
-                            char *txt = (char *) calloc(3, sizeof(char));
-                            txt[0] = next1;
-                            txt[1] = next2;
-                            long int num = strtol(txt, NULL, 16);
-                            path[strlen(path)] = (char) num;
-                            i += 2;
-                            break;
-                        }
-                    }
-                }
-                path[strlen(path)] = curChar;
-                break;
-            case HTTP_FRAGMENT:
-                fragment[strlen(fragment)] = curChar;
-                break;
+            }
+            portEnd = i;
+            if (i < length) {
+                // The slash isn't kept, but the path gets one in front anyway
+                hasPath = 1;
+                i ++;
+            }
         }
-        currentIndex ++;
-    }
 
-    if (strlen(path) == 0) {
-        free(path);
-        path = makeStrCpy("/");
-    } else if (path[0] != '/') {
-        memmove(path + 1, path, strlen(path));
-        path[0] = '/';
+        if (!hasFragment && i < length) {
+            pathStart = i;
+            for (; i < length && string[i] != '#'; i ++);
+            pathEnd = i;
+            if (i < length) {
+                hasFragment = 1;
+                fragmentStart = i + 1;
+            }
+        }
     }
 
-    if (!didGetToProtocolEnd) {
-        hostname = protocol;
-        protocol = makeStrCpy("http");
-    }
+    // Every part is a separate piece of the string, so it all fits with room for the NULs, a "/" in front of
+    // the path and a protocol that wasn't in the string
+    struct http_url *url = (struct http_url *) calloc(1, sizeof(struct http_url));
+    url->buffer = (char *) calloc(length + 16, sizeof(char));
+    char *out = url->buffer;
+
+    url->protocol = http_copyURLPart(&out, protocol, protocolLength);
+    isFile = !strcmp(url->protocol, "file");
+    url->hostname = http_copyURLPart(&out, string + hostnameStart, isFile ? 0 : hostnameEnd - hostnameStart);
 
-    if (strlen(port) == 0) {
-        if (!strcmp(protocol, "http")) {
-            strcpy(port, "80");
-        } else if (!strcmp(protocol, "https")) {
-            strcpy(port, "443");
+    // Escapes made only of decimal digits are decoded (as hex)
+    char *path = out + 1;
+    int decodedLength = 0;
+    for (int j = pathStart; j < pathEnd; j ++) {
+        if (string[j] == '%' && j + 2 < length && http_isURLDigit(string[j + 1]) && http_isURLDigit(string[j + 2])) {
+            char decoded = (char) ((string[j + 1] - '0') * 16 + (string[j + 2] - '0'));
+            if (decoded) {
+                path[decodedLength ++] = decoded;
+            }
+            j += 2;
         } else {
-            strcpy(port, "80");
+            path[decodedLength ++] = string[j];
         }
     }
-
-    if (!strcmp(protocol, "file")) {
-        strcpy(port, "0");
-        hostname = makeStrCpy("");
+    if (!decodedLength || path[0] != '/') {
+        path --;
+        path[0] = '/';
+        decodedLength ++;
     }
+    path[decodedLength] = '\0';
+    url->path = path;
+    out = path + decodedLength + 1;
+
+    url->fragment = http_copyURLPart(&out, string + fragmentStart, length - fragmentStart);
 
-    result_mem->protocol = protocol;
-    result_mem->hostname = makeStrCpy(hostname);
-    result_mem->port = atoi(port);
-    result_mem->path = path;
-    result_mem->fragment = fragment;
-    result_mem->has_explicit_port = isPortExplicit;
-    result_mem->had_protocol_slashes = hasProtocolSlashes;
-    result_mem->had_explicit_path = hasPath;
-    result_mem->had_explicit_fragment = hasFragment;
+    int port = 0;
+    for (int j = portStart; j < portEnd; j ++) {
+        port = port * 10 + string[j] - '0';
+        if (port > 65535) {
+            free(url->buffer);
+            free(url);
+            errno = 4;
+            return NULL;
+        }
+    }
+    if (isFile) {
+        port = 0;
+    } else if (portStart == portEnd) {
+        port = !strcmp(url->protocol, "https") ? 443 : 80;
+    }
 
-    free(hostname);
-    free(port);
+    url->port = port;
+    url->has_explicit_port = isPortExplicit;
+    url->had_protocol_slashes = hasProtocolSlashes;
+    url->had_explicit_path = hasPath;
+    url->had_explicit_fragment = hasFragment;
 
-    return result_mem;
+    return url;
 }
 
-char *http_urlToString(struct http_url *url) {
-    char *newAlloc = (char *) calloc(strlen(url->protocol) + 9 + strlen(url->hostname) + strlen(url->path) + strlen(url->fragment), sizeof(char));
-    strcpy(newAlloc, url->protocol);
-    if (url->had_protocol_slashes) {
-        strcat(newAlloc, "://");
-    } else {
-        strcat(newAlloc, ":");
-    }
-    strcat(newAlloc, url->hostname);
+// Appends "protocol://hostname[:port]"
+void http_appendURLOrigin(struct string_builder *builder, struct http_url *url) {
+    appendStringToBuilder(builder, url->protocol);
+    appendStringToBuilder(builder, url->had_protocol_slashes ? "://" : ":");
+    appendStringToBuilder(builder, url->hostname);
     if (url->has_explicit_port) {
-        strcat(newAlloc, ":");
-        char *al2 = (char *) calloc(16, sizeof(char));
-        sprintf(al2, "%d", url->port);
-        strcat(newAlloc, al2);
-        free(al2);
+        char port[16];
+        appendToStringBuilder(builder, port, sprintf(port, ":%d", url->port));
     }
+}
+
+void http_appendURL(struct string_builder *builder, struct http_url *url) {
+    http_appendURLOrigin(builder, url);
     if (url->had_explicit_path) {
-        strcat(newAlloc, url->path);
+        appendStringToBuilder(builder, url->path);
         if (url->had_explicit_fragment) {
-            strcat(newAlloc, "#");
-            strcat(newAlloc, url->fragment);
+            appendStringToBuilder(builder, "#");
+            appendStringToBuilder(builder, url->fragment);
         }
     }
-    return newAlloc;
 }
 
-char* http_resolveRelativeURL(struct http_url *base, char *baseString, char *string) {
-    // NOTE: This function duplicates a lot of "build string from struct http_url" code. Could that be extracted into a new function?
-    if (strlen(string) == 0) {
-        return makeStrCpy(baseString);
-    }
-    if (string[0] == '/') {
-        if (string[1] == '/') {
-            char *newAlloc = (char *) calloc(strlen(base->protocol) + 3 + strlen(string), sizeof(char));
-            strcpy(newAlloc, base->protocol);
-            strcat(newAlloc, ":");
-            strcat(newAlloc, string);
-            return newAlloc;
-        } else {
-            char *newAlloc = (char *) calloc(strlen(base->protocol) + 8 + strlen(base->hostname) + strlen(string), sizeof(char));
-            strcpy(newAlloc, base->protocol);
-            if (base->had_protocol_slashes) {
-                strcat(newAlloc, "://");
-            } else {
-                strcat(newAlloc, ":");
-            }
-            strcat(newAlloc, base->hostname);
-            if (base->has_explicit_port) {
-                strcat(newAlloc, ":");
-                char *al2 = (char *) calloc(16, sizeof(char));
-                sprintf(al2, "%d", base->port);
-                strcat(newAlloc, al2);
-                free(al2);
-            }
-            strcat(newAlloc, string);
-            return newAlloc;
-        }
+char *http_urlToString(struct http_url *url) {
+    struct string_builder builder = makeStringBuilder(64);
+    http_appendURL(&builder, url);
+    return builder.data;
+}
+
+// Appends `string`, resolved against the page at `base` (whose text is `baseString`), to the builder
+void http_appendResolvedURL(struct string_builder *builder, struct http_url *base, const char *baseString, const char *string) {
+    if (string[0] == '\0') {
+        appendStringToBuilder(builder, baseString);
+    } else if (string[0] == '/' && string[1] == '/') {
+        appendStringToBuilder(builder, base->protocol);
+        appendStringToBuilder(builder, ":");
+        appendStringToBuilder(builder, string);
+    } else if (string[0] == '/') {
+        http_appendURLOrigin(builder, base);
+        appendStringToBuilder(builder, string);
+    } else if ((string[0] == '#' || string[0] == '?') && !base->had_protocol_slashes) {
+        // The base has no hierarchy (e.g. about:blank), so the part being replaced is cut off its text as it is
+        appendToStringBuilder(builder, baseString, strcspn(baseString, string[0] == '#' ? "#" : "?#"));
+        appendStringToBuilder(builder, string);
     } else if (string[0] == '#') {
-            char *newAlloc = (char *) calloc(strlen(base->protocol) + 12 + strlen(base->hostname) + strlen(base->path) + strlen(string), sizeof(char));
-            strcpy(newAlloc, base->protocol);
-            if (base->had_protocol_slashes) {
-                strcat(newAlloc, "://");
-            } else {
-                strcat(newAlloc, ":");
-            }
-            strcat(newAlloc, base->hostname);
-            if (base->has_explicit_port) {
-                strcat(newAlloc, ":");
-                char *al2 = (char *) calloc(16, sizeof(char));
-                sprintf(al2, "%d", base->port);
-                strcat(newAlloc, al2);
-                free(al2);
-            }
-            strcat(newAlloc, base->path);
-            strcat(newAlloc, string);
-            return newAlloc;
+        http_appendURLOrigin(builder, base);
+        appendStringToBuilder(builder, base->path);
+        appendStringToBuilder(builder, string);
     } else if (string[0] == '?') {
-        // TODO
-        return makeStrCpy(baseString);
+        // Replaces the query (which is part of the path)
+        http_appendURLOrigin(builder, base);
+        appendToStringBuilder(builder, base->path, strcspn(base->path, "?"));
+        appendStringToBuilder(builder, string);
     } else {
-        int isAbsolute = 0;
-        int wasNotAbsolute = 0;
-        for (int i = 0; i < strlen(string); i ++) {
-            char cur = string[i];
-            if (cur == '?' || cur == '#') {
-                wasNotAbsolute = 1;
-            }
-            if (cur == ':' && !wasNotAbsolute) {
-                isAbsolute = 1;
-            }
-        }
-        if (isAbsolute) {
-            return makeStrCpy(string);
-        } else {
-            char *resultPath = (char *) calloc(strlen(baseString) + strlen(string) + 2, sizeof(char));
-            int lastSlashPos = 0;
-            for (int i = strlen(base->path) - 1; i >= 0; i --) {
-                if (base->path[i] == '/') {
-                    lastSlashPos = i;
-                    break;
-                }
-            }
-            strcpy(resultPath, base->path);
-            strcpy(resultPath + lastSlashPos + 1, string);
-
-            char *newAlloc = (char *) calloc(strlen(base->protocol) + 12 + strlen(base->hostname) + strlen(resultPath), sizeof(char));
-            strcpy(newAlloc, base->protocol);
-            if (base->had_protocol_slashes) {
-                strcat(newAlloc, "://");
-            } else {
-                strcat(newAlloc, ":");
-            }
-            strcat(newAlloc, base->hostname);
-            if (base->has_explicit_port) {
-                strcat(newAlloc, ":");
-                char *al2 = (char *) calloc(16, sizeof(char));
-                sprintf(al2, "%d", base->port);
-                strcat(newAlloc, al2);
-                free(al2);
-            }
-            strcat(newAlloc, resultPath);
-            return newAlloc;
+        // A ':' before any '?' or '#' means it has a protocol, so isn't relative
+        int end = strcspn(string, ":?#");
+        if (string[end] == ':') {
+            appendStringToBuilder(builder, string);
+            return;
         }
+
+        http_appendURLOrigin(builder, base);
+        const char *lastSlash = strrchr(base->path, '/');
+        appendToStringBuilder(builder, base->path, lastSlash != NULL ? lastSlash - base->path + 1 : 1);
+        appendStringToBuilder(builder, string);
     }
 }
 
+char *http_resolveRelativeURL(struct http_url *base, char *baseString, char *string) {
+    struct string_builder builder = makeStringBuilder(strlen(baseString) + strlen(string) + 16);
+    http_appendResolvedURL(&builder, base, baseString, string);
+    return builder.data;
+}
+
 #endif
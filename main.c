@@ -1,8 +1,10 @@
 // main.c
-// Compile with gcc main.c -lncurses -lssl -lcrypto
+// Compile with gcc main.c -lncurses -lssl -lcrypto -lz -lbrotlidec -pthread (add -DHTTP_NO_BROTLI to build without brotli)
+#include <signal.h>
 #include <stdlib.h>
 
 #include "http/http.h"
+#include "http/pipeline.h"
 #include "navigation/links.h"
 #include "render/display-handling.h"
 #include "utils/string.h"
@@ -22,7 +24,7 @@ void showButtons(struct nc_state *state) {
 void initializeDisplayObjects(struct nc_state *state) {
     createNewText(state, 1, 1, "Go to a URL:", "gotoURL");
     createNewText(state, 0, 0, "No document loaded", "documentText");
-    createNewText(state, 0, 0, "This is the browser's home page.\n\nNavigation tools:\nCTRL+O: Go to site\nCTRL+X: Close current page\nUp/Down arrows: scroll current document\nTab/Shift+Tab (or left arrow/right arrow): Cycle through buttons/links/text fields\n\nWhen a document is loaded:\nCTRL+O: Go to site (same as UI)\nCTRL+K: View host cookies\nCTRL+X: Close document\n\nCookies are not saved to disk.\n\nCreated by uqers.", "helpText");
+    createNewText(state, 0, 0, "This is the browser's home page.\n\nNavigation tools:\nCTRL+O: Go to site\nCTRL+X: Close current page\nUp/Down arrows: scroll current document\nTab/Shift+Tab (or left arrow/right arrow): Cycle through buttons/links/text fields\n\nWhen a document is loaded:\nCTRL+O: Go to site (same as UI)\nCTRL+K: View host cookies\nCTRL+X: Close document (or cancel it while it's loading)\n\nCookies with an expiry date are saved to disk, as are permanent redirects and sites that asked to only be visited over https.\n\nCreated by uqers.", "helpText");
     createNewTextarea(state, 1, 3, 29, 1, "urltextarea");
     createNewButton(state, 1, 5, "OK", ongotourl, "gotobutton");
     createNewText(state, 1, 13, "Use a custom user agent", "userAgentDetail");
@@ -93,8 +95,12 @@ void openCookieDialog(struct nc_state *state) {
     state->globalScrollX = 0;
     state->globalScrollY = 0;
 
-    char *hostname = http_url_from_string(state->currentPageUrl)->hostname;
-    char *cookieText = HTTP_cookieStoreToStringPretty(HTTP_getGlobalCookieStore(), hostname);
+    struct http_url *url = http_url_from_string(state->currentPageUrl);
+    pthread_mutex_lock(&HTTP_cookieStoreLock);
+    HTTP_loadJarCookies(HTTP_getGlobalCookieJar(), HTTP_getGlobalCookieStore(), url->hostname);
+    char *cookieText = HTTP_cookieStoreToStringPretty(HTTP_getGlobalCookieStore(), url->hostname);
+    pthread_mutex_unlock(&HTTP_cookieStoreLock);
+    HTTP_freeURL(url);
 
     cookiesDetail->text = (char *) calloc(strlen(cookieText) + 16, sizeof(char));
     strcpy(cookiesDetail->text, "Cookies: \n\n");
@@ -147,6 +153,7 @@ void closeDocumentPage(struct nc_state *state) {
     getTextByDescriptor(state, "documentText")->text = makeStrCpy("");
     state->currentPageUrl = NULL;
     freeButtons(state);
+    NAV_cancelSpeculation();
 
     // Should this save the global scroll when appearing over the current document?
     state->globalScrollX = 0;
@@ -165,9 +172,14 @@ void closeCurrentWindow(struct nc_state *state) {
         case PAGE_DOCUMENT_LOADED:
             closeDocumentPage(state);
             break;
-        case PAGE_EMPTY:
+        case PAGE_EMPTY: {
+            // Idle connections are closed properly rather than just dropped
+            struct http_connection_pool *pool = HTTP_getGlobalConnectionPool();
+            HTTP_setGlobalConnectionPool(NULL);
+            HTTP_closeConnectionPool(pool);
             endProgram();
             break;
+        }
     }
 }
 
@@ -269,6 +281,31 @@ void onKeyPress(struct nc_state *browserState, int ch) {
     }
 }
 
+// Starts loading the focused link's page in the background, if a link is focused
+void speculateOnFocusedLink(struct nc_state *state) {
+    if (state->currentPage != PAGE_DOCUMENT_LOADED || state->currentPageUrl == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < state->numButtons; i ++) {
+        struct nc_button btn = state->buttons[i];
+        if (!btn.visible || !btn.selected || strncmp(btn.descriptor, "_temp_linkto_", 13)) {
+            continue;
+        }
+
+        struct http_url *curURL = http_url_from_string(state->currentPageUrl);
+        if (curURL == NULL) {
+            return;
+        }
+        char *absoluteURL = http_resolveRelativeURL(curURL, state->currentPageUrl, btn.descriptor + 15);
+        NAV_speculate(absoluteURL, getTextAreaByDescriptor(state, "userAgent")->currentText);
+
+        free(absoluteURL);
+        HTTP_freeURL(curURL);
+        return;
+    }
+}
+
 void *eventLoop(struct nc_state *state) {
     while (1) {
         int ch;
@@ -281,7 +318,20 @@ void *eventLoop(struct nc_state *state) {
         }
         render_nc(state);
         state->shouldCheckAutoScroll = 0;
-        if (ch = getch()) {
+
+        // A link that stays focused for a moment is loaded ahead of time
+        if (NAV_getSpeculationEnabled()) {
+            timeout(speculationDwellTime);
+            ch = getch();
+            timeout(-1);
+            if (ch == ERR) {
+                speculateOnFocusedLink(state);
+                ch = getch();
+            }
+        } else {
+            ch = getch();
+        }
+        if (ch) {
             onKeyPress(state, ch);
         }
     }
@@ -319,8 +369,60 @@ void recursiveDisplayXML(struct xml_list xml, int depth) {
 
 int main(int argc, char **argv) {
     char *url = NULL;
-    if (argc == 2) {
-        url = argv[1];
+    int useDiskCache = 1;
+    int useCookieJar = 1;
+    int useHTTP2 = 1;
+    int64_t memoryCacheBudget = defaultMemoryCacheBudget;
+    for (int i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "--pipelining")) {
+            HTTP_setPipeliningEnabled(1);
+        } else if (!strcmp(argv[i], "--no-http2")) {
+            useHTTP2 = 0;
+        } else if (!strcmp(argv[i], "--no-cache")) {
+            useDiskCache = 0;
+        } else if (!strcmp(argv[i], "--no-cookie-jar")) {
+            useCookieJar = 0;
+        } else if (!strcmp(argv[i], "--no-speculation")) {
+            NAV_setSpeculationEnabled(0);
+        } else if (!strcmp(argv[i], "--no-prerender")) {
+            // Links are still fetched ahead of time, but only rendered once they're opened
+            NAV_setPrerenderEnabled(0);
+        } else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+            // As phase=milliseconds, e.g. "stall=5000"; 0 removes the limit
+            i ++;
+            struct http_timeouts timeouts = HTTP_getTimeouts();
+            char *value = strchr(argv[i], '=');
+            int milliseconds = value != NULL ? atoi(value + 1) : 0;
+            if (!strncmp(argv[i], "dns=", 4)) {
+                timeouts.dns = milliseconds;
+            } else if (!strncmp(argv[i], "connect=", 8)) {
+                timeouts.connect = milliseconds;
+            } else if (!strncmp(argv[i], "handshake=", 10)) {
+                timeouts.handshake = milliseconds;
+            } else if (!strncmp(argv[i], "first-byte=", 11)) {
+                timeouts.first_byte = milliseconds;
+            } else if (!strncmp(argv[i], "stall=", 6)) {
+                timeouts.stall = milliseconds;
+            } else if (!strncmp(argv[i], "request=", 8)) {
+                timeouts.request = milliseconds;
+            }
+            HTTP_setTimeouts(timeouts);
+        } else if (!strcmp(argv[i], "--connect-attempts") && i + 1 < argc) {
+            i ++;
+            struct http_timeouts timeouts = HTTP_getTimeouts();
+            timeouts.connect_attempts = atoi(argv[i]);
+            HTTP_setTimeouts(timeouts);
+        } else if (!strcmp(argv[i], "--parallel-ranges") && i + 1 < argc) {
+            // Large downloads are split across this many connections
+            i ++;
+            HTTP_setParallelRanges(atoi(argv[i]));
+        } else if (!strcmp(argv[i], "--memory-cache") && i + 1 < argc) {
+            // In megabytes; 0 turns it off
+            i ++;
+            memoryCacheBudget = (int64_t) atoll(argv[i]) * 1024 * 1024;
+        } else {
+            url = argv[i];
+        }
     }
 /*
     struct http_response parsedResponse = http_makeHTTPRequest("file:///home/batuhan/test.html", "uqers", NULL, NULL, NULL);
@@ -388,6 +490,27 @@ int main(int argc, char **argv) {
     nc_onInitFinish(&browserState);
 
     HTTP_setGlobalCookieStore(HTTP_makeCookieStore());
+    if (useCookieJar) {
+        // Without a usable data directory, cookies only last until the browser is closed
+        HTTP_setGlobalCookieJar(HTTP_openCookieJar(NULL));
+    }
+    // Kept in memory only if there's no data directory
+    HTTP_setGlobalRedirectCache(HTTP_openRedirectCache(NULL));
+    HTTP_setGlobalConnectionPool(HTTP_makeConnectionPool());
+    HTTP_setGlobalMemoryCache(HTTP_makeMemoryCache(memoryCacheBudget));
+    if (useDiskCache) {
+        // Without a usable cache directory, everything is just fetched from the network
+        HTTP_setGlobalDiskCache(HTTP_openDiskCache(NULL, defaultDiskCacheBudget));
+    }
+    secure_initContext();
+    // Offered to https servers, which can still pick HTTP/1.1
+    HTTP2_setEnabled(useHTTP2);
+
+    // Keep handling input (scrolling, CTRL+X to cancel) while pages download
+    socket_setEventSource(STDIN_FILENO, onInputDuringLoad, &browserState);
+
+    // Pooled connections can be closed by the server at any time; writing to one should fail, not kill the browser
+    signal(SIGPIPE, SIG_IGN);
 
     if (url != NULL) {
         struct nc_text_area *textarea = getTextAreaByDescriptor(&browserState, "urltextarea");
@@ -49,6 +49,13 @@ struct http_response downloadPage(
     onredirectsuccess onredirectsuccesshandler,
     onredirecterror onredirecterrorhandler
 ) {
+    // Where the URL is already known to lead through permanent redirects is asked for straight away
+    char *knownURL = HTTP_followKnownRedirects(HTTP_globalRedirectCache, *url);
+    if (knownURL != NULL) {
+        *url = knownURL;
+        onredirectsuccesshandler(ptr, knownURL, redirect_depth);
+    }
+
     struct http_response parsedResponse = http_makeHTTPRequest(*url, userAgent, handler, finishHandler, ptr);
 
     if (parsedResponse.error) {
@@ -69,6 +76,7 @@ struct http_response downloadPage(
         }
 
         char *absoluteURL = http_resolveRelativeURL(curURL, *url, parsedResponse.redirect);
+        HTTP_freeURL(curURL);
 
         struct http_url *absURL = http_url_from_string(absoluteURL);
         if (absURL == NULL) {
@@ -79,6 +87,7 @@ struct http_response downloadPage(
         *url = absoluteURL;
 
         onredirectsuccesshandler(ptr, http_urlToString(absURL), redirect_depth);
+        HTTP_freeURL(absURL);
 
         return downloadPage(ptr, userAgent, url, handler, finishHandler, redirect_depth + 1, onerrorhandler, onredirecthandler, onredirectsuccesshandler, onredirecterrorhandler);
     }
@@ -12,6 +12,7 @@
 #include "../xml/nodes.h"
 
 #include "download.h"
+#include "speculation.h"
 
 
 void onStyleSheetStart(void *ptr, char *href) {
@@ -62,6 +63,30 @@ char *onerrorhandler(void *state, int code) {
         err = makeStrCpy("Connection refused.\n");
     } else if (code == 113) {
         err = makeStrCpy("No route to host.\n");
+    } else if (code == 180) {
+        err = makeStrCpy("Timed out while resolving domain.\n");
+    } else if (code == 181) {
+        err = makeStrCpy("Timed out while connecting to host.\n");
+    } else if (code == 182) {
+        err = makeStrCpy("Timed out during the SSL/TLS handshake.\n");
+    } else if (code == 183) {
+        err = makeStrCpy("Host did not respond in time.\n");
+    } else if (code == 184) {
+        err = makeStrCpy("Host stopped sending data (response stalled).\n");
+    } else if (code == 185) {
+        err = makeStrCpy("Page took too long to load.\n");
+    } else if (code == 186) {
+        err = makeStrCpy("Connection lost, and the rest of the page could not be fetched again.\n");
+    } else if (code == 187) {
+        err = makeStrCpy("File could not be read.\n");
+    } else if (code == 188) {
+        err = makeStrCpy("Page is too large.\n");
+    } else if (code == 189) {
+        err = makeStrCpy("Not enough memory for the page.\n");
+    } else if (code == 190) {
+        err = makeStrCpy("Page load cancelled.\n");
+    } else if (code == 191) {
+        err = makeStrCpy("Invalid compressed response.\n");
     } else if (code == 192) {
         err = makeStrCpy("Error initializing SSL/TLS.\n");
     } else if (code == 193) {
@@ -107,7 +132,44 @@ char *onredirecterrorhandler(void *ptr, char *to, int num) {
     return makeStrCpy("Invalid redirected URL.");
 }
 
+// Called whenever input arrives while a page (or one of its stylesheets) is downloading. Only scrolling
+// and cancelling are handled; everything else would need the document, which doesn't exist yet.
+// Returns nonzero to cancel the download.
+int onInputDuringLoad(void *ptr) {
+    struct nc_state *state = (struct nc_state *) ptr;
+    int shouldCancel = 0;
+
+    nodelay(stdscr, TRUE);
+    int ch;
+    while ((ch = getch()) != ERR) {
+        if (ch == 24) { // CTRL+X
+            shouldCancel = 1;
+        } else if (ch == KEY_UP) {
+            if (state->globalScrollY < 0) {
+                state->globalScrollY ++;
+            }
+        } else if (ch == KEY_DOWN) {
+            state->globalScrollY --;
+        }
+    }
+    nodelay(stdscr, FALSE);
+
+    if (shouldCancel) {
+        strcat(getTextByDescriptor(state, "documentText")->text, "\nCancelling...");
+    }
+    render_nc(state);
+
+    return shouldCancel;
+}
+
+void openDownloadedPage(struct nc_state *state, char **url, struct http_response parsedResponse, dataReceiveHandler handler, dataReceiveHandler finishHandler, int redirect_depth);
+
 void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler handler, dataReceiveHandler finishHandler, int redirect_depth) {
+    if (redirect_depth == 0) {
+        // A cancelled load shouldn't affect the next one
+        socket_resetCancellation();
+    }
+
     if (redirect_depth > 15) {
         free(getTextByDescriptor(state, "documentText")->text);
         getTextByDescriptor(state, "documentText")->text = makeStrCpy("Too many redirects.");
@@ -128,37 +190,33 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
         onredirecterrorhandler
     );
 
-    if (!parsedResponse.is_html) {
-        char *lowerData = HTTP_toLowerCase(parsedResponse.response_body.data);
-        if (strncmp(lowerData, "<!doctype html", 14)) {
-            for (int i = 0; i < parsedResponse.num_headers; i ++) {
-                free(parsedResponse.headers[i].name);
-                if (parsedResponse.headers[i].value) free(parsedResponse.headers[i].value);
-            }
-            free(parsedResponse.headers);
-            free(parsedResponse.response_description);
-            free(lowerData);
+    openDownloadedPage(state, url, parsedResponse, handler, finishHandler, redirect_depth);
+}
 
-            char *total = (char *) calloc(parsedResponse.response_body.length + strlen(*url) + 32, sizeof(char));
-            strcpy(total, "Page has no title\n\n\\H\n");
-            strcat(total, doubleStringBackslashes(parsedResponse.response_body.data));
+// Shows a downloaded page (which is taken over), rendering it first if it's HTML
+void openDownloadedPage(struct nc_state *state, char **url, struct http_response parsedResponse, dataReceiveHandler handler, dataReceiveHandler finishHandler, int redirect_depth) {
+    if (!NAV_isHTMLResponse(&parsedResponse)) {
+        char *total = NAV_plainTextDocument(parsedResponse.response_body.data);
+        HTTP_freeResponse(&parsedResponse);
 
-            free(getTextByDescriptor(state, "documentText")->text);
-            getTextByDescriptor(state, "documentText")->text = total;
-            render_nc(state);
-            return;
-        }
-        free(lowerData);
+        free(getTextByDescriptor(state, "documentText")->text);
+        getTextByDescriptor(state, "documentText")->text = total;
+        int drawStage = HTTP_startTimingStage("Draw page (printText)");
+        render_nc(state);
+        HTTP_finishTimingStage(drawStage);
+        return;
     }
 
     strcat(getTextByDescriptor(state, "documentText")->text, "\nBeginning to parse page as HTML...");
     render_nc(state);
 
+    int parseStage = HTTP_startTimingStage("Parse HTML (XML_parseXmlNodes)");
     struct xml_response xml = XML_parseXmlNodes(
                                   XML_xmlDataFromString(
                                       parsedResponse.response_body.data
                                   )
                               );
+    HTTP_finishTimingStage(parseStage);
 
     strcat(getTextByDescriptor(state, "documentText")->text, "\nDone parsing page as HTML.\nConverting HTML to rich text...");
     render_nc(state);
@@ -173,6 +231,7 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
         return;
     }
 
+    int convertStage = HTTP_startTimingStage("Convert to text (htmlToText)");
     struct html2nc_result result = htmlToText(
         xml.list,
         parsedResponse.response_body.data,
@@ -183,6 +242,7 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
         onStyleSheetComplete,
         onStyleSheetError
     );
+    HTTP_finishTimingStage(convertStage);
 
     if (result.finish_status == HTML2NC_REDIRECT) {
         // Ensure base URL is valid
@@ -196,6 +256,7 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
 
         char *absoluteURL = http_resolveRelativeURL(curURL, *url, result.redirect_url);
         free(result.redirect_url);
+        HTTP_freeURL(curURL);
 
         // Ensure resulting absolute URL is valid
         struct http_url *absURL = http_url_from_string(absoluteURL);
@@ -205,6 +266,7 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
             render_nc(state);
             return;
         }
+        HTTP_freeURL(absURL);
 
         // Now we know that this is valid
         *url = absoluteURL;
@@ -213,24 +275,14 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
         return;
     }
 
-    char *total = (char *) calloc(strlen(result.text) + strlen(*url) + strlen(result.title) + 8, sizeof(char));
-    strcpy(total, result.title);
-    strcat(total, "\n\n\\H\n");
-    strcat(total, result.text);
+    char *total = NAV_richTextDocument(result);
 
     strcat(getTextByDescriptor(state, "documentText")->text, "\nDone parsing HTML as rich text.");
     render_nc(state);
 
-    free(parsedResponse.response_body.data);
-    for (int i = 0; i < parsedResponse.num_headers; i ++) {
-        free(parsedResponse.headers[i].name);
-        if (parsedResponse.headers[i].value) free(parsedResponse.headers[i].value);
-    }
-    free(parsedResponse.headers);
-    free(parsedResponse.response_description);
+    HTTP_freeResponse(&parsedResponse);
     free(result.title);
     free(result.text);
-    if (parsedResponse.redirect) free(parsedResponse.redirect);
 
     recursiveFreeXML(xml.list);
 
@@ -239,7 +291,9 @@ void downloadAndOpenPage(struct nc_state *state, char **url, dataReceiveHandler
     if (total == NULL) {
         getTextByDescriptor(state, "documentText")->text = makeStrCpy("ERROR: Serialized document was NULL!");
     }
+    int drawStage = HTTP_startTimingStage("Draw page (printText)");
     render_nc(state);
+    HTTP_finishTimingStage(drawStage);
 }
 
 // gets called with current state pointer and pressed button's descriptor
@@ -259,6 +313,7 @@ void onFinishData(void *ptrState) {
 void ongotourl(void *state, char *_) {
     struct nc_state *realState = (struct nc_state *) state;
     freeButtons(realState);
+    NAV_cancelSpeculation();
 
     realState->selectableIndex = -1;
     realState->currentPage = PAGE_DOCUMENT_LOADED;
@@ -291,7 +346,7 @@ void ongotourl(void *state, char *_) {
         char *copied = http_urlToString(from);
         setTextOf(getTextAreaByDescriptor(realState, "urlField"), copied);
 
-        free(from);
+        HTTP_freeURL(from);
         free(copied);
 
         getTextByDescriptor(realState, "documentText")->text = (char *) calloc(8192, sizeof(char));
@@ -299,6 +354,7 @@ void ongotourl(void *state, char *_) {
         render_nc(realState);
 
         char *copiedURL = makeStrCpy(getTextAreaByDescriptor(realState, "urltextarea")->currentText);
+        HTTP_beginTimingLog(copiedURL);
         downloadAndOpenPage(realState, &copiedURL, onReceiveData, onFinishData, 0);
 
         setTextOf(getTextAreaByDescriptor(realState, "urlField"), copiedURL);
@@ -306,19 +362,16 @@ void ongotourl(void *state, char *_) {
         free(copiedURL);
 
         struct http_url *finalURL = http_url_from_string(realState->currentPageUrl);
-        if (finalURL->had_explicit_fragment && finalURL->fragment[0]) {
+        if (finalURL != NULL && finalURL->had_explicit_fragment && finalURL->fragment[0]) {
             int *scrollPoint = getScrollPoint(realState, finalURL->fragment);
             if (scrollPoint) {
                 realState->globalScrollY = -(*scrollPoint);
             }
         }
+        HTTP_freeURL(finalURL);
     }
 
-    free(curURL->protocol);
-    free(curURL->hostname);
-    free(curURL->path);
-    free(curURL->fragment);
-    free(curURL);
+    HTTP_freeURL(curURL);
 
     getTextAreaByDescriptor(realState, "urlField")->visible = 1;
     getButtonByDescriptor(realState, "smallgobutton")->visible = 1;
@@ -376,18 +429,44 @@ void onlinkpressed(void *state, char *url) {
         render_nc(realState);
 
         char *copiedURL = makeStrCpy(absoluteURL);
-        downloadAndOpenPage(realState, &copiedURL, onReceiveData, onFinishData, 0);
+        HTTP_beginTimingLog(copiedURL);
+
+        // The page may already have been loaded while the link was focused
+        int cancelled;
+        struct nav_speculation *speculation = NAV_takeSpeculation(absoluteURL, &cancelled);
+        if (cancelled) {
+            char *err = onerrorhandler(realState, 190);
+            free(getTextByDescriptor(realState, "documentText")->text);
+            getTextByDescriptor(realState, "documentText")->text = NAV_plainTextDocument(err);
+            free(err);
+            render_nc(realState);
+        } else if (speculation != NULL && speculation->documentText != NULL) {
+            free(getTextByDescriptor(realState, "documentText")->text);
+            getTextByDescriptor(realState, "documentText")->text = speculation->documentText;
+            speculation->documentText = NULL;
+            int drawStage = HTTP_startTimingStage("Draw page (printText)");
+            render_nc(realState);
+            HTTP_finishTimingStage(drawStage);
+        } else if (speculation != NULL) {
+            socket_resetCancellation();
+            openDownloadedPage(realState, &copiedURL, speculation->response, onReceiveData, onFinishData, 0);
+            speculation->hasResponse = 0;
+        } else {
+            downloadAndOpenPage(realState, &copiedURL, onReceiveData, onFinishData, 0);
+        }
+        NAV_freeSpeculation(speculation);
 
         realState->currentPageUrl = copiedURL;
         setTextOf(getTextAreaByDescriptor(realState, "urlField"), copiedURL);
 
         struct http_url *finalURL = http_url_from_string(realState->currentPageUrl);
-        if (finalURL->had_explicit_fragment && finalURL->fragment[0]) {
+        if (finalURL != NULL && finalURL->had_explicit_fragment && finalURL->fragment[0]) {
             int *scrollPoint = getScrollPoint(realState, finalURL->fragment);
             if (scrollPoint) {
                 realState->globalScrollY = -(*scrollPoint);
             }
         }
+        HTTP_freeURL(finalURL);
     }
 
     getTextAreaByDescriptor(realState, "urlField")->visible = 1;
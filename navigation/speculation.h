@@ -0,0 +1,328 @@
+// Speculative loading: once the focused link has been dwelled on for a moment, its page is fetched in the
+// background (and, unless turned off, parsed and rendered too), so that pressing Enter can show it straight away.
+// Only one page is speculated on at a time, only with GET requests, and downloads are given up on as soon as
+// they grow past the memory cap. Moving to another link, or opening any page, cancels it.
+// Speculative requests carry no cookies and keep none, so merely focusing a link (e.g. one that logs out) changes
+// nothing; pages the user has cookies for, or whose response sets any, are left for the real load.
+
+#ifndef _NAV_SPECULATION
+    #define _NAV_SPECULATION 1
+
+#include "../http/http.h"
+#include "../http/response.h"
+#include "../http/url.h"
+#include "../utils/string.h"
+#include "../xml/nodes.h"
+
+// Needs render/html2nc.h, which has no include guard, to be included first (as links.h does)
+
+// How long (in milliseconds) a link has to stay focused before it's speculated on
+#define speculationDwellTime 400
+// Largest page body (and rendered document) that's kept for a speculation
+#define speculationMemoryCap (8 * 1024 * 1024)
+
+int NAV_speculationEnabled = 1;
+int NAV_prerenderEnabled = 1;
+
+void NAV_setSpeculationEnabled(int enabled) {
+    NAV_speculationEnabled = enabled;
+}
+
+int NAV_getSpeculationEnabled() {
+    return NAV_speculationEnabled;
+}
+
+void NAV_setPrerenderEnabled(int enabled) {
+    NAV_prerenderEnabled = enabled;
+}
+
+int NAV_getPrerenderEnabled() {
+    return NAV_prerenderEnabled;
+}
+
+// Returns 1 if the response should be rendered as HTML, rather than shown as plain text
+int NAV_isHTMLResponse(struct http_response *response) {
+    if (response->is_html) {
+        return 1;
+    }
+
+    char *lowerData = HTTP_toLowerCase(response->response_body.data);
+    int isHTML = !strncmp(lowerData, "<!doctype html", 14);
+    free(lowerData);
+    return isHTML;
+}
+
+// The document text for a page that's shown as plain text
+char *NAV_plainTextDocument(char *body) {
+    char *escaped = doubleStringBackslashes(body);
+    char *total = (char *) calloc(strlen(escaped) + 32, sizeof(char));
+    strcpy(total, "Page has no title\n\n\\H\n");
+    strcat(total, escaped);
+    return total;
+}
+
+// The document text for a page rendered by htmlToText
+char *NAV_richTextDocument(struct html2nc_result result) {
+    char *total = (char *) calloc(strlen(result.text) + strlen(result.title) + 8, sizeof(char));
+    strcpy(total, result.title);
+    strcat(total, "\n\n\\H\n");
+    strcat(total, result.text);
+    return total;
+}
+
+    #ifdef unix
+        #include <pthread.h>
+        #include <unistd.h>
+
+        struct nav_speculation {
+            // Absolute URL of the link
+            char *url;
+            char *userAgent;
+
+            pthread_t thread;
+            int notify[2];
+
+            // Guards `cancelled` (which is also read atomically without it) and `done`, which decide whether
+            // the thread or NAV_cancelSpeculation frees the speculation
+            pthread_mutex_t lock;
+            volatile int cancelled;
+            int done;
+
+            // Results, only read once the thread has been joined.
+            // A usable speculation has a response, or (when prerendered) the finished document text.
+            int hasResponse;
+            struct http_response response;
+            char *documentText;
+
+            // Set by the prerender if a stylesheet couldn't be loaded, which the real load reports
+            int styleSheetFailed;
+        };
+
+        struct nav_speculation *NAV_currentSpeculation = NULL;
+
+        void NAV_freeSpeculation(struct nav_speculation *speculation) {
+            if (speculation == NULL) return;
+
+            if (speculation->hasResponse) {
+                HTTP_freeResponse(&speculation->response);
+            }
+            free(speculation->documentText);
+            free(speculation->url);
+            free(speculation->userAgent);
+            close(speculation->notify[0]);
+            close(speculation->notify[1]);
+            pthread_mutex_destroy(&speculation->lock);
+            free(speculation);
+        }
+
+        void nav_onSpeculativeStyleSheetStart(void *_ptr, char *_href) {
+            (void) _ptr;
+            (void) _href;
+        }
+
+        void nav_onSpeculativeStyleSheetEvent(void *_ptr) {
+            (void) _ptr;
+        }
+
+        char *nav_onSpeculativeStyleSheetError(void *ptr, int _) {
+            (void) _;
+            ((struct nav_speculation *) ptr)->styleSheetFailed = 1;
+            return makeStrCpy("");
+        }
+
+        // Returns the document text for the response, or NULL if it has to be opened the usual way
+        char *nav_prerender(struct nav_speculation *speculation) {
+            if (!NAV_isHTMLResponse(&speculation->response)) {
+                return NAV_plainTextDocument(speculation->response.response_body.data);
+            }
+
+            struct xml_response xml = XML_parseXmlNodes(XML_xmlDataFromString(speculation->response.response_body.data));
+            if (xml.error) {
+                return NULL;
+            }
+
+            struct html2nc_result result = htmlToText(
+                xml.list,
+                speculation->response.response_body.data,
+                speculation->url,
+                speculation,
+                nav_onSpeculativeStyleSheetStart,
+                nav_onSpeculativeStyleSheetEvent,
+                nav_onSpeculativeStyleSheetEvent,
+                nav_onSpeculativeStyleSheetError
+            );
+            recursiveFreeXML(xml.list);
+
+            // <meta> refreshes are followed when the page is opened
+            if (result.finish_status == HTML2NC_REDIRECT) {
+                free(result.redirect_url);
+                return NULL;
+            }
+            // The page would look different from a real load, which reports the stylesheet's error
+            if (speculation->styleSheetFailed) {
+                free(result.title);
+                free(result.text);
+                return NULL;
+            }
+
+            char *total = NAV_richTextDocument(result);
+            free(result.title);
+            free(result.text);
+            return total;
+        }
+
+        void *nav_speculationThread(void *arg) {
+            struct nav_speculation *speculation = (struct nav_speculation *) arg;
+            socket_setThreadCancellation(&speculation->cancelled);
+            HTTP_ignoreTimingOnThread();
+            // Bodies past the cap (by Content-Length, or as they arrive) end the request with an error
+            HTTP_setBodyLimitOnThread(speculationMemoryCap);
+            HTTP_omitCredentialsOnThread();
+
+            // With its cookies, the page may well look different (e.g. when logged in)
+            if (!HTTP_hasCookiesFor(speculation->url)) {
+                // Redirects and errors are left for the real load, which reports them. So are responses that set
+                // cookies, which weren't kept. A cached body is never downloaded, so it's still checked against the cap here.
+                struct http_response response = http_makeHTTPRequest(speculation->url, speculation->userAgent, NULL, NULL, NULL);
+                if (response.error) {
+                    // Error responses are never filled in beyond the error code
+                } else if (response.do_redirect || response.response_body.length > speculationMemoryCap || HTTP_getHeader(&response, "set-cookie") != NULL) {
+                    HTTP_freeResponse(&response);
+                } else {
+                    speculation->response = response;
+                    speculation->hasResponse = 1;
+                }
+            }
+
+            if (speculation->hasResponse && NAV_prerenderEnabled && !__atomic_load_n(&speculation->cancelled, __ATOMIC_RELAXED)) {
+                speculation->documentText = nav_prerender(speculation);
+                if (speculation->documentText != NULL && strlen(speculation->documentText) > speculationMemoryCap) {
+                    free(speculation->documentText);
+                    speculation->documentText = NULL;
+                }
+            }
+            if (speculation->documentText != NULL) {
+                // The document text is all that's needed to show the page
+                HTTP_freeResponse(&speculation->response);
+                speculation->hasResponse = 0;
+            }
+
+            pthread_mutex_lock(&speculation->lock);
+            if (speculation->cancelled) {
+                // Nobody is going to join this thread
+                pthread_mutex_unlock(&speculation->lock);
+                NAV_freeSpeculation(speculation);
+                return NULL;
+            }
+            speculation->done = 1;
+            write(speculation->notify[1], "", 1);
+            pthread_mutex_unlock(&speculation->lock);
+
+            return NULL;
+        }
+
+        // Stops the current speculation without waiting for it (whatever it's doing finishes in the background)
+        void NAV_cancelSpeculation() {
+            struct nav_speculation *speculation = NAV_currentSpeculation;
+            if (speculation == NULL) return;
+            NAV_currentSpeculation = NULL;
+
+            pthread_mutex_lock(&speculation->lock);
+            __atomic_store_n(&speculation->cancelled, 1, __ATOMIC_RELAXED);
+            int done = speculation->done;
+            if (!done) {
+                // The thread frees the speculation once it notices, which may be as soon as the lock is released
+                pthread_detach(speculation->thread);
+            }
+            pthread_mutex_unlock(&speculation->lock);
+
+            if (done) {
+                pthread_join(speculation->thread, NULL);
+                NAV_freeSpeculation(speculation);
+            }
+        }
+
+        // Starts loading `url` (absolute) in the background, replacing any other speculation
+        void NAV_speculate(char *url, char *userAgent) {
+            if (!NAV_speculationEnabled) return;
+            if (NAV_currentSpeculation != NULL && !strcmp(NAV_currentSpeculation->url, url)) return;
+
+            NAV_cancelSpeculation();
+
+            // Only pages that come from the network are worth loading early
+            struct http_url *parsedURL = http_url_from_string(url);
+            if (parsedURL == NULL) return;
+            int isNetworkURL = !strcmp(parsedURL->protocol, "http") || !strcmp(parsedURL->protocol, "https");
+            HTTP_freeURL(parsedURL);
+            if (!isNetworkURL) return;
+
+            struct nav_speculation *speculation = (struct nav_speculation *) calloc(1, sizeof(struct nav_speculation));
+            if (pipe(speculation->notify)) {
+                free(speculation);
+                return;
+            }
+            speculation->url = makeStrCpy(url);
+            speculation->userAgent = makeStrCpy(userAgent);
+            pthread_mutex_init(&speculation->lock, NULL);
+
+            if (pthread_create(&speculation->thread, NULL, nav_speculationThread, speculation)) {
+                NAV_freeSpeculation(speculation);
+                return;
+            }
+            NAV_currentSpeculation = speculation;
+        }
+
+        /*
+        Takes the speculation for `url`, waiting for it to finish if needed (CTRL+X still works meanwhile).
+        Returns the speculation (free it with NAV_freeSpeculation), or NULL if there isn't a usable one.
+        Any speculation for a different URL is cancelled. Sets `cancelled` if the user cancelled while waiting.
+        */
+        struct nav_speculation *NAV_takeSpeculation(char *url, int *cancelled) {
+            *cancelled = 0;
+
+            struct nav_speculation *speculation = NAV_currentSpeculation;
+            if (speculation == NULL || strcmp(speculation->url, url)) {
+                NAV_cancelSpeculation();
+                return NULL;
+            }
+
+            socket_resetCancellation();
+            struct socket_info waitInfo = socket_makeInfo();
+            waitInfo.descriptor = speculation->notify[0];
+            if (socket_wait(&waitInfo, SOCKET_WANT_READ)) {
+                *cancelled = 1;
+                NAV_cancelSpeculation();
+                return NULL;
+            }
+
+            pthread_join(speculation->thread, NULL);
+            NAV_currentSpeculation = NULL;
+
+            if (!speculation->hasResponse && speculation->documentText == NULL) {
+                NAV_freeSpeculation(speculation);
+                return NULL;
+            }
+            return speculation;
+        }
+
+    #else
+
+        struct nav_speculation {
+            int hasResponse;
+            struct http_response response;
+            char *documentText;
+        };
+
+        void NAV_freeSpeculation(struct nav_speculation *_speculation) { }
+
+        void NAV_cancelSpeculation() { }
+
+        void NAV_speculate(char *_url, char *_userAgent) { }
+
+        struct nav_speculation *NAV_takeSpeculation(char *_url, int *cancelled) {
+            *cancelled = 0;
+            return NULL;
+        }
+
+    #endif
+#endif
@@ -1017,6 +1017,32 @@ void printText(struct nc_state *state, int y, int x, char *badlyTypedText, int i
     free(fullHorizontalRow);
 }
 
+// The page that link addresses were last resolved against, so it's only parsed again once it changes
+char *nc_linkBaseString = NULL;
+struct http_url *nc_linkBase = NULL;
+struct string_builder nc_linkAddress = { NULL, 0, 0 };
+
+// Returns where a link on the current page goes, which stays valid until the next call
+char *nc_resolveLinkAddress(struct nc_state *state, char *link) {
+    if (nc_linkBaseString == NULL || strcmp(nc_linkBaseString, state->currentPageUrl)) {
+        free(nc_linkBaseString);
+        HTTP_freeURL(nc_linkBase);
+        nc_linkBaseString = makeStrCpy(state->currentPageUrl);
+        nc_linkBase = http_url_from_string(state->currentPageUrl);
+    }
+    if (nc_linkAddress.data == NULL) {
+        nc_linkAddress = makeStringBuilder(256);
+    }
+
+    clearStringBuilder(&nc_linkAddress);
+    if (nc_linkBase == NULL) {
+        appendStringToBuilder(&nc_linkAddress, link);
+    } else {
+        http_appendResolvedURL(&nc_linkAddress, nc_linkBase, nc_linkBaseString, link);
+    }
+    return nc_linkAddress.data;
+}
+
 void render_nc(struct nc_state *browserState) {
     const double linkAddressScreenPercentage = 75; // The amount of space that the bottom text showing where a URL will go to can take up on the screen.
 
@@ -1094,17 +1120,20 @@ void render_nc(struct nc_state *browserState) {
                 if (!strncmp(btn.descriptor, "_temp_linkto_", 13)) {
                     getmaxyx(stdscr, my, mx);
                     char *lnk = btn.descriptor + 15;
-                    char *resolvedLnk = http_resolveRelativeURL(http_url_from_string(browserState->currentPageUrl), browserState->currentPageUrl, lnk);
+                    char *resolvedLnk = nc_resolveLinkAddress(browserState, lnk);
                     char *shortenedLink = shortenStringWithEllipses(resolvedLnk, mx*(linkAddressScreenPercentage/100.0));
+                    char *escapedLink = doubleStringBackslashes(shortenedLink);
                     printText(
                         browserState,
                         (my - browserState->globalScrollY) - 1,
                         (mx - browserState->globalScrollX) - strlen(shortenedLink),
-                        doubleStringBackslashes(shortenedLink),
+                        escapedLink,
                         1,
                         -1,
                         0
                     );
+                    free(escapedLink);
+                    free(shortenedLink);
                 } else if (!strncmp(btn.descriptor, "_temp_noop_", 11)) {
                     getmaxyx(stdscr, my, mx);
                     char *lnk = btn.descriptor + 13;
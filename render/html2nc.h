@@ -3,6 +3,7 @@
 #include "../css/block-inline.h"
 #include "../css/parse-selectors.h"
 #include "../css/styles.h"
+#include "../http/pipeline.h"
 #include "../http/url.h"
 #include "../navigation/download.h"
 #include "../utils/log.h"
@@ -11,6 +12,14 @@
 #include "../xml/entities.h"
 #include "../xml/nodes.h"
 
+#ifdef unix
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+#define maxStyleSheetFetchesPerHost 6
+#define maxConcurrentStyleSheetFetches 16
+
 // Ptr passed, along with URL of stylesheet
 typedef void (*onStyleSheetDownloadStart)(void *, char *);
 
@@ -95,6 +104,17 @@ struct html2nc_state {
 
     enum html2nc_finish_status finish_status;
     char *redirect_url;
+
+    // Stylesheets that were fetched before rendering (see HTML_prefetchStyleSheets)
+    char **prefetched_urls;
+    struct http_response *prefetched_responses;
+    int prefetched_count;
+
+    // Matching CSS rules happens once per element, so it's timed here and recorded once per document
+    int timing_stages;
+    long long match_start;
+    long long match_end;
+    long long match_busy;
 };
 
 struct html2nc_result {
@@ -125,6 +145,291 @@ char *getInputRendered(char *text, int width) {
     return resultingText;
 }
 
+// Adds the absolute URL of every <link rel="stylesheet"> in `xml`, in document order
+void HTML_collectStyleSheetURLs(struct xml_list xml, char *baseURL, char ***urls, int *count) {
+    for (int i = 0; i < xml.count; i ++) {
+        struct xml_node node = xml.nodes[i];
+        if (node.type != NODE_ELEMENT) {
+            continue;
+        }
+
+        char *lower = toLowerCase(node.name);
+        if (!strcmp(lower, "link")) {
+            struct xml_attrib_result attrib_result = XML_parseAttributes(node.attribute_content);
+            if (!attrib_result.error) {
+                char *rel = XML_getAttributeByName(attrib_result.attribs, "rel");
+                char *type = XML_getAttributeByName(attrib_result.attribs, "type");
+                char *href = XML_getAttributeByName(attrib_result.attribs, "href");
+                char *lowerRel = rel ? toLowerCase(rel) : NULL;
+
+                if (lowerRel && !strcmp(lowerRel, "stylesheet") && href && (!type || !strcmp(type, "text/css") || !strcmp(type, ""))) {
+                    struct http_url *url = http_url_from_string(baseURL);
+                    if (url != NULL) {
+                        (*count) ++;
+                        *urls = (char **) realloc(*urls, sizeof(char *) * *count);
+                        (*urls)[*count - 1] = http_resolveRelativeURL(url, baseURL, href);
+                    }
+                    HTTP_freeURL(url);
+                }
+
+                free(lowerRel);
+                freeXMLAttributes(attrib_result.attribs);
+            }
+        }
+        free(lower);
+
+        HTML_collectStyleSheetURLs(node.children, baseURL, urls, count);
+    }
+}
+
+// Returns "scheme://host:port" for an absolute URL, or NULL
+char *HTML_getURLOrigin(char *charURL) {
+    errno = 0;
+    struct http_url *url = http_url_from_string(charURL);
+    if (errno || url == NULL) {
+        return NULL;
+    }
+
+    char *origin = (char *) calloc(strlen(url->protocol) + strlen(url->hostname) + 16, sizeof(char));
+    sprintf(origin, "%s://%s:%d", url->protocol, url->hostname, url->port);
+
+    HTTP_freeURL(url);
+
+    return origin;
+}
+
+// One unit of work for HTML_prefetchStyleSheets: a single stylesheet, or (with pipelining) every stylesheet of an origin
+struct html_stylesheet_fetch {
+    char **urls;
+    int count;
+    char *origin;
+    struct http_response *responses;
+
+    int index;
+    int started;
+    int joined;
+
+    #ifdef unix
+        pthread_t thread;
+    #endif
+    // The fetching thread writes its index here when it's done
+    int notify;
+    // The cancellation flag of the thread that started the fetch
+    volatile int *cancellation;
+};
+
+void *HTML_styleSheetFetchThread(void *arg) {
+    struct html_stylesheet_fetch *fetch = (struct html_stylesheet_fetch *) arg;
+    socket_setThreadCancellation(fetch->cancellation);
+
+    // Runs without any UI callbacks; errors and redirects are dealt with when the stylesheet is applied
+    fetch->responses = http_makePipelinedHTTPRequests(fetch->urls, fetch->count, "uqers");
+    for (int i = 0; i < fetch->count; i ++) {
+        HTTP_storeInMemoryCache(HTTP_getGlobalMemoryCache(), fetch->urls[i], &fetch->responses[i]);
+    }
+
+    // Writes this small are atomic, so indices never get mixed up
+    write(fetch->notify, &fetch->index, sizeof(fetch->index));
+    return NULL;
+}
+
+// Returns the number of fetches to `origin` that are running
+int HTML_countRunningFetches(struct html_stylesheet_fetch *fetches, int count, char *origin) {
+    int running = 0;
+    for (int i = 0; i < count; i ++) {
+        if (fetches[i].started && !fetches[i].joined && !strcmp(fetches[i].origin, origin)) {
+            running ++;
+        }
+    }
+    return running;
+}
+
+// Fetches every stylesheet of the document at once (at most maxStyleSheetFetchesPerHost per origin) before
+// rendering, so that loading them takes about as long as the slowest one instead of the sum of all of them.
+// They're still applied in document order while rendering. With pipelining enabled, or for an origin that
+// speaks HTTP/2, the stylesheets of an origin share one connection instead. Input is handled (and can cancel the fetches) while waiting.
+void HTML_prefetchStyleSheets(struct xml_list xml, char *baseURL, struct html2nc_state *state) {
+    #ifdef unix
+        char **urls = NULL;
+        int count = 0;
+        HTML_collectStyleSheetURLs(xml, baseURL, &urls, &count);
+
+        // Stylesheets used recently don't need to be requested at all, and one used twice is only fetched once
+        int uniqueCount = 0;
+        for (int i = 0; i < count; i ++) {
+            int seen = HTTP_isInMemoryCache(HTTP_getGlobalMemoryCache(), urls[i]);
+            for (int j = 0; j < uniqueCount && !seen; j ++) {
+                seen = !strcmp(urls[i], urls[j]);
+            }
+            if (seen) {
+                free(urls[i]);
+            } else {
+                urls[uniqueCount] = urls[i];
+                uniqueCount ++;
+            }
+        }
+        count = uniqueCount;
+
+        char **origins = (char **) calloc(count + 1, sizeof(char *));
+        for (int i = 0; i < count; i ++) {
+            origins[i] = HTML_getURLOrigin(urls[i]);
+        }
+
+        int notify[2];
+        if (count == 0 || pipe(notify)) {
+            for (int i = 0; i < count; i ++) {
+                free(urls[i]);
+                free(origins[i]);
+            }
+            free(urls);
+            free(origins);
+            return;
+        }
+
+        // Group the URLs into fetches
+        struct html_stylesheet_fetch *fetches = (struct html_stylesheet_fetch *) calloc(count, sizeof(struct html_stylesheet_fetch));
+        int numFetches = 0;
+        int *grouped = (int *) calloc(count, sizeof(int));
+        for (int i = 0; i < count; i ++) {
+            if (grouped[i] || origins[i] == NULL) {
+                continue;
+            }
+
+            struct html_stylesheet_fetch *fetch = &fetches[numFetches];
+            numFetches ++;
+            fetch->urls = (char **) calloc(count, sizeof(char *));
+            fetch->origin = origins[i];
+            fetch->index = numFetches - 1;
+            fetch->notify = notify[1];
+            fetch->cancellation = socket_threadCancellation;
+            for (int j = i; j < count; j ++) {
+                int sameFetch = j == i || ((HTTP_getPipeliningEnabled() || HTTP2_isKnownOrigin(origins[i])) && !grouped[j] && origins[j] && !strcmp(origins[i], origins[j]));
+                if (sameFetch) {
+                    grouped[j] = 1;
+                    fetch->urls[fetch->count] = urls[j];
+                    fetch->count ++;
+                }
+            }
+        }
+
+        struct socket_info waitInfo = socket_makeInfo();
+        waitInfo.descriptor = notify[0];
+
+        int running = 0;
+        int cancelled = 0;
+        while (1) {
+            for (int i = 0; i < numFetches && !cancelled; i ++) {
+                struct html_stylesheet_fetch *fetch = &fetches[i];
+                if (fetch->started || running >= maxConcurrentStyleSheetFetches || HTML_countRunningFetches(fetches, numFetches, fetch->origin) >= maxStyleSheetFetchesPerHost) {
+                    continue;
+                }
+                fetch->started = !pthread_create(&fetch->thread, NULL, HTML_styleSheetFetchThread, fetch);
+                running += fetch->started;
+            }
+            if (running == 0) {
+                break;
+            }
+
+            // Once cancelled, the running fetches notice by themselves and end soon after; the read below waits for them
+            if (!cancelled && socket_wait(&waitInfo, SOCKET_WANT_READ)) {
+                cancelled = 1;
+            }
+
+            int finished[maxConcurrentStyleSheetFetches];
+            int bytesRead = read(notify[0], finished, sizeof(finished));
+            for (int i = 0; i < bytesRead / (int) sizeof(int); i ++) {
+                pthread_join(fetches[finished[i]].thread, NULL);
+                fetches[finished[i]].joined = 1;
+                running --;
+            }
+        }
+        close(notify[0]);
+        close(notify[1]);
+
+        // Fetches that never started are downloaded while rendering, as usual
+        for (int i = 0; i < numFetches; i ++) {
+            struct html_stylesheet_fetch *fetch = &fetches[i];
+            if (fetch->joined) {
+                state->prefetched_urls = (char **) realloc(state->prefetched_urls, sizeof(char *) * (state->prefetched_count + fetch->count));
+                state->prefetched_responses = (struct http_response *) realloc(state->prefetched_responses, sizeof(struct http_response) * (state->prefetched_count + fetch->count));
+                for (int j = 0; j < fetch->count; j ++) {
+                    state->prefetched_urls[state->prefetched_count] = makeStrCpy(fetch->urls[j]);
+                    state->prefetched_responses[state->prefetched_count] = fetch->responses[j];
+                    state->prefetched_count ++;
+                }
+                free(fetch->responses);
+            }
+            free(fetch->urls);
+        }
+
+        for (int i = 0; i < count; i ++) {
+            free(urls[i]);
+            free(origins[i]);
+        }
+        free(urls);
+        free(origins);
+        free(grouped);
+        free(fetches);
+    #endif
+}
+
+// Downloads a stylesheet, or takes it from the in-memory cache if it was used recently. Returns its body (free it with free()).
+char *HTML_downloadStyleSheet(void *ptr, char *url, onStyleSheetDownloadProgress onProgress, onStyleSheetDownloadError onError) {
+    struct http_memory_cache *cache = HTTP_getGlobalMemoryCache();
+
+    struct http_data cached;
+    int status = HTTP_beginMemoryCacheFetch(cache, url, &cached);
+    if (status == 1) {
+        return cached.data;
+    }
+    if (status == -1) {
+        // Cancelled while another thread was fetching it, the same as a cancelled download
+        return onError(ptr, 190);
+    }
+
+    // downloadPage replaces the URL when it follows a redirect, but the response is kept under the one that was asked for
+    char *redirectedURL = url;
+    struct http_response response = downloadPage(
+        ptr,
+        "uqers",
+        &redirectedURL,
+        onProgress,
+        NULL,
+        0,
+        onError,
+        defaultonredirecthandler,
+        defaultonredirectsuccesshandler,
+        defaultonredirecterrorhandler
+    );
+    // Should this check the content type of the response?
+
+    HTTP_storeInMemoryCache(cache, url, &response);
+
+    if (redirectedURL != url) {
+        free(redirectedURL);
+    }
+
+    // Stylesheets from file:// URLs are mapped, but the caller frees what's returned
+    char *body = HTTP_takeResponseBody(&response);
+    HTTP_freeResponse(&response);
+    return body;
+}
+
+// Returns the prefetched body of a stylesheet, or NULL if it has to be downloaded
+char *HTML_getPrefetchedStyleSheet(struct html2nc_state *state, char *url) {
+    for (int i = 0; i < state->prefetched_count; i ++) {
+        struct http_response response = state->prefetched_responses[i];
+        if (!strcmp(state->prefetched_urls[i], url)) {
+            // Errors and redirects go through downloadPage so that they're handled the usual way
+            if (response.error || response.do_redirect) {
+                return NULL;
+            }
+            return response.response_body.data;
+        }
+    }
+    return NULL;
+}
+
 char *recursiveXMLToText(
     struct xml_list xml,
     struct html2nc_state *state,
@@ -198,6 +503,7 @@ char *recursiveXMLToText(
                 }
             }
 
+            long long matchStart = state->timing_stages ? socket_nowMicroseconds() : 0;
             struct css_styling elementStyling = CSS_getDefaultStylesFromElement(node, attributes, persistentStyles);
             struct css_styling parentStyling;
             if (node.parent) {
@@ -205,6 +511,13 @@ char *recursiveXMLToText(
             } else {
                 parentStyling = CSS_getDefaultStyles();
             }
+            if (state->timing_stages) {
+                state->match_end = socket_nowMicroseconds();
+                state->match_busy += state->match_end - matchStart;
+                if (state->match_start == 0) {
+                    state->match_start = matchStart;
+                }
+            }
 
             char *lower = toLowerCase(node.name);
             int hLevel = HTML_headerLevel(node.name);
@@ -270,7 +583,9 @@ char *recursiveXMLToText(
                 if (!type || !strcmp(type, "text/css")) {
                     if (node.children.count) {
                         if (node.children.nodes[0].text_content) {
+                            int cssStage = HTTP_startTimingStage("Parse CSS (CSS_applyStyleData)");
                             CSS_applyStyleData(persistentStyles, node.children.nodes[0].text_content);
+                            HTTP_finishTimingStage(cssStage);
                         } else {
                             log_warn("<style> tag had child with no text content\n");
                         }
@@ -296,23 +611,16 @@ char *recursiveXMLToText(
                                 struct http_url *url = http_url_from_string(baseURL);
 
                                 char *absoluteURL = http_resolveRelativeURL(url, baseURL, href);
+                                HTTP_freeURL(url);
 
-                                struct http_response initialResponse = downloadPage(
-                                    ptr,
-                                    "uqers",
-                                    &absoluteURL,
-                                    onProgress,
-                                    NULL,
-                                    0,
-                                    onError,
-                                    defaultonredirecthandler,
-                                    defaultonredirectsuccesshandler,
-                                    defaultonredirecterrorhandler
-                                );
-                                // Should this check the content type of the response?
-
-                                char *styling = initialResponse.response_body.data;
+                                char *prefetched = HTML_getPrefetchedStyleSheet(state, absoluteURL);
+                                char *styling = prefetched ? prefetched : HTML_downloadStyleSheet(ptr, absoluteURL, onProgress, onError);
+                                int cssStage = HTTP_startTimingStage("Parse CSS (CSS_applyStyleData)");
                                 CSS_applyStyleData(persistentStyles, styling);
+                                HTTP_finishTimingStage(cssStage);
+                                if (!prefetched) {
+                                    free(styling);
+                                }
 
                                 onComplete(ptr);
                             } else {
@@ -831,6 +1139,17 @@ struct html2nc_result htmlToText(
     state.title = NULL;
     state.finish_status = HTML2NC_SUCCESS;
     state.redirect_url = NULL;
+    state.prefetched_urls = NULL;
+    state.prefetched_responses = NULL;
+    state.prefetched_count = 0;
+    state.timing_stages = HTTP_isTimingStages();
+    state.match_start = 0;
+    state.match_end = 0;
+    state.match_busy = 0;
+
+    int prefetchStage = HTTP_startTimingStage("Fetch stylesheets");
+    HTML_prefetchStyleSheets(xml, baseURL, &state);
+    HTTP_finishTimingStage(prefetchStage);
 
     int *jhiibwt = (int *) calloc(1, sizeof(int));
 
@@ -854,6 +1173,8 @@ struct html2nc_result htmlToText(
 
     free(jhiibwt);
 
+    HTTP_recordTimingStage("Match CSS rules", state.match_start, state.match_end, state.match_busy);
+
     // Default title, if title wasn't set
     if (state.title == NULL) {
         result.title = makeStrCpy("Page has no title");
@@ -865,6 +1186,15 @@ struct html2nc_result htmlToText(
 
     free(state.title);
 
+    for (int i = 0; i < state.prefetched_count; i ++) {
+        free(state.prefetched_urls[i]);
+        if (!state.prefetched_responses[i].error) {
+            HTTP_freeResponse(&state.prefetched_responses[i]);
+        }
+    }
+    free(state.prefetched_urls);
+    free(state.prefetched_responses);
+
     result.finish_status = state.finish_status;
     result.redirect_url = state.redirect_url;
 
@@ -1,12 +1,407 @@
-
 #ifndef _SOCKET_GENERIC
     #define _SOCKET_GENERIC 1
 
+    #include <stdint.h>
+    #include <stdlib.h>
+    #include <time.h>
+
+    #ifdef unix
+        #include <errno.h>
+        #include <poll.h>
+        #include <pthread.h>
+        #include <sys/uio.h>
+    #else
+        struct iovec {
+            void *iov_base;
+            size_t iov_len;
+        };
+    #endif
+
 struct socket_info {
     int descriptor;
     int bytesRead;
     int error;
     void *extra;
+
+    // One of `enum socket_stage`; transports use this to know how far a non-blocking connect has got
+    int stage;
+
+    // Monotonic times in milliseconds (see socket_now), or 0 for none. Waits fail with SOCKET_TIMED_OUT once
+    // `deadline` (for the current step, e.g. waiting for a reply) has passed, and with SOCKET_EXPIRED once
+    // `final_deadline` (for everything done with the socket) has.
+    long long deadline;
+    long long final_deadline;
+};
+
+enum socket_stage {
+    SOCKET_STAGE_TCP_CONNECTING,
+    SOCKET_STAGE_TLS_HANDSHAKE,
+    SOCKET_STAGE_CONNECTED,
+};
+
+// Returned by transport steps. Negative values are errors:
+/*
+-1: Error while creating socket
+-2: Error while connecting (errno is set to the reason)
+-3: Error while sending data
+-4: Error while receiving data
+-6: Error initializing SSL/TLS
+-7: SSL/TLS handshake failed
+-8: Cancelled by the event source (SOCKET_CANCELLED)
+-9: The step's deadline passed (SOCKET_TIMED_OUT)
+-10: The socket's final deadline passed (SOCKET_EXPIRED)
+-11: There wasn't enough memory for the data (SOCKET_NO_MEMORY)
+*/
+enum socket_status {
+    SOCKET_NO_MEMORY = -11,
+    SOCKET_EXPIRED = -10,
+    SOCKET_TIMED_OUT = -9,
+    SOCKET_CANCELLED = -8,
+    SOCKET_DONE = 0,
+    SOCKET_WANT_READ = 1,
+    SOCKET_WANT_WRITE = 2,
+};
+
+// Every step is non-blocking: when it can't make progress it returns SOCKET_WANT_READ or SOCKET_WANT_WRITE,
+// and should be called again once the descriptor is ready (see socket_wait).
+struct socket_transport {
+    // Params: socket, IP address, hostname, port
+    int (*connect)(struct socket_info *, const char *, const char *, int);
+
+    // Continues a connect that returned SOCKET_WANT_READ/SOCKET_WANT_WRITE
+    int (*continueConnect)(struct socket_info *);
+
+    // Params: socket, data, length, number of bytes written (out)
+    int (*write)(struct socket_info *, const char *, int, int *);
+
+    // Params: socket, buffer, maximum amount, number of bytes read (out). 0 bytes read with SOCKET_DONE means end of stream.
+    // Data is written directly into the buffer; it is not NUL-terminated.
+    int (*read)(struct socket_info *, char *, int, int *);
+
+    // Like read, but fills several regions in order. Params: socket, regions, number of regions, number of bytes read (out)
+    int (*readv)(struct socket_info *, struct iovec *, int, int *);
+
+    void (*close)(struct socket_info *);
+};
+
+struct socket_info socket_makeInfo() {
+    struct socket_info info;
+    info.descriptor = -1;
+    info.bytesRead = 0;
+    info.error = 0;
+    info.extra = NULL;
+    info.stage = SOCKET_STAGE_TCP_CONNECTING;
+    info.deadline = 0;
+    info.final_deadline = 0;
+
+    return info;
+}
+
+long long socket_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// The same clock in microseconds, for measuring how long things take
+long long socket_nowMicroseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// The deadline for a step that may take `timeout` milliseconds from now, or 0 if it has no limit
+long long socket_deadlineAfter(int timeout) {
+    return timeout > 0 ? socket_now() + timeout : 0;
+}
+
+// Params: argument given to socket_setEventSource. Returns nonzero to cancel the operation being waited on.
+typedef int (*socketEventHandler)(void *);
+
+// An extra descriptor (e.g. stdin) that is polled together with whatever socket is being waited on,
+// so that the UI can keep handling input while a page downloads.
+// Only the thread that set the event source handles it; other threads just notice cancellation.
+struct socket_event_source {
+    int descriptor;
+    socketEventHandler handler;
+    void *arg;
+
+    // Once set, every wait fails with SOCKET_CANCELLED until socket_resetCancellation is called
+    volatile int cancelled;
+
+    #ifdef unix
+        pthread_t thread;
+    #endif
+};
+
+// How often (in milliseconds) waits on other threads check whether they've been cancelled
+    #define socketCancellationCheckInterval 100
+
+// `thread` is only meaningful once a handler has been set
+struct socket_event_source socket_eventSource = { .descriptor = -1, .handler = NULL, .arg = NULL, .cancelled = 0 };
+
+void socket_setEventSource(int descriptor, socketEventHandler handler, void *arg) {
+    socket_eventSource.descriptor = descriptor;
+    socket_eventSource.handler = handler;
+    socket_eventSource.arg = arg;
+    socket_eventSource.cancelled = 0;
+    #ifdef unix
+        socket_eventSource.thread = pthread_self();
+    #endif
+}
+
+void socket_resetCancellation() {
+    socket_eventSource.cancelled = 0;
+}
+
+// A flag that cancels waits made by the calling thread (e.g. background work that's no longer needed), set with
+// __atomic_store_n. Such a thread isn't cancelled by the event source. Threads started on its behalf should
+// call this with the same flag.
+__thread volatile int *socket_threadCancellation = NULL;
+
+void socket_setThreadCancellation(volatile int *flag) {
+    socket_threadCancellation = flag;
+}
+
+int socket_isCancelled() {
+    if (socket_threadCancellation != NULL) {
+        return __atomic_load_n(socket_threadCancellation, __ATOMIC_RELAXED);
+    }
+    return socket_eventSource.cancelled;
+}
+
+    #ifdef unix
+
+// Blocks until the socket is ready for what the last step asked for, handling the event source in the meantime.
+// Returns 0 when ready, SOCKET_CANCELLED if the event source cancelled the wait, SOCKET_TIMED_OUT/SOCKET_EXPIRED
+// once one of the socket's deadlines has passed, or -1 on error.
+// A negative descriptor just waits for a deadline (or cancellation).
+int socket_wait(struct socket_info *info, int status) {
+    struct pollfd fds[2];
+    fds[0].fd = info->descriptor;
+    fds[0].events = status == SOCKET_WANT_WRITE ? POLLOUT : POLLIN;
+    fds[0].revents = 0;
+
+    int numFds = 1;
+    int isEventThread = socket_eventSource.handler != NULL && pthread_equal(pthread_self(), socket_eventSource.thread);
+    if (isEventThread) {
+        fds[1].fd = socket_eventSource.descriptor;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        numFds = 2;
+    }
+
+    int canBeCancelled = socket_eventSource.handler != NULL || socket_threadCancellation != NULL;
+    while (1) {
+        if (socket_isCancelled()) {
+            return SOCKET_CANCELLED;
+        }
+
+        int timeout = isEventThread || !canBeCancelled ? -1 : socketCancellationCheckInterval;
+        if (info->deadline || info->final_deadline) {
+            long long now = socket_now();
+            if (info->final_deadline && now >= info->final_deadline) {
+                return SOCKET_EXPIRED;
+            }
+            if (info->deadline && now >= info->deadline) {
+                return SOCKET_TIMED_OUT;
+            }
+
+            long long nearest = info->deadline && (!info->final_deadline || info->deadline < info->final_deadline) ? info->deadline : info->final_deadline;
+            if (timeout == -1 || nearest - now < timeout) {
+                timeout = (int) (nearest - now);
+            }
+        }
+
+        int res = poll(fds, numFds, timeout);
+        if (res < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (numFds == 2 && fds[1].revents) {
+            if (socket_eventSource.handler(socket_eventSource.arg)) {
+                socket_eventSource.cancelled = 1;
+                return SOCKET_CANCELLED;
+            }
+        }
+
+        // POLLERR/POLLHUP are reported as ready so that the next step can report the real error
+        if (fds[0].revents) {
+            return 0;
+        }
+    }
+}
+
+    #else
+
+int socket_wait(struct socket_info *_info, int _status) {
+    return -1;
+}
+
+    #endif
+
+// Waits for `milliseconds` (e.g. before trying again), handling the event source in the meantime.
+// Returns 0, or SOCKET_CANCELLED.
+int socket_sleep(int milliseconds) {
+    struct socket_info info = socket_makeInfo();
+    info.deadline = socket_deadlineAfter(milliseconds > 0 ? milliseconds : 1);
+
+    int res = socket_wait(&info, SOCKET_WANT_READ);
+    return res == SOCKET_CANCELLED ? SOCKET_CANCELLED : 0;
+}
+
+// Connects, waiting for readiness between steps. Returns SOCKET_DONE or a negative error.
+// The connect has to be done by `info->deadline`; a TLS handshake then gets `handshakeTimeout` milliseconds
+// of its own (0 for no limit). On a timeout, `info->stage` tells which of the two took too long.
+// `connectedAt` (if not NULL, and 0 to begin with) is set to when the TCP connection was made (see socket_nowMicroseconds).
+int socket_connect(struct socket_transport *transport, struct socket_info *info, const char *address, const char *hostname, int port, int handshakeTimeout, long long *connectedAt) {
+    int stage = info->stage;
+    int status = transport->connect(info, address, hostname, port);
+    while (status > 0) {
+        if (info->stage != stage && info->stage == SOCKET_STAGE_TLS_HANDSHAKE) {
+            info->deadline = socket_deadlineAfter(handshakeTimeout);
+            if (connectedAt != NULL) {
+                *connectedAt = socket_nowMicroseconds();
+            }
+        }
+        stage = info->stage;
+
+        int waitRes = socket_wait(info, status);
+        if (waitRes) {
+            transport->close(info);
+            return waitRes == -1 ? -2 : waitRes;
+        }
+        status = transport->continueConnect(info);
+    }
+    // Without TLS, the connection is made once everything is done
+    if (status == SOCKET_DONE && connectedAt != NULL && *connectedAt == 0) {
+        *connectedAt = socket_nowMicroseconds();
+    }
+    return status;
+}
+
+// Writes all of `data`. Returns SOCKET_DONE or a negative error.
+int socket_writeAll(struct socket_transport *transport, struct socket_info *info, const char *data, int length) {
+    int totalWritten = 0;
+    while (totalWritten < length) {
+        int written = 0;
+        int status = transport->write(info, data + totalWritten, length - totalWritten, &written);
+        if (status < 0) {
+            return status;
+        }
+        totalWritten += written;
+        if (status > 0) {
+            int waitRes = socket_wait(info, status);
+            if (waitRes) {
+                return waitRes == -1 ? -3 : waitRes;
+            }
+        }
+    }
+    return SOCKET_DONE;
+}
+
+// Reads whatever is available (waiting if nothing is). Returns the number of bytes read (0 at end of stream), or a negative error.
+int socket_readv(struct socket_transport *transport, struct socket_info *info, struct iovec *regions, int numRegions) {
+    while (1) {
+        int bytesRead = 0;
+        int status = transport->readv(info, regions, numRegions, &bytesRead);
+        if (status < 0) {
+            return status;
+        }
+        if (status == SOCKET_DONE) {
+            return bytesRead;
+        }
+        int waitRes = socket_wait(info, status);
+        if (waitRes) {
+            return waitRes == -1 ? -4 : waitRes;
+        }
+    }
+}
+
+// Reads whatever is available (waiting if nothing is). Returns the number of bytes read (0 at end of stream), or a negative error.
+int socket_read(struct socket_transport *transport, struct socket_info *info, char *buffer, int amount) {
+    while (1) {
+        int bytesRead = 0;
+        int status = transport->read(info, buffer, amount, &bytesRead);
+        if (status < 0) {
+            return status;
+        }
+        if (status == SOCKET_DONE) {
+            return bytesRead;
+        }
+        int waitRes = socket_wait(info, status);
+        if (waitRes) {
+            return waitRes == -1 ? -4 : waitRes;
+        }
+    }
+}
+
+// A caller-owned receive buffer that reads land in directly. `length` bytes of `data` are in use;
+// the data is always followed by a NUL byte so that text can be handed on as-is.
+struct socket_buffer {
+    char *data;
+    int64_t length;
+    int64_t capacity;
 };
 
+// If the memory can't be allocated, `data` is NULL (and `capacity` 0)
+struct socket_buffer socket_makeBuffer(int64_t capacity) {
+    struct socket_buffer buffer;
+    buffer.data = capacity >= 0 ? (char *) calloc(capacity + 1, sizeof(char)) : NULL;
+    buffer.length = 0;
+    buffer.capacity = buffer.data != NULL ? capacity : 0;
+
+    return buffer;
+}
+
+// Makes sure that at least `amount` more bytes fit, growing geometrically. Returns 0, or SOCKET_NO_MEMORY if the
+// buffer couldn't grow (it's left as it was).
+int socket_reserveBuffer(struct socket_buffer *buffer, int64_t amount) {
+    if (buffer->data != NULL && buffer->capacity - buffer->length >= amount) {
+        return 0;
+    }
+
+    int64_t newCapacity = buffer->capacity ? buffer->capacity : 1;
+    while (newCapacity - buffer->length < amount) {
+        if (newCapacity > INT64_MAX / 2) {
+            return SOCKET_NO_MEMORY;
+        }
+        newCapacity *= 2;
+    }
+
+    char *data = (char *) realloc(buffer->data, newCapacity + 1);
+    if (data == NULL) {
+        return SOCKET_NO_MEMORY;
+    }
+    if (buffer->data == NULL) {
+        data[0] = '\0';
+    }
+    buffer->data = data;
+    buffer->capacity = newCapacity;
+    return 0;
+}
+
+// Reads up to `amount` bytes onto the end of the buffer. Returns the number of bytes read (0 at end of stream), or a negative error.
+int socket_readIntoBuffer(struct socket_transport *transport, struct socket_info *info, struct socket_buffer *buffer, int amount) {
+    if (socket_reserveBuffer(buffer, amount)) {
+        return SOCKET_NO_MEMORY;
+    }
+
+    int bytesRead = socket_read(transport, info, buffer->data + buffer->length, amount);
+    if (bytesRead > 0) {
+        buffer->length += bytesRead;
+    }
+    buffer->data[buffer->length] = '\0';
+
+    return bytesRead;
+}
+
+void socket_freeBuffer(struct socket_buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
 #endif
@@ -1,37 +1,299 @@
 #ifndef _RESOLVE_DOMAIN_H
     #define _RESOLVE_DOMAIN_H 1
 
+    #include "common.h"
+
     #ifdef unix
         #include <arpa/inet.h>
         #include <netdb.h>
+        #include <pthread.h>
+        #include <stdlib.h>
         #include <string.h>
+        #include <time.h>
+        #include <unistd.h>
 
-        int lookupIP(char *hostname, char *buffer) {
-            struct hostent *he;
-            struct in_addr **addr_list;
-            int i;
+        #ifndef HOST_NOT_FOUND
+            #define HOST_NOT_FOUND 1
+        #endif
+
+        #ifndef TRY_AGAIN
+            #define TRY_AGAIN 2
+        #endif
+
+        #ifndef NO_RECOVERY
+            #define NO_RECOVERY 3
+        #endif
+
+        // getaddrinfo doesn't expose record TTLs, so successful lookups are kept for a fixed (configurable) time
+        #define defaultDNSCacheTTL 60
+        // How long a "host not found" answer is remembered
+        #define defaultDNSNegativeCacheTTL 10
+        #define maxDNSCacheEntries 256
+
+        struct dns_cache_entry {
+            char *hostname;
+            char address[INET_ADDRSTRLEN];
+
+            // 0, or HOST_NOT_FOUND for a cached negative answer
+            int error;
+            time_t expires;
+        };
+
+        struct dns_cache_entry *DNS_cache = NULL;
+        int DNS_cacheCount = 0;
+        int DNS_cacheTTL = defaultDNSCacheTTL;
+        int DNS_negativeCacheTTL = defaultDNSNegativeCacheTTL;
+
+        // Lookups can come from several threads; the lock is never held while resolving
+        pthread_mutex_t DNS_cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+        // A TTL of 0 disables caching of that kind of answer
+        void DNS_setCacheTTL(int ttl, int negativeTTL) {
+            pthread_mutex_lock(&DNS_cacheLock);
+            DNS_cacheTTL = ttl;
+            DNS_negativeCacheTTL = negativeTTL;
+            pthread_mutex_unlock(&DNS_cacheLock);
+        }
+
+        time_t DNS_now() {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return now.tv_sec;
+        }
+
+        void DNS_removeCacheEntry(int index) {
+            free(DNS_cache[index].hostname);
+            memmove(DNS_cache + index, DNS_cache + index + 1, (DNS_cacheCount - index - 1) * sizeof(struct dns_cache_entry));
+            DNS_cacheCount --;
+        }
+
+        // Must be called with DNS_cacheLock held. Returns the entry's index, or -1.
+        int DNS_findCacheEntry(const char *hostname, time_t now) {
+            for (int i = 0; i < DNS_cacheCount; i ++) {
+                if (strcmp(DNS_cache[i].hostname, hostname)) {
+                    continue;
+                }
+                if (DNS_cache[i].expires <= now) {
+                    DNS_removeCacheEntry(i);
+                    return -1;
+                }
+                return i;
+            }
+            return -1;
+        }
+
+        void DNS_addCacheEntry(const char *hostname, const char *address, int error) {
+            pthread_mutex_lock(&DNS_cacheLock);
+
+            int ttl = error ? DNS_negativeCacheTTL : DNS_cacheTTL;
+            if (ttl <= 0) {
+                pthread_mutex_unlock(&DNS_cacheLock);
+                return;
+            }
+
+            time_t now = DNS_now();
+            int existing = DNS_findCacheEntry(hostname, now);
+            if (existing != -1) {
+                DNS_removeCacheEntry(existing);
+            }
+
+            // Make room by dropping expired entries, then the one closest to expiring
+            for (int i = DNS_cacheCount - 1; i >= 0 && DNS_cacheCount >= maxDNSCacheEntries; i --) {
+                if (DNS_cache[i].expires <= now) {
+                    DNS_removeCacheEntry(i);
+                }
+            }
+            if (DNS_cacheCount >= maxDNSCacheEntries) {
+                int soonest = 0;
+                for (int i = 1; i < DNS_cacheCount; i ++) {
+                    if (DNS_cache[i].expires < DNS_cache[soonest].expires) {
+                        soonest = i;
+                    }
+                }
+                DNS_removeCacheEntry(soonest);
+            }
+
+            DNS_cacheCount ++;
+            DNS_cache = (struct dns_cache_entry *) realloc(DNS_cache, DNS_cacheCount * sizeof(struct dns_cache_entry));
+
+            struct dns_cache_entry *entry = &DNS_cache[DNS_cacheCount - 1];
+            entry->hostname = (char *) calloc(strlen(hostname) + 1, sizeof(char));
+            strcpy(entry->hostname, hostname);
+            memset(entry->address, 0, INET_ADDRSTRLEN);
+            if (address != NULL) {
+                strncpy(entry->address, address, INET_ADDRSTRLEN - 1);
+            }
+            entry->error = error;
+            entry->expires = now + ttl;
 
-            if ((he = gethostbyname(hostname)) == NULL) {
-	            return h_errno;
+            pthread_mutex_unlock(&DNS_cacheLock);
+        }
+
+        void DNS_clearCache() {
+            pthread_mutex_lock(&DNS_cacheLock);
+            while (DNS_cacheCount) {
+                DNS_removeCacheEntry(DNS_cacheCount - 1);
             }
+            pthread_mutex_unlock(&DNS_cacheLock);
+        }
 
-            addr_list = (struct in_addr **) he->h_addr_list;
+        // Writes the IPv4 address of `hostname` into `buffer`. Returns 0 on success, or
+        // HOST_NOT_FOUND/TRY_AGAIN/NO_RECOVERY.
+        int lookupIP(char *hostname, char *buffer) {
+            pthread_mutex_lock(&DNS_cacheLock);
+            int cached = DNS_findCacheEntry(hostname, DNS_now());
+            if (cached != -1) {
+                int error = DNS_cache[cached].error;
+                if (!error) {
+                    strcpy(buffer, DNS_cache[cached].address);
+                }
+                pthread_mutex_unlock(&DNS_cacheLock);
+                return error;
+            }
+            pthread_mutex_unlock(&DNS_cacheLock);
 
-            for (i = 0; addr_list[i] != NULL; i ++) {
-	            strcpy(buffer, inet_ntoa(*addr_list[i]));
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            // The transports only connect over IPv4
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+
+            struct addrinfo *result = NULL;
+            int res = getaddrinfo(hostname, NULL, &hints, &result);
+            if (res) {
+                if (res == EAI_NONAME
+                #ifdef EAI_NODATA
+                    || res == EAI_NODATA
+                #endif
+                ) {
+                    DNS_addCacheEntry(hostname, NULL, HOST_NOT_FOUND);
+                    return HOST_NOT_FOUND;
+                }
+                // Temporary failures aren't cached, the next attempt might succeed
+                if (res == EAI_AGAIN) {
+                    return TRY_AGAIN;
+                }
+                return NO_RECOVERY;
             }
 
+            char address[INET_ADDRSTRLEN];
+            struct sockaddr_in *addr = (struct sockaddr_in *) result->ai_addr;
+            inet_ntop(AF_INET, &addr->sin_addr, address, INET_ADDRSTRLEN);
+            freeaddrinfo(result);
+
+            DNS_addCacheEntry(hostname, address, 0);
+            strcpy(buffer, address);
+
             return 0;
         }
 
+        // A lookup running on its own thread, so that waiting for it can time out or be cancelled
+        struct dns_lookup {
+            char *hostname;
+            char address[INET_ADDRSTRLEN];
+            int error;
+
+            int notify[2];
+
+            // Guards `abandoned` and `done`, which decide whether the lookup thread or the waiter frees the lookup
+            pthread_mutex_t lock;
+            int abandoned;
+            int done;
+        };
+
+        void DNS_freeLookup(struct dns_lookup *lookup) {
+            free(lookup->hostname);
+            close(lookup->notify[0]);
+            close(lookup->notify[1]);
+            pthread_mutex_destroy(&lookup->lock);
+            free(lookup);
+        }
+
+        void *DNS_lookupThread(void *arg) {
+            struct dns_lookup *lookup = (struct dns_lookup *) arg;
+            // An abandoned lookup still ends up in the cache, for the next attempt
+            lookup->error = lookupIP(lookup->hostname, lookup->address);
+
+            pthread_mutex_lock(&lookup->lock);
+            if (lookup->abandoned) {
+                pthread_mutex_unlock(&lookup->lock);
+                DNS_freeLookup(lookup);
+                return NULL;
+            }
+            lookup->done = 1;
+            write(lookup->notify[1], "", 1);
+            pthread_mutex_unlock(&lookup->lock);
+
+            return NULL;
+        }
+
+        /*
+        Like lookupIP, but gives up (leaving the lookup to finish in the background) once `waitInfo`'s deadlines
+        pass or the wait is cancelled, returning SOCKET_TIMED_OUT/SOCKET_EXPIRED/SOCKET_CANCELLED.
+        `waitInfo` only provides the deadlines.
+        */
+        int lookupIPUntil(char *hostname, char *buffer, struct socket_info *waitInfo) {
+            pthread_mutex_lock(&DNS_cacheLock);
+            int cached = DNS_findCacheEntry(hostname, DNS_now());
+            pthread_mutex_unlock(&DNS_cacheLock);
+            if (cached != -1) {
+                return lookupIP(hostname, buffer);
+            }
+
+            struct dns_lookup *lookup = (struct dns_lookup *) calloc(1, sizeof(struct dns_lookup));
+            if (pipe(lookup->notify)) {
+                free(lookup);
+                return lookupIP(hostname, buffer);
+            }
+            lookup->hostname = (char *) calloc(strlen(hostname) + 1, sizeof(char));
+            strcpy(lookup->hostname, hostname);
+            pthread_mutex_init(&lookup->lock, NULL);
+
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, DNS_lookupThread, lookup)) {
+                DNS_freeLookup(lookup);
+                return lookupIP(hostname, buffer);
+            }
+
+            struct socket_info info = *waitInfo;
+            info.descriptor = lookup->notify[0];
+            int waitRes = socket_wait(&info, SOCKET_WANT_READ);
+
+            pthread_mutex_lock(&lookup->lock);
+            if (!lookup->done) {
+                lookup->abandoned = 1;
+                // The thread frees the lookup once it's done, which may be as soon as the lock is released
+                pthread_detach(thread);
+                pthread_mutex_unlock(&lookup->lock);
+                return waitRes ? waitRes : SOCKET_TIMED_OUT;
+            }
+            pthread_mutex_unlock(&lookup->lock);
+
+            pthread_join(thread, NULL);
+            int error = lookup->error;
+            if (!error) {
+                strcpy(buffer, lookup->address);
+            }
+            DNS_freeLookup(lookup);
+            return error;
+        }
+
     #else
         #ifndef TRY_AGAIN
             #define TRY_AGAIN 2
         #endif
 
+        void DNS_setCacheTTL(int _ttl, int _negativeTTL) { }
+
+        void DNS_clearCache() { }
+
         int lookupIP(char *_hostname, char *_buffer) {
             return TRY_AGAIN;
         }
 
+        int lookupIPUntil(char *hostname, char *buffer, struct socket_info *_waitInfo) {
+            return lookupIP(hostname, buffer);
+        }
+
     #endif
 #endif
@@ -2,6 +2,8 @@
     #define _HTTP_SOCK_SECURE_H 1
 
     #include "common.h"
+    #include "socket.h"
+    #include "../utils/string.h"
 
     #ifdef unix
 
@@ -14,32 +16,96 @@
         #include <netdb.h>
         #include <openssl/ssl.h>
         #include <openssl/err.h>
+        #include <pthread.h>
 
 
-        struct socket_info secure_rwsocket(const char *address, const char *hostname, int port, char *senddata, char *towrite, int amount) {
-            struct socket_info errorStruct;
-            errorStruct.descriptor = -1;
-            errorStruct.bytesRead = -1;
-            errorStruct.error = -1;
-            errorStruct.extra = NULL;
-
-            struct hostent *host;
-            struct sockaddr_in server;
-            int socket_desc = socket(PF_INET, SOCK_STREAM, 0);
-            server.sin_family = AF_INET;
-            server.sin_port = htons(port);
-            server.sin_addr.s_addr = inet_addr(address);
-
-            while (1) {
-                if (connect(socket_desc, (struct sockaddr *) & server, sizeof(server)) < 0) {
-                    if (errno == 115 || errno == 114) {
-                        continue;
-                    } else {
-                        errorStruct.error = -2;
-                        return errorStruct;
-                    }
+        // One context is shared by every TLS connection; creating it is expensive, and sessions can only be resumed within it
+        SSL_CTX *secure_globalContext = NULL;
+
+        struct secure_cached_session {
+            char *hostname;
+            SSL_SESSION *session;
+        };
+
+        // TLS sessions keyed by SNI hostname, so that repeat connections to a host can skip the full handshake
+        struct secure_cached_session *secure_sessionCache = NULL;
+        int secure_sessionCacheCount = 0;
+
+        // Connections can be made from several threads. The session cache functions below expect the lock to be held.
+        pthread_mutex_t secure_sessionCacheLock = PTHREAD_MUTEX_INITIALIZER;
+        pthread_mutex_t secure_contextLock = PTHREAD_MUTEX_INITIALIZER;
+
+        // Protocols offered with ALPN on new connections, in wire format (each name prefixed by its length), or NULL
+        const unsigned char *secure_alpnProtocols = NULL;
+        int secure_alpnProtocolsLength = 0;
+
+        void secure_setALPNProtocols(const unsigned char *protocols, int length) {
+            secure_alpnProtocols = protocols;
+            secure_alpnProtocolsLength = length;
+        }
+
+        // Returns 1 if the server picked `protocol` with ALPN
+        int secure_isProtocolNegotiated(struct socket_info *info, const char *protocol) {
+            SSL *ssl = (SSL *) info->extra;
+            if (ssl == NULL) {
+                return 0;
+            }
+
+            const unsigned char *selected = NULL;
+            unsigned int selectedLength = 0;
+            SSL_get0_alpn_selected(ssl, &selected, &selectedLength);
+            return selected != NULL && selectedLength == strlen(protocol) && !memcmp(selected, protocol, selectedLength);
+        }
+
+        SSL_SESSION *secure_getCachedSession(const char *hostname) {
+            for (int i = 0; i < secure_sessionCacheCount; i ++) {
+                if (!strcmp(secure_sessionCache[i].hostname, hostname)) {
+                    return secure_sessionCache[i].session;
                 }
-                break;
+            }
+            return NULL;
+        }
+
+        void secure_removeCachedSession(const char *hostname) {
+            for (int i = 0; i < secure_sessionCacheCount; i ++) {
+                if (!strcmp(secure_sessionCache[i].hostname, hostname)) {
+                    SSL_SESSION_free(secure_sessionCache[i].session);
+                    free(secure_sessionCache[i].hostname);
+                    memmove(secure_sessionCache + i, secure_sessionCache + i + 1, (secure_sessionCacheCount - i - 1) * sizeof(struct secure_cached_session));
+                    secure_sessionCacheCount --;
+                    return;
+                }
+            }
+        }
+
+        // Called by OpenSSL whenever the server hands out a session (with TLS 1.3, this happens after the handshake)
+        int secure_onNewSession(SSL *ssl, SSL_SESSION *session) {
+            // The session itself only knows the hostname if the server acknowledged SNI, so use the one we connected with
+            const char *hostname = (const char *) SSL_get_app_data(ssl);
+            if (hostname == NULL) {
+                return 0;
+            }
+
+            pthread_mutex_lock(&secure_sessionCacheLock);
+            secure_removeCachedSession(hostname);
+
+            secure_sessionCacheCount ++;
+            secure_sessionCache = (struct secure_cached_session *) realloc(secure_sessionCache, secure_sessionCacheCount * sizeof(struct secure_cached_session));
+            secure_sessionCache[secure_sessionCacheCount - 1].hostname = makeStrCpy(hostname);
+            // Keep a copy: OpenSSL marks the connection's own session as unresumable if the connection ends uncleanly,
+            // even though the ticket itself is still perfectly valid
+            secure_sessionCache[secure_sessionCacheCount - 1].session = SSL_SESSION_dup(session);
+            pthread_mutex_unlock(&secure_sessionCacheLock);
+
+            return 0;
+        }
+
+        // Returns 0 on success. Called once at startup, but also lazily by secure_connect.
+        int secure_initContext() {
+            pthread_mutex_lock(&secure_contextLock);
+            if (secure_globalContext != NULL) {
+                pthread_mutex_unlock(&secure_contextLock);
+                return 0;
             }
 
             OpenSSL_add_all_algorithms();
@@ -47,129 +113,281 @@
             const SSL_METHOD *method = TLS_client_method();
             SSL_CTX *ctx = SSL_CTX_new(method);
             if (ctx == NULL) {
-                errorStruct.error = -6;
-                return errorStruct;
+                pthread_mutex_unlock(&secure_contextLock);
+                return -6;
+            }
+
+            // Sessions are stored in secure_sessionCache by hostname, not in OpenSSL's internal cache
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(ctx, secure_onNewSession);
+
+            #ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+                // Plenty of servers close the connection without close_notify; treat that as the end of the stream
+                SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+            #endif
+
+            secure_globalContext = ctx;
+            pthread_mutex_unlock(&secure_contextLock);
+            return 0;
+        }
+
+        void secure_freeContext() {
+            pthread_mutex_lock(&secure_sessionCacheLock);
+            while (secure_sessionCacheCount) {
+                secure_removeCachedSession(secure_sessionCache[0].hostname);
+            }
+            pthread_mutex_unlock(&secure_sessionCacheLock);
+
+            pthread_mutex_lock(&secure_contextLock);
+            if (secure_globalContext != NULL) {
+                SSL_CTX_free(secure_globalContext);
+                secure_globalContext = NULL;
+            }
+            pthread_mutex_unlock(&secure_contextLock);
+        }
+
+        // Non-blocking SSL calls ask to be retried once the socket is readable or writable
+        int secure_statusFromError(SSL *ssl, int res) {
+            int err = SSL_get_error(ssl, res);
+            if (err == SSL_ERROR_WANT_READ) {
+                return SOCKET_WANT_READ;
+            }
+            if (err == SSL_ERROR_WANT_WRITE) {
+                return SOCKET_WANT_WRITE;
             }
+            return -1;
+        }
 
-            SSL *ssl = SSL_new(ctx);
-            SSL_set_fd(ssl, socket_desc);
+        void secure_freeSSL(struct socket_info *info) {
+            SSL *ssl = (SSL *) info->extra;
+            if (ssl != NULL) {
+                free(SSL_get_app_data(ssl));
+                SSL_free(ssl);
+                info->extra = NULL;
+            }
+        }
+
+        int secure_continueConnect(struct socket_info *info);
+
+        int secure_connect(struct socket_info *info, const char *address, const char *hostname, int port) {
+            if (secure_initContext()) {
+                return -6;
+            }
+
+            int status = tcp_connect(info, address, hostname, port);
+            if (status < 0) {
+                return status;
+            }
+
+            SSL *ssl = SSL_new(secure_globalContext);
+            SSL_set_fd(ssl, info->descriptor);
 
             // Send hostname data- some sites don't accept the
             // connection without this
             SSL_set_tlsext_host_name(ssl, hostname);
+            SSL_set_app_data(ssl, makeStrCpy(hostname));
+            if (secure_alpnProtocols != NULL) {
+                SSL_set_alpn_protos(ssl, secure_alpnProtocols, secure_alpnProtocolsLength);
+            }
+
+            // SSL_set_session takes its own reference, so the session can be replaced in the cache afterwards
+            pthread_mutex_lock(&secure_sessionCacheLock);
+            SSL_SESSION *cachedSession = secure_getCachedSession(hostname);
+            if (cachedSession != NULL) {
+                if (SSL_SESSION_is_resumable(cachedSession)) {
+                    SSL_set_session(ssl, cachedSession);
+                } else {
+                    secure_removeCachedSession(hostname);
+                }
+            }
+            pthread_mutex_unlock(&secure_sessionCacheLock);
+
+            info->extra = (void *) ssl;
+
+            if (status == SOCKET_DONE) {
+                info->stage = SOCKET_STAGE_TLS_HANDSHAKE;
+                return secure_continueConnect(info);
+            }
+            return status;
+        }
+
+        int secure_continueConnect(struct socket_info *info) {
+            SSL *ssl = (SSL *) info->extra;
+
+            if (info->stage == SOCKET_STAGE_TCP_CONNECTING) {
+                int status = tcp_continueConnect(info);
+                if (status < 0) {
+                    secure_freeSSL(info);
+                    return status;
+                }
+                info->stage = SOCKET_STAGE_TLS_HANDSHAKE;
+            }
 
             // Clear the error queue to avoid leaving old errors in it
             ERR_clear_error();
 
             int conn = SSL_connect(ssl);
-            if (conn != 1) {
-                if (conn == -1) {
-                    int err = SSL_get_error(ssl, conn);
-                    if (err == 1) {
-                        unsigned long err = ERR_get_error();
-                        fprintf(stderr, "Error while securely connecting to server. Error code: %ld", err);
-                        char *buf = (char *) calloc(256, sizeof(char));
-                        ERR_error_string(err, buf);
-                        fprintf(stderr, " (%s)\n", buf);
-                        free(buf);
-                    } else {
-                        fprintf(stderr, "Error while securely connecting to server. Error code: %d\n", err);
-                    }
-                } else {
-                    fprintf(stderr, "Error while securely connecting to server. Error code: \"%d\"\n", conn);
-                }
-                errorStruct.error = -7;
-                return errorStruct;
+            if (conn == 1) {
+                info->stage = SOCKET_STAGE_CONNECTED;
+                return SOCKET_DONE;
             }
 
-            if (SSL_write(ssl, senddata, strlen(senddata)) <= 0) {
-                fprintf(stderr, "Error while writing data to server.\n");
-                errorStruct.error = -3;
-                return errorStruct;
+            int status = secure_statusFromError(ssl, conn);
+            if (status > 0) {
+                return status;
             }
 
-            char *server_reply = (char *) calloc(amount + 1, sizeof(char));
-            int bytesRead = SSL_read(ssl, server_reply, amount);
-
-            if (bytesRead < 0) {
-                fprintf(stderr, "Error while receiving response from server.\n");
-                errorStruct.error = -4;
-                return errorStruct;
+            int err = SSL_get_error(ssl, conn);
+            if (err == SSL_ERROR_SSL) {
+                unsigned long err = ERR_get_error();
+                fprintf(stderr, "Error while securely connecting to server. Error code: %ld", err);
+                char *buf = (char *) calloc(256, sizeof(char));
+                ERR_error_string(err, buf);
+                fprintf(stderr, " (%s)\n", buf);
+                free(buf);
+            } else {
+                fprintf(stderr, "Error while securely connecting to server. Error code: %d\n", err);
             }
 
-            strncpy(towrite, server_reply, amount);
-            free(server_reply);
+            // A session the server refused to resume shouldn't be offered again
+            pthread_mutex_lock(&secure_sessionCacheLock);
+            secure_removeCachedSession((const char *) SSL_get_app_data(ssl));
+            pthread_mutex_unlock(&secure_sessionCacheLock);
+            secure_freeSSL(info);
+            tcp_close(info);
+            return -7;
+        }
+
+        int secure_write(struct socket_info *info, const char *data, int length, int *written) {
+            *written = 0;
 
-            struct socket_info returnValue;
-            returnValue.descriptor = socket_desc;
-            returnValue.bytesRead = bytesRead;
-            returnValue.error = 0;
-            returnValue.extra = (void *) ssl;
+            SSL *ssl = (SSL *) info->extra;
+            int res = SSL_write(ssl, data, length);
+            if (res <= 0) {
+                int status = secure_statusFromError(ssl, res);
+                if (status > 0) {
+                    return status;
+                }
+                fprintf(stderr, "Error while writing data to server.\n");
+                return -3;
+            }
 
-            return returnValue;
+            *written = res;
+            return SOCKET_DONE;
         }
 
-        struct socket_info secure_rsocket(struct socket_info info, char *towrite, int amount) {
-            struct socket_info errorStruct;
-            errorStruct.descriptor = info.descriptor;
-            errorStruct.bytesRead = -1;
-            errorStruct.error = -1;
-            errorStruct.extra = info.extra;
+        int secure_read(struct socket_info *info, char *towrite, int amount, int *bytesRead) {
+            *bytesRead = 0;
 
-            char *server_reply = (char *) calloc(amount + 1, sizeof(char));
-            int bytesRead = SSL_read((SSL *) info.extra, server_reply, amount);
-            if (bytesRead <= 0) {
-                fprintf(stderr, "Error while receiving additional response from server.\n");
-                return errorStruct;
+            SSL *ssl = (SSL *) info->extra;
+            int res = SSL_read(ssl, towrite, amount);
+            if (res <= 0) {
+                int status = secure_statusFromError(ssl, res);
+                if (status > 0) {
+                    return status;
+                }
+                if (SSL_get_error(ssl, res) == SSL_ERROR_ZERO_RETURN) {
+                    // The server closed the connection cleanly
+                    return SOCKET_DONE;
+                }
+                fprintf(stderr, "Error while receiving response from server.\n");
+                return -4;
             }
 
-            strncpy(towrite, server_reply, amount);
-            free(server_reply);
+            *bytesRead = res;
+            info->bytesRead = res;
+            return SOCKET_DONE;
+        }
 
-            struct socket_info returnValue;
-            returnValue.descriptor = info.descriptor;
-            returnValue.bytesRead = bytesRead;
-            returnValue.error = 0;
-            returnValue.extra = info.extra;
+        // TLS records have to be decrypted one SSL_read at a time, so regions are filled in turn until a read comes up short
+        int secure_readv(struct socket_info *info, struct iovec *regions, int numRegions, int *bytesRead) {
+            *bytesRead = 0;
+
+            for (int i = 0; i < numRegions; i ++) {
+                // Regions are never larger than a buffer, whose lengths fit in an int
+                int regionLength = (int) regions[i].iov_len;
+                int regionRead = 0;
+                int status = secure_read(info, (char *) regions[i].iov_base, regionLength, &regionRead);
+                if (status != SOCKET_DONE) {
+                    // Anything already read has to be reported; the caller asks again for the rest
+                    if (*bytesRead > 0) {
+                        break;
+                    }
+                    return status;
+                }
+
+                *bytesRead += regionRead;
+                if (regionRead < regionLength) {
+                    break;
+                }
+            }
 
-            return returnValue;
+            info->bytesRead = *bytesRead;
+            return SOCKET_DONE;
         }
 
-        void secure_csocket(struct socket_info info) {
-            close(info.descriptor);
-            SSL_CTX_free(SSL_get_SSL_CTX((SSL *) info.extra));
+        void secure_close(struct socket_info *info) {
+            SSL *ssl = (SSL *) info->extra;
+            if (ssl != NULL) {
+                // Sending close_notify lets the server keep the session resumable
+                SSL_shutdown(ssl);
+                secure_freeSSL(info);
+            }
+            tcp_close(info);
         }
 
     #else
 
         #include "../utils/log.h"
 
-        struct socket_info secure_rwsocket(const char *_address, const char *_hostname, int _port, char *_senddata, char *_towrite, int _amount) {
-            log_err("secure_rwsocket called, not supported on non-Unix compilation target\n");
+        int secure_initContext() {
+            return -6;
+        }
+
+        void secure_freeContext() { }
 
-            struct socket_info errorStruct;
-            errorStruct.descriptor = -1;
-            errorStruct.bytesRead = -1;
-            errorStruct.error = -1;
-            errorStruct.extra = NULL;
+        void secure_setALPNProtocols(const unsigned char *_protocols, int _length) { }
 
-            return errorStruct;
+        int secure_isProtocolNegotiated(struct socket_info *_info, const char *_protocol) {
+            return 0;
         }
 
-        struct socket_info secure_rsocket(struct socket_info info, char *_towrite, int _amount) {
-            log_err("secure_rsocket called, not supported on non-Unix compilation target\n");
+        int secure_connect(struct socket_info *_info, const char *_address, const char *_hostname, int _port) {
+            log_err("secure_connect called, not supported on non-Unix compilation target\n");
+            return -6;
+        }
 
-            struct socket_info errorStruct;
-            errorStruct.descriptor = info.descriptor;
-            errorStruct.bytesRead = -1;
-            errorStruct.error = -1;
-            errorStruct.extra = info.extra;
+        int secure_continueConnect(struct socket_info *_info) {
+            log_err("secure_continueConnect called, not supported on non-Unix compilation target\n");
+            return -6;
+        }
 
-            return errorStruct;
+        int secure_write(struct socket_info *_info, const char *_data, int _length, int *_written) {
+            log_err("secure_write called, not supported on non-Unix compilation target\n");
+            return -3;
         }
 
-        void secure_csocket(struct socket_info _info) { }
+        int secure_read(struct socket_info *_info, char *_towrite, int _amount, int *_bytesRead) {
+            log_err("secure_read called, not supported on non-Unix compilation target\n");
+            return -4;
+        }
+
+        int secure_readv(struct socket_info *_info, struct iovec *_regions, int _numRegions, int *_bytesRead) {
+            log_err("secure_readv called, not supported on non-Unix compilation target\n");
+            return -4;
+        }
+
+        void secure_close(struct socket_info *_info) { }
 
     #endif
 
+    struct socket_transport secure_transport = {
+        secure_connect,
+        secure_continueConnect,
+        secure_write,
+        secure_read,
+        secure_readv,
+        secure_close,
+    };
+
 #endif
@@ -7,137 +7,164 @@
 
             #include <arpa/inet.h>
             #include <errno.h>
+            #include <fcntl.h>
+            #include <stdio.h>
+            #include <stdlib.h>
             #include <string.h>
+            #include <sys/socket.h>
+            #include <sys/uio.h>
             #include <unistd.h>
 
-            struct socket_info rwsocket(const char *address, const char *_hostname, int portnum, char *senddata, char *towrite, int amount) {
-                struct socket_info errorStruct;
-                errorStruct.descriptor = -1;
-                errorStruct.bytesRead = -1;
-                errorStruct.error = -1;
-                errorStruct.extra = NULL;
-
-                struct timeval timeout;
-                timeout.tv_sec = 0;
-                timeout.tv_usec = 2500;
-                int socket_desc;
+            // Starts a non-blocking TCP connect. Also used by the TLS transport before its handshake.
+            int tcp_connect(struct socket_info *info, const char *address, const char *_hostname, int portnum) {
                 struct sockaddr_in server;
-                char *server_reply = (char *) calloc(amount + 1, sizeof(char));
 
-                socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+                int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
                 if (socket_desc == -1) {
                     printf("Error while creating socket. Error code: \"%d\"\n", errno);
-                    errorStruct.error = -1;
-                    return errorStruct;
+                    return -1;
                 }
 
+                fcntl(socket_desc, F_SETFL, fcntl(socket_desc, F_GETFL, 0) | O_NONBLOCK);
+
+                info->descriptor = socket_desc;
+                info->stage = SOCKET_STAGE_TCP_CONNECTING;
+
                 server.sin_addr.s_addr = inet_addr(address);
                 server.sin_family = AF_INET;
                 server.sin_port = htons(portnum);
-                setsockopt(socket_desc, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-
-                while (1) {
-                    if (connect(socket_desc, (struct sockaddr *) & server, sizeof(server)) < 0) {
-                        if (errno == 115 || errno == 114) {
-                            continue;
-                        } else {/*
-                            printf("Error while connecting to remote server. Error code: \"%d\"", errno);
-                            if (errno == 111) {
-                                printf(" (ERR_CONNECTION_REFUSED)");
-                            }
-                            if (errno == 101) {
-                                printf(" (ERR_NETWORK_UNREACHABLE)");
-                            }
-                            printf("\n");*/
-                            errorStruct.error = -2;
-                            return errorStruct;
-                        }
-                        //printf("\n");
+
+                if (connect(socket_desc, (struct sockaddr *) & server, sizeof(server)) < 0) {
+                    if (errno == EINPROGRESS) {
+                        return SOCKET_WANT_WRITE;
                     }
-                    break;
+                    int connectErrno = errno;
+                    close(socket_desc);
+                    info->descriptor = -1;
+                    errno = connectErrno;
+                    return -2;
                 }
 
-                if (send(socket_desc, senddata, strlen(senddata), 0) < 0) {
-                    printf("Error while sending data to remote server. Error code: \"%d\"\n", errno);
-                    errorStruct.error = -3;
-                    return errorStruct;
-                }
+                info->stage = SOCKET_STAGE_CONNECTED;
+                return SOCKET_DONE;
+            }
 
-                int bytesRead = recv(socket_desc, server_reply, amount, 0);
+            // Called once the socket is writable after tcp_connect returned SOCKET_WANT_WRITE
+            int tcp_continueConnect(struct socket_info *info) {
+                int soError = 0;
+                socklen_t len = sizeof(soError);
+                if (getsockopt(info->descriptor, SOL_SOCKET, SO_ERROR, &soError, &len) < 0) {
+                    soError = errno;
+                }
 
-                if (bytesRead < 0) {
-                    printf("Error while recieving response from server. Error code: \"%d\"\n", errno);
-                    errorStruct.error = -4;
-                    return errorStruct;
+                if (soError) {
+                    close(info->descriptor);
+                    info->descriptor = -1;
+                    // Callers map errno to errors such as "connection refused"
+                    errno = soError;
+                    return -2;
                 }
 
-                strncpy(towrite, server_reply, amount);
-                free(server_reply);
+                info->stage = SOCKET_STAGE_CONNECTED;
+                return SOCKET_DONE;
+            }
+
+            int tcp_write(struct socket_info *info, const char *data, int length, int *written) {
+                *written = 0;
+
+                // MSG_NOSIGNAL: a pooled connection may have been closed by the server, which should be an error, not a SIGPIPE
+                int res = send(info->descriptor, data, length, MSG_NOSIGNAL);
+                if (res < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return SOCKET_WANT_WRITE;
+                    }
+                    printf("Error while sending data to remote server. Error code: \"%d\"\n", errno);
+                    return -3;
+                }
 
-                struct socket_info returnValue;
-                returnValue.descriptor = socket_desc;
-                returnValue.bytesRead = bytesRead;
-                returnValue.error = 0;
-                returnValue.extra = NULL;
-                return returnValue;
+                *written = res;
+                return SOCKET_DONE;
             }
 
-            struct socket_info rsocket(struct socket_info info, char *towrite, int amount) {
-                struct socket_info errorStruct;
-                errorStruct.descriptor = -1;
-                errorStruct.bytesRead = -1;
-                errorStruct.error = -1;
-
-                char *server_reply = (char *) calloc(amount + 1, sizeof(char));
-                int bytesRead = recv(info.descriptor, server_reply, amount, 0);
-                if (bytesRead < 0) {
-                    printf("Error while recieving additional response from server. Error code: \"%d\"\n", errno);
-                    return errorStruct;
+            int tcp_read(struct socket_info *info, char *towrite, int amount, int *bytesRead) {
+                *bytesRead = 0;
+
+                int res = recv(info->descriptor, towrite, amount, 0);
+                if (res < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return SOCKET_WANT_READ;
+                    }
+                    printf("Error while recieving response from server. Error code: \"%d\"\n", errno);
+                    return -4;
                 }
 
-                strncpy(towrite, server_reply, amount);
-                free(server_reply);
+                *bytesRead = res;
+                info->bytesRead = res;
+                return SOCKET_DONE;
+            }
 
-                struct socket_info returnValue;
-                returnValue.descriptor = info.descriptor;
-                returnValue.bytesRead = bytesRead;
-                returnValue.error = 0;
+            int tcp_readv(struct socket_info *info, struct iovec *regions, int numRegions, int *bytesRead) {
+                *bytesRead = 0;
+
+                int res = readv(info->descriptor, regions, numRegions);
+                if (res < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return SOCKET_WANT_READ;
+                    }
+                    printf("Error while recieving response from server. Error code: \"%d\"\n", errno);
+                    return -4;
+                }
 
-                return returnValue;
+                *bytesRead = res;
+                info->bytesRead = res;
+                return SOCKET_DONE;
             }
 
-            void csocket(struct socket_info info) {
-                close(info.descriptor);
+            void tcp_close(struct socket_info *info) {
+                if (info->descriptor != -1) {
+                    close(info->descriptor);
+                    info->descriptor = -1;
+                }
             }
 
         #else
 
-            struct socket_info rwsocket(const char *address, const char *_hostname, int _portnum, char *_senddata, char *_towrite, int _amount) {
-                log_err("rwsocket called, not supported on non-Unix compilation target\n");
-
-                struct socket_info errorStruct;
-                errorStruct.descriptor = -1;
-                errorStruct.bytesRead = -1;
-                errorStruct.error = -1;
-                errorStruct.extra = NULL;
+            int tcp_connect(struct socket_info *_info, const char *_address, const char *_hostname, int _portnum) {
+                log_err("tcp_connect called, not supported on non-Unix compilation target\n");
+                return -1;
+            }
 
-                return errorStruct;
+            int tcp_continueConnect(struct socket_info *_info) {
+                log_err("tcp_continueConnect called, not supported on non-Unix compilation target\n");
+                return -2;
             }
 
-            struct socket_info rsocket(struct socket_info info, char *_towrite, int _amount) {
-                log_err("rsocket called, not supported on non-Unix compilation target\n");
+            int tcp_write(struct socket_info *_info, const char *_data, int _length, int *_written) {
+                log_err("tcp_write called, not supported on non-Unix compilation target\n");
+                return -3;
+            }
 
-                struct socket_info errorStruct;
-                errorStruct.descriptor = info.descriptor;
-                errorStruct.bytesRead = -1;
-                errorStruct.error = -1;
-                errorStruct.extra = NULL;
+            int tcp_read(struct socket_info *_info, char *_towrite, int _amount, int *_bytesRead) {
+                log_err("tcp_read called, not supported on non-Unix compilation target\n");
+                return -4;
+            }
 
-                return errorStruct;
+            int tcp_readv(struct socket_info *_info, struct iovec *_regions, int _numRegions, int *_bytesRead) {
+                log_err("tcp_readv called, not supported on non-Unix compilation target\n");
+                return -4;
             }
 
-            void csocket(struct socket_info _info) { }
+            void tcp_close(struct socket_info *_info) { }
 
         #endif
 
+        struct socket_transport tcp_transport = {
+            tcp_connect,
+            tcp_continueConnect,
+            tcp_write,
+            tcp_read,
+            tcp_readv,
+            tcp_close,
+        };
+
 #endif
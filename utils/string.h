@@ -247,6 +247,52 @@ char *shortenStringWithEllipses(const char *string, unsigned int amount) {
     return cpy;
 }
 
+// A string that is appended to in place, so building one doesn't have to find its end each time
+struct string_builder {
+    char *data;
+    int length;
+    int capacity;
+};
+
+struct string_builder makeStringBuilder(int capacity) {
+    struct string_builder builder;
+    builder.data = (char *) calloc(capacity + 1, sizeof(char));
+    builder.length = 0;
+    builder.capacity = capacity;
+    return builder;
+}
+
+void appendToStringBuilder(struct string_builder *builder, const char *text, int length) {
+    if (builder->capacity - builder->length < length) {
+        int newCapacity = builder->capacity ? builder->capacity : 16;
+        while (newCapacity - builder->length < length) {
+            newCapacity *= 2;
+        }
+        builder->data = (char *) realloc(builder->data, newCapacity + 1);
+        builder->capacity = newCapacity;
+    }
+    memcpy(builder->data + builder->length, text, length);
+    builder->length += length;
+    builder->data[builder->length] = '\0';
+}
+
+void appendStringToBuilder(struct string_builder *builder, const char *text) {
+    appendToStringBuilder(builder, text, strlen(text));
+}
+
+// Empties the builder, keeping its memory for the next string
+void clearStringBuilder(struct string_builder *builder) {
+    builder->length = 0;
+    builder->data[0] = '\0';
+}
+
+void freeStringBuilder(struct string_builder *builder) {
+    free(builder->data);
+    builder->data = NULL;
+    builder->length = 0;
+    builder->capacity = 0;
+}
+
 char *toLowerCase(const char *text) {
     int len = strlen(text);
     char *allocated = (char *) calloc(len + 1, sizeof(char));